@@ -0,0 +1,148 @@
+/*****************************************************************************
+ *  Copyright (C) 2014 Jim Garlick
+ *  Written by Jim Garlick <garlick.jim@gmail.com>
+ *  All Rights Reserved.
+ *
+ *  This file is part of pi-ted-envoy.
+ *  For details, see <https://github.com/garlick/pi-ted-envoy>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+/* cal.c - wall-clock timer for day, week and month boundaries */
+
+/* The timer is a CLOCK_REALTIME timerfd set for an absolute time, the
+ * next local midnight as mktime() sees it, so DST changes are accounted
+ * for when it is armed.  TFD_TIMER_CANCEL_ON_SET makes a read fail with
+ * ECANCELED if the clock is set, e.g. by NTP at boot or by hand; either
+ * way the date is compared with the one last seen and the timer re-armed.
+ * On a virtual clock (see clock.h) the timer is not what fires: the
+ * caller watches cal_next() and calls cal_handle() itself.
+ */
+
+#include <sys/types.h>
+#include <sys/timerfd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "util.h"
+#include "clock.h"
+#include "cal.h"
+
+struct cal_struct {
+    int fd;
+    int day;                            /* days since 1970-01-01 */
+    int week;                           /* day number of its Monday */
+    int month;                          /* year * 12 + month */
+    time_t next;                        /* next midnight */
+};
+
+/* Day number of a civil date (H. Hinnant's days_from_civil).
+ */
+static int _days (int y, int m, int d)
+{
+    int era, yoe, doy, doe;
+
+    y -= m <= 2;
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = y - era * 400;
+    doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+/* Note today's date and arm the timer for the start of tomorrow.
+ */
+static void _arm (cal_t *c)
+{
+    struct itimerspec its;
+    time_t now = clock_now ();
+    struct tm tm;
+
+    localtime_r (&now, &tm);
+    c->day = _days (tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+    c->week = c->day - (tm.tm_wday + 6) % 7;
+    c->month = (tm.tm_year + 1900) * 12 + tm.tm_mon;
+
+    tm.tm_mday++;
+    tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+    tm.tm_isdst = -1;
+    memset (&its, 0, sizeof (its));
+    its.it_value.tv_sec = c->next = mktime (&tm);
+    if (timerfd_settime (c->fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET,
+                         &its, NULL) < 0) {
+        perror ("timerfd_settime");
+        exit (1);
+    }
+}
+
+cal_t *cal_create (void)
+{
+    cal_t *c = xzmalloc (sizeof (*c));
+
+    if ((c->fd = timerfd_create (CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC))
+                                                                        < 0) {
+        perror ("timerfd_create");
+        exit (1);
+    }
+    _arm (c);
+    return c;
+}
+
+void cal_destroy (cal_t *c)
+{
+    close (c->fd);
+    free (c);
+}
+
+int cal_fd (cal_t *c)
+{
+    return c->fd;
+}
+
+time_t cal_next (cal_t *c)
+{
+    return c->next;
+}
+
+int cal_handle (cal_t *c)
+{
+    int day = c->day, week = c->week, month = c->month;
+    int mask = 0;
+    uint64_t n;
+
+    if (read (c->fd, &n, sizeof (n)) < 0 && errno != EAGAIN
+                                          && errno != ECANCELED) {
+        perror ("timerfd read");
+        exit (1);
+    }
+    _arm (c);
+    if (c->day != day)
+        mask |= CAL_DAY;
+    if (c->week != week)
+        mask |= CAL_WEEK;
+    if (c->month != month)
+        mask |= CAL_MONTH;
+    return mask;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
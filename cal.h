@@ -0,0 +1,31 @@
+/* Calendar boundaries, in local time.  Weeks start on Monday.
+ */
+#define CAL_DAY         0x01
+#define CAL_WEEK        0x02
+#define CAL_MONTH       0x04
+
+typedef struct cal_struct cal_t;
+
+/* Arm a wall-clock timer for the next local midnight.
+ */
+cal_t *cal_create (void);
+void cal_destroy (cal_t *c);
+
+/* Readable at a boundary, or when the system clock is set.
+ */
+int cal_fd (cal_t *c);
+
+/* Time of the next boundary.
+ */
+time_t cal_next (cal_t *c);
+
+/* Call when cal_fd() is readable.  Re-arms the timer and returns the
+ * CAL_ boundaries crossed since the last call, or 0 if the clock was
+ * merely adjusted within the same day.  A clock set across midnight,
+ * whether forward or back, counts as a boundary.
+ */
+int cal_handle (cal_t *c);
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
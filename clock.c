@@ -0,0 +1,95 @@
+/*****************************************************************************
+ *  Copyright (C) 2014 Jim Garlick
+ *  Written by Jim Garlick <garlick.jim@gmail.com>
+ *  All Rights Reserved.
+ *
+ *  This file is part of pi-ted-envoy.
+ *  For details, see <https://github.com/garlick/pi-ted-envoy>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+/* clock.c - system or virtual clock (see clock.h) */
+
+/* Virtual time is read without a lock from any thread.  Only sleepers
+ * take the mutex, and clock_set() wakes them whenever time moves.
+ */
+
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "clock.h"
+
+static bool virt = false;
+static uint64_t virt_us;
+static pthread_mutex_t virt_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t virt_cond = PTHREAD_COND_INITIALIZER;
+
+void clock_virtual (uint64_t us)
+{
+    virt = true;
+    virt_us = us;
+}
+
+void clock_set (uint64_t us)
+{
+    pthread_mutex_lock (&virt_lock);
+    if (us > virt_us) {
+        __atomic_store_n (&virt_us, us, __ATOMIC_RELAXED);
+        pthread_cond_broadcast (&virt_cond);
+    }
+    pthread_mutex_unlock (&virt_lock);
+}
+
+uint64_t clock_now_us (void)
+{
+    struct timeval tv;
+
+    if (virt)
+        return __atomic_load_n (&virt_us, __ATOMIC_RELAXED);
+    gettimeofday (&tv, NULL);
+    return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+time_t clock_now (void)
+{
+    if (virt)
+        return clock_now_us () / 1000000;
+    return time (NULL);
+}
+
+void clock_sleep (int sec)
+{
+    uint64_t until;
+
+    if (!virt) {
+        sleep (sec);
+        return;
+    }
+    pthread_mutex_lock (&virt_lock);
+    until = virt_us + sec * 1000000ULL;
+    while (virt_us < until)
+        pthread_cond_wait (&virt_cond, &virt_lock);
+    pthread_mutex_unlock (&virt_lock);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,29 @@
+/* Time as emond sees it.
+ *
+ * Normally this is the system clock.  In virtual mode the clock stands
+ * still until clock_set() moves it on, so that input recorded over a day
+ * can be played back as fast as it can be handled, and everything that
+ * depends on the time of day (energy integration, staleness, midnight)
+ * comes out as it did when the input was recorded.
+ */
+
+/* Switch to virtual time, starting at 'us' microseconds since the epoch.
+ * Call before any thread reads the clock.
+ */
+void clock_virtual (uint64_t us);
+
+/* Move virtual time on to 'us'.  It never goes backwards.
+ */
+void clock_set (uint64_t us);
+
+time_t clock_now (void);
+uint64_t clock_now_us (void);
+
+/* Sleep for 'sec' seconds, or in virtual mode, until the clock has
+ * been moved on by that much.
+ */
+void clock_sleep (int sec);
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,215 @@
+/*****************************************************************************
+ *  Copyright (C) 2014 Jim Garlick
+ *  Written by Jim Garlick <garlick.jim@gmail.com>
+ *  All Rights Reserved.
+ *
+ *  This file is part of pi-ted-envoy.
+ *  For details, see <https://github.com/garlick/pi-ted-envoy>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+/* device.c - open devices in the background and reopen them after errors */
+
+/* A loose connector should cost the daemon one display, not all of its
+ * data collection, so nothing here is fatal.  The handle is read with an
+ * atomic load so the owner's hot path takes no lock; everything else is
+ * under the mutex.  Only the device's thread opens or closes handles, so
+ * the owner never sees a handle being closed under it.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "metrics.h"
+#include "trace.h"
+#include "device.h"
+
+struct device_struct {
+    char *name;
+    device_open_f open;
+    device_close_f close;
+    void *arg;
+    int h;                              /* current handle or -1 */
+    int dead;                           /* handle to close, or -1 */
+    bool tried;                         /* opened or failed at least once */
+    bool fresh;
+    bool stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t t;
+};
+
+static void _deadline (struct timespec *ts, int ms)
+{
+    clock_gettime (CLOCK_MONOTONIC, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static void *_thread (void *arg)
+{
+    device_t *d = arg;
+    struct timespec ts;
+    int backoff = 0;
+    bool missing = false;
+    int h, dead, err;
+
+    trace_thread (d->name);
+    pthread_mutex_lock (&d->lock);
+    while (!d->stop) {
+        if ((dead = d->dead) >= 0) {
+            d->dead = -1;
+            pthread_mutex_unlock (&d->lock);
+            d->close (dead, d->arg);
+            pthread_mutex_lock (&d->lock);
+            continue;
+        }
+        if (d->h >= 0) {
+            pthread_cond_wait (&d->cond, &d->lock);
+            continue;
+        }
+        pthread_mutex_unlock (&d->lock);
+        h = d->open (d->arg);
+        err = errno;
+        pthread_mutex_lock (&d->lock);
+        d->tried = true;
+        pthread_cond_broadcast (&d->cond);
+        if (h >= 0) {
+            if (missing)
+                fprintf (stderr, "%s: present\n", d->name);
+            missing = false;
+            backoff = 0;
+            __atomic_store_n (&d->fresh, true, __ATOMIC_RELAXED);
+            __atomic_store_n (&d->h, h, __ATOMIC_RELEASE);
+            continue;
+        }
+        metrics_inc (M_DEV_FAILURES);
+        backoff = backoff ? backoff * 2 : DEVICE_BACKOFF_MIN;
+        if (backoff > DEVICE_BACKOFF_MAX)
+            backoff = DEVICE_BACKOFF_MAX;
+        if (!missing)
+            fprintf (stderr, "%s: %s (retrying)\n", d->name, strerror (err));
+        missing = true;
+        _deadline (&ts, backoff * 1000);
+        while (!d->stop && pthread_cond_timedwait (&d->cond, &d->lock, &ts)
+                                                                    == 0)
+            ;
+    }
+    pthread_mutex_unlock (&d->lock);
+    return NULL;
+}
+
+device_t *device_create (const char *name, device_open_f open,
+                         device_close_f close, void *arg)
+{
+    device_t *d = xzmalloc (sizeof (*d));
+    pthread_condattr_t attr;
+    int err;
+
+    d->name = xstrdup (name);
+    d->open = open;
+    d->close = close;
+    d->arg = arg;
+    d->h = -1;
+    d->dead = -1;
+    pthread_mutex_init (&d->lock, NULL);
+    pthread_condattr_init (&attr);
+    pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+    pthread_cond_init (&d->cond, &attr);
+    pthread_condattr_destroy (&attr);
+    if ((err = pthread_create (&d->t, NULL, _thread, d))) {
+        fprintf (stderr, "pthread_create: %s\n", strerror (err));
+        exit (1);
+    }
+    return d;
+}
+
+void device_destroy (device_t *d)
+{
+    pthread_mutex_lock (&d->lock);
+    d->stop = true;
+    pthread_cond_broadcast (&d->cond);
+    pthread_mutex_unlock (&d->lock);
+    pthread_join (d->t, NULL);
+    if (d->dead >= 0)
+        d->close (d->dead, d->arg);
+    if (d->h >= 0)
+        d->close (d->h, d->arg);
+    pthread_cond_destroy (&d->cond);
+    pthread_mutex_destroy (&d->lock);
+    free (d->name);
+    free (d);
+}
+
+int device_wait (device_t **d, int n, int timeout_ms)
+{
+    struct timespec ts;
+    int i, count = 0;
+
+    _deadline (&ts, timeout_ms);
+    for (i = 0; i < n; i++) {
+        pthread_mutex_lock (&d[i]->lock);
+        while (!d[i]->tried && pthread_cond_timedwait (&d[i]->cond,
+                                                &d[i]->lock, &ts) == 0)
+            ;
+        if (d[i]->h >= 0)
+            count++;
+        pthread_mutex_unlock (&d[i]->lock);
+    }
+    return count;
+}
+
+int device_handle (device_t *d)
+{
+    return __atomic_load_n (&d->h, __ATOMIC_ACQUIRE);
+}
+
+bool device_fresh (device_t *d)
+{
+    if (!__atomic_load_n (&d->fresh, __ATOMIC_RELAXED))
+        return false;
+    return __atomic_exchange_n (&d->fresh, false, __ATOMIC_RELAXED);
+}
+
+void device_failed (device_t *d)
+{
+    int err = errno;
+
+    pthread_mutex_lock (&d->lock);
+    if (d->h >= 0) {
+        metrics_inc (M_DEV_FAILURES);
+        fprintf (stderr, "%s: %s (reopening)\n", d->name, strerror (err));
+        d->dead = d->h;
+        __atomic_store_n (&d->h, -1, __ATOMIC_RELEASE);
+        pthread_cond_broadcast (&d->cond);
+    }
+    pthread_mutex_unlock (&d->lock);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,41 @@
+/* Supervised devices.  Each device has a thread that opens it, and
+ * while it is missing, retries with backoff from DEVICE_BACKOFF_MIN
+ * doubling to DEVICE_BACKOFF_MAX seconds.  The owner uses whatever handle
+ * is current and hands it back with device_failed() on an error.
+ */
+#define DEVICE_BACKOFF_MIN  1
+#define DEVICE_BACKOFF_MAX  60
+
+typedef struct device_struct device_t;
+
+/* Open and set up the device, returning a handle >= 0, or -1 with errno
+ * set.  This runs on the device's thread and may block.
+ */
+typedef int (*device_open_f) (void *arg);
+typedef void (*device_close_f) (int h, void *arg);
+
+device_t *device_create (const char *name, device_open_f open,
+                         device_close_f close, void *arg);
+void device_destroy (device_t *d);
+
+/* Wait until each of the n devices has been tried once, or for at most
+ * timeout_ms.  Returns the number present.
+ */
+int device_wait (device_t **d, int n, int timeout_ms);
+
+/* The current handle, or -1 while the device is missing.
+ */
+int device_handle (device_t *d);
+
+/* Returns true once after each time the device is (re)opened, e.g. so
+ * the owner can repaint a display that was power cycled.
+ */
+bool device_fresh (device_t *d);
+
+/* The current handle returned an error.  Close it and start retrying.
+ */
+void device_failed (device_t *d);
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
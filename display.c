@@ -0,0 +1,255 @@
+/*****************************************************************************
+ *  Copyright (C) 2014 Jim Garlick
+ *  Written by Jim Garlick <garlick.jim@gmail.com>
+ *  All Rights Reserved.
+ *
+ *  This file is part of pi-ted-envoy.
+ *  For details, see <https://github.com/garlick/pi-ted-envoy>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+/* display.c - render readings to the OLED and LEDs (see display.h) */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+
+#include "util.h"
+#include "fb.h"
+#include "oled.h"
+#include "led.h"
+#include "w1.h"
+#include "device.h"
+#include "display.h"
+
+#define I2C_OLED        0x28
+#define I2C_LED_A       0x30
+#define I2C_LED_B       0x27
+
+#define SPARK_Y         (5*FB_FONT_H)
+#define SPARK_H         (FB_HEIGHT - SPARK_Y)
+
+struct display_struct {
+    device_t *oled;
+    device_t *led_a;
+    device_t *led_b;
+    fb_t fb;                            /* OLED framebuffer */
+};
+
+/* Device callbacks for device_create().  Opening the I2C handle succeeds
+ * whether or not anything is on the bus, so also wake the device up:
+ * that write is what finds out if it is there.
+ */
+static int led_open (void *arg)
+{
+    int h, err;
+
+    if ((h = led_init ((intptr_t)arg)) < 0)
+        return -1;
+    if (led_sleep_set (h, 0) < 0 || led_brightness_set (h, 0x20) < 0) {
+        err = errno;
+        led_fini (h);
+        errno = err;
+        return -1;
+    }
+    return h;
+}
+
+static void led_close (int h, void *arg)
+{
+    led_fini (h);
+}
+
+static int oled_open (void *arg)
+{
+    int h, err;
+
+    if ((h = oled_init ((intptr_t)arg)) < 0)
+        return -1;
+    if (oled_clear (h) < 0) {
+        err = errno;
+        oled_fini (h);
+        errno = err;
+        return -1;
+    }
+    return h;
+}
+
+static void oled_close (int h, void *arg)
+{
+    oled_fini (h);
+}
+
+/* Probe the displays in parallel.  Any that are missing or slow
+ * to answer are left to their threads; the caller runs without them.
+ */
+display_t *display_create (int timeout_ms)
+{
+    display_t *d = xzmalloc (sizeof (*d));
+
+    d->led_a = device_create ("led-a", led_open, led_close,
+                              (void *)(intptr_t)I2C_LED_A);
+    d->led_b = device_create ("led-b", led_open, led_close,
+                              (void *)(intptr_t)I2C_LED_B);
+    d->oled = device_create ("oled", oled_open, oled_close,
+                             (void *)(intptr_t)I2C_OLED);
+    fb_init (&d->fb);
+    fb_invalidate (&d->fb);
+    device_wait ((device_t *[]){ d->led_a, d->led_b, d->oled }, 3,
+                 timeout_ms);
+    return d;
+}
+
+void display_destroy (display_t *d)
+{
+    if (d) {
+        device_destroy (d->led_b);
+        device_destroy (d->led_a);
+        device_destroy (d->oled);
+        free (d);
+    }
+}
+
+bool spark_sample (spark_t *sp, time_t now, int net, int gen)
+{
+    bool pushed = false;
+
+    if (sp->count > 0 && now - sp->start >= SPARK_INTERVAL) {
+        if (sp->n == SPARK_LEN) {
+            memmove (&sp->net[0], &sp->net[1], (SPARK_LEN - 1) * sizeof (int));
+            memmove (&sp->gen[0], &sp->gen[1], (SPARK_LEN - 1) * sizeof (int));
+            sp->n--;
+        }
+        sp->net[sp->n] = sp->net_sum / sp->count;
+        sp->gen[sp->n] = sp->gen_sum / sp->count;
+        sp->n++;
+        sp->net_sum = sp->gen_sum = 0;
+        sp->count = 0;
+        sp->changed = true;
+        pushed = true;
+    }
+    if (sp->count == 0)
+        sp->start = now;
+    sp->net_sum += net;
+    sp->gen_sum += gen;
+    sp->count++;
+    return pushed;
+}
+
+static void spark_draw (spark_t *sp, fb_t *fb)
+{
+    int i, lo = 0, hi = 0;
+
+    for (i = 0; i < sp->n; i++) {
+        if (sp->net[i] < lo)
+            lo = sp->net[i];
+        if (sp->net[i] > hi)
+            hi = sp->net[i];
+        if (sp->gen[i] > hi)
+            hi = sp->gen[i];
+    }
+    fb_fill_rect (fb, 0, SPARK_Y, FB_WIDTH, SPARK_H, false);
+    fb_sparkline (fb, 0, SPARK_Y, FB_WIDTH, SPARK_H, sp->gen, sp->n,
+                  lo, hi, true);
+    fb_sparkline (fb, 0, SPARK_Y, FB_WIDTH, SPARK_H, sp->net, sp->n,
+                  lo, hi, false);
+    sp->changed = false;
+}
+
+/* Write to an LED module if it is present.
+ */
+static void led_show (device_t *d, const char *fmt, ...)
+{
+    va_list ap;
+    char s[16];
+    int h;
+
+    if ((h = device_handle (d)) < 0)
+        return;
+    va_start (ap, fmt);
+    vsnprintf (s, sizeof (s), fmt, ap);
+    va_end (ap);
+    if (led_printf (h, "%s", s) < 0)
+        device_failed (d);
+}
+
+/* Upload the framebuffer if the OLED is present, all of it if the
+ * OLED was just (re)opened and so cleared.
+ */
+static void oled_show (display_t *d)
+{
+    int h;
+
+    if ((h = device_handle (d->oled)) < 0)
+        return;
+    if (device_fresh (d->oled))
+        fb_invalidate (&d->fb);
+    if (oled_fb_flush (h, &d->fb) < 0) {
+        fb_invalidate (&d->fb);
+        device_failed (d->oled);
+    }
+}
+
+void display_update (display_t *d, const display_data_t *dd)
+{
+    /* 5 text lines: 0-4, sparkline below */
+    fb_printf (&d->fb, 0, 0, "Frz %+05.1f F", c2f (dd->temp_freezer));
+    fb_printf (&d->fb, 0, 1, "Ref %+05.1f F", c2f (dd->temp_fridge));
+    fb_printf (&d->fb, 0, 2, "DAILY ENERGY");
+    fb_printf (&d->fb, 0, 3, "gen %-2.3f kWh%s", dd->gen_kwh,
+               dd->estale ? "*" : " ");
+    fb_printf (&d->fb, 0, 4, "use %-2.3f kWh%s", dd->use_kwh,
+               (dd->tstale || dd->estale) ? "*" : " ");
+    if (dd->spark && dd->spark->changed)
+        spark_draw (dd->spark, &d->fb);
+    oled_show (d);
+
+    if (dd->mode == MODE_POWER) {
+        /* LED A: gen, as integrated into use (see envoy_aggregate) */
+        if (dd->enone)
+            led_show (d->led_a, "----");
+        else
+            led_show (d->led_a, "%0.3f", (float)dd->gen_watts / 1000.0);
+
+        /* LED B: use */
+        if (dd->tstale || dd->enone)
+            led_show (d->led_b, "----");
+        else
+            led_show (d->led_b, "%0.3f",
+                      (float)(dd->net_watts + dd->gen_watts) / 1000);
+    } else if (dd->mode == MODE_TEMP) {
+        /* LED A: fridge */
+        if (isnan (dd->temp_fridge))
+            led_show (d->led_a, "----");
+        else
+            led_show (d->led_a, "%0.1lf", c2f (dd->temp_fridge));
+
+        /* LED B: freezer */
+        if (isnan (dd->temp_freezer))
+            led_show (d->led_b, "----");
+        else
+            led_show (d->led_b, "%0.1lf", c2f (dd->temp_freezer));
+    }
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
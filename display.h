@@ -0,0 +1,62 @@
+/* OLED and LED rendering, shared by emond and emondisp.
+ *
+ * The panel shows today's energy and a sparkline of power on the OLED,
+ * and either generated and used power or the fridge temps on the two
+ * LED modules.  Each device is opened and reopened in the background
+ * (see device.h), so a missing or wedged panel never blocks the caller.
+ */
+#define SPARK_LEN       FB_WIDTH
+#define SPARK_INTERVAL  60      /* sec per sparkline point */
+
+typedef enum { MODE_POWER, MODE_TEMP } dispmode_t;
+
+/* Rolling history of net (TED) and generated (Envoy) power, one point
+ * per SPARK_INTERVAL, oldest first.
+ */
+typedef struct {
+    int net[SPARK_LEN];
+    int gen[SPARK_LEN];
+    int n;
+    long net_sum;
+    long gen_sum;
+    int count;
+    time_t start;
+    bool changed;
+} spark_t;
+
+/* Average samples over SPARK_INTERVAL and push a point when it elapses.
+ * Returns true if a point was pushed.
+ */
+bool spark_sample (spark_t *sp, time_t now, int net, int gen);
+
+/* What to show.  Temps are in C and NAN if unknown.
+ */
+typedef struct {
+    dispmode_t mode;
+    double temp_fridge;
+    double temp_freezer;
+    double gen_kwh;                     /* generated today */
+    double use_kwh;                     /* energy used today */
+    int gen_watts;                      /* generated now */
+    int net_watts;                      /* net power from grid now */
+    bool tstale;                        /* TED data is stale */
+    bool estale;                        /* some Envoy is stale */
+    bool enone;                         /* no Envoy is fresh */
+    spark_t *spark;                     /* redrawn when it has changed */
+} display_data_t;
+
+typedef struct display_struct display_t;
+
+/* Start opening the OLED and LED modules at their default addresses and
+ * wait at most timeout_ms for them to answer.
+ */
+display_t *display_create (int timeout_ms);
+void display_destroy (display_t *d);
+
+/* Render dd and write what changed to whichever devices are present.
+ */
+void display_update (display_t *d, const display_data_t *dd);
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
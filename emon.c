@@ -1,8 +1,12 @@
 #include <stdio.h>
 #include <getopt.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <time.h>
 #include <zmq.h>
 
 #include "zmq.h"
@@ -10,8 +14,9 @@
 #include "emon.h"
 #include "encode.h"
 #include "w1.h"
+#include "state.h"
 
-#define OPTIONS "tmeEac"
+#define OPTIONS "tmeEacMT:u:w:sr"
 #define HAVE_GETOPT_LONG 1
 
 #if HAVE_GETOPT_LONG
@@ -23,13 +28,76 @@ static const struct option longopts[] = {
     { "envoy-energy", no_argument, 0, 'E'},
     { "monitor",      no_argument, 0, 'm'},
     { "csv",          no_argument, 0, 'c'},
+    { "metrics",      no_argument, 0, 'M'},
+    { "trace-dump",   required_argument, 0, 'T'},
+    { "uri",          required_argument, 0, 'u'},
+    { "window",       required_argument, 0, 'w'},
+    { "shm",          no_argument, 0, 's'},
+    { "recover",      no_argument, 0, 'r'},
     {0, 0, 0, 0},
 };
 #else
 #define GETOPT(ac,av,opt,lopt) getopt (ac,av,opt)
 #endif
 
-void mon (void *zs, bool topt, bool eopt, bool Eopt, bool mopt, bool copt);
+#define MAXSRC          64
+#define WINDOW_MS       1000    /* default reorder window */
+#define REPLAY_MS       1000    /* how long to wait for emond to replay */
+
+/* A message waiting to be merged.  Records are recycled through a free
+ * list and keep their buffer, which only grows, so a steady stream costs
+ * no allocation once the pool has warmed up.
+ */
+typedef struct rec_struct {
+    struct rec_struct *next;
+    uint64_t ts;
+    int len, size;
+    char *buf;
+} rec_t;
+
+/* Last sequence number seen on a topic, keyed by site and topic so that
+ * a stream merged by emonagg is tracked per site.
+ */
+typedef struct {
+    char key[SITE_MAX + TOPIC_MAX];
+    uint64_t seq;
+} topicseq_t;
+
+typedef struct {
+    const char *name;
+    const char *uri;
+    const char *ctl;                /* control socket for replay, or NULL */
+    void *zs;
+    topicseq_t *seq;                /* grows as sites and topics appear */
+    int nseq, maxseq;
+    rec_t *head, *tail;             /* pending records, arrival order */
+    int tcount, ecount, Ecount;     /* records shown, by kind */
+} src_t;
+
+/* Each source is in time order, so the next record overall is the oldest
+ * head.  The heap holds the sources that have a pending record, oldest
+ * head at the root.
+ */
+typedef struct {
+    src_t src[MAXSRC];
+    int nsrc;
+    int heap[MAXSRC];
+    int nheap;
+    rec_t *free;
+    uint64_t window;                /* usec */
+    void *zctx;
+    bool recover;                   /* replay gaps from emond's journal */
+    char *scratch;                  /* received message, NUL terminated */
+    int scratchsize;
+} merge_t;
+
+typedef struct {
+    bool topt, eopt, Eopt, mopt, copt;
+} monopt_t;
+
+void mon (merge_t *m, monopt_t *o);
+void shm_show (monopt_t *o);
+char *ctl_request (void *zctx, const char *req);
 
 void usage (void)
 {
@@ -40,40 +108,88 @@ void usage (void)
 "   -E,--envoy-energy       display Envoy energy values\n"
 "   -m,--monitor            monitor raw JSON as it is sampled\n"
 "   -c,--csv                output csv data\n"
-);
+"   -M,--metrics            display emond metrics, then exit\n"
+"   -T,--trace-dump FILE    write emond trace spans to FILE in Chrome\n"
+"                           trace format (emond must run with -T), then exit\n"
+"   -u,--uri [NAME=]URI[,CTLURI]  subscribe to URI (may repeat, default\n"
+"                           %s), tagging records with NAME (default\n"
+"                           URI); CTLURI is emond's control socket (see -r)\n"
+"   -w,--window MSEC        wait up to MSEC for a quiet source before\n"
+"                           emitting newer records (default %d)\n"
+"   -s,--shm                display current values from emond's shared\n"
+"                           memory segment (all unless -t, -e, -E), then exit\n"
+"   -r,--recover            when messages are missed, have them replayed\n"
+"                           from emond's journal (default source, or -u\n"
+"                           with CTLURI); gaps are reported regardless\n",
+             PUB_URI, WINDOW_MS);
     exit (1);
 }
 
 int main (int argc, char *argv[])
 {
-    int c;
+    int c, i;
     void *zctx;
-    void *zs;
-    bool topt = false;
-    bool mopt = false;
-    bool eopt = false;
-    bool Eopt = false;
-    bool copt = false;
+    monopt_t o = { false, false, false, false, false };
+    merge_t *m = xzmalloc (sizeof (*m));
+    bool Mopt = false;
+    bool sopt = false;
+    char *Topt = NULL;
+    FILE *f;
+    char *s, *p, *q;
 
     while ((c = GETOPT (argc, argv, OPTIONS, longopts)) != -1) {
         switch (c) {
             case 't': /* --temp */
-                topt = true;
+                o.topt = true;
                 break;
             case 'e': /* --ted-energy */
-                eopt = true;
+                o.eopt = true;
                 break;
             case 'E': /* --envoy-energy */
-                Eopt = true;
+                o.Eopt = true;
                 break;
             case 'm': /* --monitor */
-                mopt = true;
+                o.mopt = true;
                 break;
             case 'c': /* --csv */
-                copt = true;
+                o.copt = true;
+                break;
+            case 'M': /* --metrics */
+                Mopt = true;
+                break;
+            case 'T': /* --trace-dump */
+                Topt = optarg;
                 break;
             case 'a': /* --all */
-                Eopt = eopt = topt = true;
+                o.Eopt = o.eopt = o.topt = true;
+                break;
+            case 'u': /* --uri */
+                if (m->nsrc == MAXSRC) {
+                    fprintf (stderr, "emon: at most %d URIs\n", MAXSRC);
+                    exit (1);
+                }
+                m->src[m->nsrc].name = optarg;
+                m->src[m->nsrc].uri = optarg;
+                if ((p = strchr (optarg, ','))) {
+                    *p = '\0';
+                    m->src[m->nsrc].ctl = p + 1;
+                }
+                p = strchr (optarg, '=');
+                q = strstr (optarg, "://");
+                if (p && (!q || p < q)) {
+                    *p = '\0';
+                    m->src[m->nsrc].uri = p + 1;
+                }
+                m->nsrc++;
+                break;
+            case 'w': /* --window */
+                m->window = strtoul (optarg, NULL, 10) * 1000;
+                break;
+            case 's': /* --shm */
+                sopt = true;
+                break;
+            case 'r': /* --recover */
+                m->recover = true;
                 break;
             default:
                 usage ();
@@ -81,87 +197,529 @@ int main (int argc, char *argv[])
     }
     if (optind < argc)
         usage ();
-    if (!mopt && !Eopt && !eopt && !topt)
+    if (sopt) {
+        shm_show (&o);
+        exit (0);
+    }
+    if (!o.mopt && !o.Eopt && !o.eopt && !o.topt && !Mopt && !Topt)
         usage ();
+    if (m->nsrc == 0) {
+        m->src[0].name = m->src[0].uri = PUB_URI;
+        m->src[0].ctl = CTL_URI;
+        m->nsrc = 1;
+    }
+    if (m->window == 0)
+        m->window = WINDOW_MS * 1000;
 
-    zctx = _zmq_init (1);
-    zs = _zmq_socket (zctx, ZMQ_SUB);
-    _zmq_connect (zs, PUB_URI);
-    _zmq_subscribe (zs, "");
+    zctx = m->zctx = _zmq_init (1);
+    if (Mopt) {
+        s = ctl_request (zctx, "metrics");
+        fputs (s, stdout);
+        free (s);
+    }
+    if (Topt) {
+        s = ctl_request (zctx, "trace");
+        if (!(f = fopen (Topt, "w")) || fputs (s, f) < 0 || fclose (f) < 0) {
+            perror (Topt);
+            exit (1);
+        }
+        free (s);
+    }
+    if (Mopt || Topt) {
+        _zmq_term (zctx);
+        exit (0);
+    }
+    for (i = 0; i < m->nsrc; i++) {
+        m->src[i].zs = _zmq_socket (zctx, ZMQ_SUB);
+        _zmq_connect (m->src[i].zs, m->src[i].uri);
+        _zmq_subscribe (m->src[i].zs, "");
+    }
 
-    mon (zs, topt, eopt, Eopt, mopt, copt);
+    mon (m, &o);
 
-    _zmq_close (zs);
+    for (i = 0; i < m->nsrc; i++)
+        _zmq_close (m->src[i].zs);
     _zmq_term (zctx);
 
     exit (0);
 }
 
-void mon (void *zs, bool topt, bool eopt, bool Eopt, bool mopt, bool copt)
+/* Send request req to the control socket at uri and wait up to tmout
+ * usec for the reply.  Returns the REQ socket with the reply ready to
+ * read, or NULL if none came.
+ */
+static void *ctl_call (void *zctx, const char *uri, const char *req,
+                       long tmout)
 {
-    int tcount = 0;
-    int ecount = 0;
-    int Ecount = 0;
+    void *zs;
+    zmq_msg_t msg;
+    zmq_pollitem_t zp = { .events = ZMQ_POLLIN, .fd = -1 };
+    int linger = 0;
+    int rc;
 
-    for (;;) {
-        zmq_msg_t msg;
-        char *s;
+    zs = _zmq_socket (zctx, ZMQ_REQ);
+    zmq_setsockopt (zs, ZMQ_LINGER, &linger, sizeof (linger));
+    _zmq_connect (zs, uri);
+
+    _zmq_msg_init_size (&msg, strlen (req));
+    memcpy (zmq_msg_data (&msg), req, strlen (req));
+    _zmq_send (zs, &msg, 0);
+
+    zp.socket = zs;
+    if ((rc = zmq_poll (&zp, 1, tmout)) < 0) {
+        fprintf (stderr, "zmq_poll: %s\n", zmq_strerror (errno));
+        exit (1);
+    }
+    if (rc == 0) {
+        _zmq_close (zs);
+        return NULL;
+    }
+    return zs;
+}
+
+/* Send a request to emond's control socket and return the reply.
+ * Caller must free result.
+ */
+char *ctl_request (void *zctx, const char *req)
+{
+    void *zs;
+    zmq_msg_t msg;
+    char *s;
+
+    if (!(zs = ctl_call (zctx, CTL_URI, req, 5*1000000))) {
+        fprintf (stderr, "%s: no response from emond\n", CTL_URI);
+        exit (1);
+    }
+    _zmq_msg_init (&msg);
+    _zmq_recv (zs, &msg, 0);
+    s = xzmalloc (zmq_msg_size (&msg) + 1);
+    memcpy (s, zmq_msg_data (&msg), zmq_msg_size (&msg));
+    _zmq_msg_close (&msg);
+    _zmq_close (zs);
+    return s;
+}
+
+static uint64_t now_us (void)
+{
+    struct timeval tv;
+
+    gettimeofday (&tv, NULL);
+    return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+static uint64_t head_ts (merge_t *m, int h)
+{
+    return m->src[m->heap[h]].head->ts;
+}
+
+static void heap_swap (merge_t *m, int a, int b)
+{
+    int tmp = m->heap[a];
+
+    m->heap[a] = m->heap[b];
+    m->heap[b] = tmp;
+}
+
+static void heap_up (merge_t *m, int h)
+{
+    while (h > 0 && head_ts (m, (h - 1) / 2) > head_ts (m, h)) {
+        heap_swap (m, h, (h - 1) / 2);
+        h = (h - 1) / 2;
+    }
+}
+
+static void heap_down (merge_t *m, int h)
+{
+    int c;
+
+    while ((c = 2 * h + 1) < m->nheap) {
+        if (c + 1 < m->nheap && head_ts (m, c + 1) < head_ts (m, c))
+            c++;
+        if (head_ts (m, h) <= head_ts (m, c))
+            break;
+        heap_swap (m, h, c);
+        h = c;
+    }
+}
+
+/* Queue message s (len bytes) from source i, stamped with its emond
+ * publish time, or with its arrival time if emond is too old to stamp it.
+ */
+static void merge_add (merge_t *m, int i, const char *s, int len)
+{
+    src_t *src = &m->src[i];
+    rec_t *r;
+
+    if ((r = m->free))
+        m->free = r->next;
+    else
+        r = xzmalloc (sizeof (*r));
+    if (r->size < len + 1) {
+        free (r->buf);
+        r->size = len + 1 > 512 ? len + 1 : 512;
+        r->buf = xzmalloc (r->size);
+    }
+    memcpy (r->buf, s, len);
+    r->buf[len] = '\0';
+    r->len = len;
+    if (!ts_deserialize (r->buf, &r->ts))
+        r->ts = now_us ();
+    r->next = NULL;
+    if (src->tail)
+        src->tail->next = r;
+    else {
+        src->head = r;
+        m->heap[m->nheap++] = i;
+        heap_up (m, m->nheap - 1);
+    }
+    src->tail = r;
+}
+
+/* Take the oldest pending record if it is safe to emit: every source has
+ * a record queued, so nothing older can still arrive, or the record has
+ * waited out the reorder window for the sources that are quiet.
+ * Otherwise set *tmoutp to how long (usec) to wait for more input.
+ * A record arriving after newer ones have gone out is emitted late
+ * rather than dropped.
+ */
+static rec_t *merge_next (merge_t *m, int *srcp, long *tmoutp)
+{
+    uint64_t now, due;
+    src_t *src;
+    rec_t *r;
+
+    *tmoutp = -1;
+    if (m->nheap == 0)
+        return NULL;
+    if (m->nheap < m->nsrc) {
+        now = now_us ();
+        due = head_ts (m, 0) + m->window;
+        if (due > now) {
+            *tmoutp = due - now;
+            return NULL;
+        }
+    }
+    *srcp = m->heap[0];
+    src = &m->src[*srcp];
+    r = src->head;
+    if (!(src->head = r->next)) {
+        src->tail = NULL;
+        m->heap[0] = m->heap[--m->nheap];
+    }
+    heap_down (m, 0);
+    return r;
+}
+
+static void merge_put (merge_t *m, rec_t *r)
+{
+    r->next = m->free;
+    m->free = r;
+}
+
+static uint64_t *topic_seq (src_t *src, const char *key)
+{
+    int i;
+
+    for (i = 0; i < src->nseq; i++) {
+        if (!strcmp (src->seq[i].key, key))
+            return &src->seq[i].seq;
+    }
+    if (src->nseq == src->maxseq) {
+        src->maxseq = src->maxseq ? src->maxseq * 2 : 32;
+        src->seq = realloc (src->seq, src->maxseq * sizeof (src->seq[0]));
+        if (!src->seq)
+            oom ();
+    }
+    snprintf (src->seq[src->nseq].key, sizeof (src->seq[0].key), "%s", key);
+    src->seq[src->nseq].seq = 0;
+    return &src->seq[src->nseq++].seq;
+}
+
+/* True if message s is from site, or if both have no site.
+ */
+static bool site_match (const char *s, const char *site)
+{
+    char name[SITE_MAX];
+
+    if (!site_deserialize (s, name, sizeof (name)))
+        return site == NULL;
+    return site != NULL && !strcmp (name, site);
+}
+
+/* Ask source i's emond to replay messages numbered first up to (but not
+ * including) last on topic from site (NULL if unnamed), and queue them.
+ * A journal may hold other sites' messages with the same numbers, so
+ * those are ignored.  Returns how many arrived.
+ */
+static uint64_t replay (merge_t *m, int i, const char *site,
+                        const char *topic, uint64_t first, uint64_t last)
+{
+    src_t *src = &m->src[i];
+    zmq_msg_t msg;
+    char req[64];
+    uint64_t seq, n = 0;
+    void *zs;
+    char *s;
+    int len;
 
+    snprintf (req, sizeof (req), "replay %s %llu", topic,
+              (unsigned long long)first);
+    if (!(zs = ctl_call (m->zctx, src->ctl, req, REPLAY_MS * 1000)))
+        return 0;
+    do {
         _zmq_msg_init (&msg);
-        _zmq_recv(zs, &msg, 0);
-        s = xzmalloc (zmq_msg_size (&msg) + 1);
-        memcpy (s, zmq_msg_data (&msg), zmq_msg_size (&msg));
-
-        if (mopt) {
-            printf ("%s\n", s); /* print undecoded JSON */
-        } else {
-            if (topt && tcount == 0) {
-                double c, fr, fz;
-                if (temp_deserialize (s, &c, &fr, &fz)) {
-                    if (copt) {
-                        printf ("%.1lf,%.1lf,%.1lf\n",
-                                c2f (c), c2f (fr), c2f (fz));
-                    } else {
-                        printf ("Fridge top case temp   %.1lf F\n", c2f (c));
-                        printf ("Fridge temp            %.1lf F\n", c2f (fr));
-                        printf ("Freezer temp           %.1lf F\n", c2f (fz));
-                    }
-                    tcount++;
-                }
+        _zmq_recv (zs, &msg, 0);
+        if ((len = zmq_msg_size (&msg)) > 0) {
+            s = xzmalloc (len + 1);
+            memcpy (s, zmq_msg_data (&msg), len);
+            if (seq_deserialize (s, &seq) && seq >= first && seq < last
+                                          && site_match (s, site)) {
+                merge_add (m, i, s, len);
+                n++;
             }
-            if (eopt && ecount == 0) {
-                int a, c, w, v;
-                if (ted_deserialize (s, &a, &c, &w, &v)) {
-                    if (copt) {
-                        printf ("%d,%d,%d,%d\n", a, c, w, v);
-                    } else {
-                        printf ("Net power from grid    %d W\n", w);
-                        printf ("Line voltage           %d V\n", v);
+            free (s);
+        }
+        _zmq_msg_close (&msg);
+    } while (_zmq_rcvmore (zs));
+    _zmq_close (zs);
+    return n;
+}
+
+/* Check message s from source i against the last sequence number seen on
+ * its topic.  With -r, missed messages are fetched from emond's journal
+ * and queued ahead of s.  Whatever is not recovered is reported.  Returns
+ * false if s repeats the last message, so that it is not shown twice.
+ */
+static bool gap_check (merge_t *m, int i, const char *s)
+{
+    src_t *src = &m->src[i];
+    char topic[TOPIC_MAX], site[SITE_MAX], key[SITE_MAX + TOPIC_MAX];
+    uint64_t seq, missed, *last;
+    bool named;
+
+    if (!seq_deserialize (s, &seq)
+                || !topic_deserialize (s, topic, sizeof (topic)))
+        return true;
+    if ((named = site_deserialize (s, site, sizeof (site))))
+        snprintf (key, sizeof (key), "%s/%s", site, topic);
+    else
+        snprintf (key, sizeof (key), "%s", topic);
+    last = topic_seq (src, key);
+    if (*last > 0 && seq == *last)
+        return false;
+    if (*last > 0 && seq > *last + 1) {
+        missed = seq - *last - 1;
+        if (m->recover && src->ctl)
+            missed -= replay (m, i, named ? site : NULL, topic, *last + 1,
+                              seq);
+        if (missed > 0)
+            fprintf (stderr, "emon: %s: lost %llu %s message%s\n",
+                     src->name, (unsigned long long)missed, key,
+                     missed > 1 ? "s" : "");
+    } else if (*last > 0 && seq < *last)
+        fprintf (stderr, "emon: %s: %s sequence restarted\n",
+                 src->name, key);
+    *last = seq;
+    return true;
+}
+
+/* Print readings, prefixed with source name if not NULL.
+ */
+static void print_temp (const char *name, bool copt, bool stale,
+                        double c, double fr, double fz)
+{
+    const char *mark = stale ? "*" : "";
+
+    if (copt) {
+        if (name)
+            printf ("%s,", name);
+        printf ("%.1lf,%.1lf,%.1lf\n", c2f (c), c2f (fr), c2f (fz));
+    } else {
+        if (name)
+            printf ("[%s]\n", name);
+        printf ("Fridge top case temp   %.1lf F%s\n", c2f (c), mark);
+        printf ("Fridge temp            %.1lf F%s\n", c2f (fr), mark);
+        printf ("Freezer temp           %.1lf F%s\n", c2f (fz), mark);
+    }
+}
+
+static void print_ted (const char *name, bool copt, bool stale,
+                       int a, int c, int w, int v)
+{
+    const char *mark = stale ? "*" : "";
+
+    if (copt) {
+        if (name)
+            printf ("%s,", name);
+        printf ("%d,%d,%d,%d\n", a, c, w, v);
+    } else {
+        if (name)
+            printf ("[%s]\n", name);
+        printf ("Net power from grid    %d W%s\n", w, mark);
+        printf ("Line voltage           %d V%s\n", v, mark);
+    }
+}
+
+static void print_envoy (const char *name, bool copt, bool stale,
+                         int l, int w, int d, int c)
+{
+    const char *mark = stale ? "*" : "";
+
+    if (copt) {
+        if (name)
+            printf ("%s,", name);
+        printf ("%d,%d,%d,%d\n", l, w, d, c);
+    } else {
+        if (name)
+            printf ("[%s]\n", name);
+        printf ("Lifetime energy gen    %.1lf kW*h%s\n", 1E-3*l, mark);
+        printf ("Weekly energy gen      %.1lf kW*h%s\n", 1E-3*w, mark);
+        printf ("Daily energy gen       %.1lf kW*h%s\n", 1E-3*d, mark);
+        printf ("Generated power        %d W%s\n", c, mark);
+    }
+}
+
+/* Take a snapshot of emond's readings from shared memory: no socket,
+ * no waiting for the next sample.  The segment outlives emond, so
+ * readings past their staleness limit are marked with '*' as on the
+ * OLED (or, in CSV, noted on stderr).  Temperatures carry no time of
+ * their own, so they go stale when emond stops updating the segment.
+ */
+void shm_show (monopt_t *o)
+{
+    state_seg_t *seg;
+    state_t st;
+    bool all = !o->topt && !o->eopt && !o->Eopt;
+    time_t now = time (NULL);
+    bool sstale, tstale, estale;
+
+    if (!(seg = state_open (STATE_PATH))) {
+        fprintf (stderr, "%s: %s\n", STATE_PATH, strerror (errno));
+        exit (1);
+    }
+    if (!state_read (seg, &st)) {
+        fprintf (stderr, "%s: emond is updating too fast\n", STATE_PATH);
+        exit (1);
+    }
+    state_close (seg);
+    sstale = (now - st.updated / 1000000 > TED_STALE);
+    tstale = (now - st.ted_last > TED_STALE);
+    estale = (now - st.envoy_last > ENVOY_STALE);
+    if (all || o->topt) {
+        print_temp (NULL, o->copt, sstale, st.temp_case, st.temp_fridge,
+                    st.temp_freezer);
+        if (o->copt && sstale)
+            fprintf (stderr, "emon: emond last updated %lld s ago\n",
+                     (long long)(now - st.updated / 1000000));
+    }
+    if ((all || o->eopt) && st.ted_last > 0) {
+        print_ted (NULL, o->copt, tstale, st.ted_addr, st.ted_count,
+                   st.ted_watts, st.ted_volts);
+        if (o->copt && tstale)
+            fprintf (stderr, "emon: TED sample is %lld s old\n",
+                     (long long)(now - st.ted_last));
+    }
+    if ((all || o->Eopt) && st.envoy_last > 0) {
+        print_envoy (NULL, o->copt, estale, st.envoy_lifetime_energy,
+                     st.envoy_weekly_energy, st.envoy_daily_energy,
+                     st.envoy_current_power);
+        if (o->copt && estale)
+            fprintf (stderr, "emon: Envoy data is %lld s old\n",
+                     (long long)(now - st.envoy_last));
+    }
+}
+
+/* Show record s from source src.  With more than one source, raw JSON
+ * and CSV lines are prefixed with the source name.
+ * Returns true once everything asked for has been shown for every source.
+ */
+static bool show (merge_t *m, src_t *src, const char *s, monopt_t *o)
+{
+    const char *tag = m->nsrc > 1 ? src->name : NULL;
+    int i;
+
+    if (o->mopt) {
+        if (tag)
+            printf ("%s ", tag);
+        printf ("%s\n", s); /* print undecoded JSON */
+        return false;
+    }
+    if (o->topt && (o->copt || src->tcount == 0)) {
+        double c, fr, fz;
+        if (temp_deserialize (s, &c, &fr, &fz)) {
+            print_temp (tag, o->copt, false, c, fr, fz);
+            src->tcount++;
+        }
+    }
+    if (o->eopt && (o->copt || src->ecount == 0)) {
+        int a, c, w, v;
+        if (ted_deserialize (s, &a, &c, &w, &v)) {
+            print_ted (tag, o->copt, false, a, c, w, v);
+            src->ecount++;
+        }
+    }
+    if (o->Eopt && (o->copt || src->Ecount == 0)) {
+        int l, w, d, c;
+        if (envoy_deserialize (s, NULL, 0, &l, &w, &d, &c)) {
+            print_envoy (tag, o->copt, false, l, w, d, c);
+            src->Ecount++;
+        }
+    }
+    if (o->copt)
+        return false;
+    for (i = 0; i < m->nsrc; i++) {
+        src = &m->src[i];
+        if ((o->topt && src->tcount == 0) || (o->eopt && src->ecount == 0)
+                                          || (o->Eopt && src->Ecount == 0))
+            return false;
+    }
+    return true;
+}
+
+void mon (merge_t *m, monopt_t *o)
+{
+    zmq_pollitem_t zp[MAXSRC];
+    zmq_msg_t msg;
+    long tmout;
+    rec_t *r;
+    int i, len;
+
+    for (i = 0; i < m->nsrc; i++) {
+        zp[i].socket = m->src[i].zs;
+        zp[i].fd = -1;
+        zp[i].events = ZMQ_POLLIN;
+    }
+    for (;;) {
+        while ((r = merge_next (m, &i, &tmout))) {
+            bool done = show (m, &m->src[i], r->buf, o);
+            merge_put (m, r);
+            if (done)
+                return;
+        }
+        fflush (stdout);
+        if (zmq_poll (zp, m->nsrc, tmout) < 0) {
+            fprintf (stderr, "zmq_poll: %s\n", zmq_strerror (errno));
+            exit (1);
+        }
+        for (i = 0; i < m->nsrc; i++) {
+            while (_zmq_pollin (m->src[i].zs)) {
+                _zmq_msg_init (&msg);
+                _zmq_recv (m->src[i].zs, &msg, 0);
+                if (!_zmq_rcvmore (m->src[i].zs)) { /* skip emonagg topic */
+                    len = zmq_msg_size (&msg);
+                    if (m->scratchsize < len + 1) {
+                        free (m->scratch);
+                        m->scratchsize = len + 1 > 512 ? len + 1 : 512;
+                        m->scratch = xzmalloc (m->scratchsize);
                     }
-                    ecount++;
+                    memcpy (m->scratch, zmq_msg_data (&msg), len);
+                    m->scratch[len] = '\0';
+                    if (gap_check (m, i, m->scratch))
+                        merge_add (m, i, m->scratch, len);
                 }
-            }
-            if (Eopt && Ecount == 0) {
-                int l, w, d, c;
-                if (envoy_deserialize (s, &l, &w, &d, &c)) {
-                    if (copt) {
-                        printf ("%d,%d,%d,%d\n", l, w, d, c);
-                    } else {
-                        printf ("Lifetime energy gen    %.1lf kW*h\n", 1E-3*l);
-                        printf ("Weekly energy gen      %.1lf kW*h\n", 1E-3*w);
-                        printf ("Daily energy gen       %.1lf kW*h\n", 1E-3*d);
-                        printf ("Generated power        %d W\n", c);
-                    }
-                    Ecount++;
-                } 
+                _zmq_msg_close (&msg);
             }
         }
-        free (s);
-        _zmq_msg_close (&msg); 
-
-        if (!copt && !mopt && (!topt || tcount > 0) && (!eopt || ecount > 0)
-                                                    && (!Eopt || Ecount > 0))
-            break;
     }
 }
 
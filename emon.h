@@ -1 +1,18 @@
+#define ENVOY_URI       "ipc:///tmp/emond"
 #define PUB_URI         "ipc:///tmp/emond_pub"
+#define CTL_URI         "ipc:///tmp/emond_ctl"
+#define OTHER_IPC_URI   "ipc:///tmp/emond_other"
+#define AGG_URI         "ipc:///tmp/emonagg_pub"
+
+/* Readings older than this are shown as stale.
+ */
+#define TED_STALE       30      /* sec */
+#define ENVOY_STALE     600     /* sec */
+
+/* Devices, shared with emonsim.
+ */
+#define W1_TEMP_CASE    "28-000002bf1574"
+#define W1_TEMP_FRIDGE  "28-0000059d3842"
+#define W1_TEMP_FREEZER "28-0000059dec96"
+
+#define GPIO_MODE_PIN   27
@@ -0,0 +1,524 @@
+/*****************************************************************************
+ *  Copyright (C) 2014 Jim Garlick
+ *  Written by Jim Garlick <garlick.jim@gmail.com>
+ *  All Rights Reserved.
+ *
+ *  This file is part of pi-ted-envoy.
+ *  For details, see <https://github.com/garlick/pi-ted-envoy>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+/* emonagg.c - fan in the PUB streams of many emond sites */
+
+/* Each shard thread has a SUB socket connected to every n-th site URI
+ * and a table of the latest state of the sites it has heard from, so
+ * shards share nothing and ingest scales with cores as long as the sites
+ * are spread over URIs.  Sites are told apart by the "site" field emond
+ * stamps with -S.  Every message is passed on downstream under topic
+ * "site.<name>".  Each interval every shard also hands the main thread
+ * its partial rollup, and the main thread publishes their sum under
+ * topic "fleet".  Downstream messages have two parts: the topic, for
+ * subscriptions to filter on, then the JSON.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <zmq.h>
+
+#include "zmq.h"
+#include "util.h"
+#include "emon.h"
+#include "encode.h"
+
+#define SHARD_URI       "inproc://shards"
+#define SHARD_MAX       64
+#define BIND_MAX        4
+#define TAB_INIT        64      /* initial site table size (power of 2) */
+#define SITE_ENVOYS     8       /* Envoys per site, as emond's ENVOY_MAX */
+
+/* Latest message from one of a site's Envoys.  emond publishes one
+ * message per Envoy, so each is kept by its source name.
+ */
+typedef struct {
+    char name[ENVOY_SRCLEN];
+    time_t seen;
+    int watts;
+    int daily;
+} envsrc_t;
+
+/* Latest state of one site.  An empty name marks a free slot.
+ */
+typedef struct {
+    char name[SITE_MAX];
+    uint32_t hash;
+    time_t seen;                /* when we last heard from it */
+    int ted_watts;
+    envsrc_t envoy[SITE_ENVOYS];
+    int nenvoy;
+    uint32_t msgs;
+} site_t;
+
+/* Open addressing with linear probing.  Sites are never removed, they
+ * just stop counting as live, so there are no tombstones.
+ */
+typedef struct {
+    site_t *slot;
+    uint32_t cap;               /* power of 2 */
+    uint32_t n;
+} sitetab_t;
+
+/* A shard's contribution to the fleet rollup.
+ */
+typedef struct {
+    int shard;
+    int sites, live;
+    int ted_watts, envoy_watts, envoy_daily;
+    uint64_t msgs, unsited;
+} rollup_t;
+
+typedef struct {
+    int id;
+    void *zctx;
+    char **uri;
+    int nuri;
+    int nshards;
+    int interval;
+    int stale;
+    pthread_t t;
+} shard_t;
+
+#define OPTIONS "s:f:b:j:i:x:d"
+static const struct option longopts[] = {
+    {"site-uri",  required_argument, 0, 's'},
+    {"uri-file",  required_argument, 0, 'f'},
+    {"bind",      required_argument, 0, 'b'},
+    {"shards",    required_argument, 0, 'j'},
+    {"interval",  required_argument, 0, 'i'},
+    {"stale",     required_argument, 0, 'x'},
+    {"debug",     no_argument,       0, 'd'},
+    {0, 0, 0, 0},
+};
+
+static void usage (void)
+{
+    fprintf (stderr,
+"Usage: emonagg [OPTIONS]\n"
+"   -s,--site-uri URI     subscribe to an emond (e.g. tcp://host:5557),\n"
+"                         may be repeated\n"
+"   -f,--uri-file FILE    subscribe to each URI listed in FILE, one per line\n"
+"   -b,--bind URI         publish on URI (default " AGG_URI "),\n"
+"                         may be repeated\n"
+"   -j,--shards N         ingest threads (default one per CPU)\n"
+"   -i,--interval SEC     fleet rollup interval (default 10)\n"
+"   -x,--stale SEC        sites quiet this long are not live (default 60)\n"
+"   -d,--debug            print each fleet rollup on stderr\n"
+"Sites are named by emond -S.  Topics are site.<name> and fleet.\n"
+    );
+    exit (1);
+}
+
+static uint32_t hash (const char *s)
+{
+    uint32_t h = 2166136261u;   /* FNV-1a */
+
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static site_t *_probe (site_t *slot, uint32_t cap, const char *name,
+                       uint32_t h)
+{
+    uint32_t i = h & (cap - 1);
+
+    while (slot[i].name[0] != '\0' && (slot[i].hash != h
+                                       || strcmp (slot[i].name, name) != 0))
+        i = (i + 1) & (cap - 1);
+    return &slot[i];
+}
+
+/* Double the table once it is 3/4 full.
+ */
+static void _grow (sitetab_t *tab)
+{
+    uint32_t cap = tab->cap ? tab->cap * 2 : TAB_INIT;
+    site_t *slot = xzmalloc (cap * sizeof (site_t));
+    uint32_t i;
+
+    for (i = 0; i < tab->cap; i++)
+        if (tab->slot[i].name[0] != '\0')
+            *_probe (slot, cap, tab->slot[i].name, tab->slot[i].hash)
+                                                            = tab->slot[i];
+    free (tab->slot);
+    tab->slot = slot;
+    tab->cap = cap;
+}
+
+static site_t *site_lookup (sitetab_t *tab, const char *name)
+{
+    uint32_t h = hash (name);
+    site_t *st;
+
+    if ((tab->n + 1) * 4 > tab->cap * 3)
+        _grow (tab);
+    st = _probe (tab->slot, tab->cap, name, h);
+    if (st->name[0] == '\0') {
+        snprintf (st->name, sizeof (st->name), "%s", name);
+        st->hash = h;
+        tab->n++;
+    }
+    return st;
+}
+
+/* Return the top level key of a serialized message, e.g. "ted", in buf,
+ * without parsing it.
+ */
+static bool msg_kind (const char *s, char *buf, int len)
+{
+    const char *p, *q;
+
+    if (!(p = strchr (s, '"')) || !(q = strchr (p + 1, '"'))
+                               || q - p - 1 >= len)
+        return false;
+    memcpy (buf, p + 1, q - p - 1);
+    buf[q - p - 1] = '\0';
+    return true;
+}
+
+/* Find a site's Envoy 'name', adding it if new.  NULL if table is full.
+ */
+static envsrc_t *envoy_lookup (site_t *st, const char *name)
+{
+    int i;
+
+    for (i = 0; i < st->nenvoy; i++)
+        if (!strcmp (st->envoy[i].name, name))
+            return &st->envoy[i];
+    if (st->nenvoy == SITE_ENVOYS)
+        return NULL;
+    snprintf (st->envoy[i].name, sizeof (st->envoy[i].name), "%s", name);
+    return &st->envoy[st->nenvoy++];
+}
+
+static void site_update (site_t *st, const char *s, time_t now)
+{
+    char kind[16], src[ENVOY_SRCLEN];
+    int a, c, w, v, l, d;
+    envsrc_t *e;
+
+    st->seen = now;
+    st->msgs++;
+    if (!msg_kind (s, kind, sizeof (kind)))
+        return;
+    if (!strcmp (kind, "ted")) {
+        if (ted_deserialize (s, &a, &c, &w, &v))
+            st->ted_watts = w;
+    } else if (!strcmp (kind, "envoy")) {
+        if (envoy_deserialize (s, src, sizeof (src), &l, &w, &d, &c)
+                                        && (e = envoy_lookup (st, src))) {
+            e->seen = now;
+            e->watts = c;
+            e->daily = d;
+        }
+    }
+}
+
+static void rollup (sitetab_t *tab, rollup_t *r, time_t now, int stale)
+{
+    uint32_t i;
+    site_t *st;
+    int j;
+
+    r->sites = tab->n;
+    r->live = r->ted_watts = r->envoy_watts = r->envoy_daily = 0;
+    for (i = 0; i < tab->cap; i++) {
+        st = &tab->slot[i];
+        if (st->name[0] == '\0' || now - st->seen > stale)
+            continue;
+        r->live++;
+        r->ted_watts += st->ted_watts;
+        for (j = 0; j < st->nenvoy; j++) {
+            if (now - st->envoy[j].seen > ENVOY_STALE)
+                continue;
+            r->envoy_watts += st->envoy[j].watts;
+            r->envoy_daily += st->envoy[j].daily;
+        }
+    }
+}
+
+static void send_part (void *zs, const void *buf, size_t len, int flags)
+{
+    zmq_msg_t msg;
+
+    _zmq_msg_init_size (&msg, len);
+    memcpy (zmq_msg_data (&msg), buf, len);
+    _zmq_send (zs, &msg, flags);
+}
+
+static void *shard_thread (void *arg)
+{
+    shard_t *sh = arg;
+    void *zs_sub = _zmq_socket (sh->zctx, ZMQ_SUB);
+    void *zs_out = _zmq_socket (sh->zctx, ZMQ_PUSH);
+    zmq_pollitem_t zp = { .events = ZMQ_POLLIN, .fd = -1 };
+    sitetab_t tab = { NULL, 0, 0 };
+    rollup_t r = { .shard = sh->id };
+    char name[SITE_MAX], topic[SITE_MAX + 8];
+    char *buf = NULL;
+    int size = 0, len, i;
+    time_t now, next;
+    zmq_msg_t msg;
+    site_t *st;
+
+    for (i = sh->id; i < sh->nuri; i += sh->nshards)
+        _zmq_connect (zs_sub, sh->uri[i]);
+    _zmq_subscribe (zs_sub, "");
+    _zmq_connect (zs_out, SHARD_URI);
+    zp.socket = zs_sub;
+    next = time (NULL) + sh->interval;
+    for (;;) {
+        now = time (NULL);
+        if (now >= next) {
+            rollup (&tab, &r, now, sh->stale);
+            send_part (zs_out, "", 0, ZMQ_SNDMORE);
+            send_part (zs_out, &r, sizeof (r), 0);
+            next = now + sh->interval;
+        }
+        if (zmq_poll (&zp, 1, (next - now) * 1000000L) < 0) {
+            fprintf (stderr, "zmq_poll: %s\n", zmq_strerror (errno));
+            exit (1);
+        }
+        now = time (NULL);
+        while (_zmq_pollin (zs_sub)) {
+            _zmq_msg_init (&msg);
+            _zmq_recv (zs_sub, &msg, 0);
+            len = zmq_msg_size (&msg);
+            if (len + 1 > size) {
+                free (buf);
+                size = len + 1 > 1024 ? len + 1 : 1024;
+                buf = xzmalloc (size);
+            }
+            memcpy (buf, zmq_msg_data (&msg), len);
+            buf[len] = '\0';
+            r.msgs++;
+            if (!site_deserialize (buf, name, sizeof (name))) {
+                r.unsited++;
+                _zmq_msg_close (&msg);
+                continue;
+            }
+            st = site_lookup (&tab, name);
+            site_update (st, buf, now);
+            snprintf (topic, sizeof (topic), "site.%s", name);
+            send_part (zs_out, topic, strlen (topic), ZMQ_SNDMORE);
+            _zmq_send (zs_out, &msg, 0);
+        }
+    }
+    return NULL;
+}
+
+static void publish_fleet (void *zs_pub, rollup_t *part, int nshards,
+                           bool dopt)
+{
+    rollup_t f = { 0 };
+    struct timeval tv;
+    char *s, *buf;
+    int i, len;
+
+    for (i = 0; i < nshards; i++) {
+        f.sites += part[i].sites;
+        f.live += part[i].live;
+        f.ted_watts += part[i].ted_watts;
+        f.envoy_watts += part[i].envoy_watts;
+        f.envoy_daily += part[i].envoy_daily;
+        f.msgs += part[i].msgs;
+        f.unsited += part[i].unsited;
+    }
+    s = fleet_serialize (f.sites, f.live, f.ted_watts, f.envoy_watts,
+                         f.envoy_daily);
+    len = strlen (s);
+    buf = xzmalloc (len + TS_STAMPLEN + 1);
+    memcpy (buf, s, len);
+    gettimeofday (&tv, NULL);
+    len = ts_stamp (buf, len, tv.tv_sec * 1000000ULL + tv.tv_usec);
+    send_part (zs_pub, "fleet", 5, ZMQ_SNDMORE);
+    send_part (zs_pub, buf, len, 0);
+    if (dopt)
+        fprintf (stderr, "%s msgs=%llu unsited=%llu\n", buf,
+                 (unsigned long long)f.msgs, (unsigned long long)f.unsited);
+    free (buf);
+    free (s);
+}
+
+static void add_uri (char ***uri, int *n, const char *s)
+{
+    if (!(*uri = realloc (*uri, (*n + 1) * sizeof (char *))))
+        oom ();
+    (*uri)[(*n)++] = xstrdup (s);
+}
+
+static void read_uri_file (char ***uri, int *n, const char *path)
+{
+    char line[256], *p;
+    FILE *f;
+
+    if (!(f = fopen (path, "r"))) {
+        perror (path);
+        exit (1);
+    }
+    while (fgets (line, sizeof (line), f)) {
+        p = line + strspn (line, " \t");
+        p[strcspn (p, " \t\r\n#")] = '\0';
+        if (*p != '\0')
+            add_uri (uri, n, p);
+    }
+    fclose (f);
+}
+
+int main (int argc, char *argv[])
+{
+    char **uri = NULL;
+    int nuri = 0;
+    char *bind[BIND_MAX];
+    int nbind = 0;
+    int nshards = sysconf (_SC_NPROCESSORS_ONLN);
+    int interval = 10, stale = 60;
+    bool dopt = false;
+    shard_t *sh;
+    rollup_t part[SHARD_MAX], r;
+    void *zctx, *zs_in, *zs_pub;
+    zmq_pollitem_t zp = { .events = ZMQ_POLLIN, .fd = -1 };
+    zmq_msg_t topic, msg;
+    time_t now, next;
+    int c, i, err;
+
+    while ((c = getopt_long (argc, argv, OPTIONS, longopts, NULL)) != -1) {
+        switch (c) {
+            case 's':
+                add_uri (&uri, &nuri, optarg);
+                break;
+            case 'f':
+                read_uri_file (&uri, &nuri, optarg);
+                break;
+            case 'b':
+                if (nbind == BIND_MAX) {
+                    fprintf (stderr, "too many URIs (max %d)\n", BIND_MAX);
+                    exit (1);
+                }
+                bind[nbind++] = optarg;
+                break;
+            case 'j':
+                nshards = strtoul (optarg, NULL, 10);
+                break;
+            case 'i':
+                interval = strtoul (optarg, NULL, 10);
+                break;
+            case 'x':
+                stale = strtoul (optarg, NULL, 10);
+                break;
+            case 'd':
+                dopt = true;
+                break;
+            default:
+                usage ();
+        }
+    }
+    if (optind < argc || nuri == 0 || interval < 1)
+        usage ();
+    if (nshards < 1)
+        nshards = 1;
+    if (nshards > SHARD_MAX)
+        nshards = SHARD_MAX;
+    if (nshards > nuri)
+        nshards = nuri;
+    if (nbind == 0)
+        bind[nbind++] = AGG_URI;
+
+    zctx = _zmq_init (nshards);
+    zs_in = _zmq_socket (zctx, ZMQ_PULL);
+    _zmq_bind (zs_in, SHARD_URI); /* inproc: bind before shards connect */
+    zs_pub = _zmq_socket (zctx, ZMQ_PUB);
+    for (i = 0; i < nbind; i++)
+        _zmq_bind (zs_pub, bind[i]);
+
+    memset (part, 0, sizeof (part));
+    sh = xzmalloc (nshards * sizeof (*sh));
+    for (i = 0; i < nshards; i++) {
+        sh[i].id = i;
+        sh[i].zctx = zctx;
+        sh[i].uri = uri;
+        sh[i].nuri = nuri;
+        sh[i].nshards = nshards;
+        sh[i].interval = interval;
+        sh[i].stale = stale;
+        if ((err = pthread_create (&sh[i].t, NULL, shard_thread, &sh[i]))) {
+            fprintf (stderr, "pthread_create: %s\n", strerror (err));
+            exit (1);
+        }
+    }
+
+    /* Forward site messages as they come; publish the fleet rollup from
+     * the latest partials once per interval.
+     */
+    zp.socket = zs_in;
+    next = time (NULL) + interval;
+    for (;;) {
+        now = time (NULL);
+        if (now >= next) {
+            publish_fleet (zs_pub, part, nshards, dopt);
+            next = now + interval;
+        }
+        if (zmq_poll (&zp, 1, (next - now) * 1000000L) < 0) {
+            fprintf (stderr, "zmq_poll: %s\n", zmq_strerror (errno));
+            exit (1);
+        }
+        while (_zmq_pollin (zs_in)) {
+            _zmq_msg_init (&topic);
+            _zmq_recv (zs_in, &topic, 0);
+            _zmq_msg_init (&msg);
+            _zmq_recv (zs_in, &msg, 0);
+            if (zmq_msg_size (&topic) == 0) {
+                if (zmq_msg_size (&msg) == sizeof (r)) {
+                    memcpy (&r, zmq_msg_data (&msg), sizeof (r));
+                    part[r.shard] = r;
+                }
+                _zmq_msg_close (&topic);
+                _zmq_msg_close (&msg);
+            } else {
+                _zmq_send (zs_pub, &topic, ZMQ_SNDMORE);
+                _zmq_send (zs_pub, &msg, 0);
+            }
+        }
+    }
+
+    _zmq_close (zs_pub);
+    _zmq_close (zs_in);
+    _zmq_term (zctx);
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,522 @@
+/*****************************************************************************
+ *  Copyright (C) 2014 Jim Garlick
+ *  Written by Jim Garlick <garlick.jim@gmail.com>
+ *  All Rights Reserved.
+ *
+ *  This file is part of pi-ted-envoy.
+ *  For details, see <https://github.com/garlick/pi-ted-envoy>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+/* emonbench.c - benchmark the sample pipeline, results as JSON lines */
+
+/* Each micro-benchmark runs its operation enough times to fill the
+ * minimum run time and reports ns/op and malloc calls/op.  The macro
+ * benchmark pushes messages through the same inproc PUSH/PULL -> decode
+ * -> PUB path that emond's read_other uses and reports msgs/s.
+ */
+
+#define _GNU_SOURCE /* for fmemopen */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include <zmq.h>
+
+#include "zmq.h"
+#include "util.h"
+#include "ted.h"
+#include "tedscan.h"
+#include "w1.h"
+#include "encode.h"
+#include "jstream.h"
+#include "inverter.h"
+#include "i2c.h"
+#include "vi2c.h"
+#include "led.h"
+
+#define TED_FRAMES      64      /* frames in the canned TED stream */
+#define BENCH_URI       "inproc://bench"
+#define BENCH_PUB_URI   "inproc://benchpub"
+
+/* Count allocations by interposing on malloc and friends.
+ */
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+extern void __libc_free (void *ptr);
+
+static uint64_t allocs = 0;
+
+void *malloc (size_t size)
+{
+    __atomic_add_fetch (&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc (size);
+}
+
+void *calloc (size_t nmemb, size_t size)
+{
+    __atomic_add_fetch (&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc (nmemb, size);
+}
+
+void *realloc (void *ptr, size_t size)
+{
+    __atomic_add_fetch (&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc (ptr, size);
+}
+
+void free (void *ptr)
+{
+    __libc_free (ptr);
+}
+
+static uint64_t now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+typedef void (*bench_f)(void *arg, long n);
+
+/* Run fn with doubling iteration counts until one run takes at least
+ * min_ns, then report that run.
+ */
+static void bench (const char *name, bench_f fn, void *arg, uint64_t min_ns)
+{
+    uint64_t t0, t1, a0, a1;
+    long n = 1;
+
+    for (;;) {
+        a0 = __atomic_load_n (&allocs, __ATOMIC_RELAXED);
+        t0 = now_ns ();
+        fn (arg, n);
+        t1 = now_ns ();
+        a1 = __atomic_load_n (&allocs, __ATOMIC_RELAXED);
+        if (t1 - t0 >= min_ns || n >= (1L << 30))
+            break;
+        n *= 2;
+    }
+    printf ("{\"bench\":\"%s\",\"ops\":%ld,\"ns_per_op\":%.1f,"
+            "\"allocs_per_op\":%.2f}\n", name, n,
+            (double)(t1 - t0) / n, (double)(a1 - a0) / n);
+    fflush (stdout);
+}
+
+typedef struct {
+    FILE *fp;
+    uint8_t buf[TED_FRAMES * 11];
+} tedbench_t;
+
+static void b_ted_read (void *arg, long n)
+{
+    tedbench_t *tb = arg;
+    int a, c, w, v;
+    long i;
+
+    for (i = 0; i < n; i++) {
+        if (i % TED_FRAMES == 0)
+            rewind (tb->fp);
+        if (ted_read (&a, &c, &w, &v) < 0) {
+            perror ("ted_read");
+            exit (1);
+        }
+    }
+}
+
+/* Bulk decode of the same stream, so ns/op is per frame as above.
+ */
+static void b_ted_scan (void *arg, long n)
+{
+    tedbench_t *tb = arg;
+    tedscan_t *s;
+    long i;
+
+    for (i = 0; i < n; i += TED_FRAMES) {
+        s = tedscan_buf (tb->buf, sizeof (tb->buf), 1);
+        if (s->n != TED_FRAMES) {
+            fprintf (stderr, "tedscan_buf: %ld frames\n", s->n);
+            exit (1);
+        }
+        tedscan_destroy (s);
+    }
+}
+
+static void b_ted_encode (void *arg, long n)
+{
+    long i;
+
+    for (i = 0; i < n; i++)
+        free (ted_serialize (0x42, i & 0xff, -1906, 123));
+}
+
+static void b_ted_decode (void *arg, long n)
+{
+    int a, c, w, v;
+    long i;
+
+    for (i = 0; i < n; i++)
+        ted_deserialize (arg, &a, &c, &w, &v);
+}
+
+static void b_temp_encode (void *arg, long n)
+{
+    long i;
+
+    for (i = 0; i < n; i++)
+        free (temp_serialize (21.5, 3.2, -18.1));
+}
+
+static void b_temp_decode (void *arg, long n)
+{
+    double c, fr, fz;
+    long i;
+
+    for (i = 0; i < n; i++)
+        temp_deserialize (arg, &c, &fr, &fz);
+}
+
+static void b_key_encode (void *arg, long n)
+{
+    long i;
+
+    for (i = 0; i < n; i++)
+        free (key_serialize (27));
+}
+
+static void b_key_decode (void *arg, long n)
+{
+    int k;
+    long i;
+
+    for (i = 0; i < n; i++)
+        key_deserialize (arg, &k);
+}
+
+static void b_envoy_encode (void *arg, long n)
+{
+    long i;
+
+    for (i = 0; i < n; i++)
+        free (envoy_serialize (ENVOY_SOURCE, 4510000, 63100, 8830, 1230));
+}
+
+static void b_envoy_decode (void *arg, long n)
+{
+    char src[ENVOY_SRCLEN];
+    int l, w, d, c;
+    long i;
+
+    for (i = 0; i < n; i++)
+        envoy_deserialize (arg, src, sizeof (src), &l, &w, &d, &c);
+}
+
+static void b_inverters_encode (void *arg, long n)
+{
+    long i;
+
+    for (i = 0; i < n; i++)
+        free (inverters_serialize (ENVOY_SOURCE, arg));
+}
+
+static void b_inverters_decode (void *arg, long n)
+{
+    char src[ENVOY_SRCLEN];
+    int count, total, min, low, stale;
+    long i;
+
+    for (i = 0; i < n; i++)
+        inverters_deserialize (arg, src, sizeof (src), &count, &total,
+                               &min, &low, &stale);
+}
+
+static void b_led_printf (void *arg, long n)
+{
+    int fd = *(int *)arg;
+    long i;
+
+    for (i = 0; i < n; i++)
+        led_printf (fd, "%0.3f", (float)(i % 10000) / 1000.0);
+}
+
+static void b_w1_therm_get (void *arg, long n)
+{
+    long i;
+
+    for (i = 0; i < n; i++) {
+        if (isnan (w1_therm_get (arg))) {
+            perror ("w1_therm_get");
+            exit (1);
+        }
+    }
+}
+
+/* Macro benchmark: producer thread -> PUSH -> PULL -> decode -> PUB ->
+ * SUB thread, like the TED thread, read_other and an emon subscriber.
+ */
+typedef struct {
+    void *zctx;
+    long n;
+    long received;
+} pipebench_t;
+
+static void *pipe_producer (void *arg)
+{
+    pipebench_t *pb = arg;
+    void *zs = _zmq_socket (pb->zctx, ZMQ_PUSH);
+    zmq_msg_t msg;
+    char *s;
+    long i;
+
+    _zmq_connect (zs, BENCH_URI);
+    for (i = 0; i < pb->n; i++) {
+        s = ted_serialize (0x42, i & 0xff, -1906, 123);
+        _zmq_msg_init_size (&msg, strlen (s));
+        memcpy (zmq_msg_data (&msg), s, strlen (s));
+        _zmq_send (zs, &msg, 0);
+        free (s);
+    }
+    _zmq_close (zs);
+    return NULL;
+}
+
+static void *pipe_subscriber (void *arg)
+{
+    pipebench_t *pb = arg;
+    void *zs = _zmq_socket (pb->zctx, ZMQ_SUB);
+    zmq_msg_t msg;
+
+    _zmq_connect (zs, BENCH_PUB_URI);
+    _zmq_subscribe (zs, "");
+    while (pb->received < pb->n) {
+        _zmq_msg_init (&msg);
+        _zmq_recv (zs, &msg, 0);
+        _zmq_msg_close (&msg);
+        pb->received++;
+    }
+    _zmq_close (zs);
+    return NULL;
+}
+
+static void pipeline (long n)
+{
+    pipebench_t pb = { .n = n, .received = 0 };
+    pthread_t prod, sub;
+    void *zs_pull, *zs_pub;
+    zmq_msg_t msg;
+    uint64_t t0, t1, a0, a1;
+    int a, c, w, v, err;
+    char *s;
+    long i;
+
+    pb.zctx = _zmq_init (1);
+    zs_pull = _zmq_socket (pb.zctx, ZMQ_PULL);
+    _zmq_bind (zs_pull, BENCH_URI);
+    zs_pub = _zmq_socket (pb.zctx, ZMQ_PUB);
+    _zmq_bind (zs_pub, BENCH_PUB_URI);
+
+    if ((err = pthread_create (&sub, NULL, pipe_subscriber, &pb))) {
+        fprintf (stderr, "pthread_create: %s\n", strerror (err));
+        exit (1);
+    }
+    usleep (100000); /* let the subscription settle */
+
+    a0 = __atomic_load_n (&allocs, __ATOMIC_RELAXED);
+    t0 = now_ns ();
+    if ((err = pthread_create (&prod, NULL, pipe_producer, &pb))) {
+        fprintf (stderr, "pthread_create: %s\n", strerror (err));
+        exit (1);
+    }
+    for (i = 0; i < n; i++) {
+        _zmq_msg_init (&msg);
+        _zmq_recv (zs_pull, &msg, 0);
+        s = xzmalloc (zmq_msg_size (&msg) + 1);
+        memcpy (s, zmq_msg_data (&msg), zmq_msg_size (&msg));
+        if (!ted_deserialize (s, &a, &c, &w, &v)) {
+            fprintf (stderr, "pipeline: bad message: %s\n", s);
+            exit (1);
+        }
+        free (s);
+        _zmq_send (zs_pub, &msg, 0);
+    }
+    pthread_join (prod, NULL);
+    pthread_join (sub, NULL);
+    t1 = now_ns ();
+    a1 = __atomic_load_n (&allocs, __ATOMIC_RELAXED);
+
+    printf ("{\"bench\":\"pipeline\",\"ops\":%ld,\"ns_per_op\":%.1f,"
+            "\"allocs_per_op\":%.2f,\"msgs_per_s\":%.0f}\n", n,
+            (double)(t1 - t0) / n, (double)(a1 - a0) / n,
+            n * 1E9 / (t1 - t0));
+    fflush (stdout);
+
+    _zmq_close (zs_pub);
+    _zmq_close (zs_pull);
+    _zmq_term (pb.zctx);
+}
+
+/* Write a w1_slave fixture for sensor id under a fresh temp directory
+ * and point w1.c at it.  Returns the directory name.
+ */
+static char *w1_fixture (const char *id)
+{
+    char *dir = xstrdup ("/tmp/emonbench.XXXXXX");
+    char path[256];
+    FILE *f;
+
+    if (!mkdtemp (dir)) {
+        perror ("mkdtemp");
+        exit (1);
+    }
+    snprintf (path, sizeof (path), "%s/%s", dir, id);
+    if (mkdir (path, 0755) < 0) {
+        perror (path);
+        exit (1);
+    }
+    snprintf (path, sizeof (path), "%s/%s/w1_slave", dir, id);
+    if (!(f = fopen (path, "w"))) {
+        perror (path);
+        exit (1);
+    }
+    fprintf (f, "35 ff 4b 46 7f ff 0b 10 0a : crc=0a YES\n"
+                "35 ff 4b 46 7f ff 0b 10 0a t=-12687\n");
+    fclose (f);
+    w1_root_set (dir);
+    return dir;
+}
+
+static void w1_fixture_remove (char *dir, const char *id)
+{
+    char path[256];
+
+    snprintf (path, sizeof (path), "%s/%s/w1_slave", dir, id);
+    unlink (path);
+    snprintf (path, sizeof (path), "%s/%s", dir, id);
+    rmdir (path);
+    rmdir (dir);
+    w1_root_set (NULL);
+    free (dir);
+}
+
+static void usage (void)
+{
+    fprintf (stderr,
+"Usage: emonbench [-t MSEC] [-n MSGS]\n"
+"   -t MSEC    minimum run time of each micro-benchmark (default 200)\n"
+"   -n MSGS    messages sent through the pipeline benchmark (default 100000)\n"
+    );
+    exit (1);
+}
+
+int main (int argc, char *argv[])
+{
+    static invtab_t tab;
+    tedbench_t tb;
+    uint64_t min_ns = 200 * 1000000ULL;
+    long nmsgs = 100000;
+    const char *id = "28-000002bf1574";
+    char *s, *dir;
+    int fd, i, c;
+
+    while ((c = getopt (argc, argv, "t:n:")) != -1) {
+        switch (c) {
+            case 't':
+                min_ns = strtoul (optarg, NULL, 10) * 1000000ULL;
+                break;
+            case 'n':
+                nmsgs = strtoul (optarg, NULL, 10);
+                break;
+            default:
+                usage ();
+        }
+    }
+    if (optind < argc || nmsgs < 1)
+        usage ();
+
+    /* ted.c */
+    for (i = 0; i < TED_FRAMES; i++)
+        ted_frame_encode (&tb.buf[i * 11], 0x42, i, 2000 + i, 124);
+    if (!(tb.fp = fmemopen (tb.buf, sizeof (tb.buf), "r"))) {
+        perror ("fmemopen");
+        exit (1);
+    }
+    ted_init_fp (tb.fp);
+    bench ("ted_read", b_ted_read, &tb, min_ns);
+    ted_fini ();
+    bench ("ted_scan", b_ted_scan, &tb, min_ns);
+
+    /* encode.c */
+    bench ("ted_serialize", b_ted_encode, NULL, min_ns);
+    s = ted_serialize (0x42, 17, -1906, 123);
+    bench ("ted_deserialize", b_ted_decode, s, min_ns);
+    free (s);
+
+    bench ("temp_serialize", b_temp_encode, NULL, min_ns);
+    s = temp_serialize (21.5, 3.2, -18.1);
+    bench ("temp_deserialize", b_temp_decode, s, min_ns);
+    free (s);
+
+    bench ("key_serialize", b_key_encode, NULL, min_ns);
+    s = key_serialize (27);
+    bench ("key_deserialize", b_key_decode, s, min_ns);
+    free (s);
+
+    bench ("envoy_serialize", b_envoy_encode, NULL, min_ns);
+    s = envoy_serialize (ENVOY_SOURCE, 4510000, 63100, 8830, 1230);
+    bench ("envoy_deserialize", b_envoy_decode, s, min_ns);
+    free (s);
+
+    inv_init (&tab);
+    for (i = 0; i < 40; i++)
+        inv_update (&tab, 121500000000ULL + i, 180 + i, 250, time (NULL));
+    inv_rollup (&tab, time (NULL), 1800);
+    bench ("inverters_serialize", b_inverters_encode, &tab, min_ns);
+    s = inverters_serialize (ENVOY_SOURCE, &tab);
+    bench ("inverters_deserialize", b_inverters_decode, s, min_ns);
+    free (s);
+
+    /* led.c, through the virtual I2C backend with no bus delay */
+    i2c_backend_set (&vi2c_ops);
+    vi2c_speed_set (0, false);
+    if ((fd = led_init (0x30)) < 0) {
+        perror ("led_init");
+        exit (1);
+    }
+    bench ("led_printf", b_led_printf, &fd, min_ns);
+    led_fini (fd);
+
+    /* w1.c */
+    dir = w1_fixture (id);
+    bench ("w1_therm_get", b_w1_therm_get, (void *)id, min_ns);
+    w1_fixture_remove (dir, id);
+
+    pipeline (nmsgs);
+
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
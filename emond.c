@@ -24,8 +24,15 @@
 
 /* Get data from Envoy PV controller and TED 1001 (with serial hack),
  * display data on i2c OLED/LEDs.
- * Listen for JSON from envoy_scrape.pl run by cron job on zs_envoy 0MQ socket.
- * Listen for JSON from TED, temp, and key threads on zs_other 0MQ socket.
+ * Listen for JSON from envoy_scrape.pl run by cron job, or from the
+ * envoy poller thread, on zs_envoy 0MQ socket.
+ * Take samples from TED, temp, and key threads off a queue per thread,
+ * or with -l, read TED, temp, and key directly from one poll loop.
+ * Listen for JSON samples from other processes (-L) on zs_other 0MQ socket.
+ * Answer requests such as "metrics" on the zs_ctl 0MQ socket.
+ * Number published messages per topic and keep the recent ones, so that
+ * a subscriber that misses some can have them replayed over zs_ctl.
+ * With -H, serve readings, rollups and history as JSON over HTTP.
  */
 
 #include <sys/types.h>
@@ -37,6 +44,7 @@
 #include <stdbool.h>
 #include <zmq.h>
 #include <sys/time.h>
+#include <time.h>
 #include <pthread.h>
 #include <stdarg.h>
 #include <stdint.h>
@@ -44,9 +52,14 @@
 #include <unistd.h>
 #include <json/json.h>
 #include <math.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <limits.h>
 
-#include "oled.h"
-#include "led.h"
+#include "fb.h"
+#include "i2c.h"
+#include "vi2c.h"
 #include "util.h"
 #include "zmq.h"
 #include "ted.h"
@@ -54,30 +67,120 @@
 #include "w1.h"
 #include "encode.h"
 #include "emon.h"
+#include "jstream.h"
+#include "inverter.h"
+#include "envoy.h"
+#include "metrics.h"
+#include "trace.h"
+#include "spsc.h"
+#include "state.h"
+#include "httpd.h"
+#include "export.h"
+#include "cal.h"
+#include "device.h"
+#include "journal.h"
+#include "display.h"
+#include "clock.h"
 
 #define OTHER_URI       "inproc://other"
-#define ENVOY_URI       "ipc:///tmp/emond"
+#define ENVOY_POLL_URI  "inproc://envoy"
+
+#define INV_INTERVAL    60      /* sec between inverter polls */
+#define INV_RETRY       3600    /* sec to wait if Envoy has no inverter API */
+#define INV_STALE       1800    /* inverters report every 5-15 min */
 
 #define SER_TED        "/dev/ttyAMA0"
 
 #define I2C_W1          0x18 /* not used here, for doc only */
-#define I2C_OLED        0x28
-#define I2C_LED_A       0x30
-#define I2C_LED_B       0x27
 
-#define W1_TEMP_CASE    "28-000002bf1574"
-#define W1_TEMP_FRIDGE  "28-0000059d3842"
-#define W1_TEMP_FREEZER "28-0000059dec96"
+#define PROBE_TIMEOUT   1000    /* ms to wait for devices at startup */
+
+#define HIST_LEN        (24*60) /* SPARK_INTERVAL points kept for HTTP */
 
-#define GPIO_MODE_PIN   27
+/* Longer history of the sparkline points, a ring for the HTTP API.
+ */
+typedef struct {
+    int64_t t[HIST_LEN];
+    int net[HIST_LEN];
+    int gen[HIST_LEN];
+    int head;                           /* oldest point */
+    int n;
+} hist_t;
 
-typedef enum { MODE_POWER, MODE_TEMP } dispmode_t;
+/* A decoded sample from one of the local sources.
+ */
+typedef enum { SAMPLE_TED, SAMPLE_TEMP, SAMPLE_KEY } sample_type_t;
 
 typedef struct {
-    void *zs_other;
+    sample_type_t type;
+    union {
+        struct {
+            int addr;
+            int count;
+            int watts;
+            int volts;
+        } ted;
+        struct {
+            double c;
+            double fr;
+            double fz;
+        } temp;
+        int key;
+    };
+    uint64_t queued;                    /* when a thread queued it */
+} sample_t;
+
+/* Producer threads hand samples to the main loop through a queue each,
+ * which never blocks the producer: when full, the policy decides what
+ * is dropped.  Newer TED and temp samples supersede older ones; extra
+ * key presses while the main loop is stuck are noise.
+ */
+#define TED_QLEN        64
+#define KEY_QLEN        8
+#define TEMP_QLEN       4
+
+typedef struct {
+    spsc_t *q;
+    metric_t drops;                     /* counter for dropped samples */
     pthread_t t;
 } thdctx_t;
 
+#define TEMP_INTERVAL   10      /* sec between temperature samples */
+#define DISP_INTERVAL   60      /* sec between display refreshes if idle */
+
+#define ENVOY_MAX       8       /* max number of Envoy sources */
+#define PUB_MAX         4       /* max number of extra publish URIs */
+#define JOURNAL_DEPTH   1024    /* default messages kept per topic */
+
+typedef struct {
+    void *zs_envoy;
+    pthread_t t;
+    char name[ENVOY_SRCLEN];            /* source name */
+    envoy_t *envoy;
+    int interval;                       /* poll interval in seconds */
+    invtab_t inv;                       /* per-inverter table */
+    time_t inv_next;                    /* time of next inverter poll */
+    int inv_yday;                       /* day of year of last inverter poll */
+} envctx_t;
+
+/* Most recent data from one Envoy.
+ */
+typedef struct {
+    char name[ENVOY_SRCLEN];
+    int current_power;
+    int daily_energy;
+    int weekly_energy;
+    int lifetime_energy;
+    time_t last;
+    /* inverter rollups */
+    int inv_count;
+    int inv_total;
+    int inv_min;
+    int inv_low;
+    int inv_stale;
+    time_t inv_last;
+} envsrc_t;
+
 typedef struct {
     /* ZeroMQ context and sockets
      */
@@ -85,18 +188,29 @@ typedef struct {
     void *zs_other;
     void *zs_envoy;
     void *zs_pub;
-    /* file descriptors for I2C devices
-     */
-    int oled;
-    int led_a;
-    int led_b;
-    /* most recent data obtained from envoy
+    void *zs_ctl;
+    const char *site;                   /* stamped on published messages */
+    journal_t *journal;                 /* recently published, for replay */
+    FILE *out;                          /* also write published messages */
+    state_seg_t *state;                 /* readings for local readers */
+    state_t st;                         /* what was last written there */
+    httpd_t *httpd;
+    hist_t hist;
+    export_t *export;                   /* upstream time-series exporter */
+    display_t *display;                 /* OLED and LEDs, NULL if headless */
+    int energy[5];                      /* as last published, see refresh */
+    time_t energy_last;
+    /* most recent data obtained from each envoy, and their sum
+     * over sources that are not stale (see envoy_aggregate)
      */
+    envsrc_t envoy[ENVOY_MAX];
+    int envoy_nsrc;
     int envoy_current_power;
     int envoy_daily_energy;
     int envoy_weekly_energy;
     int envoy_lifetime_energy;
-    time_t envoy_last;
+    time_t envoy_last;                  /* oldest of the sources */
+    int envoy_fresh;                    /* sources in the sums */
     /* most recent data obtained from ted
      */
     int ted_addr;
@@ -112,16 +226,40 @@ typedef struct {
     /* misc
      */
     int wattsec;                        /* energy used since midnight */
+    int used_week_wh;                   /* closed out days this week */
+    int used_month_wh;                  /* closed out days this month */
+    int gen_week_wh;
+    int gen_month_wh;
+    cal_t *cal;                         /* day/week/month boundaries */
     thdctx_t kctx;                      /* key thread state */
     thdctx_t pctx;                      /* TED thread state */
     thdctx_t Tctx;                      /* temp thread state */
+    envctx_t ectx[ENVOY_MAX];           /* envoy poller thread state */
+    int ectx_count;
     dispmode_t mode;                    /* display mode */
+    bool vdisp;                         /* virtual display backend */
+    spark_t spark;                      /* power sparkline */
+    /* event loop mode (-l) sources
+     */
+    bool evloop;
+    device_t *ted;
+    int ted_fd;                         /* what ted was when last polled */
+    ted_decoder_t ted_dec;
+    gpio_watch_t key;
+    int key_tfd;                        /* key debounce timer */
+    int temp_tfd;                       /* one sensor read per expiry */
+    int temp_next;                      /* sensor to read next */
+    double temp[3];
+    int disp_tfd;                       /* idle display refresh timer */
 } server_t;
 
-const int ted_stale = 30;       /* sec */
-const int envoy_stale = 600;    /* sec */
+static const char *w1_temp_id[] = {
+    W1_TEMP_CASE, W1_TEMP_FRIDGE, W1_TEMP_FREEZER,
+};
+
+static const char *ted_dev = SER_TED;
 
-#define OPTIONS "fd"
+#define OPTIONS "fdV:e:i:TLR:lP:S:H:X:J:C:Np:"
 #define HAVE_GETOPT_LONG 1
 
 #if HAVE_GETOPT_LONG
@@ -129,38 +267,112 @@ const int envoy_stale = 600;    /* sec */
 static const struct option longopts[] = {
     {"foreground",      no_argument,        0, 'f'},
     {"debug",           no_argument,        0, 'd'},
+    {"virtual-display", required_argument,  0, 'V'},
+    {"envoy",           required_argument,  0, 'e'},
+    {"envoy-interval",  required_argument,  0, 'i'},
+    {"trace",           no_argument,        0, 'T'},
+    {"load-input",      no_argument,        0, 'L'},
+    {"device-root",     required_argument,  0, 'R'},
+    {"event-loop",      no_argument,        0, 'l'},
+    {"publish",         required_argument,  0, 'P'},
+    {"site",            required_argument,  0, 'S'},
+    {"http",            required_argument,  0, 'H'},
+    {"export",          required_argument,  0, 'X'},
+    {"journal",         required_argument,  0, 'J'},
+    {"ctl",             required_argument,  0, 'C'},
+    {"headless",        no_argument,        0, 'N'},
+    {"playback",        required_argument,  0, 'p'},
     {0, 0, 0, 0},
 };
 #else
 #define GETOPT(ac,av,opt,lopt) getopt (ac,av,opt)
 #endif
 
+/* Point each device at its place under dir, as laid out by emonsim.
+ */
+static void device_root (const char *dir)
+{
+    static char tty[PATH_MAX + 16], w1[PATH_MAX + 16];
+    static char gpio[PATH_MAX + 16], i2c[PATH_MAX + 16];
+    char root[PATH_MAX];
+
+    if (!realpath (dir, root)) { /* daemon() will chdir to / */
+        perror (dir);
+        exit (1);
+    }
+    snprintf (tty, sizeof (tty), "%s/ttyAMA0", root);
+    snprintf (w1, sizeof (w1), "%s/w1", root);
+    snprintf (gpio, sizeof (gpio), "%s/gpio", root);
+    snprintf (i2c, sizeof (i2c), "%s/i2c-1", root);
+    ted_dev = tty;
+    w1_root_set (w1);
+    gpio_root_set (gpio);
+    i2c_dev_set (i2c);
+}
+
 static void usage (void)
 {
     fprintf (stderr,
 "Usage: emond [OPTIONS]\n"
 "   -f,--foreground    do not fork and diassociate with tty\n"
 "   -d,--debug         show messages on stderr\n"
-    );
+"   -V,--virtual-display KHZ  render to memory instead of I2C, simulating\n"
+"                      bus timing at KHZ (0=no timing); with -d, print\n"
+"                      bytes on bus and frame time per display update\n"
+"   -e,--envoy [NAME=]HOST[:PORT]  poll Envoy directly instead of via cron\n"
+"                      script (may be repeated for multiple Envoys)\n"
+"   -i,--envoy-interval SEC   Envoy poll interval (default 10)\n"
+"   -T,--trace         record per-sample trace spans (see emon --trace-dump)\n"
+"   -L,--load-input    also accept TED, temp and key messages from other\n"
+"                      processes on " OTHER_IPC_URI " (see emonload)\n"
+"   -R,--device-root DIR  use DIR/ttyAMA0, DIR/w1, DIR/gpio and DIR/i2c-1\n"
+"                      instead of the real devices (see emonsim)\n"
+"   -l,--event-loop    read TED, key and temps from the main loop instead\n"
+"                      of one thread each\n"
+"   -P,--publish URI   also publish on URI, e.g. tcp://*:5557 (may repeat)\n"
+"   -S,--site NAME     tag published messages with site NAME (see emonagg)\n"
+"   -H,--http PORT     serve /api/state, /api/rollup, /api/history and\n"
+"                      /api/stream (server-sent events) on PORT\n"
+"   -X,--export URL[,KEY=VAL]...  POST readings in batches to URL, e.g.\n"
+"                      http://influx:8086/write?db=emon, where KEY may be\n"
+"                      format=lp|csv, batch=N, window=SEC, spool=DIR,\n"
+"                      spoolmax=N or jobs=N (see README)\n"
+"   -J,--journal N     keep the last N messages of each topic for replay\n"
+"                      to subscribers that missed them (default %d)\n"
+"   -C,--ctl URI       also answer control requests, including replay,\n"
+"                      on URI, e.g. tcp://*:5558 (may repeat)\n"
+"   -N,--headless      do not drive the OLED and LEDs (see emondisp)\n"
+"   -p,--playback FILE feed messages recorded with emon -m through emond on\n"
+"                      a virtual clock, as fast as possible, print what it\n"
+"                      publishes on stdout, and exit\n",
+             JOURNAL_DEPTH);
     exit (1);
 }
 
+/* Queue a sample for the main loop, counting it if something had to
+ * be dropped.
+ */
+static void thread_send (thdctx_t *tctx, sample_t *sp)
+{
+    sp->queued = metrics_now ();
+    if (!spsc_push (tctx->q, sp))
+        metrics_inc (tctx->drops);
+    metrics_inc (M_OTHER_SENT);
+}
+
 /* Wait for momentary, active-low switch to be activated,
- * then send key message on thread socket.
+ * then queue a key sample for the main loop.
  */
 static void *key_thread (void *arg)
 {
     thdctx_t *tctx = (thdctx_t *)arg;
-    zmq_msg_t msg;
-    char *s;
+    sample_t sample = { .type = SAMPLE_KEY, .key = GPIO_MODE_PIN };
 
+    trace_thread ("key");
     for (;;) {
         gpio_keypress (GPIO_MODE_PIN, 0);
-        s = key_serialize (GPIO_MODE_PIN);
-        _zmq_msg_init_size (&msg, strlen (s));
-        memcpy (zmq_msg_data (&msg), s, strlen (s));
-        _zmq_send (tctx->zs_other, &msg, 0);
-        free (s);
+        metrics_inc (M_KEYPRESSES);
+        thread_send (tctx, &sample);
     }
     return NULL;
 }
@@ -169,8 +381,8 @@ static void key_thread_init (server_t *ctx)
 {
     int err;
 
-    ctx->kctx.zs_other = _zmq_socket (ctx->zctx, ZMQ_PUSH);
-    _zmq_connect (ctx->kctx.zs_other, OTHER_URI);
+    ctx->kctx.q = spsc_create (sizeof (sample_t), KEY_QLEN, SPSC_DROP_NEWEST);
+    ctx->kctx.drops = M_KEY_DROPS;
 
     err = pthread_create (&ctx->kctx.t, NULL, key_thread, &ctx->kctx);
     if (err) {
@@ -179,35 +391,52 @@ static void key_thread_init (server_t *ctx)
     }
 }
 
-/* Read TED samples from serial port and retransmit them on thread socket
- * as JSON messages.
+/* Read TED samples from serial port and queue them for the main loop.
  */
 static void *ted_thread (void *arg)
 {
     thdctx_t *tctx = (thdctx_t *)arg;
-    zmq_msg_t msg;
-    int addr, count, volts, watts;
-    char *s;
+    sample_t sample = { .type = SAMPLE_TED };
+    uint64_t t0;
+    int backoff = 0;
 
-    if (ted_init (SER_TED) < 0) {
-        fprintf (stderr, "ted_thread: %s: %s\n", SER_TED, strerror (errno));
-        exit (1);
+    trace_thread ("ted");
+reopen:
+    while (ted_init ((char *)ted_dev) < 0) {
+        metrics_inc (M_DEV_FAILURES);
+        if (backoff == 0)
+            fprintf (stderr, "ted: %s: %s (retrying)\n", ted_dev,
+                     strerror (errno));
+        backoff = backoff ? backoff * 2 : DEVICE_BACKOFF_MIN;
+        if (backoff > DEVICE_BACKOFF_MAX)
+            backoff = DEVICE_BACKOFF_MAX;
+        sleep (backoff);
     }
+    if (backoff > 0)
+        fprintf (stderr, "ted: present\n");
+    backoff = 0;
 
     for (;;) {
-        if (ted_read (&addr, &count, &volts, &watts) < 0) {
+        if (ted_read (&sample.ted.addr, &sample.ted.count,
+                      &sample.ted.watts, &sample.ted.volts) < 0) {
             if (errno != EINVAL) {
-                perror ("ted_read");
-                exit (1);
+                metrics_inc (M_TED_IO_ERRORS);
+                fprintf (stderr, "ted: %s: %s (reopening)\n", ted_dev,
+                         errno ? strerror (errno) : "EOF");
+                ted_fini ();
+                sleep (DEVICE_BACKOFF_MIN);
+                goto reopen;
             }
             //fprintf (stderr, "bad packet\n");
+            metrics_inc (M_TED_BAD_CKSUM);
             continue;
         }
-        s = ted_serialize (addr, count, volts, watts);
-        _zmq_msg_init_size (&msg, strlen (s));
-        memcpy (zmq_msg_data (&msg), s, strlen (s));
-        _zmq_send (tctx->zs_other, &msg, 0);
-        free (s);
+        metrics_inc (M_TED_FRAMES);
+        t0 = metrics_now ();
+        trace_span ("ted_read", sample.ted.count, t0, t0);
+        thread_send (tctx, &sample);
+        if (trace_enabled)
+            trace_span ("enqueue", sample.ted.count, t0, metrics_now ());
     }
 
     ted_fini ();
@@ -218,8 +447,8 @@ static void ted_thread_init (server_t *ctx)
 {
     int err;
 
-    ctx->pctx.zs_other = _zmq_socket (ctx->zctx, ZMQ_PUSH);
-    _zmq_connect (ctx->pctx.zs_other, OTHER_URI);
+    ctx->pctx.q = spsc_create (sizeof (sample_t), TED_QLEN, SPSC_DROP_OLDEST);
+    ctx->pctx.drops = M_TED_DROPS;
 
     err = pthread_create (&ctx->pctx.t, NULL, ted_thread, &ctx->pctx);
     if (err) {
@@ -231,18 +460,23 @@ static void ted_thread_init (server_t *ctx)
 static void *temp_thread (void *arg)
 {
     thdctx_t *tctx = (thdctx_t *)arg;
-    zmq_msg_t msg;
-    char *s;
+    sample_t sample = { .type = SAMPLE_TEMP };
+    double t[3];
+    int i;
 
+    trace_thread ("temp");
     while (1) {
-        s = temp_serialize (w1_therm_get (W1_TEMP_CASE),
-                            w1_therm_get (W1_TEMP_FRIDGE),
-                            w1_therm_get (W1_TEMP_FREEZER));
-        _zmq_msg_init_size (&msg, strlen (s));
-        memcpy (zmq_msg_data (&msg), s, strlen (s));
-        _zmq_send (tctx->zs_other, &msg, 0);
-        free (s);
-        sleep (10);
+        for (i = 0; i < 3; i++) {
+            t[i] = w1_therm_get (w1_temp_id[i]);
+            metrics_inc (M_W1_READS);
+            if (isnan (t[i]))
+                metrics_inc (M_W1_ERRORS);
+        }
+        sample.temp.c = t[0];
+        sample.temp.fr = t[1];
+        sample.temp.fz = t[2];
+        thread_send (tctx, &sample);
+        clock_sleep (TEMP_INTERVAL);
     }
     return NULL;
 }
@@ -251,8 +485,8 @@ static void temp_thread_init (server_t *ctx)
 {
     int err;
 
-    ctx->Tctx.zs_other = _zmq_socket (ctx->zctx, ZMQ_PUSH);
-    _zmq_connect (ctx->Tctx.zs_other, OTHER_URI);
+    ctx->Tctx.q = spsc_create (sizeof (sample_t), TEMP_QLEN, SPSC_DROP_OLDEST);
+    ctx->Tctx.drops = M_TEMP_DROPS;
 
     err = pthread_create (&ctx->Tctx.t, NULL, temp_thread, &ctx->Tctx);
     if (err) {
@@ -261,7 +495,135 @@ static void temp_thread_init (server_t *ctx)
     }
 }
 
-static server_t *server_init (void)
+/* Send serialized message s to the main loop, and free it.
+ */
+static void envoy_send (envctx_t *ectx, char *s)
+{
+    zmq_msg_t msg;
+
+    _zmq_msg_init_size (&msg, strlen (s));
+    memcpy (zmq_msg_data (&msg), s, strlen (s));
+    _zmq_send (ectx->zs_envoy, &msg, 0);
+    free (s);
+}
+
+/* Per-inverter data changes only every few minutes, so it is polled
+ * less often than production.  The whole table goes out in one message.
+ */
+static void envoy_poll_inverters (envctx_t *ectx)
+{
+    time_t now = clock_now ();
+    struct tm tm;
+
+    if (now < ectx->inv_next)
+        return;
+    localtime_r (&now, &tm);
+    if (tm.tm_yday != ectx->inv_yday) {
+        inv_reset_peaks (&ectx->inv);
+        ectx->inv_yday = tm.tm_yday;
+    }
+    metrics_inc (M_INV_POLLS);
+    if (envoy_inverters (ectx->envoy, &ectx->inv) < 0) {
+        metrics_inc (M_INV_ERRORS);
+        ectx->inv_next = now + (errno == EPERM || errno == ENOENT
+                                ? INV_RETRY : INV_INTERVAL);
+        return;
+    }
+    ectx->inv_next = now + INV_INTERVAL;
+    inv_rollup (&ectx->inv, now, INV_STALE);
+    envoy_send (ectx, inverters_serialize (ectx->name, &ectx->inv));
+}
+
+/* Poll the Envoy over a kept-alive HTTP connection and send its
+ * production data to the main loop the same way the perl script does.
+ */
+static void *envoy_thread (void *arg)
+{
+    envctx_t *ectx = (envctx_t *)arg;
+    struct timespec next, now;
+    int l, w, d, c, rc;
+    uint64_t t0;
+
+    trace_thread ("envoy");
+    clock_gettime (CLOCK_MONOTONIC, &next);
+    for (;;) {
+        metrics_inc (M_ENVOY_POLLS);
+        t0 = metrics_now ();
+        rc = envoy_production (ectx->envoy, &l, &w, &d, &c);
+        metrics_observe (H_ENVOY_POLL, metrics_now () - t0);
+        if (rc == 0) {
+            envoy_send (ectx, envoy_serialize (ectx->name, l, w, d, c));
+            envoy_poll_inverters (ectx);
+        } else
+            metrics_inc (M_ENVOY_ERRORS);
+        next.tv_sec += ectx->interval;
+        clock_gettime (CLOCK_MONOTONIC, &now);
+        if (next.tv_sec < now.tv_sec)
+            next = now; /* poll took longer than interval */
+        while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL)
+                                                                    == EINTR)
+            ;
+    }
+    return NULL;
+}
+
+/* Find state for Envoy 'name', adding it if new.  NULL if table is full.
+ */
+static envsrc_t *envoy_source (server_t *ctx, const char *name)
+{
+    int i;
+
+    for (i = 0; i < ctx->envoy_nsrc; i++)
+        if (!strcmp (ctx->envoy[i].name, name))
+            return &ctx->envoy[i];
+    if (ctx->envoy_nsrc == ENVOY_MAX)
+        return NULL;
+    snprintf (ctx->envoy[i].name, sizeof (ctx->envoy[i].name), "%s", name);
+    return &ctx->envoy[ctx->envoy_nsrc++];
+}
+
+/* Each Envoy gets its own thread so polls run in parallel.  Its source
+ * is registered now, so that it counts as stale until it first answers.
+ */
+static void envoy_thread_init (server_t *ctx, const char *arg, int interval)
+{
+    envctx_t *ectx;
+    const char *host = arg;
+    const char *p;
+    int err;
+
+    if (ctx->ectx_count == ENVOY_MAX) {
+        fprintf (stderr, "too many Envoys (max %d)\n", ENVOY_MAX);
+        exit (1);
+    }
+    ectx = &ctx->ectx[ctx->ectx_count++];
+    if ((p = strchr (arg, '='))) {
+        snprintf (ectx->name, sizeof (ectx->name), "%.*s", (int)(p - arg), arg);
+        host = p + 1;
+    } else
+        snprintf (ectx->name, sizeof (ectx->name), "%s", host);
+    if (!envoy_source (ctx, ectx->name)) {
+        fprintf (stderr, "too many Envoys (max %d)\n", ENVOY_MAX);
+        exit (1);
+    }
+    ectx->envoy = envoy_create (host);
+    ectx->interval = interval;
+    ectx->inv_yday = -1;
+    inv_init (&ectx->inv);
+    ectx->zs_envoy = _zmq_socket (ctx->zctx, ZMQ_PUSH);
+    _zmq_connect (ectx->zs_envoy, ENVOY_POLL_URI);
+
+    err = pthread_create (&ectx->t, NULL, envoy_thread, ectx);
+    if (err) {
+        fprintf (stderr, "pthread_create: %s\n", strerror (err));
+        exit (1);
+    }
+}
+
+/* A playback leaves the well-known sockets and the shared memory
+ * readings to the emond that may be running live on the same host.
+ */
+static server_t *server_init (bool playback)
 {
     server_t *ctx = xzmalloc (sizeof (*ctx));
 
@@ -271,36 +633,40 @@ static server_t *server_init (void)
 
     ctx->zctx = _zmq_init (1);
     ctx->zs_envoy = _zmq_socket (ctx->zctx, ZMQ_PULL);
-    _zmq_bind (ctx->zs_envoy, ENVOY_URI);
     ctx->zs_pub = _zmq_socket (ctx->zctx, ZMQ_PUB);
-    _zmq_bind (ctx->zs_pub, PUB_URI);
     ctx->zs_other = _zmq_socket (ctx->zctx, ZMQ_PULL);
-    _zmq_bind (ctx->zs_other, OTHER_URI);
-
-    ctx->led_a = led_init (I2C_LED_A);
-    led_sleep_set (ctx->led_a, 0);
-    led_brightness_set (ctx->led_a, 0x20);
-
-    ctx->led_b = led_init (I2C_LED_B);
-    led_sleep_set (ctx->led_b, 0);
-    led_brightness_set (ctx->led_b, 0x20);
-
-    ctx->oled = oled_init (I2C_OLED);
-    oled_clear (ctx->oled);
-
-    ted_thread_init (ctx);
-    key_thread_init (ctx);
-    temp_thread_init (ctx);
+    ctx->zs_ctl = _zmq_socket (ctx->zctx, ZMQ_REP);
+    if (!playback) {
+        _zmq_bind (ctx->zs_envoy, ENVOY_URI);
+        _zmq_bind (ctx->zs_envoy, ENVOY_POLL_URI);
+        _zmq_bind (ctx->zs_pub, PUB_URI);
+        _zmq_bind (ctx->zs_other, OTHER_URI);
+        _zmq_bind (ctx->zs_ctl, CTL_URI);
+        ctx->state = state_create (STATE_PATH);
+    }
+    ctx->cal = cal_create ();
 
     return ctx;
 }
 
 static void server_fini (server_t *ctx)
 {
-    led_fini (ctx->led_b);
-    led_fini (ctx->led_a);
-    oled_fini (ctx->oled);
+    if (ctx->evloop) {
+        close (ctx->disp_tfd);
+        close (ctx->temp_tfd);
+        close (ctx->key_tfd);
+        gpio_watch_fini (&ctx->key);
+        device_destroy (ctx->ted);
+    }
+    display_destroy (ctx->display);
 
+    if (ctx->httpd)
+        httpd_destroy (ctx->httpd);
+    cal_destroy (ctx->cal);
+    if (ctx->state)
+        state_close (ctx->state);
+    journal_destroy (ctx->journal);
+    _zmq_close (ctx->zs_ctl);
     _zmq_close (ctx->zs_other);
     _zmq_close (ctx->zs_pub);
     _zmq_close (ctx->zs_envoy);
@@ -309,148 +675,801 @@ static void server_fini (server_t *ctx)
     free (ctx);
 }
 
-/* Message is ready on socket that Envoy perl script transmits on.
- * Read it and update envoy sample data in the server context.
+static void hist_add (hist_t *h, time_t t, int net, int gen)
+{
+    int i = (h->head + h->n) % HIST_LEN;
+
+    h->t[i] = t;
+    h->net[i] = net;
+    h->gen[i] = gen;
+    if (h->n < HIST_LEN)
+        h->n++;
+    else
+        h->head = (h->head + 1) % HIST_LEN;
+}
+
+/* Sum generation over Envoys with fresh data.  A stale source's output
+ * is unknown, so it is left out of everything built on the sums, the
+ * LEDs and wattsec alike.  envoy_last is the oldest source's last update,
+ * so if any source is stale the sums are flagged as partial; with no
+ * fresh source at all there is nothing to show or integrate.
+ */
+static void envoy_aggregate (server_t *ctx, time_t now)
+{
+    int i;
+
+    ctx->envoy_current_power = 0;
+    ctx->envoy_daily_energy = 0;
+    ctx->envoy_weekly_energy = 0;
+    ctx->envoy_lifetime_energy = 0;
+    ctx->envoy_last = 0;
+    ctx->envoy_fresh = 0;
+    for (i = 0; i < ctx->envoy_nsrc; i++) {
+        envsrc_t *src = &ctx->envoy[i];
+        if (i == 0 || src->last < ctx->envoy_last)
+            ctx->envoy_last = src->last;
+        if (now - src->last > ENVOY_STALE)
+            continue;
+        ctx->envoy_current_power += src->current_power;
+        ctx->envoy_daily_energy += src->daily_energy;
+        ctx->envoy_weekly_energy += src->weekly_energy;
+        ctx->envoy_lifetime_energy += src->lifetime_energy;
+        ctx->envoy_fresh++;
+    }
+}
+
+/* Copy the readings to the shared memory segment, where local readers
+ * (emon --shm) can take a snapshot at any time, and let the HTTP server
+ * know that its cached responses are stale.
+ */
+static void state_sync (server_t *ctx)
+{
+    state_t st;
+
+    memset (&st, 0, sizeof (st));
+    st.updated = clock_now_us ();
+    st.mode = ctx->mode;
+    st.ted_addr = ctx->ted_addr;
+    st.ted_watts = ctx->ted_watts;
+    st.ted_volts = ctx->ted_volts;
+    st.ted_count = ctx->ted_count;
+    st.ted_last = ctx->ted_last;
+    st.wattsec = ctx->wattsec;
+    st.used_week_wh = ctx->used_week_wh;
+    st.used_month_wh = ctx->used_month_wh;
+    st.gen_week_wh = ctx->gen_week_wh;
+    st.gen_month_wh = ctx->gen_month_wh;
+    st.envoy_current_power = ctx->envoy_current_power;
+    st.envoy_daily_energy = ctx->envoy_daily_energy;
+    st.envoy_weekly_energy = ctx->envoy_weekly_energy;
+    st.envoy_lifetime_energy = ctx->envoy_lifetime_energy;
+    st.envoy_last = ctx->envoy_last;
+    st.temp_case = ctx->temp_case;
+    st.temp_fridge = ctx->temp_fridge;
+    st.temp_freezer = ctx->temp_freezer;
+    if (ctx->state)
+        state_write (ctx->state, &st);
+    ctx->st = st;
+    if (ctx->httpd) {
+        httpd_invalidate (ctx->httpd, "/api/state");
+        httpd_invalidate (ctx->httpd, "/api/rollup");
+        httpd_invalidate (ctx->httpd, "/api/stream");
+    }
+}
+
+/* Hand a point to the exporter, if any.  Fields that are not finite
+ * are left out, since line protocol has no way to say NaN; a point left
+ * with no fields is not sent at all.
+ */
+static void export_add (server_t *ctx, const char *name, int nfield, ...)
+{
+    export_point_t p;
+    va_list ap;
+    int i;
+
+    if (!ctx->export)
+        return;
+    p.ts = clock_now_us ();
+    p.name = name;
+    p.nfield = 0;
+    va_start (ap, nfield);
+    for (i = 0; i < nfield; i++) {
+        p.field[p.nfield].key = va_arg (ap, const char *);
+        p.field[p.nfield].val = va_arg (ap, double);
+        if (isfinite (p.field[p.nfield].val))
+            p.nfield++;
+    }
+    va_end (ap);
+    if (p.nfield > 0)
+        export_point (ctx->export, &p);
+}
+
+static char *http_state (const char *query, void *arg)
+{
+    server_t *ctx = arg;
+
+    return state_serialize (&ctx->st);
+}
+
+static char *http_rollup (const char *query, void *arg)
+{
+    server_t *ctx = arg;
+
+    return rollup_serialize (&ctx->st);
+}
+
+/* Points with from <= time < to (epoch seconds, both optional), e.g.
+ * /api/history?from=1400000000
+ */
+static char *http_history (const char *query, void *arg)
+{
+    server_t *ctx = arg;
+    hist_t *h = &ctx->hist;
+    int64_t from = 0, to = INT64_MAX;
+    int64_t t[HIST_LEN];
+    int net[HIST_LEN], gen[HIST_LEN];
+    char *cpy = xstrdup (query);
+    char *tok, *save = NULL, *end;
+    long long v;
+    int i, j, n = 0;
+
+    for (tok = strtok_r (cpy, "&", &save); tok;
+                                        tok = strtok_r (NULL, "&", &save)) {
+        if ((end = strchr (tok, '=')) == NULL)
+            goto bad;
+        *end++ = '\0';
+        v = strtoll (end, &end, 10);
+        if (*end != '\0')
+            goto bad;
+        if (!strcmp (tok, "from"))
+            from = v;
+        else if (!strcmp (tok, "to"))
+            to = v;
+        else
+            goto bad;
+    }
+    free (cpy);
+    for (i = 0; i < h->n; i++) {
+        j = (h->head + i) % HIST_LEN;
+        if (h->t[j] >= from && h->t[j] < to) {
+            t[n] = h->t[j];
+            net[n] = h->net[j];
+            gen[n] = h->gen[j];
+            n++;
+        }
+    }
+    return history_serialize (t, net, gen, n);
+bad:
+    free (cpy);
+    return NULL;
+}
+
+static void http_init (server_t *ctx, int port)
+{
+    ctx->httpd = httpd_create (port);
+    httpd_route (ctx->httpd, "/api/state", http_state, ctx);
+    httpd_route (ctx->httpd, "/api/rollup", http_rollup, ctx);
+    httpd_route (ctx->httpd, "/api/history", http_history, ctx);
+    httpd_stream (ctx->httpd, "/api/stream", http_state, ctx);
+}
+
+/* Publish serialized message s (len bytes, NUL terminated) to subscribers,
+ * stamped with the time it left emond so that emon can merge the streams
+ * of several sites in time order, with the site name if there is one, and
+ * with its sequence number within its topic.  Keep it in the journal.
+ */
+static void publish (server_t *ctx, const char *s, int len)
+{
+    zmq_msg_t msg;
+    char topic[TOPIC_MAX];
+    uint64_t seq = 0;
+    char *buf = xzmalloc (len + SEQ_STAMPLEN + TS_STAMPLEN
+                              + SITE_STAMPLEN + 1);
+
+    memcpy (buf, s, len);
+    if (topic_deserialize (buf, topic, sizeof (topic))
+                && (seq = journal_next (ctx->journal, topic)))
+        len = seq_stamp (buf, len, seq);
+    if (ctx->site)
+        len = site_stamp (buf, len, ctx->site);
+    len = ts_stamp (buf, len, clock_now_us ());
+    _zmq_msg_init_size (&msg, len);
+    memcpy (zmq_msg_data (&msg), buf, len);
+    _zmq_send (ctx->zs_pub, &msg, 0);
+    metrics_inc (M_PUB_MSGS);
+    if (ctx->out)
+        fprintf (ctx->out, "%.*s\n", len, buf);
+    if (seq)
+        journal_add (ctx->journal, topic, seq, buf, len);
+    free (buf);
+}
+
+/* Update an Envoy's data in the server context from message s.
+ * Returns false if s is not from an Envoy.
+ */
+static bool handle_envoy (server_t *ctx, const char *s)
+{
+    char name[ENVOY_SRCLEN];
+    int l, w, d, c;
+    int count, total, min, low, stale;
+    envsrc_t *src;
+    time_t now = clock_now ();
+
+    if (envoy_deserialize (s, name, sizeof (name), &l, &w, &d, &c)) {
+        if ((src = envoy_source (ctx, name))) {
+            src->lifetime_energy = l;
+            src->weekly_energy = w;
+            src->daily_energy = d;
+            src->current_power = c;
+            src->last = now;
+        }
+    } else if (inverters_deserialize (s, name, sizeof (name), &count, &total,
+                                      &min, &low, &stale)) {
+        if ((src = envoy_source (ctx, name))) {
+            src->inv_count = count;
+            src->inv_total = total;
+            src->inv_min = min;
+            src->inv_low = low;
+            src->inv_stale = stale;
+            src->inv_last = now;
+        }
+    } else
+        return false;
+    envoy_aggregate (ctx, now);
+    state_sync (ctx);
+    export_add (ctx, "envoy", 2,
+                "current_power", (double)ctx->envoy_current_power,
+                "daily_energy", (double)ctx->envoy_daily_energy);
+    return true;
+}
+
+/* Message is ready on socket that Envoy perl script and poller threads
+ * transmit on.  Read it, update that Envoy's sample data in the server
+ * context, and republish it.
  */
 static void read_envoy (server_t *ctx, int dopt)
 {
     zmq_msg_t msg;
     char *s;
+    uint64_t t0 = metrics_now ();
 
     _zmq_msg_init (&msg);
     _zmq_recv(ctx->zs_envoy, &msg, 0);
+    metrics_inc (M_ENVOY_RECV);
     s = xzmalloc (zmq_msg_size (&msg) + 1);
     memcpy (s, zmq_msg_data (&msg), zmq_msg_size (&msg));
     if (dopt)
         fprintf (stderr, "%s\n", s);
-    if (envoy_deserialize (s, &ctx->envoy_lifetime_energy,
-                                 &ctx->envoy_weekly_energy,
-                                 &ctx->envoy_daily_energy,
-                                 &ctx->envoy_current_power))
-        ctx->envoy_last = time (NULL);
+    if (!handle_envoy (ctx, s))
+        metrics_inc (M_UNKNOWN_MSGS);
+    if (ctx->zs_pub)
+        publish (ctx, s, zmq_msg_size (&msg));
     free (s);
-    if (ctx->zs_pub) {
-        _zmq_send (ctx->zs_pub, &msg, 0);
-    } else
-        _zmq_msg_close (&msg);
+    _zmq_msg_close (&msg);
+    metrics_observe (H_DISPATCH, metrics_now () - t0);
+}
+
+/* Update the server context from a sample.
+ * If TED, update TED sample data and recalc wattsec.
+ * If key, switch mode.
+ * If temp, update temp sample data.
+ */
+static void handle_sample (server_t *ctx, sample_t *sp)
+{
+    time_t now = clock_now ();
+
+    switch (sp->type) {
+        case SAMPLE_KEY:
+            switch (ctx->mode) {
+                case MODE_TEMP:
+                    ctx->mode = MODE_POWER;
+                    break;
+                case MODE_POWER:
+                    ctx->mode = MODE_TEMP;
+                    break;
+            }
+            break;
+        case SAMPLE_TEMP:
+            ctx->temp_case = sp->temp.c;
+            ctx->temp_fridge = sp->temp.fr;
+            ctx->temp_freezer = sp->temp.fz;
+            export_add (ctx, "temp", 3, "case", sp->temp.c,
+                        "fridge", sp->temp.fr, "freezer", sp->temp.fz);
+            break;
+        case SAMPLE_TED:
+            ctx->ted_addr = sp->ted.addr;
+            ctx->ted_count = sp->ted.count;
+            ctx->ted_watts = sp->ted.watts;
+            ctx->ted_volts = sp->ted.volts;
+            export_add (ctx, "ted", 2, "watts", (double)sp->ted.watts,
+                        "volts", (double)sp->ted.volts);
+            /* N.B. although we notice if envoy or TED values are stale and
+             * try to display this, the wattsec value could be innacurate if
+             * TED readings are missed or Envoy scrape is not working for
+             * some time during the day.
+             */
+            envoy_aggregate (ctx, now);
+            if (ctx->ted_last > 0 && ctx->envoy_fresh > 0) {
+                ctx->wattsec += (now - ctx->ted_last)
+                              * (ctx->ted_watts + ctx->envoy_current_power);
+                if (spark_sample (&ctx->spark, now, ctx->ted_watts,
+                                  ctx->envoy_current_power)) {
+                    hist_add (&ctx->hist, now,
+                              ctx->spark.net[ctx->spark.n - 1],
+                              ctx->spark.gen[ctx->spark.n - 1]);
+                    if (ctx->httpd)
+                        httpd_invalidate (ctx->httpd, "/api/history");
+                }
+            }
+            ctx->ted_last = now;
+            break;
+    }
+    state_sync (ctx);
+}
+
+static bool sample_deserialize (const char *s, sample_t *sp)
+{
+    if (key_deserialize (s, &sp->key))
+        sp->type = SAMPLE_KEY;
+    else if (temp_deserialize (s, &sp->temp.c, &sp->temp.fr, &sp->temp.fz))
+        sp->type = SAMPLE_TEMP;
+    else if (ted_deserialize (s, &sp->ted.addr, &sp->ted.count,
+                                 &sp->ted.watts, &sp->ted.volts))
+        sp->type = SAMPLE_TED;
+    else
+        return false;
+    return true;
+}
+
+static char *sample_serialize (sample_t *sp)
+{
+    switch (sp->type) {
+        case SAMPLE_KEY:
+            return key_serialize (sp->key);
+        case SAMPLE_TEMP:
+            return temp_serialize (sp->temp.c, sp->temp.fr, sp->temp.fz);
+        case SAMPLE_TED:
+            return ted_serialize (sp->ted.addr, sp->ted.count,
+                                  sp->ted.watts, sp->ted.volts);
+    }
+    return NULL;
 }
 
-/* Message is ready on socket that threads transmit on.
- * If TED, update TED sample data in the server context and recalc wattsec.
- * If key, switch mode
- * If temp, update temp sample data in the server
+/* Message is ready on the socket other processes (-L) transmit on.
+ * Decode it, update the server context, and republish it.
  */
 static void read_other (server_t *ctx, int dopt)
 {
     zmq_msg_t msg;
+    sample_t sample;
     char *s;
-    time_t now = time (NULL);
-    struct tm tm_now, tm_last;
-    int key;
+    bool ok;
+    uint64_t t0 = metrics_now ();
+    uint64_t t1 = 0, t2;
 
     _zmq_msg_init (&msg);
     _zmq_recv(ctx->zs_other, &msg, 0);
+    metrics_inc (M_LOAD_RECV);
+    if (trace_enabled)
+        t1 = metrics_now ();
     s = xzmalloc (zmq_msg_size (&msg) + 1);
     memcpy (s, zmq_msg_data (&msg), zmq_msg_size (&msg));
     if (dopt)
         fprintf (stderr, "%s\n", s);
-    if (key_deserialize (s, &key)) {
-        switch (ctx->mode) {
-            case MODE_TEMP:
-                ctx->mode = MODE_POWER;
-                break;
-            case MODE_POWER:
-                ctx->mode = MODE_TEMP;
-                break;
-        }
-        goto done;
-    }
-    if (temp_deserialize (s, &ctx->temp_case, &ctx->temp_fridge,
-                             &ctx->temp_freezer))
-        goto done;
-    if (ted_deserialize (s, &ctx->ted_addr,  &ctx->ted_count,
-                            &ctx->ted_watts, &ctx->ted_volts)) {
-        /* N.B. although we notice if envoy or TED values are stale and
-         * try to display this, the wattsec value could be innacurate if TED
-         * readings are missed or Envoy scrape is not working for some time
-         * during the day.
-         */
-        if (ctx->ted_last > 0 && ctx->envoy_last > 0) {
-            localtime_r (&now, &tm_now);
-            localtime_r (&ctx->ted_last, &tm_last);
-            if (tm_now.tm_hour == 0 && tm_last.tm_hour == 23) /* reset @midnight */
-                ctx->wattsec = 0;
-            ctx->wattsec += (now - ctx->ted_last)
+    if ((ok = sample_deserialize (s, &sample)))
+        handle_sample (ctx, &sample);
+    else
+        metrics_inc (M_UNKNOWN_MSGS);
+    if (ok && sample.type == SAMPLE_TED)
+        trace_span ("dequeue", ctx->ted_count, t0, t1);
+    t2 = metrics_now ();
+    if (ctx->zs_pub) {
+        publish (ctx, s, zmq_msg_size (&msg));
+        if (ok && sample.type == SAMPLE_TED && trace_enabled)
+            trace_span ("publish", ctx->ted_count, t2, metrics_now ());
+    }
+    free (s);
+    _zmq_msg_close (&msg);
+    metrics_observe (H_DISPATCH, t2 - t0);
+}
+
+/* A sample read in this process is handled as is, and only serialized
+ * when it is published for subscribers.
+ */
+static void handle_local (server_t *ctx, sample_t *sp, int dopt)
+{
+    uint64_t t0 = metrics_now ();
+    uint64_t t1, t2;
+    char *s;
+
+    handle_sample (ctx, sp);
+    t1 = metrics_now ();
+    metrics_observe (H_DISPATCH, t1 - t0);
+    s = sample_serialize (sp);
+    t2 = metrics_now ();
+    metrics_observe (H_ENCODE, t2 - t1);
+    if (dopt)
+        fprintf (stderr, "%s\n", s);
+    publish (ctx, s, strlen (s));
+    free (s);
+    if (sp->type == SAMPLE_TED) {
+        trace_span ("ted_serialize", sp->ted.count, t1, t2);
+        if (trace_enabled)
+            trace_span ("publish", sp->ted.count, t2, metrics_now ());
+    }
+}
+
+/* A producer thread's doorbell rang.  Drain its queue.
+ */
+static void read_queue (server_t *ctx, thdctx_t *tctx, int dopt)
+{
+    sample_t sample;
+
+    spsc_ack (tctx->q);
+    while (spsc_pop (tctx->q, &sample)) {
+        metrics_inc (M_OTHER_RECV);
+        if (sample.type == SAMPLE_TED && trace_enabled)
+            trace_span ("dequeue", sample.ted.count, sample.queued,
+                        metrics_now ());
+        handle_local (ctx, &sample, dopt);
+    }
+}
+
+/* Generation for the day ending at 'end': each Envoy's last daily figure,
+ * stale or not, since what it made before it went quiet still counts.
+ * A source not heard from in the last day has nothing for this one.
+ */
+static int envoy_day_energy (server_t *ctx, time_t end)
+{
+    int i, wh = 0;
+
+    for (i = 0; i < ctx->envoy_nsrc; i++) {
+        if (ctx->envoy[i].last > 0 && end - ctx->envoy[i].last < 86400)
+            wh += ctx->envoy[i].daily_energy;
+    }
+    return wh;
+}
+
+/* A day, week or month ended (or the clock was set).  Close out the
+ * accumulators for each period that ended, publishing its total, and
+ * start the next one from zero.  The last TED reading is integrated up
+ * to the boundary first, so that the TED path, which integrates back to
+ * the previous reading, only adds what belongs to the new day.
+ */
+static void read_cal (server_t *ctx, int dopt)
+{
+    static const struct {
+        int mask;
+        const char *name;
+    } period[] = {
+        { CAL_DAY, "day" }, { CAL_WEEK, "week" }, { CAL_MONTH, "month" },
+    };
+    time_t end = cal_next (ctx->cal);
+    time_t now = clock_now ();
+    int mask = cal_handle (ctx->cal);
+    int i, day_wh, day_gen, used_wh, gen_wh;
+    char *s;
+
+    if (!(mask & CAL_DAY))
+        return;
+    if (end > now)      /* clock set back across midnight */
+        end = now;
+    if (ctx->ted_last > 0 && ctx->ted_last < end) {
+        envoy_aggregate (ctx, end);
+        if (ctx->envoy_fresh > 0)
+            ctx->wattsec += (end - ctx->ted_last)
                           * (ctx->ted_watts + ctx->envoy_current_power);
+        ctx->ted_last = end;
+    }
+    day_wh = ctx->wattsec / 3600;
+    day_gen = envoy_day_energy (ctx, end);
+    ctx->used_week_wh += day_wh;
+    ctx->used_month_wh += day_wh;
+    ctx->gen_week_wh += day_gen;
+    ctx->gen_month_wh += day_gen;
+    for (i = 0; i < sizeof (period) / sizeof (period[0]); i++) {
+        if (!(mask & period[i].mask))
+            continue;
+        if (period[i].mask == CAL_DAY) {
+            used_wh = day_wh;
+            gen_wh = day_gen;
+        } else if (period[i].mask == CAL_WEEK) {
+            used_wh = ctx->used_week_wh;
+            gen_wh = ctx->gen_week_wh;
+        } else {
+            used_wh = ctx->used_month_wh;
+            gen_wh = ctx->gen_month_wh;
         }
-        ctx->ted_last = now;
-        goto done;
+        s = boundary_serialize (period[i].name, used_wh, gen_wh);
+        if (dopt)
+            fprintf (stderr, "%s\n", s);
+        publish (ctx, s, strlen (s));
+        free (s);
     }
-done:
-    free (s);
-    if (ctx->zs_pub)
-        _zmq_send (ctx->zs_pub, &msg, 0);
-    else
-        _zmq_msg_close (&msg);
+    ctx->wattsec = 0;
+    if (mask & CAL_WEEK)
+        ctx->used_week_wh = ctx->gen_week_wh = 0;
+    if (mask & CAL_MONTH)
+        ctx->used_month_wh = ctx->gen_month_wh = 0;
+    state_sync (ctx);
+}
+
+static void tfd_arm (int fd, int first_ms, int interval_ms)
+{
+    struct itimerspec its = {
+        .it_value = { first_ms / 1000, (first_ms % 1000) * 1000000 },
+        .it_interval = { interval_ms / 1000, (interval_ms % 1000) * 1000000 },
+    };
+
+    if (timerfd_settime (fd, 0, &its, NULL) < 0) {
+        perror ("timerfd_settime");
+        exit (1);
+    }
+}
+
+static int tfd_create (int first_ms, int interval_ms)
+{
+    int fd;
+
+    if ((fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))
+                                                                        < 0) {
+        perror ("timerfd_create");
+        exit (1);
+    }
+    if (first_ms > 0)
+        tfd_arm (fd, first_ms, interval_ms);
+    return fd;
+}
+
+static void tfd_read (int fd)
+{
+    uint64_t n;
+
+    if (read (fd, &n, sizeof (n)) < 0 && errno != EAGAIN) {
+        perror ("timerfd read");
+        exit (1);
+    }
+}
+
+/* Serial data is ready.  Decode what arrived; a frame may span reads.
+ */
+static void ev_ted (server_t *ctx, int dopt)
+{
+    sample_t sample = { .type = SAMPLE_TED };
+    uint8_t buf[64];
+    uint64_t t;
+    int i, n, rc;
+
+    if ((n = read (ctx->ted_fd, buf, sizeof (buf))) <= 0) {
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        metrics_inc (M_TED_IO_ERRORS);
+        if (n == 0)
+            errno = EIO;
+        device_failed (ctx->ted);
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        rc = ted_decode (&ctx->ted_dec, buf[i], &sample.ted.addr,
+                         &sample.ted.count, &sample.ted.watts,
+                         &sample.ted.volts);
+        if (rc < 0)
+            metrics_inc (M_TED_BAD_CKSUM);
+        else if (rc > 0) {
+            metrics_inc (M_TED_FRAMES);
+            t = metrics_now ();
+            trace_span ("ted_read", sample.ted.count, t, t);
+            handle_local (ctx, &sample, dopt);
+        }
+    }
+}
+
+/* Key edge: start the debounce timer, then look at the level when
+ * it expires, as gpio_keypress does.
+ */
+static void ev_key_edge (server_t *ctx)
+{
+    gpio_watch_ack (&ctx->key);
+    tfd_arm (ctx->key_tfd, GPIO_DEBOUNCE_MS, 0);
+}
+
+static void ev_key (server_t *ctx, int dopt)
+{
+    sample_t sample = { .type = SAMPLE_KEY, .key = GPIO_MODE_PIN };
+
+    tfd_read (ctx->key_tfd);
+    if (gpio_watch_value (&ctx->key) != 0) /* active low */
+        return;
+    metrics_inc (M_KEYPRESSES);
+    handle_local (ctx, &sample, dopt);
+}
+
+/* Each 1-wire read blocks for a conversion, so read one sensor per
+ * timer expiry to keep the loop responsive, and publish a sample
+ * once all three are fresh.
+ */
+static void ev_temp (server_t *ctx, int dopt)
+{
+    sample_t sample = { .type = SAMPLE_TEMP };
+    int i = ctx->temp_next;
+
+    tfd_read (ctx->temp_tfd);
+    ctx->temp[i] = w1_therm_get (w1_temp_id[i]);
+    metrics_inc (M_W1_READS);
+    if (isnan (ctx->temp[i]))
+        metrics_inc (M_W1_ERRORS);
+    if (++ctx->temp_next < 3)
+        return;
+    ctx->temp_next = 0;
+    sample.temp.c = ctx->temp[0];
+    sample.temp.fr = ctx->temp[1];
+    sample.temp.fz = ctx->temp[2];
+    handle_local (ctx, &sample, dopt);
+}
+
+static int ev_ted_open (void *arg)
+{
+    int fd, err;
+
+    if ((fd = ted_open ((char *)ted_dev)) < 0)
+        return -1;
+    if (fcntl (fd, F_SETFL, O_NONBLOCK) < 0) {
+        err = errno;
+        close (fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+static void ev_ted_close (int fd, void *arg)
+{
+    close (fd);
+}
+
+/* Open the local sources for the event loop instead of starting
+ * the TED, key, and temp threads.  If the serial port is missing, its
+ * device_t thread keeps trying, and the loop picks it up when it next
+ * wakes (at least every DISP_INTERVAL).
+ */
+static void ev_init (server_t *ctx)
+{
+    ctx->evloop = true;
+    ctx->ted = device_create ("ted", ev_ted_open, ev_ted_close, NULL);
+    device_wait (&ctx->ted, 1, PROBE_TIMEOUT);
+    ted_decoder_init (&ctx->ted_dec);
+    gpio_watch_init (&ctx->key, GPIO_MODE_PIN);
+    ctx->key_tfd = tfd_create (0, 0);
+    ctx->temp_tfd = tfd_create (1, TEMP_INTERVAL * 1000 / 3);
+    ctx->disp_tfd = tfd_create (DISP_INTERVAL * 1000, DISP_INTERVAL * 1000);
+    ctx->temp_case = ctx->temp_fridge = ctx->temp_freezer = NAN;
 }
 
 static void update_display (server_t *ctx)
 {
-    time_t now = time (NULL);
-    bool tstale = (now - ctx->ted_last > ted_stale);
-    bool estale = (now - ctx->envoy_last > envoy_stale);
-
-    oled_clear (ctx->oled);
-    /* 5 lines: 0-4 */
-    oled_text_pos_set (ctx->oled, 0, 0);
-    oled_printf (ctx->oled, "Frz %+05.1f F", c2f (ctx->temp_freezer));
-
-    oled_text_pos_set (ctx->oled, 0, 1);
-    oled_printf (ctx->oled, "Ref %+05.1f F", c2f (ctx->temp_fridge));
-
-    oled_text_pos_set (ctx->oled, 0, 2);
-    oled_printf (ctx->oled, "DAILY ENERGY");
-
-    oled_text_pos_set (ctx->oled, 0, 3);
-    oled_printf (ctx->oled, "gen %-2.3f kWh%s",
-                 (float)ctx->envoy_daily_energy / 1000.0, estale ? "*" : " ");
-
-    oled_text_pos_set (ctx->oled, 0, 4);
-    oled_printf (ctx->oled, "use %-2.3f kWh%s",
-                 (float)ctx->wattsec / (1000*60*60),
-                 (tstale || estale) ? "*" : " ");
-#if 0
-    oled_text_pos_set (ctx->oled, 0, 4);
-    oled_printf (ctx->oled, "TED %dW %dV%s", ctx->ted_watts, ctx->ted_volts,
-                 tstale ? "*" : " ");
-#endif
-    if (ctx->mode == MODE_POWER) {
-        /* LED A: gen */
-        if (estale)
-            led_printf (ctx->led_a, "----"); 
-        else
-            led_printf (ctx->led_a, "%0.3f",
-                (float)ctx->envoy_current_power / 1000.0);
+    time_t now = clock_now ();
+    uint64_t t0 = metrics_now ();
+    uint64_t t1;
+    display_data_t dd;
 
-        /* LED B: use */
-        if (tstale || estale)
-            led_printf (ctx->led_b, "----"); 
-        else
-            led_printf (ctx->led_b, "%0.3f",
-            (float)(ctx->ted_watts + ctx->envoy_current_power) / 1000);
-    } else if (ctx->mode == MODE_TEMP) {
-        /* LED A: fridge */
-        if (ctx->temp_fridge == NAN)
-            led_printf (ctx->led_a, "----"); 
-        else
-            led_printf (ctx->led_a, "%0.1lf", c2f (ctx->temp_fridge));
+    dd.mode = ctx->mode;
+    dd.temp_fridge = ctx->temp_fridge;
+    dd.temp_freezer = ctx->temp_freezer;
+    dd.gen_kwh = (float)ctx->envoy_daily_energy / 1000.0;
+    dd.use_kwh = (float)ctx->wattsec / (1000*60*60);
+    dd.gen_watts = ctx->envoy_current_power;
+    dd.net_watts = ctx->ted_watts;
+    dd.tstale = (now - ctx->ted_last > TED_STALE);
+    dd.estale = (now - ctx->envoy_last > ENVOY_STALE);
+    dd.enone = (ctx->envoy_fresh == 0);
+    dd.spark = &ctx->spark;
+    display_update (ctx->display, &dd);
 
-        /* LED B: freezer */
-        if (ctx->temp_freezer == NAN)
-            led_printf (ctx->led_b, "----"); 
-        else
-            led_printf (ctx->led_b, "%0.1lf", c2f (ctx->temp_freezer));
+    t1 = metrics_now ();
+    metrics_inc (M_DISPLAY_UPDATES);
+    metrics_observe (H_DISPLAY, t1 - t0);
+    trace_span ("i2c_write", ctx->ted_count, t0, t1);
+}
+
+static void replay_send (const char *s, int len, void *arg)
+{
+    server_t *ctx = arg;
+    zmq_msg_t msg;
+
+    _zmq_msg_init_size (&msg, len);
+    memcpy (zmq_msg_data (&msg), s, len);
+    _zmq_send (ctx->zs_ctl, &msg, ZMQ_SNDMORE);
+    metrics_inc (M_REPLAY_MSGS);
+}
+
+/* Request is ready on the control socket.  Requests are a single word,
+ * or "replay TOPIC SEQ", which is answered with the journaled messages
+ * of TOPIC from SEQ on, one per part, then an empty part.  Unknown
+ * requests get an empty reply so the REQ side does not hang.
+ */
+static void read_ctl (server_t *ctx)
+{
+    zmq_msg_t msg;
+    char *s, *rep = NULL;
+    char topic[TOPIC_MAX];
+    unsigned long long seq;
+
+    _zmq_msg_init (&msg);
+    _zmq_recv (ctx->zs_ctl, &msg, 0);
+    s = xzmalloc (zmq_msg_size (&msg) + 1);
+    memcpy (s, zmq_msg_data (&msg), zmq_msg_size (&msg));
+    _zmq_msg_close (&msg);
+
+    if (sscanf (s, "replay %15s %llu", topic, &seq) == 2) {
+        metrics_inc (M_REPLAY_REQUESTS);
+        journal_replay (ctx->journal, topic, seq, replay_send, ctx);
+    } else if (!strcmp (s, "metrics"))
+        rep = metrics_render ();
+    else if (!strcmp (s, "trace"))
+        rep = trace_render ();
+    free (s);
+
+    _zmq_msg_init_size (&msg, rep ? strlen (rep) : 0);
+    if (rep) {
+        memcpy (zmq_msg_data (&msg), rep, strlen (rep));
+        free (rep);
     }
+    _zmq_send (ctx->zs_ctl, &msg, 0);
+}
+
+static void display (server_t *ctx, int dopt)
+{
+    struct timeval t0, t1;
+    vi2c_stats_t st;
+
+    if (!ctx->display)
+        return;
+    if (ctx->vdisp && dopt) {
+        vi2c_stats_reset ();
+        gettimeofday (&t0, NULL);
+        update_display (ctx);
+        gettimeofday (&t1, NULL);
+        vi2c_stats_get (&st);
+        fprintf (stderr, "display: %lu bytes, %lu us bus, %ld us frame\n",
+                 st.bytes, st.bus_ns / 1000,
+                 (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_usec - t0.tv_usec));
+    } else
+        update_display (ctx);
+}
+
+/* Publish today's energy for display agents (see emondisp) when any of
+ * the figures they show has changed, and at least every DISP_INTERVAL
+ * so that they can tell emond is still there.
+ */
+static void publish_energy (server_t *ctx, time_t now, int dopt)
+{
+    bool estale = (now - ctx->st.envoy_last > ENVOY_STALE);
+    bool enone = (ctx->envoy_fresh == 0);
+    int e[5] = { ctx->st.wattsec / 3600, ctx->st.envoy_daily_energy,
+                 ctx->st.envoy_current_power, estale, enone };
+    char *s;
+
+    if (!memcmp (e, ctx->energy, sizeof (e))
+                && now - ctx->energy_last < DISP_INTERVAL)
+        return;
+    s = energy_serialize (&ctx->st, estale, enone);
+    if (dopt)
+        fprintf (stderr, "%s\n", s);
+    publish (ctx, s, strlen (s));
+    free (s);
+    memcpy (ctx->energy, e, sizeof (e));
+    ctx->energy_last = now;
+}
+
+/* Run after each pass of the main loop, and at least every DISP_INTERVAL.
+ */
+static void refresh (server_t *ctx, int dopt)
+{
+    time_t now = clock_now ();
+
+    envoy_aggregate (ctx, now);
+    publish_energy (ctx, now, dopt);
+    display (ctx, dopt);
 }
 
 static void mypoll (server_t *ctx, int dopt)
@@ -458,21 +1477,211 @@ static void mypoll (server_t *ctx, int dopt)
     zmq_pollitem_t zpa[] = {
 { .socket = ctx->zs_envoy,      .events = ZMQ_POLLIN, .revents = 0, .fd = -1 },
 { .socket = ctx->zs_other,        .events = ZMQ_POLLIN, .revents = 0, .fd = -1 },
+{ .socket = ctx->zs_ctl,          .events = ZMQ_POLLIN, .revents = 0, .fd = -1 },
+{ .socket = NULL, .events = ZMQ_POLLIN, .revents = 0, .fd = spsc_fd (ctx->pctx.q) },
+{ .socket = NULL, .events = ZMQ_POLLIN, .revents = 0, .fd = spsc_fd (ctx->kctx.q) },
+{ .socket = NULL, .events = ZMQ_POLLIN, .revents = 0, .fd = spsc_fd (ctx->Tctx.q) },
+{ .socket = NULL, .events = ZMQ_POLLIN, .revents = 0, .fd = cal_fd (ctx->cal) },
+{ .socket = NULL, .events = ZMQ_POLLIN, .revents = 0,
+  .fd = ctx->httpd ? httpd_fd (ctx->httpd) : -1 },
     };
-    long tmout = 60*1000000; /* 60s */
+    long tmout = DISP_INTERVAL*1000000;
+    uint64_t l0;
     int rc;
 
-    if ((rc = zmq_poll (zpa, 2, tmout)) < 0) {
+    if ((rc = zmq_poll (zpa, ctx->httpd ? 8 : 7, tmout)) < 0) {
         fprintf (stderr, "zmq_poll: %s\n", zmq_strerror (errno));
         exit (1);
     }
+    l0 = metrics_now ();
     if (rc > 0) {
         if (zpa[0].revents & ZMQ_POLLIN)
             read_envoy (ctx, dopt);
         if (zpa[1].revents & ZMQ_POLLIN)
             read_other (ctx, dopt);
+        if (zpa[2].revents & ZMQ_POLLIN)
+            read_ctl (ctx);
+        if (zpa[3].revents & ZMQ_POLLIN)
+            read_queue (ctx, &ctx->pctx, dopt);
+        if (zpa[4].revents & ZMQ_POLLIN)
+            read_queue (ctx, &ctx->kctx, dopt);
+        if (zpa[5].revents & ZMQ_POLLIN)
+            read_queue (ctx, &ctx->Tctx, dopt);
+        if (zpa[6].revents & ZMQ_POLLIN)
+            read_cal (ctx, dopt);
+        if (zpa[7].revents & ZMQ_POLLIN)
+            httpd_handle (ctx->httpd);
     }
-    update_display (ctx);
+    refresh (ctx, dopt);
+    metrics_observe (H_LOOP, metrics_now () - l0);
+}
+
+/* ZMQ_FD only signals that a socket's state changed, so each socket is
+ * read until ZMQ_EVENTS says it is empty, whether or not its fd polled
+ * ready.  Nothing may touch the sockets between this and the next poll.
+ */
+static void ev_drain (server_t *ctx, int dopt)
+{
+    while (_zmq_pollin (ctx->zs_envoy))
+        read_envoy (ctx, dopt);
+    while (_zmq_pollin (ctx->zs_other))
+        read_other (ctx, dopt);
+    while (_zmq_pollin (ctx->zs_ctl))
+        read_ctl (ctx);
+}
+
+enum { P_ENVOY, P_OTHER, P_CTL, P_TED, P_KEY, P_KEY_TFD, P_TEMP_TFD,
+       P_DISP_TFD, P_CAL, P_HTTP, P_MAX };
+
+/* One poll over the serial port, key, timers and 0MQ sockets.
+ */
+static void ev_poll (server_t *ctx, int dopt)
+{
+    struct pollfd pfd[P_MAX];
+    uint64_t l0;
+    int i;
+
+    memset (pfd, 0, sizeof (pfd));
+    pfd[P_ENVOY].fd = _zmq_fd (ctx->zs_envoy);
+    pfd[P_OTHER].fd = _zmq_fd (ctx->zs_other);
+    pfd[P_CTL].fd = _zmq_fd (ctx->zs_ctl);
+    if (device_fresh (ctx->ted))
+        ted_decoder_init (&ctx->ted_dec);
+    pfd[P_TED].fd = ctx->ted_fd = device_handle (ctx->ted);
+    pfd[P_KEY].fd = gpio_watch_fd (&ctx->key, &pfd[P_KEY].events);
+    pfd[P_KEY_TFD].fd = ctx->key_tfd;
+    pfd[P_TEMP_TFD].fd = ctx->temp_tfd;
+    pfd[P_DISP_TFD].fd = ctx->disp_tfd;
+    pfd[P_CAL].fd = cal_fd (ctx->cal);
+    pfd[P_HTTP].fd = ctx->httpd ? httpd_fd (ctx->httpd) : -1;
+    for (i = 0; i < P_MAX; i++)
+        if (i != P_KEY)
+            pfd[i].events = POLLIN;
+
+    if (poll (pfd, P_MAX, -1) < 0) {
+        if (errno == EINTR)
+            return;
+        perror ("poll");
+        exit (1);
+    }
+    l0 = metrics_now ();
+    if (pfd[P_TED].revents)
+        ev_ted (ctx, dopt);
+    if (pfd[P_KEY].revents)
+        ev_key_edge (ctx);
+    if (pfd[P_KEY_TFD].revents)
+        ev_key (ctx, dopt);
+    if (pfd[P_TEMP_TFD].revents)
+        ev_temp (ctx, dopt);
+    if (pfd[P_DISP_TFD].revents)
+        tfd_read (ctx->disp_tfd);
+    if (pfd[P_CAL].revents)
+        read_cal (ctx, dopt);
+    if (pfd[P_HTTP].revents)
+        httpd_handle (ctx->httpd);
+    ev_drain (ctx, dopt);
+    refresh (ctx, dopt);
+    metrics_observe (H_LOOP, metrics_now () - l0);
+}
+
+/* Playback (-p) feeds a recording made with 'emon -m', one message per
+ * line with its "ts" and perhaps a site name in front, through the same
+ * handlers as live input.  The clock is virtual and set from each
+ * message's timestamp, so integration, staleness and day boundaries come
+ * out as they did live.  emond's own output in the recording (energy,
+ * boundary, ...) is skipped.  Inverter lists update the context but are
+ * not republished, as only their rollup is decoded.
+ */
+static uint64_t playback_start (FILE *f, const char *path)
+{
+    char *line = NULL, *p;
+    size_t size = 0;
+    uint64_t ts = 0;
+
+    while (getline (&line, &size, f) > 0)
+        if ((p = strchr (line, '{')) && ts_deserialize (p, &ts))
+            break;
+    free (line);
+    if (ts == 0) {
+        fprintf (stderr, "%s: no timestamped messages\n", path);
+        exit (1);
+    }
+    rewind (f);
+    return ts;
+}
+
+/* Move the clock on to 'us', stopping where the live loop would have
+ * woken without input: at each midnight, and DISP_INTERVAL after the
+ * last refresh.
+ */
+static void playback_advance (server_t *ctx, uint64_t us, time_t *lastp,
+                              int dopt)
+{
+    time_t next;
+
+    for (;;) {
+        next = *lastp + DISP_INTERVAL;
+        if (cal_next (ctx->cal) < next)
+            next = cal_next (ctx->cal);
+        if (next > us / 1000000)
+            break;
+        clock_set (next * 1000000ULL);
+        if (next == cal_next (ctx->cal))
+            read_cal (ctx, dopt);
+        refresh (ctx, dopt);
+        *lastp = next;
+    }
+    clock_set (us);
+}
+
+static bool playback_msg (server_t *ctx, const char *s, int dopt)
+{
+    sample_t sample;
+    char name[ENVOY_SRCLEN];
+    int l, w, d, c;
+    char *e;
+
+    if (sample_deserialize (s, &sample))
+        handle_local (ctx, &sample, dopt);
+    else if (envoy_deserialize (s, name, sizeof (name), &l, &w, &d, &c)) {
+        handle_envoy (ctx, s);
+        e = envoy_serialize (name, l, w, d, c);
+        if (dopt)
+            fprintf (stderr, "%s\n", e);
+        publish (ctx, e, strlen (e));
+        free (e);
+    } else if (!handle_envoy (ctx, s))
+        return false;
+    return true;
+}
+
+static void playback (server_t *ctx, FILE *f, int dopt)
+{
+    char *line = NULL, *s;
+    size_t size = 0;
+    uint64_t ts;
+    uint64_t first = clock_now_us ();
+    uint64_t t0 = metrics_now ();
+    time_t last = clock_now ();
+    long msgs = 0, skipped = 0;
+
+    while (getline (&line, &size, f) > 0) {
+        if (!(s = strchr (line, '{')) || !ts_deserialize (s, &ts)) {
+            skipped++;
+            continue;
+        }
+        playback_advance (ctx, ts, &last, dopt);
+        if (playback_msg (ctx, s, dopt))
+            msgs++;
+        else
+            skipped++;
+        refresh (ctx, dopt);
+        last = clock_now ();
+    }
+    free (line);
+    fprintf (stderr, "playback: %ld messages, %ld skipped, %.1f hours"
+             " in %.3f s\n", msgs, skipped,
+             (clock_now_us () - first) / 3600e6, (metrics_now () - t0) / 1e9);
 }
 
 int main (int argc, char *argv[])
@@ -480,6 +1689,24 @@ int main (int argc, char *argv[])
     int c;
     int fopt = 0;
     int dopt = 0;
+    int Lopt = 0;
+    int lopt = 0;
+    int Vopt = -1;
+    int Nopt = 0;
+    char *eopt[ENVOY_MAX];
+    int ecount = 0;
+    char *Popt[PUB_MAX];
+    int Pcount = 0;
+    char *Sopt = NULL;
+    int Hopt = 0;
+    char *Xopt = NULL;
+    int Jopt = JOURNAL_DEPTH;
+    char *Copt[PUB_MAX];
+    int Ccount = 0;
+    int iopt = 10;
+    char *popt = NULL;
+    FILE *pf = NULL;
+    int i;
     server_t *ctx;
 
     while ((c = GETOPT (argc, argv, OPTIONS, longopts)) != -1) {
@@ -490,18 +1717,136 @@ int main (int argc, char *argv[])
             case 'd':
                 dopt = 1;
                 break;
+            case 'V':
+                Vopt = strtoul (optarg, NULL, 10);
+                break;
+            case 'e':
+                if (ecount == ENVOY_MAX) {
+                    fprintf (stderr, "too many Envoys (max %d)\n", ENVOY_MAX);
+                    exit (1);
+                }
+                eopt[ecount++] = optarg;
+                break;
+            case 'i':
+                iopt = strtoul (optarg, NULL, 10);
+                if (iopt < 1)
+                    usage ();
+                break;
+            case 'T':
+                trace_enable (true);
+                break;
+            case 'L':
+                Lopt = 1;
+                break;
+            case 'R':
+                device_root (optarg);
+                break;
+            case 'l':
+                lopt = 1;
+                break;
+            case 'P':
+                if (Pcount == PUB_MAX) {
+                    fprintf (stderr, "too many URIs (max %d)\n", PUB_MAX);
+                    exit (1);
+                }
+                Popt[Pcount++] = optarg;
+                break;
+            case 'S':
+                if (strlen (optarg) >= SITE_MAX
+                        || strspn (optarg, SITE_CHARS) != strlen (optarg)) {
+                    fprintf (stderr, "site name must be up to %d of %s\n",
+                             SITE_MAX - 1, SITE_CHARS);
+                    exit (1);
+                }
+                Sopt = optarg;
+                break;
+            case 'H':
+                Hopt = strtoul (optarg, NULL, 10);
+                if (Hopt < 1 || Hopt > 65535)
+                    usage ();
+                break;
+            case 'X':
+                Xopt = optarg;
+                break;
+            case 'N':
+                Nopt = 1;
+                break;
+            case 'J':
+                Jopt = strtoul (optarg, NULL, 10);
+                break;
+            case 'C':
+                if (Ccount == PUB_MAX) {
+                    fprintf (stderr, "too many URIs (max %d)\n", PUB_MAX);
+                    exit (1);
+                }
+                Copt[Ccount++] = optarg;
+                break;
+            case 'p':
+                popt = optarg;
+                break;
             default:
                 usage ();
         }
     }
 
+    if (popt) {
+        if (!(pf = fopen (popt, "r"))) {
+            perror (popt);
+            exit (1);
+        }
+        clock_virtual (playback_start (pf, popt));
+        fopt = 1;
+    }
     if (!fopt) {
         if (daemon(0, 1) < 0) {
             perror ("daemon");
             exit (1);
         }
     }
-    ctx = server_init ();
+    if (Vopt >= 0) {
+        i2c_backend_set (&vi2c_ops);
+        vi2c_speed_set (Vopt, Vopt > 0);
+    }
+    trace_thread ("main");
+    ctx = server_init (popt != NULL);
+    if (Lopt)
+        _zmq_bind (ctx->zs_other, OTHER_IPC_URI);
+    for (i = 0; i < Pcount; i++)
+        _zmq_bind (ctx->zs_pub, Popt[i]);
+    for (i = 0; i < Ccount; i++)
+        _zmq_bind (ctx->zs_ctl, Copt[i]);
+    ctx->site = Sopt;
+    ctx->journal = journal_create (Jopt);
+    if (Hopt)
+        http_init (ctx, Hopt);
+    if (Xopt) {
+        ctx->export = export_create (Xopt, Sopt);
+        export_start (ctx->export);
+    }
+    ctx->vdisp = (Vopt >= 0);
+    if (!Nopt)
+        ctx->display = display_create (PROBE_TIMEOUT);
+    if (popt) {
+        ctx->out = stdout;
+        playback (ctx, pf, dopt);
+        fclose (pf);
+        server_fini (ctx);
+        exit (0);
+    }
+    if (lopt)
+        ev_init (ctx);
+    else {
+        ted_thread_init (ctx);
+        key_thread_init (ctx);
+        temp_thread_init (ctx);
+    }
+    for (i = 0; i < ecount; i++)
+        envoy_thread_init (ctx, eopt[i], iopt);
+    if (lopt) {
+        ev_drain (ctx, dopt);
+        for (;;)
+            ev_poll (ctx, dopt);
+    }
     for (;;)
         mypoll (ctx, dopt);
     server_fini (ctx);
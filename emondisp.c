@@ -0,0 +1,287 @@
+/*****************************************************************************
+ *  Copyright (C) 2014 Jim Garlick
+ *  Written by Jim Garlick <garlick.jim@gmail.com>
+ *  All Rights Reserved.
+ *
+ *  This file is part of pi-ted-envoy.
+ *  For details, see <https://github.com/garlick/pi-ted-envoy>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+/* emondisp.c - drive an OLED/LED panel from emond's published readings */
+
+/* emondisp subscribes to emond's PUB socket, locally or over TCP, keeps
+ * the latest readings, and renders them with the same code emond uses
+ * when it drives a panel itself.  Run emond with --headless and one
+ * emondisp per panel, so that a panel can be anywhere on the network
+ * and a wedged I2C bus stalls only its own agent.
+ *
+ * The TED and temperature lines come from the "ted" and "temp" messages,
+ * and a "key" message switches modes as it does in emond.  Energy since
+ * midnight and current generation come from the "energy" message, which
+ * emond publishes when they change and at least once a minute.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <sys/time.h>
+#include <limits.h>
+#include <getopt.h>
+#include <zmq.h>
+
+#include "util.h"
+#include "zmq.h"
+#include "emon.h"
+#include "encode.h"
+#include "fb.h"
+#include "i2c.h"
+#include "vi2c.h"
+#include "display.h"
+
+#define PROBE_TIMEOUT   1000    /* ms to wait for devices at startup */
+#define DISP_INTERVAL   60      /* sec between display refreshes if idle */
+
+#define OPTIONS "u:s:V:R:d"
+#define HAVE_GETOPT_LONG 1
+
+#if HAVE_GETOPT_LONG
+#define GETOPT(ac,av,opt,lopt) getopt_long (ac,av,opt,lopt,NULL)
+static const struct option longopts[] = {
+    {"uri",             required_argument,  0, 'u'},
+    {"site",            required_argument,  0, 's'},
+    {"virtual-display", required_argument,  0, 'V'},
+    {"device-root",     required_argument,  0, 'R'},
+    {"debug",           no_argument,        0, 'd'},
+    {0, 0, 0, 0},
+};
+#else
+#define GETOPT(ac,av,opt,lopt) getopt (ac,av,opt)
+#endif
+
+/* Latest readings, as of when they arrived here.
+ */
+typedef struct {
+    dispmode_t mode;
+    double temp_fridge;
+    double temp_freezer;
+    int ted_watts;
+    time_t ted_last;
+    int used_today_wh;
+    int gen_today_wh;
+    int gen_watts;
+    bool gen_stale;
+    bool gen_none;
+    time_t energy_last;
+    spark_t spark;
+} agent_t;
+
+static void usage (void)
+{
+    fprintf (stderr,
+"Usage: emondisp [OPTIONS]\n"
+"   -u,--uri URI       subscribe to URI (default " PUB_URI ")\n"
+"   -s,--site NAME     show only site NAME (for a stream merged by emonagg)\n"
+"   -V,--virtual-display KHZ  render to memory instead of I2C, simulating\n"
+"                      bus timing at KHZ (0=no timing); with -d, print\n"
+"                      bytes on bus and frame time per display update\n"
+"   -R,--device-root DIR  use DIR/i2c-1 instead of the real bus (see emonsim)\n"
+"   -d,--debug         show messages on stderr\n"
+    );
+    exit (1);
+}
+
+/* Update readings from message s.  Returns false if it is not one that
+ * the panel shows.
+ */
+static bool handle (agent_t *a, const char *s, const char *site)
+{
+    time_t now = time (NULL);
+    char name[SITE_MAX];
+    double c, fr, fz;
+    int addr, count, w, v, n;
+
+    if (site && (!site_deserialize (s, name, sizeof (name))
+                                        || strcmp (name, site) != 0))
+        return false;
+    if (ted_deserialize (s, &addr, &count, &w, &v)) {
+        a->ted_watts = w;
+        if (a->energy_last > 0 && !a->gen_none)
+            spark_sample (&a->spark, now, a->ted_watts, a->gen_watts);
+        a->ted_last = now;
+    } else if (temp_deserialize (s, &c, &fr, &fz)) {
+        a->temp_fridge = fr;
+        a->temp_freezer = fz;
+    } else if (key_deserialize (s, &n))
+        a->mode = a->mode == MODE_POWER ? MODE_TEMP : MODE_POWER;
+    else if (!energy_deserialize (s, &a->used_today_wh, &a->gen_today_wh,
+                                  &a->gen_watts, &a->gen_stale,
+                                  &a->gen_none))
+        return false;
+    else
+        a->energy_last = now;
+    return true;
+}
+
+static void update_display (display_t *d, agent_t *a)
+{
+    time_t now = time (NULL);
+    display_data_t dd;
+
+    dd.mode = a->mode;
+    dd.temp_fridge = a->temp_fridge;
+    dd.temp_freezer = a->temp_freezer;
+    dd.gen_kwh = a->gen_today_wh / 1000.0;
+    dd.use_kwh = a->used_today_wh / 1000.0;
+    dd.gen_watts = a->gen_watts;
+    dd.net_watts = a->ted_watts;
+    dd.tstale = (now - a->ted_last > TED_STALE);
+    dd.estale = a->gen_stale || (now - a->energy_last > ENVOY_STALE);
+    dd.enone = a->gen_none || (now - a->energy_last > ENVOY_STALE);
+    dd.spark = &a->spark;
+    display_update (d, &dd);
+}
+
+static void display (display_t *d, agent_t *a, bool vdisp, bool dopt)
+{
+    struct timeval t0, t1;
+    vi2c_stats_t st;
+
+    if (vdisp && dopt) {
+        vi2c_stats_reset ();
+        gettimeofday (&t0, NULL);
+        update_display (d, a);
+        gettimeofday (&t1, NULL);
+        vi2c_stats_get (&st);
+        fprintf (stderr, "display: %lu bytes, %lu us bus, %ld us frame\n",
+                 st.bytes, st.bus_ns / 1000,
+                 (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_usec - t0.tv_usec));
+    } else
+        update_display (d, a);
+}
+
+int main (int argc, char *argv[])
+{
+    const char *uri = PUB_URI;
+    const char *site = NULL;
+    static char i2c[PATH_MAX + 16];
+    char root[PATH_MAX];
+    bool dopt = false;
+    int Vopt = -1;
+    agent_t a;
+    display_t *d;
+    void *zctx, *zs;
+    zmq_pollitem_t zp = { .events = ZMQ_POLLIN, .fd = -1 };
+    zmq_msg_t msg;
+    char *s;
+    int c, len;
+    bool changed;
+    time_t now, last = 0;
+    long tmout;
+
+    while ((c = GETOPT (argc, argv, OPTIONS, longopts)) != -1) {
+        switch (c) {
+            case 'u':   /* --uri URI */
+                uri = optarg;
+                break;
+            case 's':   /* --site NAME */
+                site = optarg;
+                break;
+            case 'V':   /* --virtual-display KHZ */
+                Vopt = strtoul (optarg, NULL, 10);
+                break;
+            case 'R':   /* --device-root DIR */
+                if (!realpath (optarg, root)) {
+                    perror (optarg);
+                    exit (1);
+                }
+                snprintf (i2c, sizeof (i2c), "%s/i2c-1", root);
+                i2c_dev_set (i2c);
+                break;
+            case 'd':   /* --debug */
+                dopt = true;
+                break;
+            default:
+                usage ();
+        }
+    }
+    if (optind < argc)
+        usage ();
+
+    if (Vopt >= 0) {
+        i2c_backend_set (&vi2c_ops);
+        vi2c_speed_set (Vopt, Vopt > 0);
+    }
+    memset (&a, 0, sizeof (a));
+    a.mode = MODE_POWER;
+    a.temp_fridge = a.temp_freezer = NAN;
+    d = display_create (PROBE_TIMEOUT);
+
+    zctx = _zmq_init (1);
+    zs = _zmq_socket (zctx, ZMQ_SUB);
+    _zmq_connect (zs, uri);
+    _zmq_subscribe_all (zs);
+    zp.socket = zs;
+
+    /* Repaint on a shown message, and at least every DISP_INTERVAL so that
+     * stale markers appear even while other sites keep the socket busy.
+     */
+    for (;;) {
+        tmout = (last + DISP_INTERVAL - time (NULL)) * 1000000L;
+        if (tmout < 0)
+            tmout = 0;
+        if (tmout > DISP_INTERVAL*1000000L)     /* clock was set back */
+            tmout = DISP_INTERVAL*1000000L;
+        if (zmq_poll (&zp, 1, tmout) < 0) {
+            fprintf (stderr, "zmq_poll: %s\n", zmq_strerror (errno));
+            exit (1);
+        }
+        changed = false;
+        while (_zmq_pollin (zs)) {
+            _zmq_msg_init (&msg);
+            _zmq_recv (zs, &msg, 0);
+            if (!_zmq_rcvmore (zs)) { /* skip emonagg topic */
+                len = zmq_msg_size (&msg);
+                s = xzmalloc (len + 1);
+                memcpy (s, zmq_msg_data (&msg), len);
+                if (dopt)
+                    fprintf (stderr, "%s\n", s);
+                if (handle (&a, s, site))
+                    changed = true;
+                free (s);
+            }
+            _zmq_msg_close (&msg);
+        }
+        now = time (NULL);
+        if (changed || now - last >= DISP_INTERVAL || now < last) {
+            display (d, &a, Vopt >= 0, dopt);
+            last = now;
+        }
+    }
+
+    _zmq_close (zs);
+    _zmq_term (zctx);
+    display_destroy (d);
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,454 @@
+/*****************************************************************************
+ *  Copyright (C) 2014 Jim Garlick
+ *  Written by Jim Garlick <garlick.jim@gmail.com>
+ *  All Rights Reserved.
+ *
+ *  This file is part of pi-ted-envoy.
+ *  For details, see <https://github.com/garlick/pi-ted-envoy>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+/* emonload.c - drive emond's ingest sockets with synthetic messages */
+
+/* TED, temp and key messages go to emond's internal PULL socket, which
+ * emond exposes on OTHER_IPC_URI when started with -L; Envoy messages go
+ * to ENVOY_URI like the perl script's.  Each message carries an extra
+ * "lg" field (send time in ns) that emond's decoders ignore and pass
+ * through to PUB_URI, where a subscriber thread measures latency.
+ * With --ramp the rate is raised each period until latency starts
+ * climbing within a period, i.e. the PULL queue is growing.
+ * With --publish, emonload stands in for a swarm of emond sites instead:
+ * it publishes each simulated site's messages, stamped with "site" and
+ * "ts" like emond -S, on one of its own PUB sockets for emonagg to
+ * subscribe to, and measures latency at the other end (--subscribe).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <zmq.h>
+
+#include "zmq.h"
+#include "util.h"
+#include "emon.h"
+#include "encode.h"
+
+#define LAT_MAX         (1 << 22)       /* latencies kept per period */
+#define PUB_MAX         64
+#define GRACE_NS        2000000000ULL   /* wait for stragglers */
+
+typedef enum { LG_TED, LG_TEMP, LG_KEY, LG_ENVOY, LG_TYPES } lgtype_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    uint64_t *lat;                      /* latencies (ns) this period */
+    long n;
+    long received;                      /* total, all periods */
+    const char *uri;                    /* where to measure latency */
+    bool stop;
+} lgrecv_t;
+
+/* Where messages go: emond's PULL and Envoy sockets, or with --publish,
+ * site n's messages to pub[n % npub].
+ */
+typedef struct {
+    void *other;
+    void *envoy;
+    void *pub[PUB_MAX];
+    int npub;
+} lgout_t;
+
+#define OPTIONS "r:t:m:n:b:R:M:P:S:"
+static const struct option longopts[] = {
+    {"rate",     required_argument, 0, 'r'},
+    {"time",     required_argument, 0, 't'},
+    {"mix",      required_argument, 0, 'm'},
+    {"sensors",  required_argument, 0, 'n'},
+    {"burst",    required_argument, 0, 'b'},
+    {"ramp",     required_argument, 0, 'R'},
+    {"max-rate", required_argument, 0, 'M'},
+    {"publish",  required_argument, 0, 'P'},
+    {"subscribe", required_argument, 0, 'S'},
+    {0, 0, 0, 0},
+};
+
+static void usage (void)
+{
+    fprintf (stderr,
+"Usage: emonload [OPTIONS]\n"
+"   -r,--rate N           messages/s (default 100)\n"
+"   -t,--time SEC         length of each period (default 10)\n"
+"   -m,--mix T:t:k:E      relative weights of TED, temp, key, and Envoy\n"
+"                         messages (default 10:1:0:1)\n"
+"   -n,--sensors N        simulated TED addresses and Envoy sources (default 1)\n"
+"   -b,--burst N          send in bursts of N messages, same average rate\n"
+"   -R,--ramp STEP        raise rate by STEP each period until latency\n"
+"                         grows within a period, then report max rate\n"
+"   -M,--max-rate N       stop ramping at N messages/s (default 1000000)\n"
+"   -P,--publish URI      publish as N sites (-n) on URI instead of feeding\n"
+"                         emond, may be repeated to spread the sites\n"
+"   -S,--subscribe URI    measure latency on URI (default " PUB_URI ",\n"
+"                         or " AGG_URI " with --publish)\n"
+"Requires emond -L, or emonagg with --publish.\n"
+"Results are JSON lines, one per period.\n"
+    );
+    exit (1);
+}
+
+static uint64_t now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until (uint64_t t)
+{
+    struct timespec ts = { .tv_sec = t / 1000000000ULL,
+                           .tv_nsec = t % 1000000000ULL };
+
+    while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+                                                                == EINTR)
+        ;
+}
+
+/* Append "lg":t to the top level object of a serialized message,
+ * and if site is not NULL, "site" and "ts" like emond -S.
+ */
+static void send_stamped (void *zs, char *s, const char *site)
+{
+    zmq_msg_t msg;
+    char *p = strrchr (s, '}');
+    char tail[128];
+    struct timeval tv;
+    int len, tlen;
+
+    if (!p) {
+        fprintf (stderr, "emonload: bad message: %s\n", s);
+        exit (1);
+    }
+    len = p - s;
+    if (site) {
+        gettimeofday (&tv, NULL);
+        tlen = snprintf (tail, sizeof (tail),
+                         ", \"site\": \"%s\", \"ts\": %llu, \"lg\": %llu }",
+                         site, tv.tv_sec * 1000000ULL + tv.tv_usec,
+                         (unsigned long long)now_ns ());
+    } else
+        tlen = snprintf (tail, sizeof (tail), ", \"lg\": %llu }",
+                         (unsigned long long)now_ns ());
+    _zmq_msg_init_size (&msg, len + tlen);
+    memcpy (zmq_msg_data (&msg), s, len);
+    memcpy ((char *)zmq_msg_data (&msg) + len, tail, tlen);
+    _zmq_send (zs, &msg, 0);
+    free (s);
+}
+
+static void send_one (lgout_t *out, lgtype_t type, long i, int sensors)
+{
+    char src[ENVOY_SRCLEN];
+    int n = i % sensors;
+    void *zs_other = out->other, *zs_envoy = out->envoy;
+    const char *site = NULL;
+
+    snprintf (src, sizeof (src), "lg%d", n);
+    if (out->npub > 0) {
+        zs_other = zs_envoy = out->pub[n % out->npub];
+        site = src;
+    }
+    switch (type) {
+        case LG_TED:
+            send_stamped (zs_other, ted_serialize (n, i & 0xff,
+                                                   -1906 + (i % 100), 123),
+                          site);
+            break;
+        case LG_TEMP:
+            send_stamped (zs_other, temp_serialize (21.5, 3.2, -18.1), site);
+            break;
+        case LG_KEY:
+            send_stamped (zs_other, key_serialize (27), site);
+            break;
+        case LG_ENVOY:
+            send_stamped (zs_envoy, envoy_serialize (src, 4510000, 63100,
+                                                     8830, 1230), site);
+            break;
+        default:
+            break;
+    }
+}
+
+/* Spread the mix evenly: message i is the type whose cumulative weight
+ * range contains i modulo the total weight.
+ */
+static lgtype_t pick (const int *mix, int total, long i)
+{
+    int k = i % total, t;
+
+    for (t = 0; t < LG_TYPES; t++) {
+        if (k < mix[t])
+            return t;
+        k -= mix[t];
+    }
+    return LG_TED;
+}
+
+static void *recv_thread (void *arg)
+{
+    lgrecv_t *r = arg;
+    void *zctx = _zmq_init (1);
+    void *zs = _zmq_socket (zctx, ZMQ_SUB);
+    zmq_pollitem_t zp = { .events = ZMQ_POLLIN, .fd = -1 };
+    zmq_msg_t msg;
+    char buf[256], *p;
+    uint64_t t, sent;
+    int len;
+
+    _zmq_connect (zs, r->uri);
+    _zmq_subscribe (zs, "");
+    zp.socket = zs;
+    while (!r->stop) {
+        if (zmq_poll (&zp, 1, 100000) <= 0)
+            continue;
+        _zmq_msg_init (&msg);
+        _zmq_recv (zs, &msg, 0);
+        t = now_ns ();
+        len = zmq_msg_size (&msg);
+        if (len > sizeof (buf) - 1)
+            len = sizeof (buf) - 1;
+        memcpy (buf, zmq_msg_data (&msg), len);
+        buf[len] = '\0';
+        _zmq_msg_close (&msg);
+        if (!(p = strstr (buf, "\"lg\":")))
+            continue; /* not ours */
+        sent = strtoull (p + 5, NULL, 10);
+        pthread_mutex_lock (&r->lock);
+        if (r->n < LAT_MAX)
+            r->lat[r->n++] = t - sent;
+        r->received++;
+        pthread_mutex_unlock (&r->lock);
+    }
+    _zmq_close (zs);
+    _zmq_term (zctx);
+    return NULL;
+}
+
+static int cmp_u64 (const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t median (uint64_t *v, long n)
+{
+    uint64_t *tmp;
+    uint64_t m;
+
+    if (n == 0)
+        return 0;
+    tmp = xzmalloc (n * sizeof (*tmp));
+    memcpy (tmp, v, n * sizeof (*tmp));
+    qsort (tmp, n, sizeof (*tmp), cmp_u64);
+    m = tmp[n / 2];
+    free (tmp);
+    return m;
+}
+
+/* Run one period at 'rate' and print its results.  Returns true if the
+ * rate was sustained: everything arrived, and the median latency of the
+ * last tenth of the period is not much worse than that of the first.
+ */
+static bool period (lgout_t *out, lgrecv_t *r,
+                    long rate, int secs, const int *mix, int sensors,
+                    int burst)
+{
+    static long seq = 0;
+    int total = 0, t;
+    long sent = 0, due, received, n, tenth;
+    uint64_t t0, now, end, deadline, head, tail, p99, max;
+    bool ok;
+
+    for (t = 0; t < LG_TYPES; t++)
+        total += mix[t];
+    pthread_mutex_lock (&r->lock);
+    r->n = 0;
+    received = r->received;
+    pthread_mutex_unlock (&r->lock);
+
+    t0 = now_ns ();
+    end = t0 + secs * 1000000000ULL;
+    while ((now = now_ns ()) < end) {
+        due = (double)(now - t0) * rate / 1E9;
+        if (burst > 1)
+            due = (due / burst + 1) * burst; /* whole bursts, up front */
+        while (sent < due) {
+            send_one (out, pick (mix, total, seq), seq, sensors);
+            seq++;
+            sent++;
+        }
+        /* sleep until the next message (or burst) is due */
+        sleep_until (t0 + (uint64_t)((double)(burst > 1 ? sent : sent + 1)
+                                     * 1E9 / rate));
+    }
+
+    deadline = now_ns () + GRACE_NS;
+    do {
+        usleep (10000);
+        pthread_mutex_lock (&r->lock);
+        n = r->received - received;
+        pthread_mutex_unlock (&r->lock);
+    } while (n < sent && now_ns () < deadline);
+
+    pthread_mutex_lock (&r->lock);
+    n = r->n;
+    tenth = n / 10 > 0 ? n / 10 : 1;
+    head = median (r->lat, n < tenth ? n : tenth);
+    tail = median (r->lat + (n > tenth ? n - tenth : 0), n < tenth ? n : tenth);
+    qsort (r->lat, n, sizeof (uint64_t), cmp_u64);
+    p99 = n > 0 ? r->lat[(n * 99) / 100] : 0;
+    max = n > 0 ? r->lat[n - 1] : 0;
+    received = r->received - received;
+    pthread_mutex_unlock (&r->lock);
+
+    ok = received >= sent && tail <= 2 * head + 1000000;
+    printf ("{\"rate\":%ld,\"sent\":%ld,\"received\":%ld,"
+            "\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f,"
+            "\"first_p50_us\":%.1f,\"last_p50_us\":%.1f,\"sustained\":%s}\n",
+            rate, sent, received, median (r->lat, n) / 1E3, p99 / 1E3,
+            max / 1E3, head / 1E3, tail / 1E3, ok ? "true" : "false");
+    fflush (stdout);
+    return ok;
+}
+
+static void parse_mix (const char *s, int *mix)
+{
+    if (sscanf (s, "%d:%d:%d:%d", &mix[LG_TED], &mix[LG_TEMP],
+                                  &mix[LG_KEY], &mix[LG_ENVOY]) != 4
+            || mix[LG_TED] < 0 || mix[LG_TEMP] < 0 || mix[LG_KEY] < 0
+            || mix[LG_ENVOY] < 0
+            || mix[LG_TED] + mix[LG_TEMP] + mix[LG_KEY] + mix[LG_ENVOY] == 0)
+        usage ();
+}
+
+int main (int argc, char *argv[])
+{
+    int mix[LG_TYPES] = { 10, 1, 0, 1 };
+    long rate = 100, ramp = 0, max_rate = 1000000, best = 0;
+    int secs = 10, sensors = 1, burst = 1;
+    void *zctx;
+    lgout_t out = { .npub = 0 };
+    const char *Popt[PUB_MAX];
+    lgrecv_t r = { .lock = PTHREAD_MUTEX_INITIALIZER, .uri = NULL };
+    pthread_t t;
+    int c, err, i;
+
+    while ((c = getopt_long (argc, argv, OPTIONS, longopts, NULL)) != -1) {
+        switch (c) {
+            case 'r':
+                rate = strtoul (optarg, NULL, 10);
+                break;
+            case 't':
+                secs = strtoul (optarg, NULL, 10);
+                break;
+            case 'm':
+                parse_mix (optarg, mix);
+                break;
+            case 'n':
+                sensors = strtoul (optarg, NULL, 10);
+                break;
+            case 'b':
+                burst = strtoul (optarg, NULL, 10);
+                break;
+            case 'R':
+                ramp = strtoul (optarg, NULL, 10);
+                break;
+            case 'M':
+                max_rate = strtoul (optarg, NULL, 10);
+                break;
+            case 'P':
+                if (out.npub == PUB_MAX) {
+                    fprintf (stderr, "too many URIs (max %d)\n", PUB_MAX);
+                    exit (1);
+                }
+                Popt[out.npub++] = optarg;
+                break;
+            case 'S':
+                r.uri = optarg;
+                break;
+            default:
+                usage ();
+        }
+    }
+    if (optind < argc || rate < 1 || secs < 1 || sensors < 1 || burst < 1)
+        usage ();
+
+    if (!r.uri)
+        r.uri = out.npub > 0 ? AGG_URI : PUB_URI;
+    r.lat = xzmalloc (LAT_MAX * sizeof (uint64_t));
+    if ((err = pthread_create (&t, NULL, recv_thread, &r))) {
+        fprintf (stderr, "pthread_create: %s\n", strerror (err));
+        exit (1);
+    }
+    zctx = _zmq_init (1);
+    if (out.npub > 0) {
+        for (i = 0; i < out.npub; i++) {
+            out.pub[i] = _zmq_socket (zctx, ZMQ_PUB);
+            _zmq_bind (out.pub[i], Popt[i]);
+        }
+    } else {
+        out.other = _zmq_socket (zctx, ZMQ_PUSH);
+        _zmq_connect (out.other, OTHER_IPC_URI);
+        out.envoy = _zmq_socket (zctx, ZMQ_PUSH);
+        _zmq_connect (out.envoy, ENVOY_URI);
+    }
+    sleep (1); /* let connections and the subscription settle */
+
+    for (;;) {
+        if (!period (&out, &r, rate, secs, mix, sensors, burst))
+            break;
+        best = rate;
+        if (ramp == 0 || rate + ramp > max_rate)
+            break;
+        rate += ramp;
+    }
+    if (ramp > 0)
+        printf ("{\"max_sustained_rate\":%ld}\n", best);
+
+    r.stop = true;
+    pthread_join (t, NULL);
+    if (out.npub > 0) {
+        for (i = 0; i < out.npub; i++)
+            _zmq_close (out.pub[i]);
+    } else {
+        _zmq_close (out.envoy);
+        _zmq_close (out.other);
+    }
+    _zmq_term (zctx);
+    free (r.lat);
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
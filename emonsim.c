@@ -0,0 +1,421 @@
+/*****************************************************************************
+ *  Copyright (C) 2014 Jim Garlick
+ *  Written by Jim Garlick <garlick.jim@gmail.com>
+ *  All Rights Reserved.
+ *
+ *  This file is part of pi-ted-envoy.
+ *  For details, see <https://github.com/garlick/pi-ted-envoy>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+/* emonsim.c - simulate emond's hardware under a directory */
+
+/* Lays out DIR for emond -R DIR:
+ *   DIR/ttyAMA0        symlink to a pty emitting inverted TED frames
+ *   DIR/w1/ID/w1_slave temperature files for the three sensors
+ *   DIR/gpio/gpioN/    value/direction/edge files for the mode key
+ *   DIR/i2c-1          FIFO that swallows OLED and LED writes
+ * and keeps them changing until interrupted.
+ */
+
+#define _GNU_SOURCE /* for ptsname */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <signal.h>
+#include <termios.h>
+#include <poll.h>
+#include <time.h>
+#include <math.h>
+#include <stdarg.h>
+
+#include "ted.h"
+#include "emon.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX        1024
+#endif
+
+#define KEY_HOLD_MS     100     /* how long a simulated key press lasts */
+#define STATS_INTERVAL  10      /* sec between -v reports */
+
+typedef struct {
+    const char *root;
+    int ted_master;
+    int ted_slave;
+    int i2c;
+    long ted_frames;
+    long ted_dropped;
+    long i2c_bytes;
+    int ted_count;
+} sim_t;
+
+static volatile sig_atomic_t done = 0;
+
+#define OPTIONS "r:e:k:t:v"
+static const struct option longopts[] = {
+    {"ted-rate",      required_argument, 0, 'r'},
+    {"ted-errors",    required_argument, 0, 'e'},
+    {"key-interval",  required_argument, 0, 'k'},
+    {"temp-interval", required_argument, 0, 't'},
+    {"verbose",       no_argument,       0, 'v'},
+    {0, 0, 0, 0},
+};
+
+static void usage (void)
+{
+    fprintf (stderr,
+"Usage: emonsim [OPTIONS] DIR\n"
+"   -r,--ted-rate HZ          TED frames per second (default 1)\n"
+"   -e,--ted-errors PCT       percent of TED frames with bad checksum\n"
+"   -k,--key-interval SEC     press the mode key every SEC seconds\n"
+"   -t,--temp-interval SEC    update temperatures every SEC (default 10)\n"
+"   -v,--verbose              report I2C and TED traffic periodically\n"
+"Then run emond -R DIR.\n"
+    );
+    exit (1);
+}
+
+static uint64_t now_ms (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void path_fmt (char *buf, int len, sim_t *sim, const char *fmt, ...)
+    __attribute__ ((format (printf, 4, 5)));
+
+static void path_fmt (char *buf, int len, sim_t *sim, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    n = snprintf (buf, len, "%s/", sim->root);
+    va_start (ap, fmt);
+    vsnprintf (buf + n, len - n, fmt, ap);
+    va_end (ap);
+}
+
+static void xmkdir (const char *path)
+{
+    if (mkdir (path, 0755) < 0 && errno != EEXIST) {
+        perror (path);
+        exit (1);
+    }
+}
+
+/* Replace the contents of path atomically, so a reader never sees
+ * a partly written file.
+ */
+static void put_file (const char *path, const char *s)
+{
+    char tmp[PATH_MAX];
+    FILE *f;
+
+    snprintf (tmp, sizeof (tmp), "%s.tmp", path);
+    if (!(f = fopen (tmp, "w")) || fputs (s, f) < 0 || fclose (f) != 0) {
+        perror (tmp);
+        exit (1);
+    }
+    if (rename (tmp, path) < 0) {
+        perror (path);
+        exit (1);
+    }
+}
+
+/* GPIO value files are written in place: emond watches them with
+ * inotify, which would lose track of a renamed-over file.
+ */
+static void put_value (const char *path, int val)
+{
+    char c = val ? '1' : '0';
+    int fd;
+
+    if ((fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0
+            || write (fd, &c, 1) != 1 || close (fd) < 0) {
+        perror (path);
+        exit (1);
+    }
+}
+
+static void ted_setup (sim_t *sim)
+{
+    char path[PATH_MAX];
+    struct termios tio;
+    char *name;
+
+    if ((sim->ted_master = posix_openpt (O_RDWR | O_NOCTTY)) < 0
+            || grantpt (sim->ted_master) < 0
+            || unlockpt (sim->ted_master) < 0
+            || !(name = ptsname (sim->ted_master))) {
+        perror ("pty");
+        exit (1);
+    }
+    /* Hold the slave open, in raw mode, so frames written before emond
+     * opens it are not echoed or mangled.
+     */
+    if ((sim->ted_slave = open (name, O_RDWR | O_NOCTTY)) < 0
+            || tcgetattr (sim->ted_slave, &tio) < 0) {
+        perror (name);
+        exit (1);
+    }
+    cfmakeraw (&tio);
+    if (tcsetattr (sim->ted_slave, TCSANOW, &tio) < 0) {
+        perror (name);
+        exit (1);
+    }
+    if (fcntl (sim->ted_master, F_SETFL, O_NONBLOCK) < 0) {
+        perror ("fcntl");
+        exit (1);
+    }
+    path_fmt (path, sizeof (path), sim, "ttyAMA0");
+    unlink (path);
+    if (symlink (name, path) < 0) {
+        perror (path);
+        exit (1);
+    }
+}
+
+/* Net power swings between import and export over ten minutes.
+ */
+static void ted_send (sim_t *sim, int errpct)
+{
+    double t = now_ms () / 1000.0;
+    int watts = 500 + 2500 * sin (2 * M_PI * t / 600) + (rand () % 100);
+    int volts = 121 + (rand () % 5) - 2;
+    uint8_t pkt[11];
+
+    ted_frame_encode (pkt, 0x42, sim->ted_count++ & 0xff, watts, volts);
+    if (errpct > 0 && rand () % 100 < errpct)
+        pkt[9] ^= 0x01;
+    if (write (sim->ted_master, pkt, sizeof (pkt)) != sizeof (pkt)) {
+        if (errno != EAGAIN) {
+            perror ("pty write");
+            exit (1);
+        }
+        sim->ted_dropped++;     /* nobody reading */
+        return;
+    }
+    sim->ted_frames++;
+}
+
+static void temp_update (sim_t *sim)
+{
+    const char *id[] = { W1_TEMP_CASE, W1_TEMP_FRIDGE, W1_TEMP_FREEZER };
+    const double base[] = { 30.0, 3.5, -17.0 };
+    double t = now_ms () / 1000.0;
+    char path[PATH_MAX], buf[128];
+    int i, mc;
+
+    for (i = 0; i < 3; i++) {
+        mc = (base[i] + 1.5 * sin (2 * M_PI * t / 1800 + i)) * 1000;
+        snprintf (buf, sizeof (buf),
+                  "35 ff 4b 46 7f ff 0b 10 0a : crc=0a YES\n"
+                  "35 ff 4b 46 7f ff 0b 10 0a t=%d\n", mc);
+        path_fmt (path, sizeof (path), sim, "w1/%s/w1_slave", id[i]);
+        put_file (path, buf);
+    }
+}
+
+static void tree_setup (sim_t *sim)
+{
+    const char *id[] = { W1_TEMP_CASE, W1_TEMP_FRIDGE, W1_TEMP_FREEZER };
+    char path[PATH_MAX];
+    int i;
+
+    xmkdir (sim->root);
+    path_fmt (path, sizeof (path), sim, "w1");
+    xmkdir (path);
+    for (i = 0; i < 3; i++) {
+        path_fmt (path, sizeof (path), sim, "w1/%s", id[i]);
+        xmkdir (path);
+    }
+    temp_update (sim);
+
+    path_fmt (path, sizeof (path), sim, "gpio");
+    xmkdir (path);
+    path_fmt (path, sizeof (path), sim, "gpio/gpio%d", GPIO_MODE_PIN);
+    xmkdir (path);
+    path_fmt (path, sizeof (path), sim, "gpio/gpio%d/direction",
+              GPIO_MODE_PIN);
+    put_file (path, "in\n");
+    path_fmt (path, sizeof (path), sim, "gpio/gpio%d/edge", GPIO_MODE_PIN);
+    put_file (path, "none\n");
+    path_fmt (path, sizeof (path), sim, "gpio/gpio%d/value", GPIO_MODE_PIN);
+    put_value (path, 1); /* key is active low */
+
+    path_fmt (path, sizeof (path), sim, "i2c-1");
+    unlink (path);
+    if (mkfifo (path, 0644) < 0) {
+        perror (path);
+        exit (1);
+    }
+    /* O_RDWR so open does not wait for a writer, and writers never
+     * see EPIPE between our reads.
+     */
+    if ((sim->i2c = open (path, O_RDWR | O_NONBLOCK)) < 0) {
+        perror (path);
+        exit (1);
+    }
+}
+
+static void tree_cleanup (sim_t *sim)
+{
+    char path[PATH_MAX];
+
+    path_fmt (path, sizeof (path), sim, "ttyAMA0");
+    unlink (path);
+    path_fmt (path, sizeof (path), sim, "i2c-1");
+    unlink (path);
+}
+
+static void i2c_drain (sim_t *sim)
+{
+    uint8_t buf[4096];
+    int n;
+
+    while ((n = read (sim->i2c, buf, sizeof (buf))) > 0)
+        sim->i2c_bytes += n;
+    if (n < 0 && errno != EAGAIN) {
+        perror ("i2c read");
+        exit (1);
+    }
+}
+
+static void sig_handler (int sig)
+{
+    done = 1;
+}
+
+static uint64_t min_u64 (uint64_t a, uint64_t b)
+{
+    return a < b ? a : b;
+}
+
+int main (int argc, char *argv[])
+{
+    sim_t sim = { .ted_master = -1, .ted_slave = -1, .i2c = -1 };
+    double ted_rate = 1;
+    int errpct = 0, key_sec = 0, temp_sec = 10;
+    bool verbose = false;
+    uint64_t now, next_ted, next_temp, next_key, key_release = 0, next_stats;
+    char keypath[PATH_MAX];
+    struct pollfd pfd;
+    int c, tmout;
+
+    while ((c = getopt_long (argc, argv, OPTIONS, longopts, NULL)) != -1) {
+        switch (c) {
+            case 'r':
+                ted_rate = strtod (optarg, NULL);
+                break;
+            case 'e':
+                errpct = strtoul (optarg, NULL, 10);
+                break;
+            case 'k':
+                key_sec = strtoul (optarg, NULL, 10);
+                break;
+            case 't':
+                temp_sec = strtoul (optarg, NULL, 10);
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            default:
+                usage ();
+        }
+    }
+    if (optind != argc - 1 || ted_rate <= 0 || temp_sec < 1)
+        usage ();
+    sim.root = argv[optind];
+
+    signal (SIGINT, sig_handler);
+    signal (SIGTERM, sig_handler);
+    tree_setup (&sim);
+    ted_setup (&sim);
+    path_fmt (keypath, sizeof (keypath), &sim, "gpio/gpio%d/value",
+              GPIO_MODE_PIN);
+
+    now = now_ms ();
+    next_ted = now;
+    next_temp = now + temp_sec * 1000;
+    next_key = key_sec > 0 ? now + key_sec * 1000 : UINT64_MAX;
+    next_stats = now + STATS_INTERVAL * 1000;
+    while (!done) {
+        now = now_ms ();
+        if (now >= next_ted) {
+            ted_send (&sim, errpct);
+            next_ted += 1000 / ted_rate;
+            if (next_ted < now)
+                next_ted = now;
+        }
+        if (now >= next_temp) {
+            temp_update (&sim);
+            next_temp += temp_sec * 1000;
+        }
+        if (now >= next_key) {
+            put_value (keypath, 0);
+            key_release = now + KEY_HOLD_MS;
+            next_key += key_sec * 1000;
+        }
+        if (key_release && now >= key_release) {
+            put_value (keypath, 1);
+            key_release = 0;
+        }
+        if (now >= next_stats) {
+            if (verbose)
+                fprintf (stderr, "ted: %ld frames (%ld dropped), "
+                         "i2c: %ld bytes\n", sim.ted_frames,
+                         sim.ted_dropped, sim.i2c_bytes);
+            next_stats += STATS_INTERVAL * 1000;
+        }
+
+        tmout = min_u64 (min_u64 (next_ted, next_temp),
+                         min_u64 (next_key, next_stats)) - now;
+        if (key_release)
+            tmout = min_u64 (tmout, key_release - now);
+        if (tmout < 0)
+            tmout = 0;
+        pfd.fd = sim.i2c;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll (&pfd, 1, tmout) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror ("poll");
+            exit (1);
+        }
+        if (pfd.revents & POLLIN)
+            i2c_drain (&sim);
+    }
+    tree_cleanup (&sim);
+    close (sim.i2c);
+    close (sim.ted_slave);
+    close (sim.ted_master);
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
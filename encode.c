@@ -1,6 +1,15 @@
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
 #include <json/json.h>
 #include "util.h"
+#include "jstream.h"
+#include "inverter.h"
+#include "state.h"
 #include "encode.h"
 
 static void add_double (json_object *o, const char *name, double x)
@@ -161,9 +170,53 @@ done:
     return ret;
 }
 
-/* envoy is serialized in a perl script */
+/* envoy is also serialized in a perl script (enphase-scrape.pl) */
 
-bool envoy_deserialize (const char *s, int *lp, int *wp, int *dp, int *cp)
+static void add_string (json_object *o, const char *name, const char *str)
+{
+    json_object *no;
+
+    if (!(no = json_object_new_string (str)))
+        oom ();
+    json_object_object_add (o, name, no);
+}
+
+/* Copy string member to buf (truncated to len), or default if missing.
+ */
+static void get_string (json_object *o, const char *name, const char *dflt,
+                        char *buf, int len)
+{
+    json_object *no = json_object_object_get (o, name);
+    const char *str = no ? json_object_get_string (no) : NULL;
+
+    snprintf (buf, len, "%s", str ? str : dflt);
+}
+
+char *envoy_serialize (const char *src, int l, int w, int d, int c)
+{
+    json_object *o, *no;
+    char *s = NULL;
+
+    if (!(no = json_object_new_object ()))
+        oom ();
+    add_string (no, "source", src);
+    add_int (no, "current_power", c);
+    add_int (no, "daily_energy", d);
+    add_int (no, "weekly_energy", w);
+    add_int (no, "lifetime_energy", l);
+    if (!(o = json_object_new_object ()))
+        oom ();
+    json_object_object_add (o, "envoy", no);
+    s = xstrdup (json_object_to_json_string (o));
+    json_object_put (o);
+    return s;
+}
+
+/* Messages without a source (older scraper) are attributed to ENVOY_SOURCE.
+ * src may be NULL if the caller doesn't care.
+ */
+bool envoy_deserialize (const char *s, char *src, int srclen,
+                        int *lp, int *wp, int *dp, int *cp)
 {
     json_object *no, *o;
     int l, w, d, c;
@@ -179,6 +232,8 @@ bool envoy_deserialize (const char *s, int *lp, int *wp, int *dp, int *cp)
         || !get_int (no, "current_power", &c))
         goto done;
     ret = true;
+    if (src)
+        get_string (no, "source", ENVOY_SOURCE, src, srclen);
     *lp = l;
     *wp = w;
     *dp = d;
@@ -189,3 +244,447 @@ done:
     return ret;
 }
 
+/* Batched per-inverter message.  The rollups come before the (large)
+ * list so that inverters_deserialize() can stop parsing early.
+ *   {"inverters":{"source":"envoy","count":40,"total":7939,"min":101,"max":202,
+ *     "median":201,"low":1,"stale":0,
+ *     "list":[["121300012345",203,225,1400000000,210],...]}}
+ * List entries are serial, watts, max watts, last report, peak watts.
+ */
+char *inverters_serialize (const char *src, struct invtab_struct *tab)
+{
+    json_object *o, *no, *lo, *eo;
+    char serial[24];
+    char *s;
+    int i;
+
+    if (!(no = json_object_new_object ()))
+        oom ();
+    add_string (no, "source", src);
+    add_int (no, "count", tab->count);
+    add_int (no, "total", tab->total_watts);
+    add_int (no, "min", tab->min_watts);
+    add_int (no, "max", tab->max_watts);
+    add_int (no, "median", tab->median_watts);
+    add_int (no, "low", tab->low);
+    add_int (no, "stale", tab->stale);
+    if (!(lo = json_object_new_array ()))
+        oom ();
+    for (i = 0; i < INV_SLOTS; i++) {
+        inverter_t *inv = &tab->slot[i];
+        if (inv->serial == 0)
+            continue;
+        if (!(eo = json_object_new_array ()))
+            oom ();
+        snprintf (serial, sizeof (serial), "%llu",
+                  (unsigned long long)inv->serial);
+        json_object_array_add (eo, json_object_new_string (serial));
+        json_object_array_add (eo, json_object_new_int (inv->watts));
+        json_object_array_add (eo, json_object_new_int (inv->max_watts));
+        json_object_array_add (eo, json_object_new_int (inv->last));
+        json_object_array_add (eo, json_object_new_int (inv->peak_watts));
+        json_object_array_add (lo, eo);
+    }
+    json_object_object_add (no, "list", lo);
+    if (!(o = json_object_new_object ()))
+        oom ();
+    json_object_object_add (o, "inverters", no);
+    s = xstrdup (json_object_to_json_string (o));
+    json_object_put (o);
+    return s;
+}
+
+struct invsum {
+    bool found;
+    int *field;
+    bool want_src;
+    char *src;
+    int srclen;
+    int count, total, min, low, stale;
+    int seen;
+};
+
+static int invsum_cb (js_event_t ev, const char *tok, int depth, void *arg)
+{
+    struct invsum *is = arg;
+
+    if (depth == 2 && ev == JS_KEY)
+        is->found = !strcmp (tok, "inverters");
+    else if (depth == 3 && ev == JS_KEY && is->found) {
+        if (!strcmp (tok, "list"))
+            return -1; /* rollups are all before the list */
+        is->field = !strcmp (tok, "count") ? &is->count
+                  : !strcmp (tok, "total") ? &is->total
+                  : !strcmp (tok, "min") ? &is->min
+                  : !strcmp (tok, "low") ? &is->low
+                  : !strcmp (tok, "stale") ? &is->stale
+                  : NULL;
+        is->want_src = !strcmp (tok, "source");
+    } else if (depth == 3 && ev == JS_STRING && is->want_src) {
+        if (is->src)
+            snprintf (is->src, is->srclen, "%s", tok);
+        is->want_src = false;
+    } else if (depth == 3 && ev == JS_NUMBER && is->field) {
+        *is->field = strtol (tok, NULL, 10);
+        is->field = NULL;
+        is->seen++;
+    }
+    return 0;
+}
+
+bool inverters_deserialize (const char *s, char *src, int srclen,
+                            int *countp, int *totalp,
+                            int *minp, int *lowp, int *stalep)
+{
+    struct invsum is;
+    jstream_t js;
+
+    memset (&is, 0, sizeof (is));
+    is.src = src;
+    is.srclen = srclen;
+    if (src)
+        snprintf (src, srclen, "%s", ENVOY_SOURCE);
+    js_init (&js, invsum_cb, &is);
+    if (js_feed (&js, s, strlen (s)) < 0 || !is.found || is.seen < 5)
+        return false;
+    *countp = is.count;
+    *totalp = is.total;
+    *minp = is.min;
+    *lowp = is.low;
+    *stalep = is.stale;
+    return true;
+}
+
+/* Fleet rollup published by emonagg, summed over sites heard from
+ * recently (live).
+ */
+char *fleet_serialize (int sites, int live, int tw, int ew, int ed)
+{
+    json_object *o, *no;
+    char *s = NULL;
+
+    if (!(no = json_object_new_object ()))
+        oom ();
+    add_int (no, "sites", sites);
+    add_int (no, "live", live);
+    add_int (no, "ted_watts", tw);
+    add_int (no, "envoy_watts", ew);
+    add_int (no, "envoy_daily", ed);
+    if (!(o = json_object_new_object ()))
+        oom ();
+    json_object_object_add (o, "fleet", no);
+    s = xstrdup (json_object_to_json_string (o));
+    json_object_put (o);
+    return s;
+}
+
+bool fleet_deserialize (const char *s, int *sp, int *lp, int *twp, int *ewp,
+                        int *edp)
+{
+    json_object *no, *o;
+    int sites, live, tw, ew, ed;
+    bool ret = false;
+
+    if (!(o = json_tokener_parse (s)))
+        goto done;
+    if (!(no = json_object_object_get (o, "fleet")))
+        goto done;
+    if (!get_int (no, "sites", &sites) || !get_int (no, "live", &live)
+        || !get_int (no, "ted_watts", &tw)
+        || !get_int (no, "envoy_watts", &ew)
+        || !get_int (no, "envoy_daily", &ed))
+        goto done;
+    ret = true;
+    *sp = sites;
+    *lp = live;
+    *twp = tw;
+    *ewp = ew;
+    *edp = ed;
+done:
+    if (o)
+        json_object_put (o);
+    return ret;
+}
+
+/* A sensor with no reading is NAN, which json-c would print as a bare
+ * nan that browsers cannot parse; send null instead.
+ */
+static void add_reading (json_object *o, const char *name, double x)
+{
+    if (isfinite (x))
+        add_double (o, name, x);
+    else
+        json_object_object_add (o, name, NULL);
+}
+
+/* Dashboard views of emond's readings (see httpd.c).
+ */
+char *state_serialize (const state_t *st)
+{
+    json_object *o, *no;
+    char *s = NULL;
+
+    if (!(o = json_object_new_object ()))
+        oom ();
+    add_int (o, "mode", st->mode);
+    if (!(no = json_object_new_object ()))
+        oom ();
+    add_int (no, "watts", st->ted_watts);
+    add_int (no, "volts", st->ted_volts);
+    add_int (no, "last", st->ted_last);
+    json_object_object_add (o, "ted", no);
+    if (!(no = json_object_new_object ()))
+        oom ();
+    add_int (no, "current_power", st->envoy_current_power);
+    add_int (no, "last", st->envoy_last);
+    json_object_object_add (o, "envoy", no);
+    if (!(no = json_object_new_object ()))
+        oom ();
+    add_reading (no, "case", st->temp_case);
+    add_reading (no, "fridge", st->temp_fridge);
+    add_reading (no, "freezer", st->temp_freezer);
+    json_object_object_add (o, "temp", no);
+    s = xstrdup (json_object_to_json_string (o));
+    json_object_put (o);
+    return s;
+}
+
+/* wattsec integrates TED (net) plus Envoy power, i.e. energy used.
+ * Generation is the Envoy's daily figure, so net is used - generated.
+ * Weeks and months add today to the days closed out so far.
+ */
+static json_object *rollup_object (const state_t *st)
+{
+    json_object *no;
+    int used = st->wattsec / 3600;
+    int gen = st->envoy_daily_energy;
+    int used_week = st->used_week_wh + used, gen_week = st->gen_week_wh + gen;
+    int used_month = st->used_month_wh + used;
+    int gen_month = st->gen_month_wh + gen;
+
+    if (!(no = json_object_new_object ()))
+        oom ();
+    add_int (no, "used_today_wh", used);
+    add_int (no, "gen_today_wh", gen);
+    add_int (no, "net_today_wh", used - gen);
+    add_int (no, "used_week_wh", used_week);
+    add_int (no, "gen_week_wh", gen_week);
+    add_int (no, "net_week_wh", used_week - gen_week);
+    add_int (no, "used_month_wh", used_month);
+    add_int (no, "gen_month_wh", gen_month);
+    add_int (no, "net_month_wh", used_month - gen_month);
+    add_int (no, "gen_lifetime_wh", st->envoy_lifetime_energy);
+    return no;
+}
+
+char *rollup_serialize (const state_t *st)
+{
+    json_object *o, *no;
+    char *s = NULL;
+
+    no = rollup_object (st);
+    if (!(o = json_object_new_object ()))
+        oom ();
+    json_object_object_add (o, "energy", no);
+    s = xstrdup (json_object_to_json_string (o));
+    json_object_put (o);
+    return s;
+}
+
+/* Published by emond when today's figures change, for display agents:
+ * the rollup plus the generation now, whether that leaves out a stale
+ * Envoy, and whether no Envoy is fresh at all.
+ */
+char *energy_serialize (const state_t *st, bool gen_stale, bool gen_none)
+{
+    json_object *o, *no;
+    char *s = NULL;
+
+    no = rollup_object (st);
+    add_int (no, "gen_w", st->envoy_current_power);
+    add_int (no, "gen_stale", gen_stale);
+    add_int (no, "gen_none", gen_none);
+    if (!(o = json_object_new_object ()))
+        oom ();
+    json_object_object_add (o, "energy", no);
+    s = xstrdup (json_object_to_json_string (o));
+    json_object_put (o);
+    return s;
+}
+
+bool energy_deserialize (const char *s, int *usedp, int *genp, int *gen_wp,
+                         bool *gen_stalep, bool *gen_nonep)
+{
+    json_object *no, *o;
+    int used, gen, gen_w, gen_stale, gen_none;
+    bool ret = false;
+
+    if (!(o = json_tokener_parse (s)))
+        goto done;
+    if (!(no = json_object_object_get (o, "energy")))
+        goto done;
+    if (!get_int (no, "used_today_wh", &used)
+        || !get_int (no, "gen_today_wh", &gen)
+        || !get_int (no, "gen_w", &gen_w)
+        || !get_int (no, "gen_stale", &gen_stale)
+        || !get_int (no, "gen_none", &gen_none))
+        goto done;
+    ret = true;
+    *usedp = used;
+    *genp = gen;
+    *gen_wp = gen_w;
+    *gen_stalep = gen_stale;
+    *gen_nonep = gen_none;
+done:
+    if (o)
+        json_object_put (o);
+    return ret;
+}
+
+/* Published by emond as a day, week or month ends, with the energy used
+ * and generated over the period just closed, and net of the two.
+ */
+char *boundary_serialize (const char *period, int used_wh, int gen_wh)
+{
+    json_object *o, *no;
+    char *s = NULL;
+
+    if (!(no = json_object_new_object ()))
+        oom ();
+    add_string (no, "period", period);
+    add_int (no, "used_wh", used_wh);
+    add_int (no, "gen_wh", gen_wh);
+    add_int (no, "net_wh", used_wh - gen_wh);
+    if (!(o = json_object_new_object ()))
+        oom ();
+    json_object_object_add (o, "boundary", no);
+    s = xstrdup (json_object_to_json_string (o));
+    json_object_put (o);
+    return s;
+}
+
+/* {"history":[[time,net,gen],...]}, oldest first.
+ */
+char *history_serialize (const int64_t *t, const int *net, const int *gen,
+                         int n)
+{
+    json_object *o, *lo, *eo;
+    char *s = NULL;
+    int i;
+
+    if (!(lo = json_object_new_array ()))
+        oom ();
+    for (i = 0; i < n; i++) {
+        if (!(eo = json_object_new_array ()))
+            oom ();
+        json_object_array_add (eo, json_object_new_int (t[i]));
+        json_object_array_add (eo, json_object_new_int (net[i]));
+        json_object_array_add (eo, json_object_new_int (gen[i]));
+        json_object_array_add (lo, eo);
+    }
+    if (!(o = json_object_new_object ()))
+        oom ();
+    json_object_object_add (o, "history", lo);
+    s = xstrdup (json_object_to_json_string (o));
+    json_object_put (o);
+    return s;
+}
+
+/* The timestamp and site are spliced in and found by string search
+ * rather than through json-c, so that stamping a message on the way out
+ * and merging or aggregating many streams cost no parse and no allocation.
+ */
+static int _stamp (char *s, int len, int room, const char *key,
+                   const char *val)
+{
+    char k[16];
+    char *p;
+
+    snprintf (k, sizeof (k), "\"%s\":", key);
+    if (strstr (s, k) || !(p = strrchr (s, '}')))
+        return len;
+    return (p - s) + snprintf (p, room + (s + len - p) + 1,
+                               ", \"%s\": %s }", key, val);
+}
+
+int ts_stamp (char *s, int len, uint64_t ts)
+{
+    char val[24];
+
+    snprintf (val, sizeof (val), "%llu", (unsigned long long)ts);
+    return _stamp (s, len, TS_STAMPLEN, "ts", val);
+}
+
+bool ts_deserialize (const char *s, uint64_t *tsp)
+{
+    const char *p;
+    char *end;
+    unsigned long long ts;
+
+    if (!(p = strstr (s, "\"ts\":")))
+        return false;
+    ts = strtoull (p + 5, &end, 10);
+    if (end == p + 5)
+        return false;
+    *tsp = ts;
+    return true;
+}
+
+int seq_stamp (char *s, int len, uint64_t seq)
+{
+    char val[24];
+
+    snprintf (val, sizeof (val), "%llu", (unsigned long long)seq);
+    return _stamp (s, len, SEQ_STAMPLEN, "seq", val);
+}
+
+bool seq_deserialize (const char *s, uint64_t *seqp)
+{
+    const char *p;
+    char *end;
+    unsigned long long seq;
+
+    if (!(p = strstr (s, "\"seq\":")))
+        return false;
+    seq = strtoull (p + 6, &end, 10);
+    if (end == p + 6)
+        return false;
+    *seqp = seq;
+    return true;
+}
+
+bool topic_deserialize (const char *s, char *topic, int topiclen)
+{
+    const char *p, *q;
+
+    if (!(p = strchr (s, '{')) || !(p = strchr (p, '"'))
+                               || !(q = strchr (p + 1, '"')))
+        return false;
+    if (q - p - 1 >= topiclen || q == p + 1)
+        return false;
+    memcpy (topic, p + 1, q - p - 1);
+    topic[q - p - 1] = '\0';
+    return true;
+}
+
+int site_stamp (char *s, int len, const char *site)
+{
+    char val[SITE_MAX + 2];
+
+    snprintf (val, sizeof (val), "\"%s\"", site);
+    return _stamp (s, len, SITE_STAMPLEN, "site", val);
+}
+
+bool site_deserialize (const char *s, char *site, int sitelen)
+{
+    const char *p, *q;
+
+    if (!(p = strstr (s, "\"site\":")) || !(p = strchr (p + 7, '"'))
+                                      || !(q = strchr (p + 1, '"')))
+        return false;
+    if (q - p - 1 >= sitelen)
+        return false;
+    memcpy (site, p + 1, q - p - 1);
+    site[q - p - 1] = '\0';
+    return true;
+}
@@ -4,4 +4,54 @@ char *ted_serialize (int a, int c, int w, int v);
 bool ted_deserialize (const char *s, int *ap, int *cp, int *wp, int *vp);
 char *key_serialize (int n);
 bool key_deserialize (const char *s, int *np);
-bool envoy_deserialize (const char *s, int *lp, int *wp, int *dp, int *cp);
+#define ENVOY_SOURCE    "envoy"     /* default source name */
+#define ENVOY_SRCLEN    32
+char *envoy_serialize (const char *src, int l, int w, int d, int c);
+bool envoy_deserialize (const char *s, char *src, int srclen,
+                        int *lp, int *wp, int *dp, int *cp);
+struct invtab_struct;
+char *inverters_serialize (const char *src, struct invtab_struct *tab);
+bool inverters_deserialize (const char *s, char *src, int srclen,
+                            int *countp, int *totalp,
+                            int *minp, int *lowp, int *stalep);
+char *fleet_serialize (int sites, int live, int tw, int ew, int ed);
+bool fleet_deserialize (const char *s, int *sp, int *lp, int *twp, int *ewp,
+                        int *edp);
+struct state_data_struct;
+char *state_serialize (const struct state_data_struct *st);
+char *rollup_serialize (const struct state_data_struct *st);
+char *energy_serialize (const struct state_data_struct *st, bool gen_stale,
+                        bool gen_none);
+bool energy_deserialize (const char *s, int *usedp, int *genp, int *gen_wp,
+                         bool *gen_stalep, bool *gen_nonep);
+char *history_serialize (const int64_t *t, const int *net, const int *gen,
+                         int n);
+char *boundary_serialize (const char *period, int used_wh, int gen_wh);
+/* Insert "ts": microseconds since the epoch into serialized message s,
+ * len bytes and NUL terminated, in a buffer of len + TS_STAMPLEN + 1.
+ * Returns the new length, or len if s already has a timestamp.
+ */
+#define TS_STAMPLEN     32
+int ts_stamp (char *s, int len, uint64_t ts);
+bool ts_deserialize (const char *s, uint64_t *tsp);
+/* Insert "seq": the message's number within its topic, counting from 1
+ * when emond starts, into serialized message s in a buffer of
+ * len + SEQ_STAMPLEN + 1.  A subscriber that sees a number skipped has
+ * missed a message and can ask emond to replay it.
+ */
+#define SEQ_STAMPLEN    32
+int seq_stamp (char *s, int len, uint64_t seq);
+bool seq_deserialize (const char *s, uint64_t *seqp);
+/* Copy the topic of serialized message s, its top level key, e.g. "ted".
+ */
+#define TOPIC_MAX       16
+bool topic_deserialize (const char *s, char *topic, int topiclen);
+/* Insert "site": name (at most SITE_MAX - 1 characters, no quotes) into
+ * serialized message s in a buffer of len + SITE_STAMPLEN + 1.
+ */
+#define SITE_MAX        32
+#define SITE_CHARS      "abcdefghijklmnopqrstuvwxyz" \
+                        "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_."
+#define SITE_STAMPLEN   (SITE_MAX + 16)
+int site_stamp (char *s, int len, const char *site);
+bool site_deserialize (const char *s, char *site, int sitelen);
@@ -3,6 +3,10 @@
 # Scrape data from Envoy, encode it as JSON, and send it to emond via
 # a 0mq socket for display.  Run from cron once per minute.
 #
+# Usage: enphase-scrape.pl [hostname [source-name]]
+# Give each Envoy a distinct source name when scraping more than one;
+# emond sums generation over all sources.
+#
 # Requires these Raspbian packages:
 #   liblwp-protocol-https-perl
 #   libzmq-dev
@@ -19,7 +23,8 @@ use ZeroMQ qw/:all/;
 use JSON;
 use strict;
 
-my $envoy_hostname = "192.168.1.210";
+my $envoy_hostname = $ARGV[0] || "192.168.1.210";
+my $envoy_source = $ARGV[1] || "envoy";
 my $push_addr = "ipc:///tmp/emond";
 
 my $ua = LWP::UserAgent->new;
@@ -80,6 +85,7 @@ if ($lifetime_units eq 'M') {
 
 # Convert to JSON
 my %envoy_data = (
+	source => $envoy_source,
 	current_power => int $current_power,
 	daily_energy => int $daily_energy,
 	weekly_energy => int $weekly_energy,
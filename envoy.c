@@ -0,0 +1,197 @@
+/*****************************************************************************
+ *  Copyright (C) 2014 Jim Garlick
+ *  Written by Jim Garlick <garlick.jim@gmail.com>
+ *  All Rights Reserved.
+ *
+ *  This file is part of pi-ted-envoy.
+ *  For details, see <https://github.com/garlick/pi-ted-envoy>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+/* envoy.c - poll Enphase Envoy local monitoring page */
+
+/* This replaces the HTML scraping done by enphase-scrape.pl.
+ * The page looks like:
+ *   <tr><td>Currently</td><td>    1.23 kW</td></tr>
+ *   <tr><td>Today</td><td>    8.83 kWh</td></tr>
+ *   <tr><td>Past Week</td><td>    63.1 kWh</td></tr>
+ *   <tr><td>Since Installation</td><td>    4.51 MWh</td></tr>
+ * Per-inverter data comes from /api/v1/production/inverters, which is
+ * parsed as it streams in (see inverter.c).  Firmware that requires
+ * authentication for that page is not supported.
+ */
+
+#define _GNU_SOURCE /* for strcasestr */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "util.h"
+#include "http.h"
+#include "jstream.h"
+#include "inverter.h"
+#include "envoy.h"
+
+#define ENVOY_PORT      80
+#define ENVOY_TIMEOUT   10      /* sec */
+#define ENVOY_PAGEMAX   32768
+
+struct envoy_struct {
+    http_t *http;
+    char page[ENVOY_PAGEMAX];
+    int len;
+    invparse_t ip;
+    bool parse_error;
+};
+
+envoy_t *envoy_create (const char *host)
+{
+    envoy_t *e = xzmalloc (sizeof (*e));
+    char *cpy = xstrdup (host);
+    char *p = strchr (cpy, ':');
+    int port = ENVOY_PORT;
+
+    if (p) {
+        *p++ = '\0';
+        port = strtoul (p, NULL, 10);
+    }
+    e->http = http_create (cpy, port, ENVOY_TIMEOUT);
+    free (cpy);
+    return e;
+}
+
+void envoy_destroy (envoy_t *e)
+{
+    http_destroy (e->http);
+    free (e);
+}
+
+/* Find label cell, then parse "<td> value [kM]unit" in the following cell.
+ */
+static bool _field (const char *html, const char *label, const char *unit,
+                    int *vp)
+{
+    const char *p;
+    char *end;
+    double val;
+
+    if (!(p = strcasestr (html, label)))
+        return false;
+    if (!(p = strcasestr (p + strlen (label), "<td>")))
+        return false;
+    val = strtod (p + 4, &end);
+    if (end == p + 4)
+        return false;
+    p = end + strspn (end, " \t");
+    if (*p == 'k')
+        val *= 1000;
+    else if (*p == 'M')
+        val *= 1000000;
+    if (*p == 'k' || *p == 'M')
+        p++;
+    if (strncmp (p, unit, strlen (unit)) != 0)
+        return false;
+    *vp = (int)val;
+    return true;
+}
+
+bool envoy_parse_production (const char *html, int *lp, int *wp, int *dp,
+                             int *cp)
+{
+    int l, w, d, c;
+
+    if (!_field (html, "<td>Currently</td>", "W", &c)
+        || !_field (html, "<td>Today</td>", "Wh", &d)
+        || !_field (html, "<td>Past Week</td>", "Wh", &w)
+        || !_field (html, "<td>Since Installation</td>", "Wh", &l))
+        return false;
+    *lp = l;
+    *wp = w;
+    *dp = d;
+    *cp = c;
+    return true;
+}
+
+/* Keep as much of the page as fits; the table is near the top.
+ */
+static int _page (const char *buf, int len, void *arg)
+{
+    envoy_t *e = arg;
+    int n = sizeof (e->page) - 1 - e->len;
+
+    if (len < n)
+        n = len;
+    memcpy (e->page + e->len, buf, n);
+    e->len += n;
+    return 0;
+}
+
+int envoy_production (envoy_t *e, int *lp, int *wp, int *dp, int *cp)
+{
+    int status;
+
+    e->len = 0;
+    if ((status = http_get (e->http, "/production", _page, e)) < 0)
+        return -1;
+    if (status != 200) {
+        errno = EPROTO;
+        return -1;
+    }
+    e->page[e->len] = '\0';
+    if (!envoy_parse_production (e->page, lp, wp, dp, cp)) {
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+static int _inv (const char *buf, int len, void *arg)
+{
+    envoy_t *e = arg;
+
+    if (inv_parse_feed (&e->ip, buf, len) < 0) {
+        e->parse_error = true;
+        return -1;
+    }
+    return 0;
+}
+
+int envoy_inverters (envoy_t *e, invtab_t *tab)
+{
+    int status;
+
+    inv_parse_init (&e->ip, tab);
+    e->parse_error = false;
+    status = http_get (e->http, "/api/v1/production/inverters", _inv, e);
+    if (e->parse_error) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (status < 0)
+        return -1;
+    if (status != 200) {
+        errno = status == 401 ? EPERM : ENOENT;
+        return -1;
+    }
+    return e->ip.updated;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
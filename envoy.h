@@ -0,0 +1,21 @@
+typedef struct envoy_struct envoy_t;
+
+/* Create a poller for the Envoy at host[:port].
+ */
+envoy_t *envoy_create (const char *host);
+void envoy_destroy (envoy_t *e);
+
+/* Fetch the /production page and parse it.
+ * Energy is in Wh, power in W.  Returns 0 on success, -1 with errno set.
+ */
+int envoy_production (envoy_t *e, int *lp, int *wp, int *dp, int *cp);
+
+/* Fetch per-inverter data into tab (streamed, no tree is built).
+ * Returns the number of inverters updated, or -1 with errno set.
+ */
+int envoy_inverters (envoy_t *e, invtab_t *tab);
+
+/* Parse the /production page.
+ */
+bool envoy_parse_production (const char *html, int *lp, int *wp, int *dp,
+                             int *cp);
@@ -0,0 +1,108 @@
+/*****************************************************************************
+ *  Copyright (C) 2014 Jim Garlick
+ *  Written by Jim Garlick <garlick.jim@gmail.com>
+ *  All Rights Reserved.
+ *
+ *  This file is part of pi-ted-envoy.
+ *  For details, see <https://github.com/garlick/pi-ted-envoy>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+/* envoyutil.c - poll an Envoy (or a stand-in serving a canned page) */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "jstream.h"
+#include "inverter.h"
+#include "envoy.h"
+
+static void inverters (envoy_t *e, const char *host)
+{
+    static invtab_t tab;
+    int i;
+
+    inv_init (&tab);
+    if (envoy_inverters (e, &tab) < 0) {
+        fprintf (stderr, "%s: inverters: %s\n", host, strerror (errno));
+        return;
+    }
+    inv_rollup (&tab, time (NULL), 1800);
+    for (i = 0; i < INV_SLOTS; i++) {
+        inverter_t *inv = &tab.slot[i];
+        if (inv->serial != 0)
+            printf ("%llu %dW (max %dW) last=%ld\n",
+                    (unsigned long long)inv->serial, inv->watts,
+                    inv->max_watts, (long)inv->last);
+    }
+    printf ("inverters=%d total=%d min=%d median=%d max=%d low=%d stale=%d\n",
+            tab.count, tab.total_watts, tab.min_watts, tab.median_watts,
+            tab.max_watts, tab.low, tab.stale);
+}
+
+int main (int argc, char *argv[])
+{
+    envoy_t *e;
+    int l, w, d, c;
+    int count = 1, interval = 5, i;
+    bool iopt = false;
+    struct timeval t0, t1;
+
+    if (argc > 1 && !strcmp (argv[1], "-i")) {
+        iopt = true;
+        argc--;
+        argv++;
+    }
+    if (argc < 2 || argc > 4) {
+        fprintf (stderr,
+                 "Usage: envoyutil [-i] host[:port] [count [interval]]\n");
+        exit (1);
+    }
+    if (argc > 2)
+        count = strtoul (argv[2], NULL, 10);
+    if (argc > 3)
+        interval = strtoul (argv[3], NULL, 10);
+    e = envoy_create (argv[1]);
+    for (i = 0; i < count; i++) {
+        if (i > 0)
+            sleep (interval);
+        if (iopt) {
+            inverters (e, argv[1]);
+            continue;
+        }
+        gettimeofday (&t0, NULL);
+        if (envoy_production (e, &l, &w, &d, &c) < 0) {
+            fprintf (stderr, "%s: %s\n", argv[1], strerror (errno));
+            continue;
+        }
+        gettimeofday (&t1, NULL);
+        printf ("lifetime=%d weekly=%d daily=%d current=%d (%ld ms)\n",
+                l, w, d, c, (t1.tv_sec - t0.tv_sec) * 1000
+                          + (t1.tv_usec - t0.tv_usec) / 1000);
+    }
+    envoy_destroy (e);
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,595 @@
+/*****************************************************************************
+ *  Copyright (C) 2014 Jim Garlick
+ *  Written by Jim Garlick <garlick.jim@gmail.com>
+ *  All Rights Reserved.
+ *
+ *  This file is part of pi-ted-envoy.
+ *  For details, see <https://github.com/garlick/pi-ted-envoy>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+/* export.c - batch readings to an upstream time-series service */
+
+/* emond hands points to the exporter thread through a drop-oldest queue,
+ * so a dead or slow upstream can never hold up ingest.  The thread groups
+ * points into batches, formatted once per batch, and POSTs each batch.
+ * A batch that upstream refuses outright (4xx) would be refused again, so
+ * it is dropped and counted.  When a POST fails any other way, the batch
+ * and every later one go to the spool, one file per batch, written to a
+ * temporary name, fsynced and renamed into place so a crash leaves whole
+ * batches only.  While the spool has anything in it, new batches go there
+ * too, so that they wait their turn behind it.  The spool is replayed
+ * oldest first, up to jobs batches at a time, by a fixed pool of jobs
+ * workers that each keep their own connection, with exponential backoff
+ * between failed rounds.  Batches in a round race each other, and one
+ * that fails is sent again after later ones that did not, so with jobs
+ * above 1 upstream may see batches out of order.  That is harmless:
+ * every point carries its own timestamp.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "spsc.h"
+#include "http.h"
+#include "metrics.h"
+#include "trace.h"
+#include "export.h"
+
+#define EXPORT_QLEN     4096
+#define EXPORT_TIMEOUT  10              /* sec per HTTP request */
+#define BACKOFF_MIN     1
+#define BACKOFF_MAX     300
+#define JOBS_MAX        16
+
+typedef enum {
+    POST_OK,
+    POST_RETRY,                         /* transport error or 5xx */
+    POST_REJECTED,                      /* 4xx: sending it again won't help */
+} post_t;
+
+typedef struct {
+    uint64_t seq;                       /* spool file to send */
+    post_t r;
+} job_t;
+
+typedef struct {
+    const char *name;
+    const char *type;                   /* Content-Type */
+    const char *header;                 /* first line of a batch, or NULL */
+    void (*point) (FILE *f, const export_point_t *p, const char *site);
+} export_fmt_t;
+
+struct export_struct {
+    spsc_t *q;
+    pthread_t t;
+    const export_fmt_t *fmt;
+    char *site;
+    char *host;
+    int port;
+    char *path;
+    http_t *http;
+    int batch;
+    int window;
+    char *spool;
+    int spoolmax;
+    int jobs;
+    uint64_t seq;                       /* name of the next spool file */
+    int spooled;                        /* files in the spool */
+    int backoff;                        /* sec, 0 if upstream is healthy */
+    int64_t retry;                      /* when to try upstream again (ms) */
+    /* the replay workers and the round they are working on */
+    pthread_t worker[JOBS_MAX];
+    pthread_mutex_t lock;
+    pthread_cond_t work;                /* a round has been handed out */
+    pthread_cond_t done;                /* the last job of it finished */
+    job_t job[JOBS_MAX];
+    int njob;
+    int next;                           /* next job to take */
+    int pending;                        /* jobs not finished yet */
+    /* the batch being built */
+    char *buf;
+    size_t len;
+    FILE *f;
+    int n;
+    int64_t first;                      /* when it was started (ms) */
+};
+
+/* Monotonic clock in ms.
+ */
+static int64_t _now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* InfluxDB line protocol: name[,site=S] k=v[,k=v...] ns
+ */
+static void _lp (FILE *f, const export_point_t *p, const char *site)
+{
+    int i;
+
+    fputs (p->name, f);
+    if (site)
+        fprintf (f, ",site=%s", site);
+    for (i = 0; i < p->nfield; i++)
+        fprintf (f, "%c%s=%g", i == 0 ? ' ' : ',', p->field[i].key,
+                 p->field[i].val);
+    fprintf (f, " %lld000\n", (long long)p->ts);
+}
+
+/* CSV, one row per field.
+ */
+static void _csv (FILE *f, const export_point_t *p, const char *site)
+{
+    int i;
+
+    for (i = 0; i < p->nfield; i++)
+        fprintf (f, "%lld.%06lld,%s,%s,%s,%g\n",
+                 (long long)(p->ts / 1000000), (long long)(p->ts % 1000000),
+                 site ? site : "", p->name, p->field[i].key, p->field[i].val);
+}
+
+static const export_fmt_t formats[] = {
+    { "lp", "text/plain; charset=utf-8", NULL, _lp },
+    { "csv", "text/csv", "time,site,measurement,field,value\n", _csv },
+};
+
+static void _parse_url (export_t *x, const char *url)
+{
+    const char *p, *q;
+
+    if (strncmp (url, "http://", 7) != 0)
+        goto bad;
+    p = url + 7;
+    if (!(q = strchr (p, '/')))
+        q = p + strlen (p);
+    x->host = xzmalloc (q - p + 1);
+    memcpy (x->host, p, q - p);
+    x->port = 80;
+    if ((p = strchr (x->host, ':'))) {
+        x->port = strtoul (p + 1, NULL, 10);
+        x->host[p - x->host] = '\0';
+    }
+    x->path = xstrdup (*q ? q : "/");
+    if (*x->host == '\0' || x->port < 1 || x->port > 65535)
+        goto bad;
+    return;
+bad:
+    fprintf (stderr, "export: bad URL (want http://host[:port]/path): %s\n",
+             url);
+    exit (1);
+}
+
+/* Number the spool from one past the highest file already there.
+ */
+static void _scan_spool (export_t *x)
+{
+    struct dirent *d;
+    uint64_t n;
+    char *end;
+    DIR *dir;
+
+    if (mkdir (x->spool, 0755) < 0 && errno != EEXIST) {
+        perror (x->spool);
+        exit (1);
+    }
+    if (!(dir = opendir (x->spool))) {
+        perror (x->spool);
+        exit (1);
+    }
+    while ((d = readdir (dir))) {
+        n = strtoull (d->d_name, &end, 10);
+        if (end == d->d_name || strcmp (end, ".batch") != 0)
+            continue;
+        if (n >= x->seq)
+            x->seq = n + 1;
+        x->spooled++;
+    }
+    closedir (dir);
+}
+
+export_t *export_create (const char *spec, const char *site)
+{
+    export_t *x = xzmalloc (sizeof (*x));
+    char *cpy = xstrdup (spec);
+    char *tok, *save = NULL, *val;
+    int i;
+
+    x->fmt = &formats[0];
+    x->batch = 100;
+    x->window = 60;
+    x->spool = "/var/spool/emond";
+    x->spoolmax = 10000;
+    x->jobs = 4;
+    _parse_url (x, strtok_r (cpy, ",", &save));
+    while ((tok = strtok_r (NULL, ",", &save))) {
+        if (!(val = strchr (tok, '=')))
+            goto bad;
+        *val++ = '\0';
+        if (!strcmp (tok, "format")) {
+            for (i = 0; i < sizeof (formats) / sizeof (formats[0]); i++)
+                if (!strcmp (val, formats[i].name))
+                    break;
+            if (i == sizeof (formats) / sizeof (formats[0]))
+                goto bad;
+            x->fmt = &formats[i];
+        } else if (!strcmp (tok, "batch"))
+            x->batch = strtoul (val, NULL, 10);
+        else if (!strcmp (tok, "window"))
+            x->window = strtoul (val, NULL, 10);
+        else if (!strcmp (tok, "spool"))
+            x->spool = val;
+        else if (!strcmp (tok, "spoolmax"))
+            x->spoolmax = strtoul (val, NULL, 10);
+        else if (!strcmp (tok, "jobs"))
+            x->jobs = strtoul (val, NULL, 10);
+        else
+            goto bad;
+    }
+    if (x->batch < 1 || x->window < 1 || x->spoolmax < 1 || x->jobs < 1
+                                                       || x->jobs > JOBS_MAX)
+        goto bad;
+    x->spool = xstrdup (x->spool);
+    x->site = site ? xstrdup (site) : NULL;
+    x->http = http_create (x->host, x->port, EXPORT_TIMEOUT);
+    x->q = spsc_create (sizeof (export_point_t), EXPORT_QLEN,
+                        SPSC_DROP_OLDEST);
+    _scan_spool (x);
+    free (cpy); /* N.B. x->spool was copied before this */
+    return x;
+bad:
+    fprintf (stderr, "export: bad option in %s\n", spec);
+    exit (1);
+}
+
+bool export_point (export_t *x, const export_point_t *p)
+{
+    metrics_inc (M_EXPORT_POINTS);
+    if (!spsc_push (x->q, p)) {
+        metrics_inc (M_EXPORT_DROPS);
+        return false;
+    }
+    return true;
+}
+
+/* 408 and 429 are 4xx, but they mean "later", not "never".
+ */
+static post_t _post (export_t *x, http_t *h, const char *buf, int len)
+{
+    int status = http_post (h, x->path, x->fmt->type, buf, len, NULL, NULL);
+
+    if (status >= 200 && status <= 299) {
+        metrics_inc (M_EXPORT_BATCHES);
+        return POST_OK;
+    }
+    if (status >= 400 && status <= 499 && status != 408 && status != 429) {
+        fprintf (stderr, "export: upstream rejected a batch (HTTP %d),"
+                         " dropping it\n", status);
+        metrics_inc (M_EXPORT_REJECTED);
+        return POST_REJECTED;
+    }
+    metrics_inc (M_EXPORT_ERRORS);
+    return POST_RETRY;
+}
+
+static void _spool_path (export_t *x, uint64_t seq, char *path, int len)
+{
+    snprintf (path, len, "%s/%020llu.batch", x->spool,
+              (unsigned long long)seq);
+}
+
+/* Return the names of up to max of the oldest spool files in seq[],
+ * and delete the oldest ones beyond spoolmax.
+ */
+static int _spool_list (export_t *x, uint64_t *seq, int max)
+{
+    struct dirent **d;
+    char path[PATH_MAX];
+    uint64_t n;
+    char *end;
+    int i, count, found = 0, excess;
+
+    if ((count = scandir (x->spool, &d, NULL, alphasort)) < 0) {
+        x->spooled = 0;
+        return 0;
+    }
+    x->spooled = 0;
+    for (i = 0; i < count; i++) {
+        n = strtoull (d[i]->d_name, &end, 10);
+        if (end != d[i]->d_name && !strcmp (end, ".batch"))
+            x->spooled++;
+    }
+    excess = x->spooled - x->spoolmax;
+    for (i = 0; i < count; i++) {
+        n = strtoull (d[i]->d_name, &end, 10);
+        if (end == d[i]->d_name || strcmp (end, ".batch") != 0)
+            goto next;
+        if (excess > 0) {
+            _spool_path (x, n, path, sizeof (path));
+            (void)unlink (path);
+            metrics_inc (M_EXPORT_DROPS);
+            x->spooled--;
+            excess--;
+        } else if (found < max)
+            seq[found++] = n;
+next:
+        free (d[i]);
+    }
+    free (d);
+    return found;
+}
+
+/* Write the batch to a temporary file, fsync it, rename it into place,
+ * and fsync the directory so the rename itself survives a crash.
+ */
+static void _spool_write (export_t *x, const char *buf, int len)
+{
+    char tmp[PATH_MAX], path[PATH_MAX];
+    int fd, n, off = 0;
+
+    snprintf (tmp, sizeof (tmp), "%s/.tmp", x->spool);
+    _spool_path (x, x->seq, path, sizeof (path));
+    if ((fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+        goto error;
+    while (off < len) {
+        if ((n = write (fd, buf + off, len - off)) < 0) {
+            if (errno == EINTR)
+                continue;
+            goto error_close;
+        }
+        off += n;
+    }
+    if (fsync (fd) < 0 || close (fd) < 0)
+        goto error;
+    if (rename (tmp, path) < 0)
+        goto error;
+    if ((fd = open (x->spool, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0) {
+        (void)fsync (fd);
+        close (fd);
+    }
+    x->seq++;
+    x->spooled++;
+    metrics_inc (M_EXPORT_SPOOLED);
+    if (x->spooled > x->spoolmax)
+        (void)_spool_list (x, NULL, 0);
+    return;
+error_close:
+    close (fd);
+error:
+    fprintf (stderr, "export: %s: %s (batch lost)\n", path, strerror (errno));
+    (void)unlink (tmp);
+}
+
+static char *_slurp (const char *path, int *lenp)
+{
+    struct stat sb;
+    char *buf;
+    int fd, n, off = 0;
+
+    if ((fd = open (path, O_RDONLY | O_CLOEXEC)) < 0)
+        return NULL;
+    if (fstat (fd, &sb) < 0) {
+        close (fd);
+        return NULL;
+    }
+    buf = xzmalloc (sb.st_size + 1);
+    while (off < sb.st_size) {
+        if ((n = read (fd, buf + off, sb.st_size - off)) <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            break;
+        }
+        off += n;
+    }
+    close (fd);
+    *lenp = off;
+    return buf;
+}
+
+static post_t _replay_one (export_t *x, http_t *h, uint64_t seq)
+{
+    char path[PATH_MAX];
+    char *buf;
+    int len;
+    post_t r;
+
+    _spool_path (x, seq, path, sizeof (path));
+    if (!(buf = _slurp (path, &len)))
+        return POST_OK; /* gone: nothing to send */
+    if ((r = _post (x, h, buf, len)) != POST_RETRY)
+        (void)unlink (path);
+    free (buf);
+    return r;
+}
+
+/* Replay worker: take jobs from the current round until it runs out,
+ * then wait for the next one.
+ */
+static void *_worker (void *arg)
+{
+    export_t *x = arg;
+    http_t *h = http_create (x->host, x->port, EXPORT_TIMEOUT);
+    job_t *job;
+
+    for (;;) {
+        pthread_mutex_lock (&x->lock);
+        while (x->next == x->njob)
+            pthread_cond_wait (&x->work, &x->lock);
+        job = &x->job[x->next++];
+        pthread_mutex_unlock (&x->lock);
+
+        job->r = _replay_one (x, h, job->seq);
+
+        pthread_mutex_lock (&x->lock);
+        if (--x->pending == 0)
+            pthread_cond_signal (&x->done);
+        pthread_mutex_unlock (&x->lock);
+    }
+    return NULL;
+}
+
+static void _backoff (export_t *x, int64_t now)
+{
+    x->backoff = x->backoff ? x->backoff * 2 : BACKOFF_MIN;
+    if (x->backoff > BACKOFF_MAX)
+        x->backoff = BACKOFF_MAX;
+    x->retry = now + x->backoff * 1000LL + rand () % (x->backoff * 500 + 1);
+}
+
+/* Send up to jobs of the oldest spooled batches at once.  Any failure
+ * that is worth retrying backs off the next round; otherwise the next
+ * round follows straight on.
+ */
+static void _replay (export_t *x)
+{
+    uint64_t seq[JOBS_MAX];
+    bool ok = true;
+    int i, n;
+
+    n = _spool_list (x, seq, x->jobs);
+    pthread_mutex_lock (&x->lock);
+    for (i = 0; i < n; i++) {
+        x->job[i].seq = seq[i];
+        x->job[i].r = POST_RETRY;
+    }
+    x->njob = n;
+    x->next = 0;
+    x->pending = n;
+    pthread_cond_broadcast (&x->work);
+    while (x->pending > 0)
+        pthread_cond_wait (&x->done, &x->lock);
+    for (i = 0; i < n; i++) {
+        if (x->job[i].r != POST_RETRY)
+            x->spooled--;
+        else
+            ok = false;
+    }
+    pthread_mutex_unlock (&x->lock);
+    if (!ok)
+        _backoff (x, _now ());
+    else
+        x->backoff = 0;
+}
+
+static void _batch_add (export_t *x, const export_point_t *p, int64_t now)
+{
+    if (!x->f) {
+        if (!(x->f = open_memstream (&x->buf, &x->len)))
+            oom ();
+        if (x->fmt->header)
+            fputs (x->fmt->header, x->f);
+        x->first = now;
+        x->n = 0;
+    }
+    x->fmt->point (x->f, p, x->site);
+    x->n++;
+}
+
+/* Send the batch now if upstream is healthy and nothing is queued ahead
+ * of it, otherwise spool it.
+ */
+static void _batch_flush (export_t *x, int64_t now)
+{
+    post_t r = POST_RETRY;
+
+    if (!x->f)
+        return;
+    fclose (x->f);
+    x->f = NULL;
+    if (x->spooled == 0 && now >= x->retry) {
+        if ((r = _post (x, x->http, x->buf, x->len)) == POST_RETRY)
+            _backoff (x, now);
+    }
+    if (r == POST_RETRY)
+        _spool_write (x, x->buf, x->len);
+    free (x->buf);
+    x->buf = NULL;
+}
+
+static void *_thread (void *arg)
+{
+    export_t *x = arg;
+    struct pollfd pfd = { .fd = spsc_fd (x->q), .events = POLLIN };
+    export_point_t p;
+    int64_t now, due;
+    int tmout;
+
+    trace_thread ("export");
+    for (;;) {
+        now = _now ();
+        due = INT64_MAX;
+        if (x->f)
+            due = x->first + x->window * 1000LL;
+        if (x->spooled > 0 && x->retry < due)
+            due = x->retry;
+        tmout = due == INT64_MAX ? -1 : due > now ? due - now : 0;
+        if (poll (&pfd, 1, tmout) < 0 && errno != EINTR) {
+            perror ("poll");
+            exit (1);
+        }
+        now = _now ();
+        spsc_ack (x->q);
+        while (spsc_pop (x->q, &p)) {
+            _batch_add (x, &p, now);
+            if (x->n >= x->batch)
+                _batch_flush (x, now);
+        }
+        if (x->f && now >= x->first + x->window * 1000LL)
+            _batch_flush (x, now);
+        if (x->spooled > 0 && now >= x->retry)
+            _replay (x);
+    }
+    return NULL;
+}
+
+void export_start (export_t *x)
+{
+    int i, err;
+
+    pthread_mutex_init (&x->lock, NULL);
+    pthread_cond_init (&x->work, NULL);
+    pthread_cond_init (&x->done, NULL);
+    for (i = 0; i < x->jobs; i++) {
+        if ((err = pthread_create (&x->worker[i], NULL, _worker, x))) {
+            fprintf (stderr, "pthread_create: %s\n", strerror (err));
+            exit (1);
+        }
+    }
+    if ((err = pthread_create (&x->t, NULL, _thread, x))) {
+        fprintf (stderr, "pthread_create: %s\n", strerror (err));
+        exit (1);
+    }
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
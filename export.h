@@ -0,0 +1,43 @@
+#define EXPORT_MAXFIELD 4
+
+/* One reading for upstream.  name and keys must be static strings.
+ */
+typedef struct {
+    int64_t ts;                         /* usec since the epoch */
+    const char *name;                   /* measurement, e.g. "ted" */
+    int nfield;
+    struct {
+        const char *key;
+        double val;
+    } field[EXPORT_MAXFIELD];
+} export_point_t;
+
+typedef struct export_struct export_t;
+
+/* Parse spec, URL[,key=value]... where URL is http://host[:port]/path
+ * and keys are:
+ *   format=lp|csv   InfluxDB line protocol (default) or CSV
+ *   batch=N         send when N points are waiting (default 100)
+ *   window=SEC      or when the oldest has waited SEC (default 60)
+ *   spool=DIR       keep batches in DIR while upstream is down
+ *                   (default /var/spool/emond)
+ *   spoolmax=N      keep at most N batches, dropping the oldest
+ *                   (default 10000)
+ *   jobs=N          replay up to N batches at once (default 4)
+ * site, if not NULL, tags every point.  Exits on a bad spec.
+ */
+export_t *export_create (const char *spec, const char *site);
+
+/* Start the exporter thread.
+ */
+void export_start (export_t *x);
+
+/* Queue a point for the exporter thread.  Never blocks: if the thread
+ * has fallen behind, the oldest queued point is dropped and false is
+ * returned.  Only one thread may call this.
+ */
+bool export_point (export_t *x, const export_point_t *p);
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
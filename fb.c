@@ -0,0 +1,350 @@
+/*****************************************************************************
+ *  Copyright (C) 2014 Jim Garlick
+ *  Written by Jim Garlick <garlick.jim@gmail.com>
+ *  All Rights Reserved.
+ *
+ *  This file is part of pi-ted-envoy.
+ *  For details, see <https://github.com/garlick/pi-ted-envoy>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+/* fb.c - 1-bpp framebuffer for the 128x64 OLED with dirty rectangles */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "fb.h"
+
+/* 5x7 font for 0x20-0x7e, one byte per column, LSB is the top row.
+ */
+static const uint8_t font[][5] = {
+    {0x00,0x00,0x00,0x00,0x00}, {0x00,0x00,0x5f,0x00,0x00}, /* sp ! */
+    {0x00,0x07,0x00,0x07,0x00}, {0x14,0x7f,0x14,0x7f,0x14}, /* " # */
+    {0x24,0x2a,0x7f,0x2a,0x12}, {0x23,0x13,0x08,0x64,0x62}, /* $ % */
+    {0x36,0x49,0x56,0x20,0x50}, {0x00,0x05,0x03,0x00,0x00}, /* & ' */
+    {0x00,0x1c,0x22,0x41,0x00}, {0x00,0x41,0x22,0x1c,0x00}, /* ( ) */
+    {0x2a,0x1c,0x7f,0x1c,0x2a}, {0x08,0x08,0x3e,0x08,0x08}, /* * + */
+    {0x00,0x50,0x30,0x00,0x00}, {0x08,0x08,0x08,0x08,0x08}, /* , - */
+    {0x00,0x60,0x60,0x00,0x00}, {0x20,0x10,0x08,0x04,0x02}, /* . / */
+    {0x3e,0x51,0x49,0x45,0x3e}, {0x00,0x42,0x7f,0x40,0x00}, /* 0 1 */
+    {0x42,0x61,0x51,0x49,0x46}, {0x21,0x41,0x45,0x4b,0x31}, /* 2 3 */
+    {0x18,0x14,0x12,0x7f,0x10}, {0x27,0x45,0x45,0x45,0x39}, /* 4 5 */
+    {0x3c,0x4a,0x49,0x49,0x30}, {0x01,0x71,0x09,0x05,0x03}, /* 6 7 */
+    {0x36,0x49,0x49,0x49,0x36}, {0x06,0x49,0x49,0x29,0x1e}, /* 8 9 */
+    {0x00,0x36,0x36,0x00,0x00}, {0x00,0x56,0x36,0x00,0x00}, /* : ; */
+    {0x08,0x14,0x22,0x41,0x00}, {0x14,0x14,0x14,0x14,0x14}, /* < = */
+    {0x00,0x41,0x22,0x14,0x08}, {0x02,0x01,0x51,0x09,0x06}, /* > ? */
+    {0x32,0x49,0x79,0x41,0x3e}, {0x7e,0x11,0x11,0x11,0x7e}, /* @ A */
+    {0x7f,0x49,0x49,0x49,0x36}, {0x3e,0x41,0x41,0x41,0x22}, /* B C */
+    {0x7f,0x41,0x41,0x22,0x1c}, {0x7f,0x49,0x49,0x49,0x41}, /* D E */
+    {0x7f,0x09,0x09,0x09,0x01}, {0x3e,0x41,0x49,0x49,0x7a}, /* F G */
+    {0x7f,0x08,0x08,0x08,0x7f}, {0x00,0x41,0x7f,0x41,0x00}, /* H I */
+    {0x20,0x40,0x41,0x3f,0x01}, {0x7f,0x08,0x14,0x22,0x41}, /* J K */
+    {0x7f,0x40,0x40,0x40,0x40}, {0x7f,0x02,0x0c,0x02,0x7f}, /* L M */
+    {0x7f,0x04,0x08,0x10,0x7f}, {0x3e,0x41,0x41,0x41,0x3e}, /* N O */
+    {0x7f,0x09,0x09,0x09,0x06}, {0x3e,0x41,0x51,0x21,0x5e}, /* P Q */
+    {0x7f,0x09,0x19,0x29,0x46}, {0x46,0x49,0x49,0x49,0x31}, /* R S */
+    {0x01,0x01,0x7f,0x01,0x01}, {0x3f,0x40,0x40,0x40,0x3f}, /* T U */
+    {0x1f,0x20,0x40,0x20,0x1f}, {0x3f,0x40,0x38,0x40,0x3f}, /* V W */
+    {0x63,0x14,0x08,0x14,0x63}, {0x07,0x08,0x70,0x08,0x07}, /* X Y */
+    {0x61,0x51,0x49,0x45,0x43}, {0x00,0x7f,0x41,0x41,0x00}, /* Z [ */
+    {0x02,0x04,0x08,0x10,0x20}, {0x00,0x41,0x41,0x7f,0x00}, /* \ ] */
+    {0x04,0x02,0x01,0x02,0x04}, {0x40,0x40,0x40,0x40,0x40}, /* ^ _ */
+    {0x00,0x01,0x02,0x04,0x00}, {0x20,0x54,0x54,0x54,0x78}, /* ` a */
+    {0x7f,0x48,0x44,0x44,0x38}, {0x38,0x44,0x44,0x44,0x20}, /* b c */
+    {0x38,0x44,0x44,0x48,0x7f}, {0x38,0x54,0x54,0x54,0x18}, /* d e */
+    {0x08,0x7e,0x09,0x01,0x02}, {0x0c,0x52,0x52,0x52,0x3e}, /* f g */
+    {0x7f,0x08,0x04,0x04,0x78}, {0x00,0x44,0x7d,0x40,0x00}, /* h i */
+    {0x20,0x40,0x44,0x3d,0x00}, {0x7f,0x10,0x28,0x44,0x00}, /* j k */
+    {0x00,0x41,0x7f,0x40,0x00}, {0x7c,0x04,0x18,0x04,0x78}, /* l m */
+    {0x7c,0x08,0x04,0x04,0x78}, {0x38,0x44,0x44,0x44,0x38}, /* n o */
+    {0x7c,0x14,0x14,0x14,0x08}, {0x08,0x14,0x14,0x18,0x7c}, /* p q */
+    {0x7c,0x08,0x04,0x04,0x08}, {0x48,0x54,0x54,0x54,0x20}, /* r s */
+    {0x04,0x3f,0x44,0x40,0x20}, {0x3c,0x40,0x40,0x20,0x7c}, /* t u */
+    {0x1c,0x20,0x40,0x20,0x1c}, {0x3c,0x40,0x30,0x40,0x3c}, /* v w */
+    {0x44,0x28,0x10,0x28,0x44}, {0x0c,0x50,0x50,0x50,0x3c}, /* x y */
+    {0x44,0x64,0x54,0x4c,0x44}, {0x00,0x08,0x36,0x41,0x00}, /* z { */
+    {0x00,0x00,0x7f,0x00,0x00}, {0x00,0x41,0x36,0x08,0x00}, /* | } */
+    {0x08,0x04,0x08,0x10,0x08},                             /* ~ */
+};
+
+static bool _clip (fb_rect_t *r)
+{
+    if (r->x < 0) {
+        r->w += r->x;
+        r->x = 0;
+    }
+    if (r->y < 0) {
+        r->h += r->y;
+        r->y = 0;
+    }
+    if (r->x + r->w > FB_WIDTH)
+        r->w = FB_WIDTH - r->x;
+    if (r->y + r->h > FB_HEIGHT)
+        r->h = FB_HEIGHT - r->y;
+    return (r->w > 0 && r->h > 0);
+}
+
+static void _union (fb_rect_t *a, const fb_rect_t *b)
+{
+    int x1 = a->x + a->w > b->x + b->w ? a->x + a->w : b->x + b->w;
+    int y1 = a->y + a->h > b->y + b->h ? a->y + a->h : b->y + b->h;
+
+    a->x = a->x < b->x ? a->x : b->x;
+    a->y = a->y < b->y ? a->y : b->y;
+    a->w = x1 - a->x;
+    a->h = y1 - a->y;
+}
+
+static bool _overlap (const fb_rect_t *a, const fb_rect_t *b)
+{
+    return (a->x <= b->x + b->w && b->x <= a->x + a->w
+         && a->y <= b->y + b->h && b->y <= a->y + a->h);
+}
+
+/* Add r to the dirty list, merging with any rectangle it touches.
+ * When the list is full, merge with the first entry; the shrink in
+ * fb_dirty_next() keeps the cost of an over-large union small.
+ */
+static void _dirty (fb_t *fb, int x, int y, int w, int h)
+{
+    fb_rect_t r = { .x = x, .y = y, .w = w, .h = h };
+    int i;
+
+    if (!_clip (&r))
+        return;
+    for (i = 0; i < fb->ndirty; i++) {
+        if (_overlap (&fb->dirty[i], &r)) {
+            _union (&fb->dirty[i], &r);
+            return;
+        }
+    }
+    if (fb->ndirty == FB_MAXDIRTY)
+        _union (&fb->dirty[0], &r);
+    else
+        fb->dirty[fb->ndirty++] = r;
+}
+
+static inline void _set (fb_t *fb, int x, int y, bool on)
+{
+    uint8_t mask = 0x80 >> (x & 7);
+
+    if (on)
+        fb->pix[y][x >> 3] |= mask;
+    else
+        fb->pix[y][x >> 3] &= ~mask;
+}
+
+static inline bool _get (uint8_t a[FB_HEIGHT][FB_STRIDE], int x, int y)
+{
+    return (a[y][x >> 3] & (0x80 >> (x & 7))) != 0;
+}
+
+void fb_init (fb_t *fb)
+{
+    memset (fb, 0, sizeof (*fb));
+}
+
+void fb_invalidate (fb_t *fb)
+{
+    memset (fb->shadow, 0, sizeof (fb->shadow));
+    fb->ndirty = 0;
+    _dirty (fb, 0, 0, FB_WIDTH, FB_HEIGHT);
+}
+
+void fb_clear (fb_t *fb)
+{
+    memset (fb->pix, 0, sizeof (fb->pix));
+    _dirty (fb, 0, 0, FB_WIDTH, FB_HEIGHT);
+}
+
+void fb_pixel (fb_t *fb, int x, int y, bool on)
+{
+    if (x < 0 || x >= FB_WIDTH || y < 0 || y >= FB_HEIGHT)
+        return;
+    _set (fb, x, y, on);
+    _dirty (fb, x, y, 1, 1);
+}
+
+void fb_fill_rect (fb_t *fb, int x, int y, int w, int h, bool on)
+{
+    fb_rect_t r = { .x = x, .y = y, .w = w, .h = h };
+    int i, j;
+
+    if (!_clip (&r))
+        return;
+    for (j = r.y; j < r.y + r.h; j++)
+        for (i = r.x; i < r.x + r.w; i++)
+            _set (fb, i, j, on);
+    _dirty (fb, r.x, r.y, r.w, r.h);
+}
+
+/* Bresenham */
+void fb_line (fb_t *fb, int x0, int y0, int x1, int y1, bool on)
+{
+    int dx = abs (x1 - x0), sx = x0 < x1 ? 1 : -1;
+    int dy = -abs (y1 - y0), sy = y0 < y1 ? 1 : -1;
+    int err = dx + dy, e2;
+    int bx = x0 < x1 ? x0 : x1;
+    int by = y0 < y1 ? y0 : y1;
+
+    for (;;) {
+        if (x0 >= 0 && x0 < FB_WIDTH && y0 >= 0 && y0 < FB_HEIGHT)
+            _set (fb, x0, y0, on);
+        if (x0 == x1 && y0 == y1)
+            break;
+        e2 = 2 * err;
+        if (e2 >= dy) {
+            err += dy;
+            x0 += sx;
+        }
+        if (e2 <= dx) {
+            err += dx;
+            y0 += sy;
+        }
+    }
+    _dirty (fb, bx, by, dx + 1, -dy + 1);
+}
+
+static void _putc (fb_t *fb, int x, int y, char c)
+{
+    const uint8_t *g;
+    int i, j;
+
+    if (c < 0x20 || c > 0x7e)
+        c = '?';
+    g = font[c - 0x20];
+    for (i = 0; i < FB_FONT_W; i++) {
+        for (j = 0; j < FB_FONT_H; j++) {
+            int px = x + i, py = y + j;
+            if (px < 0 || px >= FB_WIDTH || py < 0 || py >= FB_HEIGHT)
+                continue;
+            _set (fb, px, py, i < 5 && (g[i] & (1 << j)));
+        }
+    }
+}
+
+void fb_puts (fb_t *fb, int x, int y, const char *s)
+{
+    int n = 0;
+
+    for (; *s != '\0'; s++, n++)
+        _putc (fb, x + n * FB_FONT_W, y, *s);
+    _dirty (fb, x, y, n * FB_FONT_W, FB_FONT_H);
+}
+
+void fb_printf (fb_t *fb, int col, int row, const char *fmt, ...)
+{
+    char s[FB_WIDTH / FB_FONT_W + 1];
+    int x = col * FB_FONT_W, y = row * FB_FONT_H;
+    va_list ap;
+
+    va_start (ap, fmt);
+    vsnprintf (s, sizeof (s), fmt, ap);
+    va_end (ap);
+    fb_fill_rect (fb, x, y, FB_WIDTH - x, FB_FONT_H, false);
+    fb_puts (fb, x, y, s);
+}
+
+void fb_sparkline (fb_t *fb, int x, int y, int w, int h,
+                   const int *val, int n, int lo, int hi, bool dotted)
+{
+    int i, px, py, lastx = -1, lasty = -1;
+    int range = hi > lo ? hi - lo : 1;
+
+    if (n > w)
+        n = w;
+    for (i = 0; i < n; i++) {
+        int v = val[i];
+        if (v < lo)
+            v = lo;
+        if (v > hi)
+            v = hi;
+        px = x + w - n + i;
+        py = y + h - 1 - (int)((long)(v - lo) * (h - 1) / range);
+        if (dotted) {
+            if (i % 2 == 0)
+                _set (fb, px, py, true);
+        } else if (lastx >= 0)
+            fb_line (fb, lastx, lasty, px, py, true);
+        else
+            _set (fb, px, py, true);
+        lastx = px;
+        lasty = py;
+    }
+    _dirty (fb, x, y, w, h);
+}
+
+bool fb_dirty_next (fb_t *fb, fb_rect_t *r)
+{
+    fb_rect_t d;
+    int x, y, x0, y0, x1, y1;
+
+    while (fb->ndirty > 0) {
+        d = fb->dirty[--fb->ndirty];
+        x0 = FB_WIDTH; y0 = FB_HEIGHT; x1 = -1; y1 = -1;
+        for (y = d.y; y < d.y + d.h; y++) {
+            for (x = d.x; x < d.x + d.w; x++) {
+                if (_get (fb->pix, x, y) != _get (fb->shadow, x, y)) {
+                    if (x < x0) x0 = x;
+                    if (x > x1) x1 = x;
+                    if (y < y0) y0 = y;
+                    if (y > y1) y1 = y;
+                }
+            }
+        }
+        if (x1 < 0)
+            continue; /* nothing really changed */
+        r->x = x0;
+        r->y = y0;
+        r->w = x1 - x0 + 1;
+        r->h = y1 - y0 + 1;
+        for (y = y0; y <= y1; y++) {
+            for (x = x0; x <= x1; x++) {
+                uint8_t mask = 0x80 >> (x & 7);
+                fb->shadow[y][x >> 3] = (fb->shadow[y][x >> 3] & ~mask)
+                                      | (fb->pix[y][x >> 3] & mask);
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+int fb_pack (fb_t *fb, fb_rect_t *r, uint8_t *buf, int len)
+{
+    int rowbytes = (r->w + 7) / 8;
+    int x, y, n = 0;
+
+    if (rowbytes * r->h > len)
+        return -1;
+    memset (buf, 0, rowbytes * r->h);
+    for (y = r->y; y < r->y + r->h; y++) {
+        for (x = 0; x < r->w; x++) {
+            if (_get (fb->pix, r->x + x, y))
+                buf[n + x / 8] |= 0x80 >> (x % 8);
+        }
+        n += rowbytes;
+    }
+    return n;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
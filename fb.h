@@ -0,0 +1,61 @@
+#define FB_WIDTH        128
+#define FB_HEIGHT       64
+#define FB_STRIDE       (FB_WIDTH/8)
+
+#define FB_FONT_W       6   /* 5x7 glyph plus one column of spacing */
+#define FB_FONT_H       8   /* 7 rows plus one row of spacing */
+
+#define FB_MAXDIRTY     8
+
+typedef struct {
+    int x, y, w, h;
+} fb_rect_t;
+
+/* 1-bpp framebuffer, rows of FB_STRIDE bytes, MSB is the leftmost pixel.
+ * 'shadow' holds what was last uploaded to the panel so that a flush
+ * can shrink each dirty rectangle down to the pixels that really changed.
+ */
+typedef struct {
+    uint8_t pix[FB_HEIGHT][FB_STRIDE];
+    uint8_t shadow[FB_HEIGHT][FB_STRIDE];
+    fb_rect_t dirty[FB_MAXDIRTY];
+    int ndirty;
+} fb_t;
+
+void fb_init (fb_t *fb);
+void fb_clear (fb_t *fb);
+
+void fb_pixel (fb_t *fb, int x, int y, bool on);
+void fb_fill_rect (fb_t *fb, int x, int y, int w, int h, bool on);
+void fb_line (fb_t *fb, int x0, int y0, int x1, int y1, bool on);
+
+/* Draw text in the built-in 5x7 font with top left corner at pixel x,y.
+ */
+void fb_puts (fb_t *fb, int x, int y, const char *s);
+
+/* Draw text on character cell col,row (21 columns by 8 rows).
+ * The rest of the row is cleared.
+ */
+void fb_printf (fb_t *fb, int col, int row, const char *fmt, ...);
+
+/* Plot n values as a line (or dots) in the box x,y,w,h, scaled so that
+ * lo is the bottom row and hi is the top row.  The newest value is drawn
+ * at the right edge.
+ */
+void fb_sparkline (fb_t *fb, int x, int y, int w, int h,
+                   const int *val, int n, int lo, int hi, bool dotted);
+
+/* Mark the whole panel dirty, e.g. after the panel was cleared.
+ */
+void fb_invalidate (fb_t *fb);
+
+/* Pop a dirty rectangle, shrunk to the bounding box of pixels that differ
+ * from the shadow copy, and update the shadow.  Returns false when there
+ * is nothing left to upload.
+ */
+bool fb_dirty_next (fb_t *fb, fb_rect_t *r);
+
+/* Pack rectangle r into buf, rows padded to a byte, MSB first.
+ * Returns number of bytes used.
+ */
+int fb_pack (fb_t *fb, fb_rect_t *r, uint8_t *buf, int len);
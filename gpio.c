@@ -30,6 +30,9 @@
 #include <fcntl.h>
 #include <poll.h>
 #include <string.h>
+#include <sys/vfs.h>
+#include <sys/inotify.h>
+#include <linux/magic.h>
 #include <linux/input.h> /* for KEY_ definitions only */
 
 #include "gpio.h"
@@ -39,7 +42,29 @@
 #endif
 #define INTBUFLEN   16
 
-#define DEBOUNCE_MS 5
+
+#define GPIO_ROOT   "/sys/class/gpio"
+
+static const char *gpio_root = GPIO_ROOT;
+static int sysfs = -1;          /* root is on sysfs (-1 = not yet known) */
+
+void gpio_root_set (const char *dir)
+{
+    gpio_root = dir ? dir : GPIO_ROOT;
+    sysfs = -1;
+}
+
+/* A tree of plain files (e.g. from emonsim) has pins pre-created,
+ * and no edge interrupts, so changes are watched with inotify.
+ */
+static int _sysfs (void)
+{
+    struct statfs sb;
+
+    if (sysfs == -1)
+        sysfs = (statfs (gpio_root, &sb) == 0 && sb.f_type == SYSFS_MAGIC);
+    return sysfs;
+}
 
 static void _export (int pin)
 {
@@ -48,10 +73,12 @@ static void _export (int pin)
     char msg[INTBUFLEN];
     FILE *fp;
 
-    snprintf (path, sizeof (path), "/sys/class/gpio/gpio%d", pin);
+    if (!_sysfs ())
+        return;
+    snprintf (path, sizeof (path), "%s/gpio%d", gpio_root, pin);
     if (stat (path, &sb) == 0)
         return;
-    snprintf (path, sizeof (path), "/sys/class/gpio/export");
+    snprintf (path, sizeof (path), "%s/export", gpio_root);
     fp = fopen (path, "w");
     if (!fp) {
         perror (path);
@@ -75,10 +102,12 @@ static void _unexport (int pin)
     char msg[INTBUFLEN];
     FILE *fp;
 
-    snprintf (path, sizeof (path), "/sys/class/gpio/gpio%d", pin);
+    if (!_sysfs ())
+        return;
+    snprintf (path, sizeof (path), "%s/gpio%d", gpio_root, pin);
     if (stat (path, &sb) < 0)
         return;
-    snprintf (path, sizeof (path), "/sys/class/gpio/unexport");
+    snprintf (path, sizeof (path), "%s/unexport", gpio_root);
     fp = fopen (path, "w");
     if (!fp) {
         perror (path);
@@ -100,7 +129,8 @@ static void _direction (int pin, const char *direction)
     char path[PATH_MAX];
     FILE *fp;
 
-    snprintf (path, sizeof (path), "/sys/class/gpio/gpio%d/direction", pin);
+    snprintf (path, sizeof (path), "%s/gpio%d/direction", gpio_root,
+              pin);
     fp = fopen (path, "w");
     if (!fp) {
         perror (path);
@@ -121,7 +151,8 @@ static void _edge (int pin, char *edge)
     char path[PATH_MAX];
     FILE *fp;
 
-    snprintf (path, sizeof (path), "/sys/class/gpio/gpio%d/edge", pin);
+    snprintf (path, sizeof (path), "%s/gpio%d/edge", gpio_root,
+              pin);
     fp = fopen (path, "w");
     if (!fp) {
         perror (path);
@@ -157,7 +188,8 @@ static int _open_value (int pin, int flags)
     char path[PATH_MAX];
     int fd;
 
-    snprintf (path, sizeof (path), "/sys/class/gpio/gpio%d/value", pin);
+    snprintf (path, sizeof (path), "%s/gpio%d/value", gpio_root,
+              pin);
     fd = open (path, flags);
     if (fd < 0) {
         perror (path);
@@ -194,36 +226,101 @@ void gpio_pin_pulse (int pin, int msec, int active_value)
     _unexport (pin);
 }
 
-void gpio_keypress (int pin, int active_value)
+/* Watch the value file of a simulated pin for writes.
+ */
+static int _watch_value (int pin)
 {
-    struct pollfd pfd[1];
-    int val, fd;
+    char path[PATH_MAX];
+    int ifd;
 
-    memset (pfd, 0, sizeof (pfd));
+    snprintf (path, sizeof (path), "%s/gpio%d/value", gpio_root, pin);
+    if ((ifd = inotify_init1 (IN_CLOEXEC | IN_NONBLOCK)) < 0) {
+        perror ("inotify_init1");
+        exit (1);
+    }
+    if (inotify_add_watch (ifd, path, IN_MODIFY | IN_CLOSE_WRITE) < 0) {
+        perror (path);
+        exit (1);
+    }
+    return ifd;
+}
 
+void gpio_watch_init (gpio_watch_t *w, int pin)
+{
+    w->pin = pin;
     _export (pin);
     _direction (pin, "in");
     _edge (pin, "both");
-    fd = _open_value (pin, O_RDONLY);
-    val = _read_value (fd);
+    w->fd = _open_value (pin, O_RDONLY);
+    w->ifd = _sysfs () ? -1 : _watch_value (pin);
+}
+
+int gpio_watch_fd (gpio_watch_t *w, short *events)
+{
+    if (w->ifd >= 0) {
+        *events = POLLIN;
+        return w->ifd;
+    }
+    *events = POLLPRI;
+    return w->fd;
+}
+
+/* A sysfs edge stays signalled until the value is read, and inotify
+ * events until they are read, so either must be consumed before the
+ * fd is polled again.
+ */
+void gpio_watch_ack (gpio_watch_t *w)
+{
+    char buf[sizeof (struct inotify_event) + PATH_MAX];
+
+    if (w->ifd < 0) {
+        (void)_read_value (w->fd);
+        return;
+    }
+    while (read (w->ifd, buf, sizeof (buf)) > 0)
+        ;
+}
+
+int gpio_watch_value (gpio_watch_t *w)
+{
+    return _read_value (w->fd);
+}
+
+void gpio_watch_fini (gpio_watch_t *w)
+{
+    if (w->ifd >= 0)
+        close (w->ifd);
+    close (w->fd);
+    _unexport (w->pin);
+}
+
+void gpio_keypress (int pin, int active_value)
+{
+    struct pollfd pfd[1];
+    gpio_watch_t w;
+    int val;
+
+    memset (pfd, 0, sizeof (pfd));
+
+    gpio_watch_init (&w, pin);
+    val = gpio_watch_value (&w);
 
     do {
-        pfd[0].fd = fd;
+        pfd[0].fd = gpio_watch_fd (&w, &pfd[0].events);
         pfd[0].revents = 0;
-        pfd[0].events = POLLPRI;
 
         if (poll (pfd, 1, -1) < 0) {
             perror ("poll");
             exit (1);
         }
+        gpio_watch_ack (&w);
 
-        usleep (1000 * DEBOUNCE_MS);
-        val = _read_value (fd); 
+        usleep (1000 * GPIO_DEBOUNCE_MS);
+        val = gpio_watch_value (&w);
     } while (val != active_value);
 
-    close (fd);
-    _unexport (pin);
-}        
+    gpio_watch_fini (&w);
+}
 
 /*
  * vi:tabstop=4 shiftwidth=4 expandtab
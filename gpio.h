@@ -1,2 +1,26 @@
 void gpio_pin_pulse (int pin, int msec, int active_value);
 void gpio_keypress (int pin, int active_value);
+
+#define GPIO_DEBOUNCE_MS 5
+
+/* Non-blocking key watching, for callers with their own poll loop:
+ * poll the fd returned by gpio_watch_fd() for the returned events, call
+ * gpio_watch_ack(), then read the value after GPIO_DEBOUNCE_MS.
+ */
+typedef struct {
+    int pin;
+    int fd;                     /* value file */
+    int ifd;                    /* inotify fd when not on sysfs, else -1 */
+} gpio_watch_t;
+
+void gpio_watch_init (gpio_watch_t *w, int pin);
+int gpio_watch_fd (gpio_watch_t *w, short *events);
+void gpio_watch_ack (gpio_watch_t *w);
+int gpio_watch_value (gpio_watch_t *w);
+void gpio_watch_fini (gpio_watch_t *w);
+
+/* Use dir instead of /sys/class/gpio (NULL restores the default).
+ * If dir is not on sysfs, pins are expected to exist already and
+ * value changes are detected with inotify.
+ */
+void gpio_root_set (const char *dir);
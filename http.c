@@ -0,0 +1,341 @@
+/*****************************************************************************
+ *  Copyright (C) 2014 Jim Garlick
+ *  Written by Jim Garlick <garlick.jim@gmail.com>
+ *  All Rights Reserved.
+ *
+ *  This file is part of pi-ted-envoy.
+ *  For details, see <https://github.com/garlick/pi-ted-envoy>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+/* http.c - minimal HTTP/1.1 client with persistent connections */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "util.h"
+#include "http.h"
+
+#define HTTP_BUFSIZE    4096
+
+struct http_struct {
+    char *host;
+    int port;
+    int timeout;
+    int fd;
+    bool reused;                /* current fd has served a request */
+    bool started;               /* status line of response was received */
+    char buf[HTTP_BUFSIZE];     /* receive buffer */
+    int pos;                    /* start of unconsumed data in buf */
+    int len;                    /* end of valid data in buf */
+};
+
+http_t *http_create (const char *host, int port, int timeout_sec)
+{
+    http_t *h = xzmalloc (sizeof (*h));
+
+    h->host = xstrdup (host);
+    h->port = port;
+    h->timeout = timeout_sec;
+    h->fd = -1;
+    return h;
+}
+
+static void _disconnect (http_t *h)
+{
+    if (h->fd >= 0) {
+        close (h->fd);
+        h->fd = -1;
+    }
+    h->pos = h->len = 0;
+    h->reused = false;
+}
+
+void http_destroy (http_t *h)
+{
+    _disconnect (h);
+    free (h->host);
+    free (h);
+}
+
+static int _connect (http_t *h)
+{
+    struct addrinfo hints, *res, *r;
+    struct timeval tv = { .tv_sec = h->timeout, .tv_usec = 0 };
+    char port[16];
+    int fd = -1, one = 1, e;
+
+    memset (&hints, 0, sizeof (hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf (port, sizeof (port), "%d", h->port);
+    if ((e = getaddrinfo (h->host, port, &hints, &res)) != 0) {
+        errno = e == EAI_SYSTEM ? errno : EHOSTUNREACH;
+        return -1;
+    }
+    for (r = res; r != NULL; r = r->ai_next) {
+        if ((fd = socket (r->ai_family, r->ai_socktype, r->ai_protocol)) < 0)
+            continue;
+        (void)setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+        (void)setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+        (void)setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+        if (connect (fd, r->ai_addr, r->ai_addrlen) == 0)
+            break;
+        e = errno;
+        close (fd);
+        fd = -1;
+        errno = e;
+    }
+    freeaddrinfo (res);
+    if (fd < 0)
+        return -1;
+    h->fd = fd;
+    h->pos = h->len = 0;
+    h->reused = false;
+    return 0;
+}
+
+static int _send (http_t *h, const char *buf, int len)
+{
+    int n, done = 0;
+
+    while (done < len) {
+        n = send (h->fd, buf + done, len - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+/* Read more data into buf, compacting first if needed.
+ * Returns bytes read, 0 on EOF, -1 on error.
+ */
+static int _fill (http_t *h)
+{
+    int n;
+
+    if (h->pos > 0) {
+        memmove (h->buf, h->buf + h->pos, h->len - h->pos);
+        h->len -= h->pos;
+        h->pos = 0;
+    }
+    if (h->len == sizeof (h->buf)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    do {
+        n = recv (h->fd, h->buf + h->len, sizeof (h->buf) - h->len, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0)
+        h->len += n;
+    return n;
+}
+
+/* Return next CRLF terminated line (terminator replaced with NUL).
+ */
+static char *_getline (http_t *h)
+{
+    char *p, *line;
+    int n;
+
+    for (;;) {
+        p = memmem (h->buf + h->pos, h->len - h->pos, "\r\n", 2);
+        if (p) {
+            *p = '\0';
+            line = h->buf + h->pos;
+            h->pos = p + 2 - h->buf;
+            return line;
+        }
+        if ((n = _fill (h)) <= 0) {
+            if (n == 0)
+                errno = ECONNRESET;
+            return NULL;
+        }
+    }
+}
+
+/* Pass 'count' body bytes to cb (count < 0 means until EOF).
+ */
+static int _body (http_t *h, long count, http_body_f cb, void *arg)
+{
+    int n;
+
+    while (count != 0) {
+        if (h->pos == h->len) {
+            if ((n = _fill (h)) < 0)
+                return -1;
+            if (n == 0) {
+                if (count < 0)
+                    return 0;
+                errno = ECONNRESET;
+                return -1;
+            }
+        }
+        n = h->len - h->pos;
+        if (count > 0 && n > count)
+            n = count;
+        if (cb && cb (h->buf + h->pos, n, arg) < 0) {
+            errno = ECANCELED;
+            return -1;
+        }
+        h->pos += n;
+        if (count > 0)
+            count -= n;
+    }
+    return 0;
+}
+
+static int _chunked (http_t *h, http_body_f cb, void *arg)
+{
+    char *line;
+    long size;
+
+    for (;;) {
+        if (!(line = _getline (h)))
+            return -1;
+        size = strtol (line, NULL, 16);
+        if (size < 0) {
+            errno = EPROTO;
+            return -1;
+        }
+        if (size == 0)
+            break;
+        if (_body (h, size, cb, arg) < 0)
+            return -1;
+        if (!(line = _getline (h)))     /* CRLF after chunk */
+            return -1;
+    }
+    do {                                /* trailers */
+        if (!(line = _getline (h)))
+            return -1;
+    } while (*line != '\0');
+    return 0;
+}
+
+static int _response (http_t *h, http_body_f cb, void *arg)
+{
+    char *line, *p;
+    int status, minor;
+    long clen = -1;
+    bool chunked = false, keepalive = true;
+
+    if (!(line = _getline (h)))
+        return -1;
+    if (sscanf (line, "HTTP/1.%d %d", &minor, &status) != 2) {
+        errno = EPROTO;
+        return -1;
+    }
+    h->started = true;
+    if (minor == 0)
+        keepalive = false;
+    while ((line = _getline (h)) && *line != '\0') {
+        if (!(p = strchr (line, ':')))
+            continue;
+        *p++ = '\0';
+        p += strspn (p, " \t");
+        if (!strcasecmp (line, "Content-Length"))
+            clen = strtol (p, NULL, 10);
+        else if (!strcasecmp (line, "Transfer-Encoding"))
+            chunked = (strcasestr (p, "chunked") != NULL);
+        else if (!strcasecmp (line, "Connection"))
+            keepalive = (strcasestr (p, "close") == NULL);
+    }
+    if (!line)
+        return -1;
+    if (chunked) {
+        if (_chunked (h, cb, arg) < 0)
+            return -1;
+    } else if (clen >= 0) {
+        if (_body (h, clen, cb, arg) < 0)
+            return -1;
+    } else {
+        if (_body (h, -1, cb, arg) < 0)
+            return -1;
+        keepalive = false;
+    }
+    if (!keepalive)
+        _disconnect (h);
+    else
+        h->reused = true;
+    return status;
+}
+
+static int _request (http_t *h, const char *method, const char *path,
+                     const char *type, const char *body, int len,
+                     http_body_f cb, void *arg)
+{
+    char req[512];
+    int n, status, tries = 0;
+    bool reused;
+
+again:
+    if (h->fd < 0 && _connect (h) < 0)
+        return -1;
+    reused = h->reused;
+    h->started = false;
+    if (body)
+        n = snprintf (req, sizeof (req), "%s %s HTTP/1.1\r\nHost: %s\r\n"
+                      "Content-Type: %s\r\nContent-Length: %d\r\n\r\n",
+                      method, path, h->host, type, len);
+    else
+        n = snprintf (req, sizeof (req), "%s %s HTTP/1.1\r\nHost: %s\r\n\r\n",
+                      method, path, h->host);
+    if (n >= sizeof (req)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (_send (h, req, n) < 0 || (body && _send (h, body, len) < 0)
+                              || (status = _response (h, cb, arg)) < 0) {
+        int saved = errno;
+        _disconnect (h);
+        /* A kept-alive connection may have been closed by the server
+         * while idle.  Retry once on a fresh connection.
+         */
+        if (reused && !h->started && tries++ == 0)
+            goto again;
+        errno = saved;
+        return -1;
+    }
+    return status;
+}
+
+int http_get (http_t *h, const char *path, http_body_f cb, void *arg)
+{
+    return _request (h, "GET", path, NULL, NULL, 0, cb, arg);
+}
+
+int http_post (http_t *h, const char *path, const char *type,
+               const char *body, int len, http_body_f cb, void *arg)
+{
+    return _request (h, "POST", path, type, body, len, cb, arg);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
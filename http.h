@@ -0,0 +1,25 @@
+typedef struct http_struct http_t;
+
+/* Called with each piece of the response body as it arrives.
+ * Return -1 to abort the transfer.
+ */
+typedef int (*http_body_f) (const char *buf, int len, void *arg);
+
+/* Create a client for host:port.  Nothing is connected until the first
+ * request; the connection is then kept alive and reused until the server
+ * closes it or an error occurs.
+ */
+http_t *http_create (const char *host, int port, int timeout_sec);
+void http_destroy (http_t *h);
+
+/* Issue a GET and stream the response body to cb.
+ * Returns the HTTP status code, or -1 with errno set.
+ */
+int http_get (http_t *h, const char *path, http_body_f cb, void *arg);
+
+/* Issue a POST of len bytes of body, of content type type, and stream
+ * the response body to cb (which may be NULL).
+ * Returns the HTTP status code, or -1 with errno set.
+ */
+int http_post (http_t *h, const char *path, const char *type,
+               const char *body, int len, http_body_f cb, void *arg);
@@ -0,0 +1,489 @@
+/*****************************************************************************
+ *  Copyright (C) 2014 Jim Garlick
+ *  Written by Jim Garlick <garlick.jim@gmail.com>
+ *  All Rights Reserved.
+ *
+ *  This file is part of pi-ted-envoy.
+ *  For details, see <https://github.com/garlick/pi-ted-envoy>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+/* httpd.c - non-blocking HTTP/1.1 server for the dashboard API */
+
+/* All sockets are non-blocking and registered with one epoll fd, which
+ * the caller polls alongside its own.  A connection buffers what the
+ * socket would not take and waits for EPOLLOUT, so one slow phone never
+ * stalls the loop; a stream client that falls too far behind is dropped.
+ * Responses are cached whole (status line, headers and body) per route,
+ * keyed by query string, and only rendered again after the route is
+ * invalidated.
+ */
+
+#define _GNU_SOURCE /* for accept4 */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+
+#include "util.h"
+#include "httpd.h"
+
+#define HTTPD_MAXCONN   32
+#define HTTPD_MAXROUTE  8
+#define HTTPD_REQMAX    4096            /* request line and headers */
+#define HTTPD_OUTMAX    (256*1024)      /* drop clients this far behind */
+
+typedef struct {
+    int fd;
+    bool stream;                        /* SSE client */
+    bool close;                         /* close once output is flushed */
+    bool want_out;                      /* registered for EPOLLOUT */
+    char in[HTTPD_REQMAX];
+    int inlen;
+    char *out;                          /* output the socket didn't take */
+    int outlen;
+    int outsize;
+} conn_t;
+
+typedef struct {
+    char *path;
+    httpd_render_f render;
+    void *arg;
+    bool stream;
+    bool valid;                         /* cached response is current */
+    char *query;                        /* query the cache was built for */
+    char *resp;                         /* cached response */
+    int resplen;
+    int hdrlen;                         /* resp without body, for HEAD */
+    char etag[16];
+} route_t;
+
+struct httpd_struct {
+    int lfd;
+    int efd;
+    conn_t *conn[HTTPD_MAXCONN];
+    route_t route[HTTPD_MAXROUTE];
+    int nroute;
+};
+
+httpd_t *httpd_create (int port)
+{
+    httpd_t *h = xzmalloc (sizeof (*h));
+    struct sockaddr_in sin = { .sin_family = AF_INET,
+                               .sin_port = htons (port),
+                               .sin_addr.s_addr = htonl (INADDR_ANY) };
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    int one = 1;
+
+    h->lfd = socket (AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (h->lfd < 0
+            || setsockopt (h->lfd, SOL_SOCKET, SO_REUSEADDR, &one,
+                           sizeof (one)) < 0
+            || bind (h->lfd, (struct sockaddr *)&sin, sizeof (sin)) < 0
+            || listen (h->lfd, 16) < 0) {
+        fprintf (stderr, "httpd: port %d: %s\n", port, strerror (errno));
+        exit (1);
+    }
+    if ((h->efd = epoll_create1 (EPOLL_CLOEXEC)) < 0
+            || epoll_ctl (h->efd, EPOLL_CTL_ADD, h->lfd, &ev) < 0) {
+        perror ("epoll");
+        exit (1);
+    }
+    return h;
+}
+
+static void _close (httpd_t *h, conn_t *c)
+{
+    int i;
+
+    for (i = 0; i < HTTPD_MAXCONN; i++)
+        if (h->conn[i] == c)
+            h->conn[i] = NULL;
+    close (c->fd); /* also drops it from the epoll set */
+    free (c->out);
+    free (c);
+}
+
+void httpd_destroy (httpd_t *h)
+{
+    int i;
+
+    for (i = 0; i < HTTPD_MAXCONN; i++)
+        if (h->conn[i])
+            _close (h, h->conn[i]);
+    for (i = 0; i < h->nroute; i++) {
+        free (h->route[i].path);
+        free (h->route[i].query);
+        free (h->route[i].resp);
+    }
+    close (h->efd);
+    close (h->lfd);
+    free (h);
+}
+
+int httpd_fd (httpd_t *h)
+{
+    return h->efd;
+}
+
+static void _add_route (httpd_t *h, const char *path, httpd_render_f render,
+                        void *arg, bool stream)
+{
+    route_t *r;
+
+    if (h->nroute == HTTPD_MAXROUTE) {
+        fprintf (stderr, "httpd: too many routes (max %d)\n", HTTPD_MAXROUTE);
+        exit (1);
+    }
+    r = &h->route[h->nroute++];
+    r->path = xstrdup (path);
+    r->render = render;
+    r->arg = arg;
+    r->stream = stream;
+}
+
+void httpd_route (httpd_t *h, const char *path, httpd_render_f render,
+                  void *arg)
+{
+    _add_route (h, path, render, arg, false);
+}
+
+void httpd_stream (httpd_t *h, const char *path, httpd_render_f render,
+                   void *arg)
+{
+    _add_route (h, path, render, arg, true);
+}
+
+static route_t *_find_route (httpd_t *h, const char *path)
+{
+    int i;
+
+    for (i = 0; i < h->nroute; i++)
+        if (!strcmp (h->route[i].path, path))
+            return &h->route[i];
+    return NULL;
+}
+
+static void _want_out (httpd_t *h, conn_t *c, bool out)
+{
+    struct epoll_event ev = { .events = EPOLLIN | (out ? EPOLLOUT : 0),
+                              .data.ptr = c };
+
+    if (c->want_out != out) {
+        (void)epoll_ctl (h->efd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->want_out = out;
+    }
+}
+
+/* Write what the socket will take now, keeping the rest for EPOLLOUT.
+ * Returns false if the connection was closed.
+ */
+static bool _flush (httpd_t *h, conn_t *c)
+{
+    int n;
+
+    while (c->outlen > 0) {
+        if ((n = write (c->fd, c->out, c->outlen)) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == EINTR)
+                continue;
+            _close (h, c);
+            return false;
+        }
+        memmove (c->out, c->out + n, c->outlen - n);
+        c->outlen -= n;
+    }
+    if (c->outlen == 0 && c->close) {
+        _close (h, c);
+        return false;
+    }
+    _want_out (h, c, c->outlen > 0);
+    return true;
+}
+
+static bool _send (httpd_t *h, conn_t *c, const char *buf, int len)
+{
+    if (c->outlen + len > HTTPD_OUTMAX) {
+        _close (h, c);
+        return false;
+    }
+    if (c->outlen + len > c->outsize) {
+        c->outsize = c->outlen + len > 4096 ? c->outlen + len : 4096;
+        if (!(c->out = realloc (c->out, c->outsize)))
+            oom ();
+    }
+    memcpy (c->out + c->outlen, buf, len);
+    c->outlen += len;
+    return _flush (h, c);
+}
+
+static bool _send_status (httpd_t *h, conn_t *c, int code, const char *msg,
+                          const char *etag)
+{
+    char buf[256];
+    int len;
+
+    len = snprintf (buf, sizeof (buf), "HTTP/1.1 %d %s\r\n"
+                    "%s%s%s"
+                    "Content-Length: 0\r\n"
+                    "%s\r\n", code, msg,
+                    etag ? "ETag: " : "", etag ? etag : "", etag ? "\r\n" : "",
+                    c->close ? "Connection: close\r\n" : "");
+    return _send (h, c, buf, len);
+}
+
+static uint32_t _hash (const char *s, int len)
+{
+    uint32_t h = 2166136261u;   /* FNV-1a */
+
+    while (len-- > 0) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Bring the route's cached response up to date for query.
+ * Returns false if render rejected the query.
+ */
+static bool _render (route_t *r, const char *query)
+{
+    char *body;
+    int len;
+
+    if (r->valid && !strcmp (r->query, query))
+        return true;
+    if (!(body = r->render (query, r->arg)))
+        return false;
+    len = strlen (body);
+    free (r->query);
+    r->query = xstrdup (query);
+    free (r->resp);
+    r->resp = xzmalloc (len + 256);
+    if (r->stream) {
+        r->resplen = snprintf (r->resp, len + 256, "data: %s\n\n", body);
+    } else {
+        snprintf (r->etag, sizeof (r->etag), "\"%08x\"", _hash (body, len));
+        r->hdrlen = snprintf (r->resp, len + 256, "HTTP/1.1 200 OK\r\n"
+                              "Content-Type: application/json\r\n"
+                              "Content-Length: %d\r\n"
+                              "ETag: %s\r\n"
+                              "Cache-Control: no-cache\r\n"
+                              "Access-Control-Allow-Origin: *\r\n"
+                              "\r\n", len, r->etag);
+        memcpy (r->resp + r->hdrlen, body, len);
+        r->resplen = r->hdrlen + len;
+    }
+    r->valid = true;
+    free (body);
+    return true;
+}
+
+void httpd_invalidate (httpd_t *h, const char *path)
+{
+    route_t *r = _find_route (h, path);
+    conn_t *c;
+    int i;
+    bool listeners = false;
+
+    if (!r)
+        return;
+    r->valid = false;
+    if (!r->stream)
+        return;
+    for (i = 0; i < HTTPD_MAXCONN; i++)
+        if (h->conn[i] && h->conn[i]->stream)
+            listeners = true;
+    if (!listeners || !_render (r, ""))
+        return;
+    for (i = 0; i < HTTPD_MAXCONN; i++) {
+        if ((c = h->conn[i]) && c->stream)
+            (void)_send (h, c, r->resp, r->resplen);
+    }
+}
+
+/* Return the value of header name in the request head, or NULL.
+ * The head has been split into NUL terminated lines.
+ */
+static const char *_header (char **line, int n, const char *name)
+{
+    int i, len = strlen (name);
+
+    for (i = 1; i < n; i++) {
+        if (!strncasecmp (line[i], name, len) && line[i][len] == ':')
+            return line[i] + len + 1 + strspn (line[i] + len + 1, " \t");
+    }
+    return NULL;
+}
+
+/* Handle one request head (NUL terminated, CRLFs intact).
+ * Returns false if the connection was closed.
+ */
+static bool _request (httpd_t *h, conn_t *c, char *head)
+{
+    static const char sse[] = "HTTP/1.1 200 OK\r\n"
+                              "Content-Type: text/event-stream\r\n"
+                              "Cache-Control: no-cache\r\n"
+                              "Access-Control-Allow-Origin: *\r\n"
+                              "\r\n";
+    char *line[32], *method, *target, *version, *query, *p;
+    const char *v, *inm;
+    int n = 0;
+    route_t *r;
+    bool head_only;
+
+    for (p = strtok (head, "\r\n"); p && n < 32; p = strtok (NULL, "\r\n"))
+        line[n++] = p;
+    if (n == 0 || !(method = strtok (line[0], " "))
+               || !(target = strtok (NULL, " "))
+               || !(version = strtok (NULL, " "))) {
+        c->close = true;
+        return _send_status (h, c, 400, "Bad Request", NULL);
+    }
+    v = _header (line, n, "Connection");
+    if (strcmp (version, "HTTP/1.1") != 0 || (v && !strcasecmp (v, "close")))
+        c->close = true;
+    if (!(head_only = !strcmp (method, "HEAD")) && strcmp (method, "GET")) {
+        c->close = true;
+        return _send_status (h, c, 405, "Method Not Allowed", NULL);
+    }
+    if ((query = strchr (target, '?')))
+        *query++ = '\0';
+    else
+        query = "";
+    if (!(r = _find_route (h, target)))
+        return _send_status (h, c, 404, "Not Found", NULL);
+    if (r->stream) {
+        c->stream = true;
+        if (!_send (h, c, sse, sizeof (sse) - 1))
+            return false;
+        if (_render (r, ""))
+            return _send (h, c, r->resp, r->resplen);
+        return true;
+    }
+    if (!_render (r, query))
+        return _send_status (h, c, 400, "Bad Request", NULL);
+    if ((inm = _header (line, n, "If-None-Match")) && !strcmp (inm, r->etag))
+        return _send_status (h, c, 304, "Not Modified", r->etag);
+    return _send (h, c, r->resp, head_only ? r->hdrlen : r->resplen);
+}
+
+static void _accept (httpd_t *h)
+{
+    struct epoll_event ev = { .events = EPOLLIN };
+    conn_t *c;
+    int fd, i;
+
+    while ((fd = accept4 (h->lfd, NULL, NULL,
+                          SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        for (i = 0; i < HTTPD_MAXCONN; i++)
+            if (!h->conn[i])
+                break;
+        if (i == HTTPD_MAXCONN) {
+            close (fd);
+            continue;
+        }
+        c = xzmalloc (sizeof (*c));
+        c->fd = fd;
+        ev.data.ptr = c;
+        if (epoll_ctl (h->efd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close (fd);
+            free (c);
+            continue;
+        }
+        h->conn[i] = c;
+    }
+}
+
+static void _input (httpd_t *h, conn_t *c)
+{
+    char *end;
+    int n, len;
+
+    for (;;) {
+        if (c->stream || c->close) { /* discard */
+            char junk[256];
+            n = read (c->fd, junk, sizeof (junk));
+        } else
+            n = read (c->fd, c->in + c->inlen, HTTPD_REQMAX - 1 - c->inlen);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0) {
+            _close (h, c);
+            return;
+        }
+        if (c->stream || c->close)
+            continue;
+        c->inlen += n;
+        c->in[c->inlen] = '\0';
+        while (!c->stream && !c->close
+                          && (end = strstr (c->in, "\r\n\r\n"))) {
+            len = end + 4 - c->in;
+            end[2] = '\0';
+            if (!_request (h, c, c->in))
+                return;
+            memmove (c->in, c->in + len, c->inlen - len + 1);
+            c->inlen -= len;
+        }
+        if (c->inlen == HTTPD_REQMAX - 1) {
+            c->close = true;
+            (void)_send_status (h, c, 431, "Request Header Fields Too Large",
+                                NULL);
+            return;
+        }
+    }
+}
+
+void httpd_handle (httpd_t *h)
+{
+    struct epoll_event ev[16];
+    conn_t *c;
+    int i, n;
+
+    while ((n = epoll_wait (h->efd, ev, 16, 0)) > 0) {
+        for (i = 0; i < n; i++) {
+            if (!ev[i].data.ptr) {
+                _accept (h);
+                continue;
+            }
+            c = ev[i].data.ptr;
+            if (ev[i].events & (EPOLLERR | EPOLLHUP)) {
+                _close (h, c);
+                continue;
+            }
+            if ((ev[i].events & EPOLLOUT) && !_flush (h, c))
+                continue;
+            if (ev[i].events & EPOLLIN)
+                _input (h, c);
+        }
+        if (n < 16)
+            break;
+    }
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
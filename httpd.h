@@ -0,0 +1,37 @@
+typedef struct httpd_struct httpd_t;
+
+/* Build the JSON body for a route, given the query string ("" if none).
+ * Return NULL if the query is bad.  Caller frees result.
+ */
+typedef char *(*httpd_render_f) (const char *query, void *arg);
+
+/* Listen on port for GET requests, serviced from the caller's loop:
+ * poll httpd_fd() for input and call httpd_handle() when it is ready.
+ */
+httpd_t *httpd_create (int port);
+void httpd_destroy (httpd_t *h);
+int httpd_fd (httpd_t *h);
+void httpd_handle (httpd_t *h);
+
+/* Serve JSON from render at path.  The response is rendered on demand,
+ * then cached with its headers and ETag until httpd_invalidate (path),
+ * so polling an unchanged route costs a copy, or a 304 if the client
+ * sends If-None-Match.
+ */
+void httpd_route (httpd_t *h, const char *path, httpd_render_f render,
+                  void *arg);
+
+/* Serve a server-sent events stream at path.  Each httpd_invalidate (path)
+ * renders one event and sends it to every client (if any), and new clients
+ * get the latest event first.
+ */
+void httpd_stream (httpd_t *h, const char *path, httpd_render_f render,
+                   void *arg);
+
+/* The data behind path has changed.
+ */
+void httpd_invalidate (httpd_t *h, const char *path);
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
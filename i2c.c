@@ -0,0 +1,125 @@
+/*****************************************************************************
+ *  Copyright (C) 2014 Jim Garlick
+ *  Written by Jim Garlick <garlick.jim@gmail.com>
+ *  All Rights Reserved.
+ *
+ *  This file is part of pi-ted-envoy.
+ *  For details, see <https://github.com/garlick/pi-ted-envoy>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+/* i2c.c - display backend selection and the /dev/i2c-1 backend */
+
+#include <sys/ioctl.h>
+#include <linux/i2c-dev.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "i2c.h"
+#include "metrics.h"
+
+#define I2C_DEV         "/dev/i2c-1"
+
+static const i2c_ops_t *ops = &i2c_dev_ops;
+static const char *devname = I2C_DEV;
+
+void i2c_dev_set (const char *path)
+{
+    devname = path ? path : I2C_DEV;
+}
+
+/* If the device is not a character device (e.g. a FIFO drained by
+ * emonsim), there is no slave address to set.
+ */
+static int dev_open (int addr, i2c_devtype_t type)
+{
+    struct stat sb;
+    int fd;
+
+    fd = open (devname, O_RDWR);
+    if (fd < 0)
+        return -1;
+    if (fstat (fd, &sb) < 0) {
+        close (fd);
+        return -1;
+    }
+    if (S_ISCHR (sb.st_mode) && ioctl (fd, I2C_SLAVE, addr) < 0) {
+        close (fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int dev_write (int fd, const uint8_t *buf, int len)
+{
+    return write (fd, buf, len);
+}
+
+static int dev_read (int fd, uint8_t *buf, int len)
+{
+    return read (fd, buf, len);
+}
+
+static void dev_close (int fd)
+{
+    close (fd);
+}
+
+const i2c_ops_t i2c_dev_ops = {
+    .name = "dev",
+    .open = dev_open,
+    .write = dev_write,
+    .read = dev_read,
+    .close = dev_close,
+};
+
+void i2c_backend_set (const i2c_ops_t *newops)
+{
+    ops = newops;
+}
+
+int i2c_open (int addr, i2c_devtype_t type)
+{
+    return ops->open (addr, type);
+}
+
+int i2c_write (int h, const uint8_t *buf, int len)
+{
+    int n = ops->write (h, buf, len);
+
+    metrics_inc (M_I2C_WRITES);
+    if (n > 0)
+        metrics_add (M_I2C_BYTES, n);
+    if (n < len)
+        metrics_inc (M_I2C_ERRORS);
+    return n;
+}
+
+int i2c_read (int h, uint8_t *buf, int len)
+{
+    return ops->read (h, buf, len);
+}
+
+void i2c_close (int h)
+{
+    ops->close (h);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,31 @@
+/* Device types, so a backend can decode what is written to a handle.
+ */
+typedef enum { I2C_DEV_RAW, I2C_DEV_OLED, I2C_DEV_LED } i2c_devtype_t;
+
+/* Display backend.  Handles are small non-negative integers;
+ * for the /dev/i2c-1 backend they are file descriptors.
+ * open/write/read return -1 and set errno on failure.
+ */
+typedef struct {
+    const char *name;
+    int (*open) (int addr, i2c_devtype_t type);
+    int (*write) (int h, const uint8_t *buf, int len);
+    int (*read) (int h, uint8_t *buf, int len);
+    void (*close) (int h);
+} i2c_ops_t;
+
+extern const i2c_ops_t i2c_dev_ops;     /* /dev/i2c-1 */
+
+/* Use path instead of /dev/i2c-1 for the dev backend (NULL restores
+ * the default).
+ */
+void i2c_dev_set (const char *path);
+
+/* Select the backend used by subsequent i2c_open() calls (default dev).
+ */
+void i2c_backend_set (const i2c_ops_t *ops);
+
+int i2c_open (int addr, i2c_devtype_t type);
+int i2c_write (int h, const uint8_t *buf, int len);
+int i2c_read (int h, uint8_t *buf, int len);
+void i2c_close (int h);
@@ -0,0 +1,198 @@
+/*****************************************************************************
+ *  Copyright (C) 2014 Jim Garlick
+ *  Written by Jim Garlick <garlick.jim@gmail.com>
+ *  All Rights Reserved.
+ *
+ *  This file is part of pi-ted-envoy.
+ *  For details, see <https://github.com/garlick/pi-ted-envoy>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+/* inverter.c - per-microinverter table and Envoy inverter list parser */
+
+/* The Envoy returns one object per microinverter:
+ *   [{"serialNumber":"121300012345","lastReportDate":1400000000,
+ *     "devType":1,"lastReportWatts":203,"maxReportWatts":225}, ...]
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "jstream.h"
+#include "inverter.h"
+
+enum { F_NONE, F_SERIAL, F_LAST, F_WATTS, F_MAX };
+
+void inv_init (invtab_t *tab)
+{
+    memset (tab, 0, sizeof (*tab));
+}
+
+static unsigned int _hash (uint64_t serial)
+{
+    serial ^= serial >> 33;
+    serial *= 0xff51afd7ed558ccdULL;
+    serial ^= serial >> 33;
+    return (unsigned int)serial & (INV_SLOTS - 1);
+}
+
+inverter_t *inv_lookup (invtab_t *tab, uint64_t serial)
+{
+    unsigned int i, h = _hash (serial);
+
+    for (i = 0; i < INV_SLOTS; i++) {
+        inverter_t *inv = &tab->slot[(h + i) & (INV_SLOTS - 1)];
+        if (inv->serial == serial)
+            return inv;
+        if (inv->serial == 0)
+            break;
+    }
+    return NULL;
+}
+
+inverter_t *inv_update (invtab_t *tab, uint64_t serial, int watts,
+                        int max_watts, time_t last)
+{
+    unsigned int i, h = _hash (serial);
+    inverter_t *inv = NULL;
+
+    if (serial == 0)
+        return NULL;
+    for (i = 0; i < INV_SLOTS; i++) {
+        inv = &tab->slot[(h + i) & (INV_SLOTS - 1)];
+        if (inv->serial == serial)
+            break;
+        if (inv->serial == 0) {
+            if (tab->count == INV_SLOTS / 2)
+                return NULL; /* keep probe sequences short */
+            inv->serial = serial;
+            tab->count++;
+            break;
+        }
+    }
+    if (i == INV_SLOTS)
+        return NULL;
+    inv->watts = watts;
+    inv->max_watts = max_watts;
+    if (last != inv->last)
+        inv->reports++;
+    inv->last = last;
+    if (watts > inv->peak_watts)
+        inv->peak_watts = watts;
+    return inv;
+}
+
+static int _cmpint (const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+void inv_rollup (invtab_t *tab, time_t now, int stale_sec)
+{
+    int w[INV_SLOTS / 2];
+    int i, n = 0;
+
+    tab->total_watts = 0;
+    tab->stale = 0;
+    tab->low = 0;
+    for (i = 0; i < INV_SLOTS; i++) {
+        inverter_t *inv = &tab->slot[i];
+        if (inv->serial == 0)
+            continue;
+        tab->total_watts += inv->watts;
+        if (now - inv->last > stale_sec)
+            tab->stale++;
+        else if (n < INV_SLOTS / 2)
+            w[n++] = inv->watts;
+    }
+    if (n == 0) {
+        tab->min_watts = tab->max_watts = tab->median_watts = 0;
+        return;
+    }
+    qsort (w, n, sizeof (int), _cmpint);
+    tab->min_watts = w[0];
+    tab->max_watts = w[n - 1];
+    tab->median_watts = w[n / 2];
+    for (i = 0; i < n; i++)
+        if (w[i] * 100 < tab->median_watts * INV_LOW_PCT)
+            tab->low++;
+}
+
+void inv_reset_peaks (invtab_t *tab)
+{
+    int i;
+
+    for (i = 0; i < INV_SLOTS; i++) {
+        tab->slot[i].peak_watts = 0;
+        tab->slot[i].reports = 0;
+    }
+}
+
+static int _cb (js_event_t ev, const char *tok, int depth, void *arg)
+{
+    invparse_t *ip = arg;
+
+    if (depth == 2 && ev == JS_OBJ_BEGIN) {
+        ip->serial = 0;
+        ip->watts = ip->max_watts = 0;
+        ip->last = 0;
+    } else if (depth == 2 && ev == JS_OBJ_END) {
+        if (inv_update (ip->tab, ip->serial, ip->watts, ip->max_watts,
+                        ip->last))
+            ip->updated++;
+    } else if (depth == 3 && ev == JS_KEY) {
+        ip->field = !strcmp (tok, "serialNumber") ? F_SERIAL
+                  : !strcmp (tok, "lastReportDate") ? F_LAST
+                  : !strcmp (tok, "lastReportWatts") ? F_WATTS
+                  : !strcmp (tok, "maxReportWatts") ? F_MAX
+                  : F_NONE;
+    } else if (depth == 3 && (ev == JS_STRING || ev == JS_NUMBER)) {
+        switch (ip->field) {
+            case F_SERIAL:
+                ip->serial = strtoull (tok, NULL, 10);
+                break;
+            case F_LAST:
+                ip->last = strtol (tok, NULL, 10);
+                break;
+            case F_WATTS:
+                ip->watts = strtol (tok, NULL, 10);
+                break;
+            case F_MAX:
+                ip->max_watts = strtol (tok, NULL, 10);
+                break;
+        }
+        ip->field = F_NONE;
+    }
+    return 0;
+}
+
+void inv_parse_init (invparse_t *ip, invtab_t *tab)
+{
+    memset (ip, 0, sizeof (*ip));
+    ip->tab = tab;
+    js_init (&ip->js, _cb, ip);
+}
+
+int inv_parse_feed (invparse_t *ip, const char *buf, int len)
+{
+    return js_feed (&ip->js, buf, len) < 0 ? -1 : 0;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,58 @@
+#define INV_SLOTS       256     /* power of 2, > 2x inverters on a site */
+#define INV_LOW_PCT     50      /* "low" if under this % of array median */
+
+typedef struct {
+    uint64_t serial;            /* 0 = empty slot */
+    int watts;                  /* last reported */
+    int max_watts;              /* max reported (lifetime) per Envoy */
+    int peak_watts;             /* max seen since rollup reset */
+    time_t last;                /* time of last report */
+    unsigned int reports;       /* reports seen since rollup reset */
+} inverter_t;
+
+typedef struct invtab_struct {
+    inverter_t slot[INV_SLOTS];
+    int count;
+    /* array rollups, updated by inv_rollup() */
+    int total_watts;
+    int min_watts;
+    int max_watts;
+    int median_watts;
+    int low;                    /* inverters below INV_LOW_PCT of median */
+    int stale;                  /* inverters not reporting recently */
+} invtab_t;
+
+void inv_init (invtab_t *tab);
+
+/* Add or update an inverter report, keyed by serial number.
+ * Returns NULL if the table is full.
+ */
+inverter_t *inv_update (invtab_t *tab, uint64_t serial, int watts,
+                        int max_watts, time_t last);
+
+inverter_t *inv_lookup (invtab_t *tab, uint64_t serial);
+
+/* Recompute array rollups.  Inverters whose last report is older than
+ * stale_sec before 'now' count as stale and are left out of min/median.
+ */
+void inv_rollup (invtab_t *tab, time_t now, int stale_sec);
+
+/* Clear per-inverter peak/report counts, e.g. at midnight.
+ */
+void inv_reset_peaks (invtab_t *tab);
+
+/* Streaming parser for the Envoy /api/v1/production/inverters array.
+ * Feed it the HTTP body in pieces; inverters go straight into the table.
+ */
+typedef struct {
+    jstream_t js;
+    invtab_t *tab;
+    int field;
+    uint64_t serial;
+    int watts, max_watts;
+    time_t last;
+    int updated;
+} invparse_t;
+
+void inv_parse_init (invparse_t *ip, invtab_t *tab);
+int inv_parse_feed (invparse_t *ip, const char *buf, int len);
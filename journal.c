@@ -0,0 +1,153 @@
+/*****************************************************************************
+ *  Copyright (C) 2014 Jim Garlick
+ *  Written by Jim Garlick <garlick.jim@gmail.com>
+ *  All Rights Reserved.
+ *
+ *  This file is part of pi-ted-envoy.
+ *  For details, see <https://github.com/garlick/pi-ted-envoy>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+/* journal.c - keep recent published messages for replay (see journal.h) */
+
+/* Slots keep their buffer, which only grows, so once a topic's ring has
+ * gone round journaling costs a copy and no allocation.  Topics are few
+ * and fixed (ted, temp, envoy, ...), so they are found by linear search.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "util.h"
+#include "encode.h"
+#include "journal.h"
+
+typedef struct {
+    uint64_t seq;                       /* 0 if empty */
+    int len;
+    int size;
+    char *buf;
+} slot_t;
+
+typedef struct {
+    char name[TOPIC_MAX];
+    uint64_t seq;                       /* last number taken */
+    slot_t *ring;
+} topic_t;
+
+struct journal_struct {
+    int depth;
+    topic_t topic[JOURNAL_TOPICS];
+    int ntopic;
+};
+
+journal_t *journal_create (int depth)
+{
+    journal_t *j = xzmalloc (sizeof (*j));
+
+    j->depth = depth;
+    return j;
+}
+
+void journal_destroy (journal_t *j)
+{
+    int i, k;
+
+    if (j) {
+        for (i = 0; i < j->ntopic; i++) {
+            if (j->topic[i].ring) {
+                for (k = 0; k < j->depth; k++)
+                    free (j->topic[i].ring[k].buf);
+                free (j->topic[i].ring);
+            }
+        }
+        free (j);
+    }
+}
+
+static topic_t *_lookup (journal_t *j, const char *name, bool create)
+{
+    topic_t *t;
+    int i;
+
+    for (i = 0; i < j->ntopic; i++) {
+        if (!strcmp (j->topic[i].name, name))
+            return &j->topic[i];
+    }
+    if (!create || j->ntopic == JOURNAL_TOPICS
+                || strlen (name) >= TOPIC_MAX)
+        return NULL;
+    t = &j->topic[j->ntopic++];
+    strcpy (t->name, name);
+    if (j->depth > 0)
+        t->ring = xzmalloc (j->depth * sizeof (t->ring[0]));
+    return t;
+}
+
+uint64_t journal_next (journal_t *j, const char *topic)
+{
+    topic_t *t = _lookup (j, topic, true);
+
+    return t ? ++t->seq : 0;
+}
+
+void journal_add (journal_t *j, const char *topic, uint64_t seq,
+                  const char *s, int len)
+{
+    topic_t *t;
+    slot_t *sl;
+
+    if (j->depth == 0 || seq == 0 || !(t = _lookup (j, topic, false)))
+        return;
+    sl = &t->ring[seq % j->depth];
+    if (sl->size < len) {
+        free (sl->buf);
+        sl->size = len > 256 ? len : 256;
+        sl->buf = xzmalloc (sl->size);
+    }
+    memcpy (sl->buf, s, len);
+    sl->len = len;
+    sl->seq = seq;
+}
+
+int journal_replay (journal_t *j, const char *topic, uint64_t seq,
+                    journal_f fn, void *arg)
+{
+    topic_t *t;
+    slot_t *sl;
+    int n = 0;
+
+    if (j->depth == 0 || !(t = _lookup (j, topic, false)))
+        return 0;
+    if (t->seq >= j->depth && seq <= t->seq - j->depth)
+        seq = t->seq - j->depth + 1;
+    if (seq == 0)
+        seq = 1;
+    for (; seq <= t->seq; seq++) {
+        sl = &t->ring[seq % j->depth];
+        if (sl->seq != seq)
+            continue;
+        fn (sl->buf, sl->len, arg);
+        n++;
+    }
+    return n;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,39 @@
+/* Bounded in-memory journal of published messages.
+ *
+ * Every topic keeps its last 'depth' messages, as stamped and sent, in a
+ * ring indexed by sequence number.  A subscriber that sees a gap in a
+ * topic's sequence asks for a replay from the first number it missed;
+ * if that has already been overwritten, the replay starts later and the
+ * subscriber can tell how much is lost for good.
+ */
+
+typedef struct journal_struct journal_t;
+
+#define JOURNAL_TOPICS  16
+
+/* Create a journal keeping 'depth' messages per topic.  With a depth of
+ * 0 messages are numbered but not kept.
+ */
+journal_t *journal_create (int depth);
+void journal_destroy (journal_t *j);
+
+/* Take the next sequence number of 'topic', counting from 1.
+ * Returns 0 if the topic table is full.
+ */
+uint64_t journal_next (journal_t *j, const char *topic);
+
+/* Keep a copy of message s, len bytes, published as 'seq' of 'topic'.
+ */
+void journal_add (journal_t *j, const char *topic, uint64_t seq,
+                  const char *s, int len);
+
+/* Call fn on each kept message of 'topic' numbered 'seq' or later, oldest
+ * first.  Returns the number of messages.
+ */
+typedef void (*journal_f)(const char *s, int len, void *arg);
+int journal_replay (journal_t *j, const char *topic, uint64_t seq,
+                    journal_f fn, void *arg);
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,221 @@
+/*****************************************************************************
+ *  Copyright (C) 2014 Jim Garlick
+ *  Written by Jim Garlick <garlick.jim@gmail.com>
+ *  All Rights Reserved.
+ *
+ *  This file is part of pi-ted-envoy.
+ *  For details, see <https://github.com/garlick/pi-ted-envoy>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+/* jstream.c - incremental JSON tokenizer */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "jstream.h"
+
+enum { S_VALUE, S_AFTER, S_COLON, S_STRING, S_NUMBER, S_LITERAL, S_DONE };
+
+void js_init (jstream_t *js, js_cb_f cb, void *arg)
+{
+    memset (js, 0, sizeof (*js));
+    js->cb = cb;
+    js->arg = arg;
+    js->state = S_VALUE;
+}
+
+static void _tokc (jstream_t *js, char c)
+{
+    if (js->toklen < JS_TOKMAX - 1)
+        js->tok[js->toklen++] = c;
+}
+
+static int _emit (jstream_t *js, js_event_t ev, int depth)
+{
+    const char *tok = NULL;
+
+    if (ev == JS_KEY || ev == JS_STRING || ev == JS_NUMBER) {
+        js->tok[js->toklen] = '\0';
+        tok = js->tok;
+    }
+    return js->cb (ev, tok, depth, js->arg);
+}
+
+static bool _inobj (jstream_t *js)
+{
+    return js->depth > 0 && (js->objmask & (1U << js->depth));
+}
+
+/* A value just finished at the current level.
+ */
+static void _value_done (jstream_t *js)
+{
+    js->state = js->depth == 0 ? S_DONE : S_AFTER;
+}
+
+static int _literal_done (jstream_t *js)
+{
+    js_event_t ev;
+
+    js->tok[js->toklen] = '\0';
+    if (!strcmp (js->tok, "true"))
+        ev = JS_TRUE;
+    else if (!strcmp (js->tok, "false"))
+        ev = JS_FALSE;
+    else if (!strcmp (js->tok, "null"))
+        ev = JS_NULL;
+    else
+        return -1;
+    _value_done (js);
+    return _emit (js, ev, js->depth + 1) < 0 ? 1 : 0;
+}
+
+int js_feed (jstream_t *js, const char *buf, int len)
+{
+    int i, rc;
+    char c;
+
+    for (i = 0; i < len; i++) {
+        c = buf[i];
+again:
+        switch (js->state) {
+            case S_STRING:
+                if (js->esc > 0) {
+                    /* keep escapes verbatim except the common ones */
+                    if (js->esc == 5 && c != 'u') {
+                        _tokc (js, c == 'n' ? '\n' : c == 't' ? '\t' : c);
+                        js->esc = 0;
+                    } else {
+                        if (js->esc == 5)
+                            _tokc (js, '?');
+                        js->esc--;
+                    }
+                } else if (c == '\\')
+                    js->esc = 5;
+                else if (c == '"') {
+                    if (js->want_key) {
+                        js->want_key = false;
+                        js->state = S_COLON;
+                        if (_emit (js, JS_KEY, js->depth + 1) < 0)
+                            return 1;
+                    } else {
+                        _value_done (js);
+                        if (_emit (js, JS_STRING, js->depth + 1) < 0)
+                            return 1;
+                    }
+                } else
+                    _tokc (js, c);
+                break;
+            case S_NUMBER:
+                if (isdigit (c) || c == '-' || c == '+' || c == '.'
+                                || c == 'e' || c == 'E') {
+                    _tokc (js, c);
+                    break;
+                }
+                _value_done (js);
+                if (_emit (js, JS_NUMBER, js->depth + 1) < 0)
+                    return 1;
+                goto again;
+            case S_LITERAL:
+                if (isalpha (c)) {
+                    _tokc (js, c);
+                    break;
+                }
+                if ((rc = _literal_done (js)) != 0)
+                    return rc;
+                goto again;
+            default:
+                if (isspace (c))
+                    break;
+                if (js->state == S_COLON) {
+                    if (c != ':')
+                        return -1;
+                    js->state = S_VALUE;
+                    break;
+                }
+                if (js->state == S_DONE)
+                    return -1;
+                if (js->state == S_AFTER) {
+                    if (c == ',') {
+                        js->state = S_VALUE;
+                        js->want_key = _inobj (js);
+                        break;
+                    }
+                    if (c == '}' || c == ']') {
+                        if (_inobj (js) != (c == '}'))
+                            return -1;
+                        js->depth--;
+                        _value_done (js);
+                        if (_emit (js, c == '}' ? JS_OBJ_END : JS_ARR_END,
+                                   js->depth + 1) < 0)
+                            return 1;
+                        break;
+                    }
+                    return -1;
+                }
+                /* S_VALUE */
+                if (js->want_key) {
+                    if (c == '}' && _inobj (js)) {   /* empty object */
+                        js->want_key = false;
+                        js->state = S_AFTER;
+                        goto again;
+                    }
+                    if (c != '"')
+                        return -1;
+                    js->toklen = 0;
+                    js->state = S_STRING;
+                    break;
+                }
+                if (c == ']' && js->depth > 0 && !_inobj (js)) {
+                    js->state = S_AFTER;        /* empty array */
+                    goto again;
+                }
+                if (c == '{' || c == '[') {
+                    if (js->depth == JS_MAXDEPTH - 1)
+                        return -1;
+                    if (_emit (js, c == '{' ? JS_OBJ_BEGIN : JS_ARR_BEGIN,
+                               js->depth + 1) < 0)
+                        return 1;
+                    js->depth++;
+                    if (c == '{')
+                        js->objmask |= (1U << js->depth);
+                    else
+                        js->objmask &= ~(1U << js->depth);
+                    js->want_key = (c == '{');
+                    break;
+                }
+                js->toklen = 0;
+                if (c == '"')
+                    js->state = S_STRING;
+                else if (c == '-' || isdigit (c)) {
+                    js->state = S_NUMBER;
+                    _tokc (js, c);
+                } else if (isalpha (c)) {
+                    js->state = S_LITERAL;
+                    _tokc (js, c);
+                } else
+                    return -1;
+                break;
+        }
+    }
+    return 0;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,35 @@
+typedef enum {
+    JS_OBJ_BEGIN, JS_OBJ_END, JS_ARR_BEGIN, JS_ARR_END,
+    JS_KEY, JS_STRING, JS_NUMBER, JS_TRUE, JS_FALSE, JS_NULL,
+} js_event_t;
+
+#define JS_TOKMAX       64      /* longer strings/numbers are truncated */
+#define JS_MAXDEPTH     32
+
+/* Called for each token.  'tok' is NUL terminated, for KEY/STRING/NUMBER
+ * only.  'depth' is the nesting level of the token (1 = top level value).
+ * Return -1 to stop parsing.
+ */
+typedef int (*js_cb_f) (js_event_t ev, const char *tok, int depth, void *arg);
+
+/* Incremental JSON tokenizer.  Input may be fed in arbitrary pieces;
+ * nothing is allocated and no tree is built.
+ */
+typedef struct {
+    js_cb_f cb;
+    void *arg;
+    int state;
+    int depth;
+    uint32_t objmask;           /* bit n set if level n is an object */
+    bool want_key;
+    char tok[JS_TOKMAX];
+    int toklen;
+    int esc;                    /* chars left in escape sequence */
+} jstream_t;
+
+void js_init (jstream_t *js, js_cb_f cb, void *arg);
+
+/* Returns 0 on success, 1 if the callback stopped the parse,
+ * -1 on syntax error.
+ */
+int js_feed (jstream_t *js, const char *buf, int len);
@@ -30,11 +30,9 @@
  * Cut trace to disable built-in 4.7K pullup.
  */
 
-#include <sys/ioctl.h>
-#include <linux/i2c-dev.h>
 #include <sys/types.h>
-#include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -42,6 +40,7 @@
 #include <stdarg.h>
 #include <assert.h>
 
+#include "i2c.h"
 #include "led.h"
 
 #define REG_CMD			0x01
@@ -90,20 +89,39 @@ _char (char c)
          : 0; /* blank */
 }
 
-static void
+/* Inverse of _char() for decoding segment data, '?' if unknown.
+ * The decimal point bit is ignored.
+ */
+char
+led_seg_char (uint8_t seg)
+{
+    int i;
+
+    seg &= 0x7f;
+    if (seg == 0)
+        return ' ';
+    for (i = 0; i < sizeof (charset); i++)
+        if (charset[i] == seg)
+            return i < 10 ? '0' + i : i < 16 ? 'A' + i - 10 : '-';
+    return '?';
+}
+
+/* Errors are returned to the caller, as -1 with errno set, so that a
+ * daemon can carry on without a display that has come loose.
+ */
+static int
 _write(int fd, uint8_t *buf, int len)
 {
     int n;
 
-    n = write (fd, buf, len);
-    if (n < 0) {
-        perror ("write");
-        exit (1);
-    }
+    n = i2c_write (fd, buf, len);
+    if (n < 0)
+        return -1;
     if (n < len) {
-        fprintf (stderr, "short write\n");
-        exit (1);
+        errno = EIO;
+        return -1;
     }
+    return 0;
 }
 
 static int
@@ -111,81 +129,87 @@ _read(int fd, uint8_t *buf, int len)
 {
     int n;
 
-    n = read (fd, buf, len);
-    if (n < 0) {
-        perror ("read");
-        exit (1);
-    }
+    n = i2c_read (fd, buf, len);
+    if (n < 0)
+        return -1;
     if (n == 0) {
-        fprintf (stderr, "premature EOF on read\n");
-        exit (1);
+        errno = EIO;
+        return -1;
     }
     return n;
 }
 
-static void
-_led_display (int fd, uint8_t *val)
+static int
+_led_display (int fd, const uint8_t *val)
 {
     uint8_t buf[] = { REG_DAT, val[3], val[2], val[1], val[0] };
-    _write (fd, buf, sizeof (buf));
+    return _write (fd, buf, sizeof (buf));
 }
 
-void
+int
+led_raw_set (int fd, const uint8_t seg[4])
+{
+    return _led_display (fd, seg);
+}
+
+int
 led_brightness_set (int fd, uint8_t val)
 {
     uint8_t buf[] = { REG_BRIGHTNESS, val,  0xff, 0 , 0};
-    _write (fd, buf, sizeof (buf));
+    return _write (fd, buf, sizeof (buf));
 }
 
-void
+int
 led_addr_set (int fd, uint8_t newaddr)
 {
     uint8_t buf[] = { REG_ADDRESS, newaddr };
-    _write (fd, buf, sizeof (buf));
+    return _write (fd, buf, sizeof (buf));
 }
 
-void
+int
 led_reset (int fd)
 {
     uint8_t buf[] = { REG_RESET, RESET_OLED };
-    _write (fd, buf, sizeof (buf));
+    return _write (fd, buf, sizeof (buf));
 }
 
 /* 1=sleep, 0=wake */
-void
+int
 led_sleep_set (int fd, int val)
 {
     uint8_t buf[] = { REG_SLEEP, val ? SLEEP_ON : SLEEP_OFF, 0, 0, 0 };
-    _write (fd, buf, sizeof (buf));
+    return _write (fd, buf, sizeof (buf));
 }
 
-uint8_t 
+int
 led_status_get (int fd)
 {
     uint8_t wbuf[] = { REG_STATUS };
     uint8_t rbuf[1];
 
-    _write (fd, wbuf, sizeof (wbuf));
-    if (_read (fd, rbuf, sizeof (rbuf)) != 1) {
-        perror ("read status byte");
-        exit (1);
-    }
+    if (_write (fd, wbuf, sizeof (wbuf)) < 0)
+        return -1;
+    if (_read (fd, rbuf, sizeof (rbuf)) < 0)
+        return -1;
     return rbuf[0];
 }
 
-void
+int
 led_version_print (int fd)
 {
     uint8_t wbuf[] = { REG_VERSION };
     uint8_t rbuf[19];
     int n;
 
-    _write (fd, wbuf, sizeof (wbuf));
-    n = _read (fd, rbuf, sizeof (rbuf));
+    if (_write (fd, wbuf, sizeof (wbuf)) < 0)
+        return -1;
+    if ((n = _read (fd, rbuf, sizeof (rbuf))) < 0)
+        return -1;
     printf ("%.*s\n", n, (char *)rbuf);
+    return 0;
 }
 
-void
+int
 led_test (int fd)
 {
     int i;
@@ -193,31 +217,40 @@ led_test (int fd)
 
     for (i = 0; i < 8; i++) {
         memset (buf, 1<<i, 4);
-        _led_display (fd, buf);
+        if (_led_display (fd, buf) < 0)
+            return -1;
         usleep (1000*100);
     }
+    return 0;
 }
 
-static void
-_led_puts (int fd, char *s)
+void
+led_encode (const char *s, uint8_t seg[4])
 {
-    uint8_t buf[4];
-    char *p = s;
-    int i = 0;
+    const char *p;
+    int i;
 
-    memset (buf, 0, sizeof (buf));
+    memset (seg, 0, 4);
     for (i = 0, p = s; *p != '\0' && i < 4; p++) {
         if (*p == '.' && i == 0)
-            buf[i++] = 0x80;
+            seg[i++] = 0x80;
         else if (*p == '.' && i > 0)
-            buf[i - 1] |= 0x80;
+            seg[i - 1] |= 0x80;
         else
-            buf[i++] = _char(*p);
+            seg[i++] = _char(*p);
     }
-    _led_display (fd, buf);
 }
 
-void
+static int
+_led_puts (int fd, char *s)
+{
+    uint8_t buf[4];
+
+    led_encode (s, buf);
+    return _led_display (fd, buf);
+}
+
+int
 led_printf (int fd, const char *fmt, ...)
 {
     char s[10];
@@ -226,31 +259,21 @@ led_printf (int fd, const char *fmt, ...)
     va_start (ap, fmt);
     vsnprintf (s, sizeof (s), fmt, ap);
     va_end (ap);
-    _led_puts (fd, s);
+    return _led_puts (fd, s);
 }
 
+/* Returns a handle, or -1 with errno set.
+ */
 int
 led_init(int addr)
 {
-    const char *devname = "/dev/i2c-1";
-    int fd;
-
-    fd = open (devname, O_RDWR);
-    if (fd < 0) {
-        perror (devname);
-        exit (1);
-    }
-    if (ioctl (fd, I2C_SLAVE, addr) < 0) {
-        perror ("ioctl I2C_SLAVE");
-        exit (1);
-    }
-    return fd;
+    return i2c_open (addr, I2C_DEV_LED);
 }
 
 void
 led_fini(int fd)
 {
-    close (fd);
+    i2c_close (fd);
 }
 
 /*
@@ -1,16 +1,29 @@
 int led_init(int addr);
 void led_fini(int fd);
 
-void led_printf (int fd, const char *fmt, ...);
+/* The rest return -1 with errno set on I2C errors.
+ */
+int led_printf (int fd, const char *fmt, ...);
 
-void led_brightness_set (int fd, uint8_t val);
-void led_sleep_set (int fd, int val);
-uint8_t led_status_get (int fd);
+int led_brightness_set (int fd, uint8_t val);
+int led_sleep_set (int fd, int val);
+int led_status_get (int fd);
 
-void led_version_print (int fd);
-void led_addr_set (int fd, uint8_t newaddr);
-void led_test (int fd);
-void led_reset (int fd);
+int led_version_print (int fd);
+int led_addr_set (int fd, uint8_t newaddr);
+int led_test (int fd);
+int led_reset (int fd);
+
+char led_seg_char (uint8_t seg);
+
+/* Encode up to 4 characters (0-9, A-F, '-', blank, with '.' lighting
+ * the previous digit's decimal point) as segments, leftmost first.
+ */
+void led_encode (const char *s, uint8_t seg[4]);
+
+/* Display segments as encoded by led_encode().
+ */
+int led_raw_set (int fd, const uint8_t seg[4]);
 
 #define LED_ADDR_FACTORY	0x27
 #define LED_ADDR_ADDRMODE	0x51
@@ -0,0 +1,286 @@
+/*****************************************************************************
+ *  Copyright (C) 2014 Jim Garlick
+ *  Written by Jim Garlick <garlick.jim@gmail.com>
+ *  All Rights Reserved.
+ *
+ *  This file is part of pi-ted-envoy.
+ *  For details, see <https://github.com/garlick/pi-ted-envoy>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+/* metrics.c - per-thread counters and histograms, Prometheus text output */
+
+#define _GNU_SOURCE /* for open_memstream */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "metrics.h"
+
+#define NBUCKETS        8
+
+typedef struct {
+    const char *family;
+    const char *labels;
+    const char *type;
+    const char *help;
+} mdesc_t;
+
+static const mdesc_t counters[M_COUNTER_MAX] = {
+    { "emond_ted_frames_total", "", "counter",
+      "TED frames with a good checksum" },
+    { "emond_ted_bad_frames_total", "{reason=\"checksum\"}", "counter",
+      "TED frames discarded" },
+    { "emond_ted_bad_frames_total", "{reason=\"io\"}", "counter",
+      "TED frames discarded" },
+    { "emond_w1_reads_total", "", "counter",
+      "1-wire temperature reads" },
+    { "emond_w1_errors_total", "", "counter",
+      "1-wire temperature reads that returned NaN" },
+    { "emond_keypresses_total", "", "counter",
+      "Mode key presses" },
+    { "emond_other_sent_total", "", "counter",
+      "Messages sent by producer threads to the main loop" },
+    { "emond_dispatch_total", "{socket=\"other\"}", "counter",
+      "Messages handled by the main loop" },
+    { "emond_dispatch_total", "{socket=\"envoy\"}", "counter",
+      "Messages handled by the main loop" },
+    { "emond_dispatch_total", "{socket=\"load\"}", "counter",
+      "Messages handled by the main loop" },
+    { "emond_unknown_messages_total", "", "counter",
+      "Messages that did not decode" },
+    { "emond_published_total", "", "counter",
+      "Messages published to subscribers" },
+    { "emond_i2c_writes_total", "", "counter",
+      "I2C writes" },
+    { "emond_i2c_bytes_total", "", "counter",
+      "I2C bytes written" },
+    { "emond_i2c_errors_total", "", "counter",
+      "I2C writes that failed" },
+    { "emond_display_updates_total", "", "counter",
+      "Display updates" },
+    { "emond_envoy_polls_total", "{page=\"production\"}", "counter",
+      "Envoy polls" },
+    { "emond_envoy_polls_total", "{page=\"inverters\"}", "counter",
+      "Envoy polls" },
+    { "emond_envoy_errors_total", "{page=\"production\"}", "counter",
+      "Envoy polls that failed" },
+    { "emond_envoy_errors_total", "{page=\"inverters\"}", "counter",
+      "Envoy polls that failed" },
+    { "emond_queue_drops_total", "{queue=\"ted\"}", "counter",
+      "Samples dropped because a producer queue was full" },
+    { "emond_queue_drops_total", "{queue=\"key\"}", "counter",
+      "Samples dropped because a producer queue was full" },
+    { "emond_queue_drops_total", "{queue=\"temp\"}", "counter",
+      "Samples dropped because a producer queue was full" },
+    { "emond_queue_drops_total", "{queue=\"export\"}", "counter",
+      "Samples dropped because a producer queue was full" },
+    { "emond_export_points_total", "", "counter",
+      "Points handed to the exporter" },
+    { "emond_export_batches_total", "", "counter",
+      "Batches accepted upstream" },
+    { "emond_export_errors_total", "", "counter",
+      "Batch uploads that failed" },
+    { "emond_export_spooled_total", "", "counter",
+      "Batches written to the spool" },
+    { "emond_export_rejected_total", "", "counter",
+      "Batches refused by upstream and dropped" },
+    { "emond_device_failures_total", "", "counter",
+      "Device opens that failed or handles that stopped working" },
+    { "emond_replay_requests_total", "", "counter",
+      "Journal replays requested by subscribers that missed messages" },
+    { "emond_replay_messages_total", "", "counter",
+      "Messages sent in journal replays" },
+};
+
+static const mdesc_t hists[H_HIST_MAX] = {
+    { "emond_encode_seconds", "", "histogram",
+      "Time to serialize a sample" },
+    { "emond_dispatch_seconds", "", "histogram",
+      "Time to decode and handle a message in the main loop" },
+    { "emond_display_seconds", "", "histogram",
+      "Time to render and upload a display update" },
+    { "emond_loop_seconds", "", "histogram",
+      "Main loop busy time per wakeup" },
+    { "emond_envoy_poll_seconds", "", "histogram",
+      "Envoy HTTP poll latency" },
+};
+
+/* Bucket upper bounds in ns; the last bucket is +Inf.
+ */
+static const uint64_t bucket_ns[NBUCKETS - 1] = {
+    10000, 100000, 1000000, 10000000, 100000000, 1000000000, 10000000000ULL,
+};
+static const char *bucket_le[NBUCKETS] = {
+    "1e-05", "0.0001", "0.001", "0.01", "0.1", "1", "10", "+Inf",
+};
+
+typedef struct shard {
+    uint64_t counter[M_COUNTER_MAX];
+    uint64_t bucket[H_HIST_MAX][NBUCKETS];
+    uint64_t sum_ns[H_HIST_MAX];
+    struct shard *next;
+} shard_t;
+
+static __thread shard_t *self = NULL;
+static shard_t *shards = NULL;
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The list lock is only taken when a thread registers and when
+ * rendering, never on the update path.  Shards are not freed, since
+ * counters of threads that exit must still be reported.
+ */
+static shard_t *_shard (void)
+{
+    if (!self) {
+        shard_t *sh = calloc (1, sizeof (*sh));
+        if (!sh) {
+            fprintf (stderr, "out of memory\n");
+            exit (1);
+        }
+        pthread_mutex_lock (&shards_lock);
+        sh->next = shards;
+        shards = sh;
+        pthread_mutex_unlock (&shards_lock);
+        self = sh;
+    }
+    return self;
+}
+
+/* Only the owning thread writes a shard, so a relaxed load/store pair
+ * suffices and readers never see a torn value.
+ */
+static inline void _add (uint64_t *p, uint64_t n)
+{
+    __atomic_store_n (p, __atomic_load_n (p, __ATOMIC_RELAXED) + n,
+                      __ATOMIC_RELAXED);
+}
+
+static inline uint64_t _load (uint64_t *p)
+{
+    return __atomic_load_n (p, __ATOMIC_RELAXED);
+}
+
+void metrics_add (metric_t m, uint64_t n)
+{
+    _add (&_shard ()->counter[m], n);
+}
+
+void metrics_observe (metric_hist_t h, uint64_t ns)
+{
+    shard_t *sh = _shard ();
+    int i;
+
+    for (i = 0; i < NBUCKETS - 1; i++)
+        if (ns <= bucket_ns[i])
+            break;
+    _add (&sh->bucket[h][i], 1);
+    _add (&sh->sum_ns[h], ns);
+}
+
+uint64_t metrics_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t metrics_get (metric_t m)
+{
+    shard_t *sh;
+    uint64_t n = 0;
+
+    pthread_mutex_lock (&shards_lock);
+    for (sh = shards; sh != NULL; sh = sh->next)
+        n += _load (&sh->counter[m]);
+    pthread_mutex_unlock (&shards_lock);
+    return n;
+}
+
+static void _header (FILE *f, const mdesc_t *d, const char **last)
+{
+    if (*last && !strcmp (*last, d->family))
+        return;
+    fprintf (f, "# HELP %s %s\n# TYPE %s %s\n", d->family, d->help,
+             d->family, d->type);
+    *last = d->family;
+}
+
+char *metrics_render (void)
+{
+    const char *last = NULL;
+    uint64_t b[NBUCKETS], sum, cum, other_sent = 0, other_recv = 0;
+    uint64_t drops = 0;
+    shard_t *sh;
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *f;
+    int m, h, i;
+
+    if (!(f = open_memstream (&buf, &len))) {
+        fprintf (stderr, "out of memory\n");
+        exit (1);
+    }
+    pthread_mutex_lock (&shards_lock);
+    for (m = 0; m < M_COUNTER_MAX; m++) {
+        uint64_t n = 0;
+        for (sh = shards; sh != NULL; sh = sh->next)
+            n += _load (&sh->counter[m]);
+        _header (f, &counters[m], &last);
+        fprintf (f, "%s%s %llu\n", counters[m].family, counters[m].labels,
+                 (unsigned long long)n);
+        if (m == M_OTHER_SENT)
+            other_sent = n;
+        if (m == M_OTHER_RECV)
+            other_recv = n;
+        if (m == M_TED_DROPS || m == M_KEY_DROPS || m == M_TEMP_DROPS)
+            drops += n;
+    }
+    for (h = 0; h < H_HIST_MAX; h++) {
+        memset (b, 0, sizeof (b));
+        sum = 0;
+        for (sh = shards; sh != NULL; sh = sh->next) {
+            for (i = 0; i < NBUCKETS; i++)
+                b[i] += _load (&sh->bucket[h][i]);
+            sum += _load (&sh->sum_ns[h]);
+        }
+        _header (f, &hists[h], &last);
+        for (i = 0, cum = 0; i < NBUCKETS; i++) {
+            cum += b[i];
+            fprintf (f, "%s_bucket{le=\"%s\"} %llu\n", hists[h].family,
+                     bucket_le[i], (unsigned long long)cum);
+        }
+        fprintf (f, "%s_sum %.9f\n", hists[h].family, sum * 1E-9);
+        fprintf (f, "%s_count %llu\n", hists[h].family,
+                 (unsigned long long)cum);
+    }
+    pthread_mutex_unlock (&shards_lock);
+    fprintf (f, "# HELP emond_other_queue_depth Messages sent by producer "
+                "threads not yet handled or dropped\n"
+                "# TYPE emond_other_queue_depth gauge\n"
+                "emond_other_queue_depth %lld\n",
+             (long long)(other_sent - other_recv - drops));
+    fclose (f);
+    return buf;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
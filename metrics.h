@@ -0,0 +1,70 @@
+/* Counters.  Keep in the same order as the table in metrics.c, where
+ * the label variants of a family must be adjacent.
+ */
+typedef enum {
+    M_TED_FRAMES,
+    M_TED_BAD_CKSUM,
+    M_TED_IO_ERRORS,
+    M_W1_READS,
+    M_W1_ERRORS,
+    M_KEYPRESSES,
+    M_OTHER_SENT,
+    M_OTHER_RECV,                       /* from producer threads only */
+    M_ENVOY_RECV,
+    M_LOAD_RECV,                        /* from other processes (-L) */
+    M_UNKNOWN_MSGS,
+    M_PUB_MSGS,
+    M_I2C_WRITES,
+    M_I2C_BYTES,
+    M_I2C_ERRORS,
+    M_DISPLAY_UPDATES,
+    M_ENVOY_POLLS,
+    M_INV_POLLS,
+    M_ENVOY_ERRORS,
+    M_INV_ERRORS,
+    M_TED_DROPS,
+    M_KEY_DROPS,
+    M_TEMP_DROPS,
+    M_EXPORT_DROPS,
+    M_EXPORT_POINTS,
+    M_EXPORT_BATCHES,
+    M_EXPORT_ERRORS,
+    M_EXPORT_SPOOLED,
+    M_EXPORT_REJECTED,
+    M_DEV_FAILURES,
+    M_REPLAY_REQUESTS,
+    M_REPLAY_MSGS,
+    M_COUNTER_MAX,
+} metric_t;
+
+/* Latency histograms.
+ */
+typedef enum {
+    H_ENCODE,
+    H_DISPATCH,
+    H_DISPLAY,
+    H_LOOP,
+    H_ENVOY_POLL,
+    H_HIST_MAX,
+} metric_hist_t;
+
+/* Updates go to a per-thread shard with plain relaxed stores, so they
+ * never take a lock or contend on a cache line.  A thread's shard is
+ * created on its first update.
+ */
+void metrics_add (metric_t m, uint64_t n);
+#define metrics_inc(m) metrics_add ((m), 1)
+void metrics_observe (metric_hist_t h, uint64_t ns);
+
+/* Monotonic clock in ns, for timing observations.
+ */
+uint64_t metrics_now (void);
+
+/* Sum of counter m across threads.
+ */
+uint64_t metrics_get (metric_t m);
+
+/* Render all metrics in Prometheus text exposition format.
+ * Caller must free result.
+ */
+char *metrics_render (void);
@@ -22,14 +22,10 @@
  *****************************************************************************/
 /* oled.c - interface Digole 128x64 I2C OLED module to raspberry pi */
 
-/* FIXME: support graphics modes */
-
 #define _GNU_SOURCE /* for vasprintf */
-#include <sys/ioctl.h>
-#include <linux/i2c-dev.h>
 #include <sys/types.h>
-#include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdarg.h>
@@ -37,61 +33,67 @@
 #include <stdbool.h>
 #include <string.h>
 
+#include "fb.h"
+#include "i2c.h"
 #include "oled.h"
 
-static void
+/* Errors are returned to the caller, as -1 with errno set, so that a
+ * daemon can carry on without a display that has come loose.
+ */
+static int
 _write(int fd, uint8_t *buf, int len)
 {
     int n;
 
-    n = write (fd, buf, len);
-    if (n < 0) {
-        perror ("write");
-        exit (1);
-    }
+    n = i2c_write (fd, buf, len);
+    if (n < 0)
+        return -1;
     if (n < len) {
-        fprintf (stderr, "short write\n");
-        exit (1);
+        errno = EIO;
+        return -1;
     }
+    return 0;
 }
 
 /* clear screen, set display pos=0,0, default font, cursor off */
-void
+int
 oled_clear(int fd)
 {
     uint8_t buf[] = { 'C', 'L' };
-    _write(fd, buf, sizeof (buf));
+    return _write(fd, buf, sizeof (buf));
 }
 
 /* 0=off, 1=on */
-void
+int
 oled_cursor_set (int fd, bool val)
 {
     uint8_t buf[] = { 'C', 'S', val ? 1 : 0 };
-    _write(fd, buf, sizeof (buf));
+    return _write(fd, buf, sizeof (buf));
 }
 
 /* 0=screen off, 1=screen on */
-void
+int
 oled_sleep_set (int fd, bool val)
 {
     uint8_t buf[] = { 'S', 'O', 'O', val ? 1 : 0 };
-    _write(fd, buf, sizeof (buf));
+    return _write(fd, buf, sizeof (buf));
 }
 
 /* zero origin */
-void
+int
 oled_text_pos_set (int fd, uint8_t x, uint8_t y)
 {
     uint8_t buf[] = { 'T', 'P', x, y };
-    _write(fd, buf, sizeof (buf));
+    return _write(fd, buf, sizeof (buf));
 }
 
-static void
+static int
 _oled_puts (int fd, char *s)
 {
     int len = strlen (s) + 1;
     uint8_t *buf = malloc (len + 2);
+    int rc;
+
     if (!buf) {
         fprintf (stderr, "out of memory\n");
         exit (1);
@@ -99,16 +101,17 @@ _oled_puts (int fd, char *s)
     buf[0] = 'T';
     buf[1] = 'T';
     memcpy(&buf[2], s, len);
-    _write(fd, buf, len + 2);
+    rc = _write(fd, buf, len + 2);
     free (buf);
+    return rc;
 }
 
-void
+int
 oled_printf (int fd, const char *fmt, ...)
 {
     va_list ap;
     char *s;
-    int n;
+    int n, rc;
 
     va_start (ap, fmt);
     n = vasprintf (&s, fmt, ap);
@@ -117,43 +120,89 @@ oled_printf (int fd, const char *fmt, ...)
         exit (1);
     }
     va_end (ap);
-    _oled_puts (fd, s);
+    rc = _oled_puts (fd, s);
     free (s);
+    return rc;
 }
 
-void
+/* Draw monochrome image with top left corner at x,y.
+ * Rows are padded to a byte, MSB is the leftmost pixel.
+ * The area is blanked first so that 0 bits clear pixels.
+ */
+int
+oled_bitmap (int fd, uint8_t x, uint8_t y, uint8_t w, uint8_t h,
+             const uint8_t *bits)
+{
+    uint8_t buf[OLED_MAXWRITE];
+    int rowbytes = (w + 7) / 8;
+    int rows = (sizeof (buf) - 7) / rowbytes;
+    uint8_t fill[] = { 'S', 'C', 0, 'F', 'R', x, y, x + w - 1, y + h - 1,
+                       'S', 'C', 1 };
+    int i, n;
+
+    if (_write(fd, fill, sizeof (fill)) < 0)
+        return -1;
+    for (i = 0; i < h; i += n) {
+        n = h - i < rows ? h - i : rows;
+        buf[0] = 'D';
+        buf[1] = 'I';
+        buf[2] = 'M';
+        buf[3] = x;
+        buf[4] = y + i;
+        buf[5] = w;
+        buf[6] = n;
+        memcpy (&buf[7], &bits[i * rowbytes], n * rowbytes);
+        if (_write(fd, buf, 7 + n * rowbytes) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Upload the changed regions of the framebuffer.
+ * Returns the number of rectangles sent, or -1 on error, in which case
+ * the panel no longer matches the shadow copy: call fb_invalidate().
+ */
+int
+oled_fb_flush (int fd, fb_t *fb)
+{
+    uint8_t bits[FB_HEIGHT * FB_STRIDE];
+    fb_rect_t r;
+    int count = 0;
+
+    while (fb_dirty_next (fb, &r)) {
+        fb_pack (fb, &r, bits, sizeof (bits));
+        if (oled_bitmap (fd, r.x, r.y, r.w, r.h, bits) < 0)
+            return -1;
+        count++;
+    }
+    return count;
+}
+
+int
 oled_addr_set (int oldaddr, int newaddr)
 {
     uint8_t buf[] = { 'S', 'I', '2', 'C', 'A', newaddr };
-    int fd;
+    int fd, rc;
 
-    fd = oled_init (oldaddr);
-    _write(fd, buf, sizeof (buf));
+    if ((fd = oled_init (oldaddr)) < 0)
+        return -1;
+    rc = _write(fd, buf, sizeof (buf));
     oled_fini (fd);
+    return rc;
 }
 
+/* Returns a handle, or -1 with errno set.
+ */
 int
 oled_init(int addr)
 {
-    const char *devname = "/dev/i2c-1";
-    int fd;
-
-    fd = open (devname, O_RDWR);
-    if (fd < 0) {
-        perror (devname);
-        exit (1);
-    }
-    if (ioctl (fd, I2C_SLAVE, addr) < 0) {
-        perror ("ioctl I2C_SLAVE");
-        exit (1);
-    }
-    return fd;
+    return i2c_open (addr, I2C_DEV_OLED);
 }
 
 void
 oled_fini(int fd)
 {
-    close (fd);
+    i2c_close (fd);
 }
 
 #if 0
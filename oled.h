@@ -1,13 +1,20 @@
-void oled_clear(int fd);
-void oled_cursor_set (int fd, bool val);
-void oled_sleep_set (int fd, bool val);
+/* These return -1 with errno set on I2C errors.
+ */
+int oled_clear(int fd);
+int oled_cursor_set (int fd, bool val);
+int oled_sleep_set (int fd, bool val);
 
-void oled_text_pos_set (int fd, uint8_t x, uint8_t y);
-void oled_printf (int fd, const char *fmt, ...);
+int oled_text_pos_set (int fd, uint8_t x, uint8_t y);
+int oled_printf (int fd, const char *fmt, ...);
 
-void oled_addr_set (int oldaddr, int newaddr);
+int oled_bitmap (int fd, uint8_t x, uint8_t y, uint8_t w, uint8_t h,
+                 const uint8_t *bits);
+int oled_fb_flush (int fd, fb_t *fb);
+
+int oled_addr_set (int oldaddr, int newaddr);
 
 int oled_init(int addr);
 void oled_fini(int fd);
 
 #define OLED_TEXT_COL	32
+#define OLED_MAXWRITE	128	/* max bytes per I2C write */
@@ -0,0 +1,157 @@
+/*****************************************************************************
+ *  Copyright (C) 2014 Jim Garlick
+ *  Written by Jim Garlick <garlick.jim@gmail.com>
+ *  All Rights Reserved.
+ *
+ *  This file is part of pi-ted-envoy.
+ *  For details, see <https://github.com/garlick/pi-ted-envoy>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+/* spsc.c - fixed-size single-producer/single-consumer queues */
+
+/* head is the next slot to pop, tail the next slot to push; both only
+ * increase.  The producer owns tail and the consumer owns head, except
+ * that a drop-oldest producer advances head with a CAS when full.  The
+ * consumer therefore copies a slot out first and keeps it only if its
+ * own CAS on head succeeds: if the producer dropped the slot meanwhile,
+ * the CAS fails and the (possibly torn) copy is discarded.
+ */
+
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "spsc.h"
+#include "util.h"
+
+struct spsc_struct {
+    uint64_t head;
+    char pad1[64 - sizeof (uint64_t)];  /* keep head and tail on */
+    uint64_t tail;                      /*   separate cache lines */
+    char pad2[64 - sizeof (uint64_t)];
+    uint64_t drops;
+    uint32_t cap;                       /* power of 2 */
+    size_t size;
+    spsc_policy_t policy;
+    int efd;
+    uint8_t *buf;
+};
+
+spsc_t *spsc_create (size_t size, uint32_t cap, spsc_policy_t policy)
+{
+    spsc_t *q = xzmalloc (sizeof (*q));
+    uint32_t n = 1;
+
+    while (n < cap)
+        n <<= 1;
+    q->cap = n;
+    q->size = size;
+    q->policy = policy;
+    q->buf = xzmalloc (size * n);
+    if ((q->efd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        perror ("eventfd");
+        exit (1);
+    }
+    return q;
+}
+
+void spsc_destroy (spsc_t *q)
+{
+    close (q->efd);
+    free (q->buf);
+    free (q);
+}
+
+bool spsc_push (spsc_t *q, const void *item)
+{
+    uint64_t tail = q->tail;
+    uint64_t head = __atomic_load_n (&q->head, __ATOMIC_ACQUIRE);
+    uint64_t one = 1;
+    bool ok = true;
+
+    while (tail - head >= q->cap) {
+        if (q->policy == SPSC_DROP_NEWEST) {
+            __atomic_add_fetch (&q->drops, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+        /* drop oldest: take the slot away from the consumer */
+        if (__atomic_compare_exchange_n (&q->head, &head, head + 1, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            __atomic_add_fetch (&q->drops, 1, __ATOMIC_RELAXED);
+            ok = false;
+            break;
+        }
+        /* consumer popped concurrently; head was reloaded by the CAS */
+    }
+    memcpy (q->buf + (tail & (q->cap - 1)) * q->size, item, q->size);
+    __atomic_store_n (&q->tail, tail + 1, __ATOMIC_RELEASE);
+
+    /* Ring the doorbell on every push: skipping it when the queue looked
+     * non-empty races with a consumer that is just emptying it.
+     */
+    if (write (q->efd, &one, sizeof (one)) < 0 && errno != EAGAIN) {
+        perror ("eventfd write");
+        exit (1);
+    }
+    return ok;
+}
+
+bool spsc_pop (spsc_t *q, void *item)
+{
+    uint64_t head = __atomic_load_n (&q->head, __ATOMIC_ACQUIRE);
+    uint64_t tail;
+
+    for (;;) {
+        tail = __atomic_load_n (&q->tail, __ATOMIC_ACQUIRE);
+        if (head == tail)
+            return false;
+        memcpy (item, q->buf + (head & (q->cap - 1)) * q->size, q->size);
+        if (__atomic_compare_exchange_n (&q->head, &head, head + 1, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return true;
+        /* producer dropped this slot; head was reloaded by the CAS */
+    }
+}
+
+int spsc_fd (spsc_t *q)
+{
+    return q->efd;
+}
+
+void spsc_ack (spsc_t *q)
+{
+    uint64_t n;
+
+    if (read (q->efd, &n, sizeof (n)) < 0 && errno != EAGAIN) {
+        perror ("eventfd read");
+        exit (1);
+    }
+}
+
+uint64_t spsc_drops (spsc_t *q)
+{
+    return __atomic_load_n (&q->drops, __ATOMIC_RELAXED);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,32 @@
+/* What to do when a producer finds its queue full.
+ */
+typedef enum { SPSC_DROP_NEWEST, SPSC_DROP_OLDEST } spsc_policy_t;
+
+typedef struct spsc_struct spsc_t;
+
+/* Create a queue of at least cap items of size bytes each
+ * (rounded up to a power of 2).
+ */
+spsc_t *spsc_create (size_t size, uint32_t cap, spsc_policy_t policy);
+void spsc_destroy (spsc_t *q);
+
+/* Copy item in, never blocking.  Returns false if an item was dropped:
+ * this one (drop-newest) or the oldest queued one (drop-oldest).
+ * Only one thread may push.
+ */
+bool spsc_push (spsc_t *q, const void *item);
+
+/* Copy the oldest item out.  Returns false if the queue is empty.
+ * Only one thread may pop.
+ */
+bool spsc_pop (spsc_t *q, void *item);
+
+/* The eventfd doorbell, readable after a push.  Call spsc_ack(),
+ * then pop until empty.
+ */
+int spsc_fd (spsc_t *q);
+void spsc_ack (spsc_t *q);
+
+/* Number of items dropped so far.
+ */
+uint64_t spsc_drops (spsc_t *q);
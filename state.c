@@ -0,0 +1,166 @@
+/*****************************************************************************
+ *  Copyright (C) 2014 Jim Garlick
+ *  Written by Jim Garlick <garlick.jim@gmail.com>
+ *  All Rights Reserved.
+ *
+ *  This file is part of pi-ted-envoy.
+ *  For details, see <https://github.com/garlick/pi-ted-envoy>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+/* state.c - emond's readings in shared memory, under a seqlock */
+
+/* The writer makes seq odd, copies the state in, then makes seq even
+ * again.  A reader copies the state out between two reads of seq and
+ * keeps the copy only if seq was even and unchanged, so readers never
+ * block the writer and need no syscall.  The state is copied a word at
+ * a time with relaxed atomics, so a torn read is detected by seq rather
+ * than being a data race.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "util.h"
+#include "state.h"
+
+#define READ_TRIES      1000
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq;                       /* odd while a write is under way */
+    uint32_t size;                      /* sizeof (state_t) */
+    uint64_t st[(sizeof (state_t) + 7) / 8];
+} shared_t;
+
+struct state_struct {
+    shared_t *sh;
+};
+
+static state_seg_t *_map (int fd, int prot)
+{
+    state_seg_t *seg = xzmalloc (sizeof (*seg));
+
+    seg->sh = mmap (NULL, sizeof (shared_t), prot, MAP_SHARED, fd, 0);
+    if (seg->sh == MAP_FAILED) {
+        perror ("mmap");
+        exit (1);
+    }
+    return seg;
+}
+
+state_seg_t *state_create (const char *path)
+{
+    state_seg_t *seg;
+    int fd;
+
+    (void)unlink (path); /* readers of an old segment see it go stale */
+    if ((fd = open (path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644)) < 0
+                || fchmod (fd, 0644) < 0 /* regardless of umask */
+                || ftruncate (fd, sizeof (shared_t)) < 0) {
+        perror (path);
+        exit (1);
+    }
+    seg = _map (fd, PROT_READ | PROT_WRITE);
+    close (fd);
+    seg->sh->size = sizeof (state_t);
+    seg->sh->version = STATE_VERSION;
+    __atomic_store_n (&seg->sh->magic, STATE_MAGIC, __ATOMIC_RELEASE);
+    return seg;
+}
+
+state_seg_t *state_open (const char *path)
+{
+    state_seg_t *seg;
+    struct stat sb;
+    int fd;
+
+    if ((fd = open (path, O_RDONLY | O_CLOEXEC)) < 0)
+        return NULL;
+    if (fstat (fd, &sb) < 0 || sb.st_size < sizeof (shared_t)) {
+        close (fd);
+        errno = EPROTO;
+        return NULL;
+    }
+    seg = _map (fd, PROT_READ);
+    close (fd);
+    if (__atomic_load_n (&seg->sh->magic, __ATOMIC_ACQUIRE) != STATE_MAGIC
+            || seg->sh->version != STATE_VERSION
+            || seg->sh->size != sizeof (state_t)) {
+        state_close (seg);
+        errno = EPROTO;
+        return NULL;
+    }
+    return seg;
+}
+
+void state_close (state_seg_t *seg)
+{
+    munmap (seg->sh, sizeof (shared_t));
+    free (seg);
+}
+
+void state_write (state_seg_t *seg, const state_t *st)
+{
+    shared_t *sh = seg->sh;
+    uint64_t w[sizeof (sh->st) / 8];
+    uint32_t seq = sh->seq;
+    int i;
+
+    memset (w, 0, sizeof (w));
+    memcpy (w, st, sizeof (*st));
+    __atomic_store_n (&sh->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence (__ATOMIC_RELEASE);
+    for (i = 0; i < sizeof (w) / 8; i++)
+        __atomic_store_n (&sh->st[i], w[i], __ATOMIC_RELAXED);
+    __atomic_store_n (&sh->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+bool state_read (state_seg_t *seg, state_t *st)
+{
+    shared_t *sh = seg->sh;
+    uint64_t w[sizeof (sh->st) / 8];
+    uint32_t s0, s1;
+    int i, tries;
+
+    for (tries = 0; tries < READ_TRIES; tries++) {
+        s0 = __atomic_load_n (&sh->seq, __ATOMIC_ACQUIRE);
+        if (s0 & 1)
+            continue;
+        for (i = 0; i < sizeof (w) / 8; i++)
+            w[i] = __atomic_load_n (&sh->st[i], __ATOMIC_RELAXED);
+        __atomic_thread_fence (__ATOMIC_ACQUIRE);
+        s1 = __atomic_load_n (&sh->seq, __ATOMIC_RELAXED);
+        if (s0 == s1) {
+            memcpy (st, w, sizeof (*st));
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,55 @@
+#define STATE_PATH      "/dev/shm/emond"
+#define STATE_MAGIC     0x6e6f6d65      /* "emon" */
+#define STATE_VERSION   3               /* bump when state_t changes */
+
+/* emond's current readings.  Fixed-size fields only, as this is the
+ * layout of a file shared between processes.
+ */
+typedef struct state_data_struct {
+    int64_t updated;                    /* usec since the epoch */
+    int32_t mode;                       /* display mode */
+    int32_t ted_watts;
+    int32_t ted_volts;
+    int32_t ted_count;
+    int64_t ted_last;
+    int32_t wattsec;                    /* energy used since midnight */
+    int32_t envoy_current_power;
+    int32_t envoy_daily_energy;
+    int32_t envoy_weekly_energy;
+    int32_t envoy_lifetime_energy;
+    int32_t ted_addr;
+    int64_t envoy_last;
+    double temp_case;
+    double temp_fridge;
+    double temp_freezer;
+    int32_t used_week_wh;               /* closed out days this week */
+    int32_t used_month_wh;              /* closed out days this month */
+    int32_t gen_week_wh;
+    int32_t gen_month_wh;
+} state_t;
+
+typedef struct state_struct state_seg_t;
+
+/* Create (or replace) the segment at path and map it for writing.
+ */
+state_seg_t *state_create (const char *path);
+
+/* Map an existing segment for reading.  Returns NULL with errno set if
+ * it is missing or was written by an emond with a different layout.
+ */
+state_seg_t *state_open (const char *path);
+void state_close (state_seg_t *seg);
+
+/* Copy st into the segment.  Only one thread may write.
+ */
+void state_write (state_seg_t *seg, const state_t *st);
+
+/* Copy a consistent snapshot of the segment into st without a syscall,
+ * retrying while a write is in progress.  Returns false if the writer
+ * kept the segment busy for too long.
+ */
+bool state_read (state_seg_t *seg, state_t *st);
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -40,7 +40,7 @@
 
 static FILE *ted = NULL;
 
-static int32_t raw_power(uint8_t *pkt)
+static int32_t raw_power(const uint8_t *pkt)
 {
 	uint32_t i;
 	
@@ -50,7 +50,7 @@ static int32_t raw_power(uint8_t *pkt)
 	return (int32_t)i;
 }
 
-static int32_t raw_voltage(uint8_t *pkt)
+static int32_t raw_voltage(const uint8_t *pkt)
 {
 	uint32_t i;
 
@@ -72,46 +72,99 @@ static int verify_cksum(uint8_t *pkt)
 	return (sum == pkt[9]);
 }
 		
-int ted_read(int *addrp, int *countp, int *wattsp, int *voltsp)
+/* Build an 11 byte frame as it appears on the wire (inverted), the
+ * inverse of ted_read: 0x55 sync, addr, count, 24-bit raw power and
+ * voltage, checksum, and a pad byte chosen so the checksum verifies.
+ * Used by the simulator and benchmarks.
+ */
+void ted_frame_encode(uint8_t *pkt, int addr, int count, int watts, int volts)
+{
+	int32_t p = ((watts / 1000.0 - 1.19) / 0.84 * 204.0 + 288.0) * 256;
+	int32_t v = ((volts - 123.6) / 0.4 * 85 + 27620) * 256;
+	int i, sum = 0;
+
+	pkt[0] = 0x55;
+	pkt[1] = addr;
+	pkt[2] = count;
+	pkt[3] = p & 0xff;
+	pkt[4] = (p >> 8) & 0xff;
+	pkt[5] = (p >> 16) & 0xff;
+	pkt[6] = v & 0xff;
+	pkt[7] = (v >> 8) & 0xff;
+	pkt[8] = (v >> 16) & 0xff;
+	pkt[9] = 0;
+	for (i = 0; i < 9; i++)
+		sum += pkt[i];
+	pkt[10] = -sum & 0xff;
+	for (i = 0; i < 11; i++)
+		pkt[i] = ~pkt[i];
+}
+
+void ted_calib(const uint8_t *pkt, int *wattsp, int *voltsp)
 {
-	int cc, i;
-	uint8_t c, pkt[11];
 	double power, voltage; /* kW and V */
 
-	i = 0;
-	while (i < 11 && (cc = fgetc(ted)) != EOF) {
-		c = ~(uint8_t)cc;
-		if (c != 0x55 && i == 0)
-			continue; /* resync */
-		pkt[i++] = c;
-	} 
-	if (cc == EOF) {
-		if (errno == 0)
-			errno = EIO;
-		return -1;
+	/* per http://gangliontwitch.com/ted/ */
+	voltage = 123.6 + (raw_voltage(pkt)/256 - 27620) / 85 * 0.4;
+	power = 1.19 + 0.84 * ((raw_power(pkt)/256 - 288.0) / 204.0);
+
+	if (wattsp)
+		*wattsp = power * 1000;
+	if (voltsp)
+		*voltsp = voltage;
+}
+
+void ted_decoder_init(ted_decoder_t *d)
+{
+	d->len = 0;
+	d->resync = 0;
+}
+
+int ted_decode(ted_decoder_t *d, uint8_t cc,
+	       int *addrp, int *countp, int *wattsp, int *voltsp)
+{
+	uint8_t c = ~cc;
+	uint8_t *pkt = d->pkt;
+
+	if (c != 0x55 && d->len == 0) {
+		d->resync++;
+		return 0;
 	}
+	pkt[d->len++] = c;
+	if (d->len < 11)
+		return 0;
+	d->len = 0;
 
 	if (!verify_cksum (pkt)) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	/* per http://gangliontwitch.com/ted/ */
-	voltage = 123.6 + (raw_voltage(pkt)/256 - 27620) / 85 * 0.4;
-	power = 1.19 + 0.84 * ((raw_power(pkt)/256 - 288.0) / 204.0);
-
 	if (addrp)
 		*addrp = pkt[1];
 	if (countp)
 		*countp = pkt[2];
-	if (wattsp)
-		*wattsp = power * 1000;
-	if (voltsp)
-		*voltsp = voltage;
-	return 0;
+	ted_calib (pkt, wattsp, voltsp);
+	return 1;
 }
 
-int ted_init(char *devname)
+int ted_read(int *addrp, int *countp, int *wattsp, int *voltsp)
+{
+	ted_decoder_t d;
+	int cc, rc;
+
+	ted_decoder_init (&d);
+	while ((cc = fgetc(ted)) != EOF) {
+		rc = ted_decode (&d, cc, addrp, countp, wattsp, voltsp);
+		if (rc != 0)
+			return rc < 0 ? -1 : 0;
+	}
+	if (errno == 0)
+		errno = EIO;
+	return -1;
+}
+
+int ted_open(char *devname)
 {
 	int fd;
 	struct termios tio;
@@ -139,11 +192,26 @@ int ted_init(char *devname)
 		close (fd);
 		return -1;
 	}
+	return fd;
+}
+
+int ted_init(char *devname)
+{
+	int fd;
+
+	if ((fd = ted_open(devname)) < 0)
+		return -1;
 	if ((ted = fdopen(fd, "r")) == NULL)
 		return -1;
 	return 0;
 }
 
+int ted_init_fp(FILE *fp)
+{
+	ted = fp;
+	return 0;
+}
+
 void ted_fini (void)
 {
 	fclose (ted);
@@ -1,3 +1,27 @@
+/* Incremental frame decoder, for callers that do their own reads.
+ */
+typedef struct {
+	uint8_t pkt[11];	/* last frame, un-inverted, e.g. to log a bad one */
+	int len;
+	unsigned long resync;	/* bytes skipped looking for a frame */
+} ted_decoder_t;
+
 int ted_read(int *addrp, int *countp, int *wattsp, int *voltsp);
 int ted_init(char *devname);
+int ted_open(char *devname);	/* configure tty and return its fd */
+int ted_init_fp(FILE *fp);	/* decode from an already open stream */
 void ted_fini (void);
+void ted_frame_encode(uint8_t *pkt, int addr, int count, int watts, int volts);
+
+/* Convert an un-inverted frame with a good checksum to watts and volts.
+ * All decoders go through here, so the formulas live in one place.
+ */
+void ted_calib(const uint8_t *pkt, int *wattsp, int *voltsp);
+
+void ted_decoder_init(ted_decoder_t *d);
+/* Feed one byte as read from the wire.  Returns 1 and fills in the
+ * sample when a frame completes, 0 if more bytes are needed, or -1 with
+ * errno set to EINVAL when a frame completes with a bad checksum.
+ */
+int ted_decode(ted_decoder_t *d, uint8_t c,
+	       int *addrp, int *countp, int *wattsp, int *voltsp);
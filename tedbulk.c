@@ -0,0 +1,254 @@
+/*****************************************************************************
+ *  Copyright (C) 2014 Jim Garlick
+ *  Written by Jim Garlick <garlick.jim@gmail.com>
+ *  All Rights Reserved.
+ *
+ *  This file is part of pi-ted-envoy.
+ *  For details, see <https://github.com/garlick/pi-ted-envoy>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+/* tedbulk.c - decode TED captures in bulk for offline analysis */
+
+/* Each FILE (a tedutil capture or raw PLM bytes) is decoded on all cores
+ * by tedscan, and a line of statistics is printed for it.  With --output,
+ * the frames of all the files, in order, are also appended to one binary
+ * file per column (PREFIX.time, .watts, ...) in native byte order, for
+ * loading straight into numpy or R.  With --csv they are printed instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "tedscan.h"
+
+#define MAX_GAP_NS      (60 * 1000000000LL) /* longer gaps add no energy */
+
+#define OPTIONS "j:o:c"
+#define HAVE_GETOPT_LONG 1
+
+#if HAVE_GETOPT_LONG
+#define GETOPT(ac,av,opt,lopt) getopt_long (ac,av,opt,lopt,NULL)
+static const struct option longopts[] = {
+    {"jobs",    required_argument,  0, 'j'},
+    {"output",  required_argument,  0, 'o'},
+    {"csv",     no_argument,        0, 'c'},
+    {0, 0, 0, 0},
+};
+#else
+#define GETOPT(ac,av,opt,lopt) getopt (ac,av,opt)
+#endif
+
+typedef struct {
+    const char *suffix;
+    FILE *f;
+} column_t;
+
+enum { COL_TIME, COL_WATTS, COL_VOLTS, COL_ADDR, COL_COUNT, NCOL };
+
+static column_t col[NCOL] = {
+    { "time", NULL },
+    { "watts", NULL },
+    { "volts", NULL },
+    { "addr", NULL },
+    { "count", NULL },
+};
+
+static void usage (void)
+{
+    fprintf (stderr,
+"Usage: tedbulk [OPTIONS] FILE...\n"
+"   -j,--jobs N         decode with N threads (default one per CPU)\n"
+"   -o,--output PREFIX  append frames to PREFIX.{time,watts,volts,addr,count}\n"
+"   -c,--csv            print frames as CSV, statistics to stderr\n"
+    );
+    exit (1);
+}
+
+static double now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1E-9;
+}
+
+static void columns_open (const char *prefix)
+{
+    char path[PATH_MAX];
+    int i;
+
+    for (i = 0; i < NCOL; i++) {
+        snprintf (path, sizeof (path), "%s.%s", prefix, col[i].suffix);
+        if (!(col[i].f = fopen (path, "w"))) {
+            fprintf (stderr, "%s: %s\n", path, strerror (errno));
+            exit (1);
+        }
+    }
+}
+
+static void columns_close (void)
+{
+    int i;
+
+    for (i = 0; i < NCOL; i++) {
+        if (fclose (col[i].f) != 0) {
+            fprintf (stderr, "%s: %s\n", col[i].suffix, strerror (errno));
+            exit (1);
+        }
+    }
+}
+
+static void column_write (int i, const void *p, size_t size, long n)
+{
+    if (fwrite (p, size, n, col[i].f) != n) {
+        fprintf (stderr, "%s: %s\n", col[i].suffix, strerror (errno));
+        exit (1);
+    }
+}
+
+/* Raw input has no clock; a zero time column keeps the files aligned.
+ */
+static void columns_write (tedscan_t *s)
+{
+    static const int64_t zero[1024];
+    long i, n;
+
+    if (s->time)
+        column_write (COL_TIME, s->time, sizeof (s->time[0]), s->n);
+    else {
+        for (i = 0; i < s->n; i += n) {
+            n = s->n - i < 1024 ? s->n - i : 1024;
+            column_write (COL_TIME, zero, sizeof (zero[0]), n);
+        }
+    }
+    column_write (COL_WATTS, s->watts, sizeof (s->watts[0]), s->n);
+    column_write (COL_VOLTS, s->volts, sizeof (s->volts[0]), s->n);
+    column_write (COL_ADDR, s->addr, sizeof (s->addr[0]), s->n);
+    column_write (COL_COUNT, s->count, sizeof (s->count[0]), s->n);
+}
+
+static void csv (tedscan_t *s)
+{
+    long i;
+
+    for (i = 0; i < s->n; i++)
+        printf ("%.3f,%d,%d,%d,%d\n",
+                s->time ? s->time[i] * 1E-9 : 0.,
+                s->addr[i], s->count[i], s->watts[i], s->volts[i]);
+}
+
+static void stats (FILE *f, const char *name, tedscan_t *s, double secs)
+{
+    long i, gaps = 0, missing = 0;
+    int wmin = 0, wmax = 0, vmin = 0, vmax = 0;
+    double wsum = 0, vsum = 0, wh = 0;
+    int64_t dt;
+
+    for (i = 0; i < s->n; i++) {
+        if (i == 0 || s->watts[i] < wmin)
+            wmin = s->watts[i];
+        if (i == 0 || s->watts[i] > wmax)
+            wmax = s->watts[i];
+        if (i == 0 || s->volts[i] < vmin)
+            vmin = s->volts[i];
+        if (i == 0 || s->volts[i] > vmax)
+            vmax = s->volts[i];
+        wsum += s->watts[i];
+        vsum += s->volts[i];
+        if (i == 0)
+            continue;
+        if (s->count[i] != ((s->count[i - 1] + 1) & 0xff)) {
+            gaps++;
+            missing += (s->count[i] - s->count[i - 1] - 1) & 0xff;
+        }
+        if (s->time) {
+            dt = s->time[i] - s->time[i - 1];
+            if (dt > 0 && dt <= MAX_GAP_NS)
+                wh += s->watts[i - 1] * (dt * 1E-9) / 3600;
+        }
+    }
+    fprintf (f, "%s: frames=%ld badsync=%ld skipped=%llu gaps=%ld"
+             " missing=%ld", name, s->n, s->badsync,
+             (unsigned long long)(s->bytes - s->n * 11), gaps, missing);
+    if (s->n > 0)
+        fprintf (f, " watts=%d/%.0f/%d volts=%d/%.1f/%d", wmin, wsum / s->n,
+                 wmax, vmin, vsum / s->n, vmax);
+    if (s->time && s->n > 1)
+        fprintf (f, " hours=%.2f kwh=%.3f",
+                 (s->time[s->n - 1] - s->time[0]) * 1E-9 / 3600, wh / 1000);
+    fprintf (f, " (%.2fs, %.0f MB/s)%s\n", secs,
+             secs > 0 ? s->bytes / secs / 1E6 : 0.,
+             s->truncated ? " truncated" : "");
+}
+
+int main (int argc, char *argv[])
+{
+    const char *prefix = NULL;
+    bool copt = false;
+    int jobs = 0;
+    tedscan_t *s;
+    double t0;
+    int c, i;
+
+    while ((c = GETOPT (argc, argv, OPTIONS, longopts)) != -1) {
+        switch (c) {
+            case 'j':   /* --jobs N */
+                jobs = strtoul (optarg, NULL, 10);
+                break;
+            case 'o':   /* --output PREFIX */
+                prefix = optarg;
+                break;
+            case 'c':   /* --csv */
+                copt = true;
+                break;
+            default:
+                usage ();
+        }
+    }
+    if (optind == argc)
+        usage ();
+
+    if (prefix)
+        columns_open (prefix);
+    for (i = optind; i < argc; i++) {
+        t0 = now ();
+        if (!(s = tedscan_file (argv[i], jobs))) {
+            fprintf (stderr, "%s: %s\n", argv[i], strerror (errno));
+            exit (1);
+        }
+        stats (copt ? stderr : stdout, argv[i], s, now () - t0);
+        if (prefix)
+            columns_write (s);
+        if (copt)
+            csv (s);
+        tedscan_destroy (s);
+    }
+    if (prefix)
+        columns_close ();
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,355 @@
+/*****************************************************************************
+ *  Copyright (C) 2014 Jim Garlick
+ *  Written by Jim Garlick <garlick.jim@gmail.com>
+ *  All Rights Reserved.
+ *
+ *  This file is part of pi-ted-envoy.
+ *  For details, see <https://github.com/garlick/pi-ted-envoy>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+/* tedcap.c - read and write TED capture files (see tedcap.h) */
+
+/* At 1200 baud the PLM delivers a frame a byte at a time, so the capture
+ * loop is expected to coalesce a burst into one record.  With varints a
+ * record then costs 3 or 4 bytes over the 11 of the frame itself.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "util.h"
+#include "tedcap.h"
+
+#define HDR_MAGIC       "TEDCAP1\n"
+#define IDX_MAGIC       "TEDIDX1\n"
+#define HDR_LEN         24
+#define TRAILER_LEN     24
+#define IDX_ENTRY_LEN   24
+
+typedef struct {
+    uint64_t off;                       /* of a sync record */
+    int64_t mono;
+    int64_t wall;
+} idx_t;
+
+struct tedcap_struct {
+    FILE *f;
+    bool writer;
+    int64_t mono;                       /* of the previous record */
+    int64_t wall_base;                  /* wall at the last sync ... */
+    int64_t mono_base;                  /* ... and mono at that point */
+    uint64_t off;                       /* reader: file position */
+    uint64_t end;                       /* reader: where records end */
+    idx_t *idx;
+    int nidx;
+    int maxidx;
+};
+
+static void _put64 (uint8_t *p, uint64_t v)
+{
+    int i;
+
+    for (i = 0; i < 8; i++)
+        p[i] = v >> (8 * i);
+}
+
+static uint64_t _get64 (const uint8_t *p)
+{
+    uint64_t v = 0;
+    int i;
+
+    for (i = 0; i < 8; i++)
+        v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+
+static void _putvar (FILE *f, uint64_t v)
+{
+    while (v >= 0x80) {
+        fputc ((v & 0x7f) | 0x80, f);
+        v >>= 7;
+    }
+    fputc (v, f);
+}
+
+/* Returns 0, or -1 at EOF (errno 0) or on a bad varint (EINVAL).
+ */
+static int _getvar (tedcap_t *c, uint64_t *vp)
+{
+    uint64_t v = 0;
+    int ch, shift;
+
+    for (shift = 0; shift < 64; shift += 7) {
+        if ((ch = fgetc (c->f)) == EOF) {
+            errno = ferror (c->f) ? EIO : shift ? EINVAL : 0;
+            return -1;
+        }
+        c->off++;
+        v |= (uint64_t)(ch & 0x7f) << shift;
+        if (!(ch & 0x80)) {
+            *vp = v;
+            return 0;
+        }
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+static void _idx_add (tedcap_t *c, uint64_t off, int64_t mono, int64_t wall)
+{
+    if (c->nidx == c->maxidx) {
+        c->maxidx = c->maxidx ? c->maxidx * 2 : 256;
+        if (!(c->idx = realloc (c->idx, c->maxidx * sizeof (c->idx[0]))))
+            oom ();
+    }
+    c->idx[c->nidx].off = off;
+    c->idx[c->nidx].mono = mono;
+    c->idx[c->nidx].wall = wall;
+    c->nidx++;
+}
+
+tedcap_t *tedcap_create (const char *path)
+{
+    tedcap_t *c = xzmalloc (sizeof (*c));
+
+    if (!(c->f = fopen (path, "w"))) {
+        free (c);
+        return NULL;
+    }
+    c->writer = true;
+    c->mono = -1;
+    return c;
+}
+
+/* Write the time since the previous record, in whole us, and advance
+ * by that much, as the reader will.
+ */
+static void _advance (tedcap_t *c, int64_t mono)
+{
+    int64_t dt = mono > c->mono ? (mono - c->mono) / 1000 : 0;
+
+    _putvar (c->f, dt);
+    c->mono += dt * 1000;
+}
+
+static void _sync (tedcap_t *c, int64_t mono, int64_t wall)
+{
+    uint64_t off = ftell (c->f);
+    uint8_t b[8];
+
+    _advance (c, mono);
+    _putvar (c->f, 0);
+    _put64 (b, wall);
+    fwrite (b, 1, 8, c->f);
+    _idx_add (c, off, c->mono, wall);
+    c->mono_base = c->mono;
+}
+
+int tedcap_write (tedcap_t *c, int64_t mono, int64_t wall,
+                  const uint8_t *buf, int len)
+{
+    uint8_t hdr[HDR_LEN];
+
+    if (len <= 0 || len > TEDCAP_MAXREC) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (c->mono < 0) {
+        memcpy (hdr, HDR_MAGIC, 8);
+        _put64 (hdr + 8, wall);
+        _put64 (hdr + 16, mono);
+        fwrite (hdr, 1, sizeof (hdr), c->f);
+        c->mono = mono;
+        _sync (c, mono, wall);
+    } else if (mono - c->mono_base >= TEDCAP_SYNC_NS)
+        _sync (c, mono, wall);
+    _advance (c, mono);
+    _putvar (c->f, len);
+    fwrite (buf, 1, len, c->f);
+    return ferror (c->f) ? -1 : 0;
+}
+
+int tedcap_flush (tedcap_t *c)
+{
+    return fflush (c->f) == 0 ? 0 : -1;
+}
+
+/* Find the index from the trailer, if the capture was closed cleanly.
+ */
+static void _load_index (tedcap_t *c)
+{
+    uint8_t t[TRAILER_LEN], e[IDX_ENTRY_LEN];
+    uint64_t off, count, i;
+    long size;
+
+    if (fseek (c->f, 0, SEEK_END) < 0 || (size = ftell (c->f)) < 0)
+        return;
+    c->end = size;
+    if (size < HDR_LEN + TRAILER_LEN
+            || fseek (c->f, size - TRAILER_LEN, SEEK_SET) < 0
+            || fread (t, 1, sizeof (t), c->f) != sizeof (t)
+            || memcmp (t + 16, IDX_MAGIC, 8) != 0)
+        return;
+    off = _get64 (t);
+    count = _get64 (t + 8);
+    if (off < HDR_LEN || off + count * IDX_ENTRY_LEN + TRAILER_LEN != size
+            || fseek (c->f, off, SEEK_SET) < 0)
+        return;
+    for (i = 0; i < count; i++) {
+        if (fread (e, 1, sizeof (e), c->f) != sizeof (e)) {
+            c->nidx = 0;
+            return;
+        }
+        _idx_add (c, _get64 (e), _get64 (e + 8), _get64 (e + 16));
+    }
+    c->end = off;
+}
+
+tedcap_t *tedcap_open (const char *path)
+{
+    tedcap_t *c = xzmalloc (sizeof (*c));
+    uint8_t hdr[HDR_LEN];
+
+    if (!(c->f = fopen (path, "r"))) {
+        free (c);
+        return NULL;
+    }
+    if (fread (hdr, 1, sizeof (hdr), c->f) != sizeof (hdr)
+                                || memcmp (hdr, HDR_MAGIC, 8) != 0) {
+        fclose (c->f);
+        free (c);
+        errno = EINVAL;
+        return NULL;
+    }
+    c->wall_base = _get64 (hdr + 8);
+    c->mono = c->mono_base = _get64 (hdr + 16);
+    _load_index (c);
+    if (fseek (c->f, HDR_LEN, SEEK_SET) < 0) {
+        tedcap_close (c);
+        return NULL;
+    }
+    c->off = HDR_LEN;
+    return c;
+}
+
+int tedcap_read (tedcap_t *c, int64_t *mono, int64_t *wall,
+                 uint8_t *buf, int len)
+{
+    uint64_t dt, n;
+    uint8_t b[8];
+
+    for (;;) {
+        if (c->off >= c->end)
+            return 0;
+        if (_getvar (c, &dt) < 0)
+            return errno ? -1 : 0;
+        if (_getvar (c, &n) < 0)
+            goto corrupt;
+        c->mono += dt * 1000;
+        if (n == 0) {
+            if (fread (b, 1, 8, c->f) != 8)
+                goto corrupt;
+            c->off += 8;
+            c->wall_base = _get64 (b);
+            c->mono_base = c->mono;
+            continue;
+        }
+        if (n > len || n > TEDCAP_MAXREC)
+            goto corrupt;
+        if (fread (buf, 1, n, c->f) != n)
+            goto corrupt;
+        c->off += n;
+        if (mono)
+            *mono = c->mono;
+        if (wall)
+            *wall = c->wall_base + (c->mono - c->mono_base);
+        return n;
+    }
+corrupt:
+    errno = EINVAL;
+    return -1;
+}
+
+/* Without an index (the capture was cut off), go back to the start.
+ * Otherwise skip the sync record found, whose time is in the index.
+ */
+int tedcap_seek (tedcap_t *c, int64_t wall)
+{
+    uint8_t hdr[HDR_LEN];
+    uint64_t dt, n;
+    int i;
+
+    for (i = c->nidx - 1; i > 0 && c->idx[i].wall > wall; i--)
+        ;
+    if (c->nidx == 0) {
+        if (fseek (c->f, 0, SEEK_SET) < 0
+                || fread (hdr, 1, sizeof (hdr), c->f) != sizeof (hdr))
+            return -1;
+        c->off = HDR_LEN;
+        c->wall_base = _get64 (hdr + 8);
+        c->mono = c->mono_base = _get64 (hdr + 16);
+        return 0;
+    }
+    if (fseek (c->f, c->idx[i].off, SEEK_SET) < 0)
+        return -1;
+    c->off = c->idx[i].off;
+    if (_getvar (c, &dt) < 0 || _getvar (c, &n) < 0 || n != 0
+                             || fseek (c->f, 8, SEEK_CUR) < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    c->off += 8;
+    c->mono = c->mono_base = c->idx[i].mono;
+    c->wall_base = c->idx[i].wall;
+    return 0;
+}
+
+int tedcap_close (tedcap_t *c)
+{
+    uint8_t e[IDX_ENTRY_LEN], t[TRAILER_LEN];
+    int rc = 0;
+    long off;
+    int i;
+
+    if (c->writer && c->mono >= 0 && (off = ftell (c->f)) >= 0) {
+        for (i = 0; i < c->nidx; i++) {
+            _put64 (e, c->idx[i].off);
+            _put64 (e + 8, c->idx[i].mono);
+            _put64 (e + 16, c->idx[i].wall);
+            fwrite (e, 1, sizeof (e), c->f);
+        }
+        _put64 (t, off);
+        _put64 (t + 8, c->nidx);
+        memcpy (t + 16, IDX_MAGIC, 8);
+        fwrite (t, 1, sizeof (t), c->f);
+    }
+    if (ferror (c->f))
+        rc = -1;
+    if (fclose (c->f) != 0)
+        rc = -1;
+    free (c->idx);
+    free (c);
+    return rc;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
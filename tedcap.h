@@ -0,0 +1,56 @@
+/* Capture files of the raw TED PLM byte stream.
+ *
+ * A 24 byte header ("TEDCAP1\n", then the wall and monotonic clocks in
+ * ns at the start) is followed by records.  Each record is a varint of
+ * microseconds since the previous record (monotonic), a varint length,
+ * and that many bytes as read from the wire.  A record of length 0
+ * instead carries the wall clock (8 bytes, ns), written at least every
+ * TEDCAP_SYNC_NS so that wall time survives clock steps and a capture
+ * cut off by a crash is still readable.  On a clean close, the offsets
+ * of those sync records are appended as an index followed by a 24 byte
+ * trailer (index offset, entry count, "TEDIDX1\n").  All integers are
+ * little-endian.
+ */
+#define TEDCAP_SYNC_NS  1000000000LL
+
+typedef struct tedcap_struct tedcap_t;
+
+/* Create a capture for writing.  Returns NULL with errno set on error.
+ */
+tedcap_t *tedcap_create (const char *path);
+
+/* Append bytes read at the given clock times (ns).
+ */
+int tedcap_write (tedcap_t *c, int64_t mono, int64_t wall,
+                  const uint8_t *buf, int len);
+
+/* Push buffered records to the file, e.g. once a second while capturing.
+ */
+int tedcap_flush (tedcap_t *c);
+
+/* Open a capture for reading.  Returns NULL with errno set (EINVAL if
+ * it is not a capture).
+ */
+tedcap_t *tedcap_open (const char *path);
+
+/* Read the next record into buf, of size len (TEDCAP_MAXREC is enough).
+ * Returns its length, 0 at the end, or -1 with errno set (EINVAL if the
+ * file is corrupt).
+ */
+#define TEDCAP_MAXREC   256
+int tedcap_read (tedcap_t *c, int64_t *mono, int64_t *wall,
+                 uint8_t *buf, int len);
+
+/* Position the reader at the last sync point at or before wall time t,
+ * using the index if there is one.
+ */
+int tedcap_seek (tedcap_t *c, int64_t wall);
+
+/* Flush and, for a writer, append the index.  Returns -1 if anything
+ * could not be written.
+ */
+int tedcap_close (tedcap_t *c);
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
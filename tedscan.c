@@ -0,0 +1,447 @@
+/*****************************************************************************
+ *  Copyright (C) 2014 Jim Garlick
+ *  Written by Jim Garlick <garlick.jim@gmail.com>
+ *  All Rights Reserved.
+ *
+ *  This file is part of pi-ted-envoy.
+ *  For details, see <https://github.com/garlick/pi-ted-envoy>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+/* tedscan.c - bulk decode TED captures on all cores (see tedscan.h) */
+
+/* The input is cut into CHUNK byte pieces that worker threads claim in
+ * turn.  A worker checks every position of its chunk for a frame
+ * starting there, 16 positions at a time with GCC vector extensions,
+ * reading up to 10 bytes into the next chunk.  On x86 these become SSE;
+ * the Pi's ARMv6 has no NEON, so there GCC lowers them to scalar code.
+ * Since ~x == 0xff - x, the bytes need not be inverted to be tested: a
+ * sync byte is 0xaa on the wire, and ten inverted bytes summing to zero
+ * (the checksum, see ted.c) is ten wire bytes summing to 10 * 0xff mod
+ * 256.  Only the few candidates that pass are inverted and calibrated.
+ *
+ * Frames can straddle a chunk edge and, in noise, overlap each other, so
+ * workers keep every sync byte they find.  A serial pass then walks the
+ * candidates in order, choosing frames that start past the end of the
+ * last one chosen, and a second parallel pass copies the choices into
+ * the output columns.  Both serial and parallel passes touch only
+ * candidates, about one per 11 bytes of clean input.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "ted.h"
+#include "tedcap.h"
+#include "tedscan.h"
+
+#define CHUNK           (1 << 20)       /* bytes of input per work item */
+#define FRAME_LEN       11
+
+#define SYNC_RAW        0xaa            /* ~0x55 */
+#define CKSUM_RAW       ((10 * 0xff) & 0xff)
+
+typedef uint8_t v16_t __attribute__ ((vector_size (16)));
+
+#define LANE_MSB        0x8080808080808080ULL
+#define SPLAT(x)        { x, x, x, x, x, x, x, x, x, x, x, x, x, x, x, x }
+
+typedef struct {
+    uint64_t pos;                       /* of the sync byte */
+    int32_t watts;
+    int32_t volts;
+    uint8_t addr;
+    uint8_t count;
+    bool ok;                            /* checksum verified */
+    bool keep;                          /* chosen by the merge */
+} cand_t;
+
+typedef struct {
+    cand_t *c;
+    long n;
+    long max;
+    long out;                           /* output index of first frame */
+} chunk_t;
+
+typedef struct scan_struct scan_t;
+
+struct scan_struct {
+    const uint8_t *buf;
+    size_t len;
+    const uint64_t *roff;               /* capture: start of each record */
+    const int64_t *rwall;               /*   and its wall clock time */
+    long nrec;
+    bool timed;                         /* input was a capture */
+    chunk_t *chunk;
+    long nchunk;
+    long next;                          /* next chunk to claim */
+    void (*fn)(scan_t *sc, long k);
+    tedscan_t *s;
+};
+
+static void *_alloc (size_t size)
+{
+    void *p = malloc (size ? size : 1);
+
+    if (!p)
+        oom ();
+    return p;
+}
+
+static inline v16_t _load (const uint8_t *p)
+{
+    v16_t v;
+
+    memcpy (&v, p, sizeof (v));
+    return v;
+}
+
+static void _cand (chunk_t *ch, const uint8_t *p, uint64_t pos, bool ok)
+{
+    uint8_t pkt[FRAME_LEN];
+    int watts, volts;
+    cand_t *c;
+    int i;
+
+    if (ch->n == ch->max) {
+        ch->max = ch->max ? ch->max * 2 : CHUNK / FRAME_LEN + 16;
+        if (!(ch->c = realloc (ch->c, ch->max * sizeof (ch->c[0]))))
+            oom ();
+    }
+    c = &ch->c[ch->n++];
+    c->pos = pos;
+    c->ok = ok;
+    c->keep = false;
+    if (ok) {
+        for (i = 0; i < FRAME_LEN; i++)
+            pkt[i] = ~p[i];
+        ted_calib (pkt, &watts, &volts);
+        c->addr = pkt[1];
+        c->count = pkt[2];
+        c->watts = watts;
+        c->volts = volts;
+    }
+}
+
+static bool _cksum_ok (const uint8_t *p)
+{
+    uint8_t sum = p[10];
+    int i;
+
+    for (i = 0; i < 9; i++)
+        sum += p[i];
+    return sum == CKSUM_RAW;
+}
+
+/* Find candidates at positions [lo, hi) of chunk k.
+ */
+static void _scan (scan_t *sc, long k)
+{
+    static const v16_t sync = SPLAT (SYNC_RAW);
+    static const v16_t cksum = SPLAT (CKSUM_RAW);
+    const uint8_t *b = sc->buf;
+    chunk_t *ch = &sc->chunk[k];
+    uint64_t lo = (uint64_t)k * CHUNK;
+    uint64_t hi = lo + CHUNK;
+    uint64_t i, m[2], ok[2];
+    v16_t v0, sum;
+    int j, lane;
+
+    if (hi > sc->len - FRAME_LEN + 1)
+        hi = sc->len - FRAME_LEN + 1;
+    for (i = lo; i + 16 <= hi; i += 16) {
+        v0 = _load (b + i);
+        v0 = (v16_t)(v0 == sync);
+        memcpy (m, &v0, sizeof (m));
+        if (!(m[0] | m[1]))
+            continue;
+        sum = _load (b + i) + _load (b + i + 1) + _load (b + i + 2)
+            + _load (b + i + 3) + _load (b + i + 4) + _load (b + i + 5)
+            + _load (b + i + 6) + _load (b + i + 7) + _load (b + i + 8)
+            + _load (b + i + 10);
+        sum = (v16_t)(sum == cksum);
+        memcpy (ok, &sum, sizeof (ok));
+        for (j = 0; j < 2; j++) {
+            m[j] &= LANE_MSB;           /* one bit per lane */
+            while (m[j]) {
+                lane = __builtin_ctzll (m[j]) / 8;
+                _cand (ch, b + i + j * 8 + lane, i + j * 8 + lane,
+                       (ok[j] >> (lane * 8 + 7)) & 1);
+                m[j] &= m[j] - 1;
+            }
+        }
+    }
+    for (; i < hi; i++) {
+        if (b[i] == SYNC_RAW)
+            _cand (ch, b + i, i, _cksum_ok (b + i));
+    }
+}
+
+/* Copy the frames chosen from chunk k to the output.
+ */
+static void _fill (scan_t *sc, long k)
+{
+    chunk_t *ch = &sc->chunk[k];
+    tedscan_t *s = sc->s;
+    long i, o = ch->out;
+    long lo, hi, r = -1;
+    uint64_t last;
+    cand_t *c;
+
+    for (i = 0; i < ch->n; i++) {
+        c = &ch->c[i];
+        if (!c->keep)
+            continue;
+        s->watts[o] = c->watts;
+        s->volts[o] = c->volts;
+        s->addr[o] = c->addr;
+        s->count[o] = c->count;
+        if (s->time) {
+            /* time of the record holding the last byte of the frame */
+            last = c->pos + FRAME_LEN - 1;
+            if (r < 0) {
+                lo = 0;
+                hi = sc->nrec;
+                while (hi - lo > 1) {
+                    r = (lo + hi) / 2;
+                    if (sc->roff[r] > last)
+                        hi = r;
+                    else
+                        lo = r;
+                }
+                r = lo;
+            }
+            while (r + 1 < sc->nrec && sc->roff[r + 1] <= last)
+                r++;
+            s->time[o] = sc->rwall[r];
+        }
+        o++;
+    }
+    free (ch->c);
+    ch->c = NULL;
+}
+
+static void *_worker (void *arg)
+{
+    scan_t *sc = arg;
+    long k;
+
+    while ((k = __atomic_fetch_add (&sc->next, 1, __ATOMIC_RELAXED))
+                                                            < sc->nchunk)
+        sc->fn (sc, k);
+    return NULL;
+}
+
+/* Run fn over every chunk on 'jobs' threads, this one included.
+ */
+static void _run (scan_t *sc, void (*fn)(scan_t *sc, long k), int jobs)
+{
+    pthread_t t[jobs];
+    int i, e;
+
+    sc->fn = fn;
+    sc->next = 0;
+    for (i = 1; i < jobs; i++) {
+        if ((e = pthread_create (&t[i], NULL, _worker, sc))) {
+            fprintf (stderr, "pthread_create: %s\n", strerror (e));
+            exit (1);
+        }
+    }
+    _worker (sc);
+    for (i = 1; i < jobs; i++)
+        pthread_join (t[i], NULL);
+}
+
+static tedscan_t *_decode (scan_t *sc, int jobs)
+{
+    tedscan_t *s = xzmalloc (sizeof (*s));
+    uint64_t end = 0;
+    long k, i, n = 0;
+    cand_t *c;
+
+    if (jobs <= 0)
+        jobs = sysconf (_SC_NPROCESSORS_ONLN);
+    if (jobs <= 0)
+        jobs = 1;
+    sc->nchunk = sc->len >= FRAME_LEN
+               ? (sc->len - FRAME_LEN) / CHUNK + 1 : 0;
+    if (jobs > sc->nchunk)
+        jobs = sc->nchunk ? sc->nchunk : 1;
+    sc->chunk = xzmalloc ((sc->nchunk + 1) * sizeof (sc->chunk[0]));
+    sc->s = s;
+    _run (sc, _scan, jobs);
+
+    for (k = 0; k < sc->nchunk; k++) {
+        sc->chunk[k].out = n;
+        for (i = 0; i < sc->chunk[k].n; i++) {
+            c = &sc->chunk[k].c[i];
+            if (c->pos < end)
+                continue;
+            if (!c->ok) {
+                s->badsync++;
+                continue;
+            }
+            c->keep = true;
+            end = c->pos + FRAME_LEN;
+            n++;
+        }
+    }
+
+    s->n = n;
+    s->bytes = sc->len;
+    s->watts = _alloc (n * sizeof (s->watts[0]));
+    s->volts = _alloc (n * sizeof (s->volts[0]));
+    s->addr = _alloc (n * sizeof (s->addr[0]));
+    s->count = _alloc (n * sizeof (s->count[0]));
+    if (sc->timed)
+        s->time = _alloc (n * sizeof (s->time[0]));
+    _run (sc, _fill, jobs);
+    free (sc->chunk);
+    return s;
+}
+
+tedscan_t *tedscan_buf (const uint8_t *buf, size_t len, int jobs)
+{
+    scan_t sc;
+
+    memset (&sc, 0, sizeof (sc));
+    sc.buf = buf;
+    sc.len = len;
+    return _decode (&sc, jobs);
+}
+
+/* Concatenate the records of a capture, noting where each one starts.
+ */
+static tedscan_t *_capture (tedcap_t *cap, int jobs)
+{
+    uint8_t rec[TEDCAP_MAXREC];
+    uint8_t *buf = NULL;
+    uint64_t *roff = NULL;
+    int64_t *rwall = NULL;
+    size_t len = 0, max = 0;
+    long nrec = 0, maxrec = 0;
+    bool truncated = false;
+    int64_t wall;
+    tedscan_t *s;
+    scan_t sc;
+    int n;
+
+    while ((n = tedcap_read (cap, NULL, &wall, rec, sizeof (rec))) != 0) {
+        if (n < 0) {
+            if (errno != EINVAL) {
+                free (buf);
+                free (roff);
+                free (rwall);
+                return NULL;
+            }
+            truncated = true;
+            break;
+        }
+        if (len + n > max) {
+            max = max ? max * 2 : 1 << 20;
+            if (!(buf = realloc (buf, max)))
+                oom ();
+        }
+        if (nrec == maxrec) {
+            maxrec = maxrec ? maxrec * 2 : 1 << 16;
+            if (!(roff = realloc (roff, maxrec * sizeof (roff[0])))
+                    || !(rwall = realloc (rwall, maxrec * sizeof (rwall[0]))))
+                oom ();
+        }
+        memcpy (buf + len, rec, n);
+        roff[nrec] = len;
+        rwall[nrec] = wall;
+        nrec++;
+        len += n;
+    }
+    memset (&sc, 0, sizeof (sc));
+    sc.buf = buf;
+    sc.len = len;
+    sc.roff = roff;
+    sc.timed = true;
+    sc.rwall = rwall;
+    sc.nrec = nrec;
+    s = _decode (&sc, jobs);
+    s->truncated = truncated;
+    free (buf);
+    free (roff);
+    free (rwall);
+    return s;
+}
+
+tedscan_t *tedscan_file (const char *path, int jobs)
+{
+    tedcap_t *cap;
+    tedscan_t *s;
+    struct stat sb;
+    void *p = NULL;
+    int fd, saved;
+
+    if ((cap = tedcap_open (path))) {
+        s = _capture (cap, jobs);
+        saved = errno;
+        tedcap_close (cap);
+        errno = saved;
+        return s;
+    }
+    if (errno != EINVAL)
+        return NULL;
+    if ((fd = open (path, O_RDONLY)) < 0)
+        return NULL;
+    if (fstat (fd, &sb) < 0)
+        goto error;
+    if (sb.st_size > 0) {
+        p = mmap (NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+            goto error;
+    }
+    close (fd);
+    s = tedscan_buf (p, sb.st_size, jobs);
+    if (p)
+        munmap (p, sb.st_size);
+    return s;
+error:
+    saved = errno;
+    close (fd);
+    errno = saved;
+    return NULL;
+}
+
+void tedscan_destroy (tedscan_t *s)
+{
+    if (s) {
+        free (s->time);
+        free (s->watts);
+        free (s->volts);
+        free (s->addr);
+        free (s->count);
+        free (s);
+    }
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,39 @@
+/* Bulk decoding of TED captures, for offline analysis.
+ *
+ * The whole input is decoded at once, in chunks spread over 'jobs'
+ * threads, into one column per field.  A frame is any 0x55 sync byte
+ * (after inversion) followed by ten bytes whose checksum verifies; where
+ * frames overlap the first one wins.  Unlike ted_decode(), a sync byte
+ * with a bad checksum skips one byte rather than eleven, so a false sync
+ * inside line noise does not cost the real frame behind it.
+ */
+
+typedef struct {
+    long n;                             /* frames decoded */
+    int64_t *time;                      /* wall clock, ns (NULL for raw) */
+    int32_t *watts;
+    int32_t *volts;
+    uint8_t *addr;
+    uint8_t *count;
+    long badsync;                       /* sync bytes outside any frame whose
+                                           checksum failed (not frames) */
+    uint64_t bytes;                     /* input bytes scanned */
+    bool truncated;                     /* capture ended in a bad record */
+} tedscan_t;
+
+/* Decode a file, either a capture (see tedcap.h) or raw bytes as read
+ * from the PLM.  'jobs' of 0 means one per CPU.  Returns NULL with
+ * errno set on error.  A capture that ends in a corrupt record, e.g.
+ * one cut off by a crash, is decoded up to that point.
+ */
+tedscan_t *tedscan_file (const char *path, int jobs);
+
+/* Decode raw bytes in memory.
+ */
+tedscan_t *tedscan_buf (const uint8_t *buf, size_t len, int jobs);
+
+void tedscan_destroy (tedscan_t *s);
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
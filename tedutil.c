@@ -22,6 +22,14 @@
  *****************************************************************************/
 /* tedutil.c - dump ted data */
 
+/* By default, decode frames from the serial port and print them.  With
+ * --capture, record the raw bytes to a capture file (see tedcap.h)
+ * instead, with a line of statistics each second, so that a noisy
+ * install can be studied later without losing data to the console.
+ * --replay decodes a capture as if it were the serial port, optionally
+ * starting --from a wall clock time, found through the capture's index.
+ */
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -35,32 +43,298 @@
 #include <time.h>
 #include <signal.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <poll.h>
 
 #include "ted.h"
+#include "tedcap.h"
 
-int main (int argc, char *argv[])
+#define TED_DEV		"/dev/ttyAMA0"
+#define GAP_MS		20	/* idle time that ends a burst (~2 bytes) */
+
+#define OPTIONS "c:r:f:q"
+#define HAVE_GETOPT_LONG 1
+
+#if HAVE_GETOPT_LONG
+#define GETOPT(ac,av,opt,lopt) getopt_long (ac,av,opt,lopt,NULL)
+static const struct option longopts[] = {
+	{"capture",	required_argument,	0, 'c'},
+	{"replay",	required_argument,	0, 'r'},
+	{"from",	required_argument,	0, 'f'},
+	{"quiet",	no_argument,		0, 'q'},
+	{0, 0, 0, 0},
+};
+#else
+#define GETOPT(ac,av,opt,lopt) getopt (ac,av,opt)
+#endif
+
+typedef struct {
+	ted_decoder_t dec;
+	unsigned long frames;
+	unsigned long bad;		/* checksum failures */
+	unsigned long gaps;		/* breaks in the count sequence */
+	unsigned long missing;		/* frames those breaks skipped */
+	int last;			/* count of the last frame or -1 */
+} stats_t;
+
+static volatile sig_atomic_t stop = 0;
+
+static void usage (void)
 {
-	int addr, count, volts, watts;
+	fprintf (stderr,
+"Usage: tedutil [OPTIONS] [DEVICE]\n"
+"   -c,--capture FILE   record raw bytes from DEVICE (default " TED_DEV ")\n"
+"                       to FILE, printing statistics each second\n"
+"   -r,--replay FILE    decode a capture instead of DEVICE\n"
+"   -f,--from TIME      with -r, start at TIME (seconds since the epoch)\n"
+"   -q,--quiet          do not print decoded frames, only statistics\n"
+	);
+	exit (1);
+}
 
-	if (ted_init ("/dev/ttyAMA0") < 0) {
-		perror ("/dev/ttyAMA0");
-		return 1;
-	}
+static int64_t now_ns (clockid_t id)
+{
+	struct timespec ts;
 
-	for (;;) {
-		if (ted_read (&addr, &count, &watts, &volts) < 0) {
-			if (errno != EINVAL) {
-				perror ("ted_read");
-				break;
+	clock_gettime (id, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void stats_init (stats_t *st)
+{
+	memset (st, 0, sizeof (*st));
+	ted_decoder_init (&st->dec);
+	st->last = -1;
+}
+
+/* Decode bytes read at wall time 'wall' (ns, or 0 if live), keeping
+ * statistics and printing frames if 'print'.
+ */
+static void feed (stats_t *st, const uint8_t *buf, int len, int64_t wall,
+		  bool print)
+{
+	int addr, count, watts, volts;
+	int i, j, rc;
+
+	for (i = 0; i < len; i++) {
+		rc = ted_decode (&st->dec, buf[i], &addr, &count, &watts,
+				 &volts);
+		if (rc == 0)
+			continue;
+		if (rc < 0) {
+			st->bad++;
+			if (print) {
+				fprintf (stderr, "bad checksum:");
+				for (j = 0; j < 11; j++)
+					fprintf (stderr, " %02x",
+						 st->dec.pkt[j]);
+				fprintf (stderr, "\n");
 			}
-			fprintf (stderr, "bad packet\n");
 			continue;
 		}
+		st->frames++;
+		if (st->last >= 0 && count != ((st->last + 1) & 0xff)) {
+			st->gaps++;
+			st->missing += (count - st->last - 1) & 0xff;
+		}
+		st->last = count;
+		if (!print)
+			continue;
+		if (wall)
+			printf ("%lld.%06lld ", (long long)(wall / 1000000000),
+				(long long)(wall % 1000000000 / 1000));
 		printf ("addr=%d count=%d volts=%d watts=%d\n",
 			addr, count, volts, watts);
 	}
+}
+
+static void stats_print (stats_t *st, const char *what, double rate)
+{
+	fprintf (stderr, "%s: %.1f frames/s, %lu frames, %lu resync bytes, "
+		 "%lu bad checksums, %lu count gaps (%lu frames missing)\n",
+		 what, rate, st->frames, st->dec.resync, st->bad, st->gaps,
+		 st->missing);
+}
+
+static void on_signal (int sig)
+{
+	stop = 1;
+}
+
+/* Read bursts of bytes, each ended by GAP_MS of quiet, and write each
+ * as one record stamped with the time its first byte arrived.
+ */
+static void capture (const char *dev, const char *path, bool quiet)
+{
+	struct sigaction sa;
+	struct pollfd pfd;
+	uint8_t buf[TEDCAP_MAXREC];
+	int64_t mono = 0, wall = 0, t0, tick;
+	unsigned long frames = 0;
+	tedcap_t *cap;
+	stats_t st;
+	int n = 0, rc;
+
+	if ((pfd.fd = ted_open ((char *)dev)) < 0) {
+		perror (dev);
+		exit (1);
+	}
+	pfd.events = POLLIN;
+	if (!(cap = tedcap_create (path))) {
+		perror (path);
+		exit (1);
+	}
+	memset (&sa, 0, sizeof (sa));
+	sa.sa_handler = on_signal;	/* no SA_RESTART: interrupt poll */
+	sigaction (SIGINT, &sa, NULL);
+	sigaction (SIGTERM, &sa, NULL);
+	stats_init (&st);
+	t0 = tick = now_ns (CLOCK_MONOTONIC);
+	while (!stop) {
+		rc = poll (&pfd, 1, n > 0 ? GAP_MS : 1000);
+		if (rc < 0 && errno != EINTR) {
+			perror ("poll");
+			exit (1);
+		}
+		if (rc > 0) {
+			if (n == 0) {
+				mono = now_ns (CLOCK_MONOTONIC);
+				wall = now_ns (CLOCK_REALTIME);
+			}
+			if ((rc = read (pfd.fd, buf + n, sizeof (buf) - n))
+									<= 0) {
+				fprintf (stderr, "%s: %s\n", dev,
+					 rc < 0 ? strerror (errno) : "EOF");
+				break;
+			}
+			feed (&st, buf + n, rc, 0, false);
+			n += rc;
+		}
+		if (n > 0 && (rc == 0 || n == sizeof (buf))) {
+			if (tedcap_write (cap, mono, wall, buf, n) < 0) {
+				perror (path);
+				exit (1);
+			}
+			n = 0;
+		}
+		if (now_ns (CLOCK_MONOTONIC) - tick >= 1000000000LL) {
+			tick += 1000000000LL;
+			if (!quiet)
+				stats_print (&st, "capture",
+					     st.frames - frames);
+			frames = st.frames;
+			if (tedcap_flush (cap) < 0) {
+				perror (path);
+				exit (1);
+			}
+		}
+	}
+	if (n > 0)
+		(void)tedcap_write (cap, mono, wall, buf, n);
+	if (tedcap_close (cap) < 0) {
+		perror (path);
+		exit (1);
+	}
+	close (pfd.fd);
+	stats_print (&st, "total", st.frames * 1E9
+		     / (now_ns (CLOCK_MONOTONIC) - t0 + 1));
+}
+
+/* Decode the capture at path, skipping bytes recorded before wall time
+ * 'from' (ns, or 0 for all of it).
+ */
+static void replay (const char *path, int64_t from, bool quiet)
+{
+	uint8_t buf[TEDCAP_MAXREC];
+	int64_t mono, wall, first = -1, last = 0;
+	tedcap_t *cap;
+	stats_t st;
+	int n;
+
+	if (!(cap = tedcap_open (path))) {
+		fprintf (stderr, "%s: %s\n", path, errno == EINVAL
+			 ? "not a TED capture" : strerror (errno));
+		exit (1);
+	}
+	if (from > 0 && tedcap_seek (cap, from) < 0) {
+		fprintf (stderr, "%s: %s\n", path, errno == EINVAL
+			 ? "truncated or corrupt" : strerror (errno));
+		exit (1);
+	}
+	stats_init (&st);
+	while ((n = tedcap_read (cap, &mono, &wall, buf, sizeof (buf))) > 0) {
+		if (wall < from)
+			continue;
+		if (first < 0)
+			first = mono;
+		last = mono;
+		feed (&st, buf, n, wall, !quiet);
+	}
+	if (n < 0)
+		fprintf (stderr, "%s: %s\n", path, errno == EINVAL
+			 ? "truncated or corrupt" : strerror (errno));
+	tedcap_close (cap);
+	stats_print (&st, "total", first < 0 || last == first ? 0
+		     : st.frames * 1E9 / (last - first));
+}
 
-	ted_fini ();
+int main (int argc, char *argv[])
+{
+	const char *dev = TED_DEV;
+	char *copt = NULL;
+	char *ropt = NULL;
+	int64_t fopt = 0;
+	bool qopt = false;
+	char *end;
+	stats_t st;
+	uint8_t buf[64];
+	int c, fd, n;
+
+	while ((c = GETOPT (argc, argv, OPTIONS, longopts)) != -1) {
+		switch (c) {
+			case 'c':
+				copt = optarg;
+				break;
+			case 'r':
+				ropt = optarg;
+				break;
+			case 'f':
+				fopt = strtoll (optarg, &end, 10) * 1000000000LL;
+				if (end == optarg || *end != '\0' || fopt <= 0)
+					usage ();
+				break;
+			case 'q':
+				qopt = true;
+				break;
+			default:
+				usage ();
+		}
+	}
+	if (optind < argc - 1 || (copt && ropt) || (ropt && optind < argc)
+			      || (fopt && !ropt))
+		usage ();
+	if (optind < argc)
+		dev = argv[optind];
+	if (copt) {
+		capture (dev, copt, qopt);
+		return 0;
+	}
+	if (ropt) {
+		replay (ropt, fopt, qopt);
+		return 0;
+	}
+
+	if ((fd = ted_open ((char *)dev)) < 0) {
+		perror (dev);
+		return 1;
+	}
+	stats_init (&st);
+	while ((n = read (fd, buf, sizeof (buf))) > 0)
+		feed (&st, buf, n, 0, true);
+	if (n < 0)
+		perror ("read");
+	close (fd);
 
 	return 0;
 }
@@ -0,0 +1,171 @@
+/*****************************************************************************
+ *  Copyright (C) 2014 Jim Garlick
+ *  Written by Jim Garlick <garlick.jim@gmail.com>
+ *  All Rights Reserved.
+ *
+ *  This file is part of pi-ted-envoy.
+ *  For details, see <https://github.com/garlick/pi-ted-envoy>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+/* trace.c - per-thread span rings, Chrome trace-event output */
+
+#define _GNU_SOURCE /* for open_memstream */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "trace.h"
+#include "util.h"
+
+typedef struct {
+    const char *name;
+    uint64_t id;
+    uint64_t start;
+    uint64_t end;
+} trace_event_t;
+
+typedef struct ring {
+    trace_event_t ev[TRACE_RING];
+    uint64_t head;                      /* number of events ever written */
+    int tid;
+    char name[16];
+    struct ring *next;
+} ring_t;
+
+bool trace_enabled = false;
+
+static __thread ring_t *self = NULL;
+static __thread const char *self_name = NULL;
+static ring_t *rings = NULL;
+static int ring_count = 0;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void trace_enable (bool on)
+{
+    trace_enabled = on;
+}
+
+void trace_thread (const char *name)
+{
+    self_name = name;
+    if (self)
+        snprintf (self->name, sizeof (self->name), "%s", name);
+}
+
+/* Rings are created on first use, so threads that never record cost
+ * nothing, and are never freed so a dump can still show exited threads.
+ */
+static ring_t *_ring (void)
+{
+    if (!self) {
+        ring_t *r = xzmalloc (sizeof (*r));
+        pthread_mutex_lock (&rings_lock);
+        r->tid = ++ring_count;
+        r->next = rings;
+        rings = r;
+        pthread_mutex_unlock (&rings_lock);
+        snprintf (r->name, sizeof (r->name), "%s",
+                  self_name ? self_name : "thread");
+        self = r;
+    }
+    return self;
+}
+
+void trace_span (const char *name, uint64_t id, uint64_t start, uint64_t end)
+{
+    ring_t *r;
+    trace_event_t *e;
+    uint64_t head;
+
+    if (!trace_enabled)
+        return;
+    r = _ring ();
+    head = r->head;
+    e = &r->ev[head % TRACE_RING];
+    e->name = name;
+    e->id = id;
+    e->start = start;
+    e->end = end;
+    __atomic_store_n (&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Copy a ring while its owner may still be writing it.  Events published
+ * before the copy started are valid unless the writer lapped them during
+ * the copy, which the second read of head detects.  The raw copy goes
+ * in tmp; returns the number of valid events, oldest first, in out.
+ */
+static int _snapshot (ring_t *r, trace_event_t *tmp, trace_event_t *out)
+{
+    uint64_t h1, h2, first, i;
+    int n = 0;
+
+    h1 = __atomic_load_n (&r->head, __ATOMIC_ACQUIRE);
+    memcpy (tmp, r->ev, sizeof (r->ev));
+    __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    h2 = __atomic_load_n (&r->head, __ATOMIC_RELAXED);
+
+    first = h1 > TRACE_RING ? h1 - TRACE_RING : 0;
+    if (h2 + 1 > TRACE_RING && h2 + 1 - TRACE_RING > first)
+        first = h2 + 1 - TRACE_RING;
+    for (i = first; i < h1; i++)
+        out[n++] = tmp[i % TRACE_RING];
+    return n;
+}
+
+char *trace_render (void)
+{
+    trace_event_t *ev = xzmalloc (sizeof (trace_event_t) * TRACE_RING);
+    trace_event_t *tmp = xzmalloc (sizeof (trace_event_t) * TRACE_RING);
+    const char *sep = "";
+    char *buf = NULL;
+    size_t len = 0;
+    ring_t *r;
+    FILE *f;
+    int i, n;
+
+    if (!(f = open_memstream (&buf, &len)))
+        oom ();
+    fprintf (f, "{\"traceEvents\":[");
+    pthread_mutex_lock (&rings_lock);
+    for (r = rings; r != NULL; r = r->next) {
+        fprintf (f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                 "\"tid\":%d,\"args\":{\"name\":\"%s\"}}", sep, r->tid,
+                 r->name);
+        sep = ",";
+        n = _snapshot (r, tmp, ev);
+        for (i = 0; i < n; i++) {
+            fprintf (f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,"
+                     "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+                     "\"args\":{\"id\":%llu}}",
+                     ev[i].name, r->tid, ev[i].start / 1000.0,
+                     (ev[i].end - ev[i].start) / 1000.0,
+                     (unsigned long long)ev[i].id);
+        }
+    }
+    pthread_mutex_unlock (&rings_lock);
+    fprintf (f, "\n]}\n");
+    fclose (f);
+    free (tmp);
+    free (ev);
+    return buf;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,24 @@
+#define TRACE_RING      4096    /* events kept per thread */
+
+/* Set by trace_enable().  Call sites may test it to skip taking
+ * timestamps that are only needed for tracing.
+ */
+extern bool trace_enabled;
+
+void trace_enable (bool on);
+
+/* Name the calling thread in the trace output.
+ */
+void trace_thread (const char *name);
+
+/* Record a span of stage 'name' (a string constant) for sample 'id',
+ * with start and end times from metrics_now().  Does nothing unless
+ * tracing is enabled.  Only the calling thread writes its ring, so no
+ * lock is taken; the oldest events are overwritten.
+ */
+void trace_span (const char *name, uint64_t id, uint64_t start, uint64_t end);
+
+/* Render all rings in Chrome trace-event JSON format ("X" events,
+ * timestamps in us).  Caller must free result.
+ */
+char *trace_render (void);
@@ -0,0 +1,392 @@
+/*****************************************************************************
+ *  Copyright (C) 2014 Jim Garlick
+ *  Written by Jim Garlick <garlick.jim@gmail.com>
+ *  All Rights Reserved.
+ *
+ *  This file is part of pi-ted-envoy.
+ *  For details, see <https://github.com/garlick/pi-ted-envoy>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+/* vi2c.c - virtual display backend for running the render path off the Pi */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "fb.h"
+#include "oled.h"
+#include "led.h"
+#include "i2c.h"
+#include "vi2c.h"
+
+#define VI2C_MAXDEV     16
+
+/* LED registers, see led.c */
+#define REG_DAT         0x02
+#define REG_SLEEP       0x04
+#define REG_BRIGHTNESS  0x0a
+
+#define OLED_TEXT_ROWS  8
+
+typedef struct {
+    bool used;
+    int addr;
+    i2c_devtype_t type;
+    /* LED */
+    uint8_t seg[4];
+    uint8_t brightness;
+    bool sleep;
+    /* OLED */
+    char text[OLED_TEXT_ROWS][OLED_TEXT_COL + 1];
+    int tx, ty;
+    uint8_t color;
+    uint8_t pix[FB_HEIGHT][FB_STRIDE];
+    unsigned long unknown;      /* undecodable commands */
+} vdev_t;
+
+static vdev_t dev[VI2C_MAXDEV];
+static pthread_mutex_t bus = PTHREAD_MUTEX_INITIALIZER; /* one at a time */
+static vi2c_stats_t stats;
+static int bus_khz = 0;
+static bool bus_delay = false;
+
+void vi2c_speed_set (int khz, bool delay)
+{
+    bus_khz = khz;
+    bus_delay = delay;
+}
+
+void vi2c_stats_get (vi2c_stats_t *st)
+{
+    *st = stats;
+}
+
+void vi2c_stats_reset (void)
+{
+    memset (&stats, 0, sizeof (stats));
+}
+
+/* Each transfer is START, address byte, data bytes, STOP; 9 clocks/byte.
+ */
+static void bus_xfer (int len)
+{
+    unsigned long ns;
+
+    stats.bytes += len + 1;
+    if (bus_khz == 0)
+        return;
+    ns = (9UL * (len + 1) + 2) * 1000000UL / bus_khz;
+    stats.bus_ns += ns;
+    if (bus_delay) {
+        struct timespec ts = { .tv_sec = ns / 1000000000UL,
+                               .tv_nsec = ns % 1000000000UL };
+        while (nanosleep (&ts, &ts) < 0 && errno == EINTR)
+            ;
+    }
+}
+
+static vdev_t *lookup (int h)
+{
+    if (h < 0 || h >= VI2C_MAXDEV || !dev[h].used) {
+        errno = EBADF;
+        return NULL;
+    }
+    return &dev[h];
+}
+
+static vdev_t *lookup_addr (int addr)
+{
+    int i;
+
+    for (i = 0; i < VI2C_MAXDEV; i++)
+        if (dev[i].used && dev[i].addr == addr)
+            return &dev[i];
+    return NULL;
+}
+
+static void oled_clear_state (vdev_t *d)
+{
+    memset (d->text, ' ', sizeof (d->text));
+    for (int i = 0; i < OLED_TEXT_ROWS; i++)
+        d->text[i][OLED_TEXT_COL] = '\0';
+    memset (d->pix, 0, sizeof (d->pix));
+    d->tx = d->ty = 0;
+}
+
+static void oled_setpix (vdev_t *d, int x, int y, bool on)
+{
+    uint8_t mask = 0x80 >> (x & 7);
+
+    if (x < 0 || x >= FB_WIDTH || y < 0 || y >= FB_HEIGHT)
+        return;
+    if (on)
+        d->pix[y][x >> 3] |= mask;
+    else
+        d->pix[y][x >> 3] &= ~mask;
+}
+
+/* Decode one Digole command at buf, return its length or -1.
+ */
+static int oled_cmd (vdev_t *d, const uint8_t *buf, int len)
+{
+    int i, x, y, n;
+
+    if (len >= 2 && !memcmp (buf, "CL", 2)) {
+        oled_clear_state (d);
+        return 2;
+    }
+    if (len >= 3 && !memcmp (buf, "CS", 2))
+        return 3;
+    if (len >= 4 && !memcmp (buf, "SOO", 3))
+        return 4;
+    if (len >= 4 && !memcmp (buf, "TP", 2)) {
+        d->tx = buf[2];
+        d->ty = buf[3];
+        return 4;
+    }
+    if (len >= 2 && !memcmp (buf, "TT", 2)) {
+        for (i = 2; i < len && buf[i] != '\0'; i++) {
+            if (d->ty < OLED_TEXT_ROWS && d->tx < OLED_TEXT_COL)
+                d->text[d->ty][d->tx] = buf[i];
+            d->tx++;
+        }
+        return i < len ? i + 1 : len;
+    }
+    if (len >= 6 && !memcmp (buf, "SI2CA", 5))
+        return 6;
+    if (len >= 3 && !memcmp (buf, "SC", 2)) {
+        d->color = buf[2];
+        return 3;
+    }
+    if (len >= 6 && !memcmp (buf, "FR", 2)) {
+        for (y = buf[3]; y <= buf[5]; y++)
+            for (x = buf[2]; x <= buf[4]; x++)
+                oled_setpix (d, x, y, d->color != 0);
+        return 6;
+    }
+    if (len >= 7 && !memcmp (buf, "DIM", 3)) {
+        int w = buf[5], h = buf[6], rowbytes = (w + 7) / 8;
+        n = 7 + rowbytes * h;
+        if (len < n)
+            return -1;
+        for (y = 0; y < h; y++)
+            for (x = 0; x < w; x++)
+                oled_setpix (d, buf[3] + x, buf[4] + y,
+                             buf[7 + y * rowbytes + x / 8] & (0x80 >> (x % 8)));
+        return n;
+    }
+    return -1;
+}
+
+static void led_cmd (vdev_t *d, const uint8_t *buf, int len)
+{
+    if (len == 5 && buf[0] == REG_DAT) {
+        d->seg[0] = buf[4];
+        d->seg[1] = buf[3];
+        d->seg[2] = buf[2];
+        d->seg[3] = buf[1];
+    } else if (len >= 2 && buf[0] == REG_BRIGHTNESS)
+        d->brightness = buf[1];
+    else if (len >= 2 && buf[0] == REG_SLEEP)
+        d->sleep = (buf[1] == 0xa5);
+}
+
+static int _open (int addr, i2c_devtype_t type)
+{
+    int i;
+
+    for (i = 0; i < VI2C_MAXDEV; i++) {
+        if (!dev[i].used) {
+            memset (&dev[i], 0, sizeof (dev[i]));
+            dev[i].used = true;
+            dev[i].addr = addr;
+            dev[i].type = type;
+            oled_clear_state (&dev[i]);
+            return i;
+        }
+    }
+    errno = EMFILE;
+    return -1;
+}
+
+static int _write (int h, const uint8_t *buf, int len)
+{
+    vdev_t *d = lookup (h);
+    int off, n;
+
+    if (!d)
+        return -1;
+    stats.writes++;
+    bus_xfer (len);
+    switch (d->type) {
+        case I2C_DEV_OLED:
+            for (off = 0; off < len; off += n) {
+                if ((n = oled_cmd (d, buf + off, len - off)) < 0) {
+                    d->unknown++;
+                    break;
+                }
+            }
+            break;
+        case I2C_DEV_LED:
+            led_cmd (d, buf, len);
+            break;
+        case I2C_DEV_RAW:
+            break;
+    }
+    return len;
+}
+
+/* Reads return zeros, which the LED module reports as STATUS_RUN.
+ */
+static int _read (int h, uint8_t *buf, int len)
+{
+    if (!lookup (h))
+        return -1;
+    stats.reads++;
+    bus_xfer (len);
+    memset (buf, 0, len);
+    return len;
+}
+
+static void _close (int h)
+{
+    vdev_t *d = lookup (h);
+
+    if (d)
+        d->used = false;
+}
+
+/* Devices may be opened from other threads than the one writing to the
+ * display, so like a real bus, take one transaction at a time.
+ */
+static int v_open (int addr, i2c_devtype_t type)
+{
+    int h;
+
+    pthread_mutex_lock (&bus);
+    h = _open (addr, type);
+    pthread_mutex_unlock (&bus);
+    return h;
+}
+
+static int v_write (int h, const uint8_t *buf, int len)
+{
+    int n;
+
+    pthread_mutex_lock (&bus);
+    n = _write (h, buf, len);
+    pthread_mutex_unlock (&bus);
+    return n;
+}
+
+static int v_read (int h, uint8_t *buf, int len)
+{
+    int n;
+
+    pthread_mutex_lock (&bus);
+    n = _read (h, buf, len);
+    pthread_mutex_unlock (&bus);
+    return n;
+}
+
+static void v_close (int h)
+{
+    pthread_mutex_lock (&bus);
+    _close (h);
+    pthread_mutex_unlock (&bus);
+}
+
+const i2c_ops_t vi2c_ops = {
+    .name = "virtual",
+    .open = v_open,
+    .write = v_write,
+    .read = v_read,
+    .close = v_close,
+};
+
+int vi2c_led_get (int addr, char *s, int len)
+{
+    vdev_t *d = lookup_addr (addr);
+    int i, n = 0;
+
+    if (!d || d->type != I2C_DEV_LED)
+        return -1;
+    for (i = 0; i < 4 && n < len - 2; i++) {
+        s[n++] = led_seg_char (d->seg[i]);
+        if ((d->seg[i] & 0x80))
+            s[n++] = '.';
+    }
+    s[n] = '\0';
+    return 0;
+}
+
+bool vi2c_oled_pixel (int addr, int x, int y)
+{
+    vdev_t *d = lookup_addr (addr);
+
+    if (!d || x < 0 || x >= FB_WIDTH || y < 0 || y >= FB_HEIGHT)
+        return false;
+    return (d->pix[y][x >> 3] & (0x80 >> (x & 7))) != 0;
+}
+
+void vi2c_dump (FILE *f)
+{
+    char s[16];
+    int i, x, y;
+
+    for (i = 0; i < VI2C_MAXDEV; i++) {
+        vdev_t *d = &dev[i];
+        if (!d->used)
+            continue;
+        switch (d->type) {
+            case I2C_DEV_LED:
+                vi2c_led_get (d->addr, s, sizeof (s));
+                fprintf (f, "led 0x%x: [%5s] brightness=0x%x%s\n", d->addr,
+                         s, d->brightness, d->sleep ? " asleep" : "");
+                break;
+            case I2C_DEV_OLED:
+                fprintf (f, "oled 0x%x:%s\n", d->addr,
+                         d->unknown ? " (undecoded commands seen)" : "");
+                for (y = 0; y < OLED_TEXT_ROWS; y++)
+                    if (strspn (d->text[y], " ") < OLED_TEXT_COL)
+                        fprintf (f, "  text %d: %s\n", y, d->text[y]);
+                for (y = 0; y < FB_HEIGHT; y += 2) {
+                    fputs ("  |", f);
+                    for (x = 0; x < FB_WIDTH; x++) {
+                        bool a = vi2c_oled_pixel (d->addr, x, y);
+                        bool b = vi2c_oled_pixel (d->addr, x, y + 1);
+                        fputc (a && b ? '8' : a ? '\'' : b ? '.' : ' ', f);
+                    }
+                    fputs ("|\n", f);
+                }
+                break;
+            case I2C_DEV_RAW:
+                fprintf (f, "raw 0x%x\n", d->addr);
+                break;
+        }
+    }
+    fprintf (f, "bus: %lu writes %lu reads %lu bytes %lu us\n", stats.writes,
+             stats.reads, stats.bytes, stats.bus_ns / 1000);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,31 @@
+typedef struct {
+    unsigned long writes;
+    unsigned long reads;
+    unsigned long bytes;        /* bytes on the bus, including address */
+    unsigned long bus_ns;       /* simulated bus time */
+} vi2c_stats_t;
+
+/* Virtual display backend: records traffic and decodes the OLED and LED
+ * command streams into in-memory screen state.
+ */
+extern const i2c_ops_t vi2c_ops;
+
+/* Simulate bus timing at khz (e.g. 100 or 400), 0 to disable.
+ * If 'delay' is true, writes also sleep for the simulated time.
+ */
+void vi2c_speed_set (int khz, bool delay);
+
+void vi2c_stats_get (vi2c_stats_t *st);
+void vi2c_stats_reset (void);
+
+/* Copy decoded LED digits at addr to s (e.g. "1.234"), -1 if not open.
+ */
+int vi2c_led_get (int addr, char *s, int len);
+
+/* Return decoded OLED pixel at x,y for the device at addr.
+ */
+bool vi2c_oled_pixel (int addr, int x, int y);
+
+/* Print decoded state of all open devices.
+ */
+void vi2c_dump (FILE *f);
@@ -40,13 +40,21 @@
 
 #include "w1.h"
 
-#define W1_PATH_TMPL	"/sys/bus/w1/devices/%s/w1_slave"
+#define W1_ROOT		"/sys/bus/w1/devices"
+#define W1_PATH_TMPL	"%s/%s/w1_slave"
+
+static const char *w1_root = W1_ROOT;
 
 /* Example:
 35 ff 4b 46 7f ff 0b 10 0a : crc=0a YES
 35 ff 4b 46 7f ff 0b 10 0a t=-12687
 */
 
+void w1_root_set (const char *dir)
+{
+	w1_root = dir ? dir : W1_ROOT;
+}
+
 /* Return temp probe sample in degrees C */
 double w1_therm_get (const char *addr)
 {
@@ -55,7 +63,7 @@ double w1_therm_get (const char *addr)
 	double val, ret = NAN;
 	int crc;
 
-	if (asprintf (&path, W1_PATH_TMPL, addr) < 0) {
+	if (asprintf (&path, W1_PATH_TMPL, w1_root, addr) < 0) {
 		fprintf (stderr, "Out of memory\n");
 		exit (1);
 	}
@@ -3,6 +3,11 @@
  */
 double w1_therm_get (const char *addr);
 
+/* Look for sensors under dir instead of /sys/bus/w1/devices
+ * (NULL restores the default).
+ */
+void w1_root_set (const char *dir);
+
 /* Convert Celcuis to Farenheit.
  */
 double c2f (double c);
@@ -193,6 +193,30 @@ bool _zmq_rcvmore (void *socket)
     return (bool)more;
 }
 
+/* For polling a socket alongside other fds.  The fd only signals that
+ * ZMQ_EVENTS may have changed, so check _zmq_pollin() before sleeping
+ * and read until it is false.
+ */
+int _zmq_fd (void *socket)
+{
+    int fd;
+    size_t fd_size = sizeof (fd);
+
+    _zmq_getsockopt (socket, ZMQ_FD, &fd, &fd_size);
+
+    return fd;
+}
+
+bool _zmq_pollin (void *socket)
+{
+    uint32_t events;
+    size_t events_size = sizeof (events);
+
+    _zmq_getsockopt (socket, ZMQ_EVENTS, &events, &events_size);
+
+    return (events & ZMQ_POLLIN) != 0;
+}
+
 void _zmq_msg_dup (zmq_msg_t *dest, zmq_msg_t *src)
 {
     _zmq_msg_init_size (dest, zmq_msg_size (src));
@@ -15,5 +15,7 @@ void _zmq_recv (void *socket, zmq_msg_t *msg, int flags);
 void _zmq_getsockopt (void *socket, int option_name, void *option_value,
                       size_t *option_len);
 bool _zmq_rcvmore (void *socket);
+int _zmq_fd (void *socket);
+bool _zmq_pollin (void *socket);
 void _zmq_msg_dup (zmq_msg_t *dest, zmq_msg_t *src);
 void _zmq_mcast_loop (void *sock, bool enable);
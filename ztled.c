@@ -39,7 +39,9 @@
 
 #define GPIO_RST_PIN    17
 
-#define OPTIONS "tai:x:d:s:b:rR"
+#define STREAM_MAXDEV   8
+
+#define OPTIONS "tai:x:d:s:b:rRS"
 #define HAVE_GETOPT_LONG 1
 
 #if HAVE_GETOPT_LONG
@@ -54,6 +56,7 @@ static const struct option longopts[] = {
     {"brightness",      required_argument,  0, 'b'},
     {"reset",           no_argument,        0, 'r'},
     {"hard-reset",      no_argument,        0, 'R'},
+    {"stream",          no_argument,        0, 'S'},
     {0, 0, 0, 0},
 };
 #else
@@ -73,10 +76,155 @@ static void usage (void)
 "   -b,--brightness N       set brightness (0-0xff)\n"
 "   -r,--reset              soft reset device\n"
 "   -R,--hard-reset         hard reset device\n"
+"   -S,--stream             read commands from stdin, one per line:\n"
+"                           s STR, i N, x N, d N (display as above),\n"
+"                           b N (brightness), r HH HH HH HH (raw segments,\n"
+"                           leftmost first), a ADDR (switch module)\n"
     );
     exit (1);
 }
 
+static void fail (int addr)
+{
+    fprintf (stderr, "led 0x%x: %s\n", addr, strerror (errno));
+    exit (1);
+}
+
+/* An open module and what it was last sent, so that only changes are
+ * written.  Modules stay open until exit, as a stream may switch between
+ * them on every line.
+ */
+typedef struct {
+    int addr;
+    int fd;
+    uint8_t seg[4];
+    int brightness;                     /* -1 if unknown */
+    bool valid;                         /* seg is what is displayed */
+} stream_dev_t;
+
+static stream_dev_t *stream_open (stream_dev_t *dev, int *ndev, int addr)
+{
+    stream_dev_t *d;
+    int i;
+
+    for (i = 0; i < *ndev; i++)
+        if (dev[i].addr == addr)
+            return &dev[i];
+    if (*ndev == STREAM_MAXDEV) {
+        fprintf (stderr, "too many modules (max %d)\n", STREAM_MAXDEV);
+        exit (1);
+    }
+    d = &dev[(*ndev)++];
+    d->addr = addr;
+    d->brightness = -1;
+    d->valid = false;
+    if ((d->fd = led_init (addr)) < 0 || led_sleep_set (d->fd, 0) < 0)
+        fail (addr);
+    return d;
+}
+
+static void stream_seg (stream_dev_t *d, const uint8_t seg[4])
+{
+    if (d->valid && !memcmp (d->seg, seg, 4))
+        return;
+    if (led_raw_set (d->fd, seg) < 0)
+        fail (d->addr);
+    memcpy (d->seg, seg, 4);
+    d->valid = true;
+}
+
+static void stream_text (stream_dev_t *d, const char *fmt, ...)
+{
+    uint8_t seg[4];
+    va_list ap;
+    char s[16];
+
+    va_start (ap, fmt);
+    vsnprintf (s, sizeof (s), fmt, ap);
+    va_end (ap);
+    led_encode (s, seg);
+    stream_seg (d, seg);
+}
+
+/* Apply commands from stdin, one per line, as fast as they come.
+ * Bad lines are reported and skipped; I2C errors are fatal.
+ */
+static void stream (int addr)
+{
+    stream_dev_t dev[STREAM_MAXDEV];
+    stream_dev_t *d;
+    char *line = NULL, *arg, *end;
+    size_t size = 0;
+    unsigned int raw[4];
+    uint8_t seg[4];
+    int ndev = 0, lineno = 0;
+    ssize_t len;
+    double f;
+    long n;
+    int i;
+
+    d = stream_open (dev, &ndev, addr);
+    while ((len = getline (&line, &size, stdin)) >= 0) {
+        lineno++;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (len == 0 || line[0] == '#')
+            continue;
+        arg = len > 2 && line[1] == ' ' ? line + 2 : "";
+        switch (line[0]) {
+            case 's':
+                stream_text (d, "%s", arg);
+                continue;
+            case 'i':
+                n = strtol (arg, &end, 0);
+                if (end == arg)
+                    break;
+                stream_text (d, "%+.3ld", n);
+                continue;
+            case 'x':
+                n = strtoul (arg, &end, 0);
+                if (end == arg)
+                    break;
+                stream_text (d, "%.4lx", n);
+                continue;
+            case 'd':
+                f = strtod (arg, &end);
+                if (end == arg)
+                    break;
+                stream_text (d, "%1.3f", f);
+                continue;
+            case 'b':
+                n = strtoul (arg, &end, 0);
+                if (end == arg || n > 0xff)
+                    break;
+                if (n != d->brightness) {
+                    if (led_brightness_set (d->fd, n) < 0)
+                        fail (d->addr);
+                    d->brightness = n;
+                }
+                continue;
+            case 'r':
+                if (sscanf (arg, "%x %x %x %x", &raw[0], &raw[1], &raw[2],
+                            &raw[3]) != 4)
+                    break;
+                for (i = 0; i < 4; i++)
+                    seg[i] = raw[i];
+                stream_seg (d, seg);
+                continue;
+            case 'a':
+                n = strtoul (arg, &end, 0);
+                if (end == arg || n < 0x03 || n > 0x77)
+                    break;
+                d = stream_open (dev, &ndev, n);
+                continue;
+        }
+        fprintf (stderr, "ztled: stdin:%d: bad command: %s\n", lineno, line);
+    }
+    free (line);
+    for (i = 0; i < ndev; i++)
+        led_fini (dev[i].fd);
+}
+
 int main (int argc, char *argv[])
 {
     int c;
@@ -93,6 +241,7 @@ int main (int argc, char *argv[])
     int bopt_arg = 0;
     int ropt = 0;
     int Ropt = 0;
+    int Sopt = 0;
     int addr = 0;
     int fd;
 
@@ -130,6 +279,9 @@ int main (int argc, char *argv[])
             case 'R':
                 Ropt = 1;
                 break;
+            case 'S':
+                Sopt = 1;
+                break;
             default:
                 usage ();
         }
@@ -140,38 +292,45 @@ int main (int argc, char *argv[])
     }
     if (optind != argc - 1)
         usage ();
-    if (!topt && !aopt && !iopt && !xopt && !dopt && !sopt && !bopt && !ropt)
+    if (!topt && !aopt && !iopt && !xopt && !dopt && !sopt && !bopt && !ropt
+              && !Sopt)
         usage ();
     if (topt && aopt)
         usage ();
     addr = strtoul (argv[optind], NULL, 0);
 
+    if (Sopt) {
+        stream (addr);
+        exit (0);
+    }
+
     if (aopt) {
-        fd = led_init (LED_ADDR_ADDRMODE);
-        led_addr_set (fd, addr);
+        if ((fd = led_init (LED_ADDR_ADDRMODE)) < 0
+                || led_addr_set (fd, addr) < 0)
+            fail (LED_ADDR_ADDRMODE);
         led_fini (fd);
         exit (0);
     }
 
-    fd = led_init (addr);
-    led_sleep_set (fd, 0);
-
-    if (ropt)
-        led_reset (fd);
-
-    if (bopt)
-        led_brightness_set (fd, bopt_arg);
-
-    if (topt)
-        led_test (fd);
-    if (iopt)
-        led_printf (fd, "%+.3d", iopt_arg);
-    if (xopt)
-        led_printf (fd, "%.4x", xopt_arg);
-    if (dopt)
-        led_printf (fd, "%1.3f", dopt_arg);
-    if (sopt)
-        led_printf (fd, "%s", sopt_arg);
+    if ((fd = led_init (addr)) < 0 || led_sleep_set (fd, 0) < 0)
+        fail (addr);
+
+    if (ropt && led_reset (fd) < 0)
+        fail (addr);
+
+    if (bopt && led_brightness_set (fd, bopt_arg) < 0)
+        fail (addr);
+
+    if (topt && led_test (fd) < 0)
+        fail (addr);
+    if (iopt && led_printf (fd, "%+.3d", iopt_arg) < 0)
+        fail (addr);
+    if (xopt && led_printf (fd, "%.4x", xopt_arg) < 0)
+        fail (addr);
+    if (dopt && led_printf (fd, "%1.3f", dopt_arg) < 0)
+        fail (addr);
+    if (sopt && led_printf (fd, "%s", sopt_arg) < 0)
+        fail (addr);
 
     led_fini (fd);
 